@@ -1,14 +1,51 @@
 // MP4Muxer.cpp
 #include "MP4Muxer.h"
+#include "SRH264Bitstream.h"
+#include "SRAsyncFileOutput.h"
+#include "SRStats.h"
+#include "SRMemoryTracker.h"
 
 // You must wrap FFmpeg includes with this to avoid compiler warnings/errors
 extern "C" {
 #include "libavformat/avformat.h"
 #include "libavutil/opt.h"
+#include "libavutil/dict.h"
 }
 
 // Helper to convert UE4 FString to char*
 #include "Misc/CString.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+#include "HAL/PlatformProcess.h"
+#include "HAL/FileManager.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+#include "Async/Async.h"
+
+CSV_DEFINE_CATEGORY(SRMP4Muxer, true);
+
+namespace
+{
+    // sizeof(MOVIentry) in FFmpeg 4.4. The mov muxer keeps one per sample until the trailer, or the fragment, is written.
+    constexpr int64 IndexBytesPerSample = 48;
+
+    // Counts a producer in for as long as it is inside AddPacket. Counted in before it looks at bAcceptingPackets,
+    // so once Finalize has cleared that and seen no producers, none can reach the queue anymore.
+    struct FProducerScope
+    {
+        explicit FProducerScope(TAtomic<int32>& InNumProducers)
+            : NumProducers(InNumProducers)
+        {
+            ++NumProducers;
+        }
+
+        ~FProducerScope()
+        {
+            --NumProducers;
+        }
+
+        TAtomic<int32>& NumProducers;
+    };
+}
 
 FMP4Muxer::FMP4Muxer()
 {
@@ -18,56 +55,269 @@ FMP4Muxer::FMP4Muxer()
 FMP4Muxer::~FMP4Muxer()
 {
     Finalize();
+
+    // Every AVBufferRef has been released by now, so all payloads are back in the free list
+    while (FPayload* Payload = FreePayloads.Pop())
+    {
+        delete Payload;
+        --NumPayloads;
+    }
+    check(NumPayloads == 0);
 }
 
-bool FMP4Muxer::Initialize(const FString& FilePath, const AVEncoder::FVideoConfig& VideoConfig, const AVEncoder::FAudioConfig& AudioConfig)
+bool FMP4Muxer::Initialize(const FString& FilePath, const AVEncoder::FVideoConfig& InVideoConfig, const AVEncoder::FAudioConfig& InAudioConfig, const FMP4MuxerOptions& InOptions)
 {
-    // 1. Allocate format context for MP4
-    avformat_alloc_output_context2(&FormatContext, nullptr, "mp4", TCHAR_TO_UTF8(*FilePath));
-    if (!FormatContext)
+    Options = InOptions;
+    BaseFilePath = FilePath;
+    VideoConfig = InVideoConfig;
+    AudioConfig = InAudioConfig;
+
+    ScratchPacket = av_packet_alloc();
+    if (!ScratchPacket)
     {
-        UE_LOG(LogTemp, Error, TEXT("Failed to allocate MP4 format context"));
         return false;
     }
 
-    // 2. Create Video and Audio Streams
-    if (!AddVideoStream(VideoConfig))
+    IOStartTime = FPlatformTime::Seconds();
+    IOEndTime = 0;
+
+    // 1-3. Create the output file with its streams
+    SegmentIndex = 0;
+    Output.Reset(OpenOutput(IsSegmented() ? GetSegmentPath(SegmentIndex) : FilePath, VideoConfig));
+    if (!Output)
     {
         return false;
     }
-    if (!AddAudioStream(AudioConfig))
+    NumSegments = 1;
+    if (IsSegmented())
+    {
+        PrepareNextSegment();
+    }
+
+    // Note: We don't write the header yet. We need the SPS/PPS from the first keyframe.
+    // The writer thread writes it when it receives the first packet.
+
+    // 4. Start the writer thread. From here on only the writer thread touches the outputs.
+    Queue = MakeUnique<TSRBoundedMpscQueue<FQueuedPacket>>(FMath::Max(Options.QueueCapacity, 2));
+    WorkEvent = FPlatformProcess::GetSynchEventFromPool(false);
+    SpaceEvent = FPlatformProcess::GetSynchEventFromPool(false);
+    bStopWriter = false;
+    WriterThread = FRunnableThread::Create(this, TEXT("MP4MuxerWriter"), 0, TPri_AboveNormal);
+    if (!WriterThread)
     {
+        UE_LOG(LogTemp, Error, TEXT("Failed to create the MP4 muxer writer thread"));
         return false;
     }
+    bAcceptingPackets = true;
+
+    return true;
+}
+
+FMP4Muxer::FOutput* FMP4Muxer::OpenOutput(const FString& FilePath, const AVEncoder::FVideoConfig& InVideoConfig)
+{
+    TUniquePtr<FOutput> Out = MakeUnique<FOutput>();
+    Out->FilePath = FilePath;
+
+    // 1. Allocate format context for MP4
+    avformat_alloc_output_context2(&Out->FormatContext, nullptr, "mp4", TCHAR_TO_UTF8(*FilePath));
+    if (!Out->FormatContext)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Failed to allocate MP4 format context"));
+        return nullptr;
+    }
+
+    // 2. Create Video and Audio Streams
+    if (!AddVideoStream(*Out, InVideoConfig) || !AddAudioStream(*Out, AudioConfig))
+    {
+        CloseOutput(*Out);
+        return nullptr;
+    }
 
     // 3. Open the output file for writing
-    if (!(FormatContext->oformat->flags & AVFMT_NOFILE))
+    if (Options.IOBufferSizeMB > 0)
+    {
+        FSRAsyncFileOutput::FSettings IOSettings;
+        IOSettings.BufferSize = Options.IOBufferSizeMB * 1024 * 1024;
+        IOSettings.NumBuffers = Options.IONumBuffers;
+        // Growing the file ahead changes its size, which only Finalize trims again. A fragmented file has to end at
+        // its last fragment even if Finalize never comes.
+        IOSettings.GrowthExtent = Options.bFragmented ? 0 : int64(Options.IOGrowthMB) * 1024 * 1024;
+        // Fragments are meant to reach the disk as they are completed
+        IOSettings.FlushIntervalMs = Options.bFragmented ? Options.FragmentDurationMs : 0;
+
+        Out->AsyncOutput = FSRAsyncFileOutput::Open(FilePath, IOSettings);
+        if (!Out->AsyncOutput)
+        {
+            CloseOutput(*Out);
+            return nullptr;
+        }
+        Out->FormatContext->pb = Out->AsyncOutput->GetAVIOContext();
+        Out->FormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    else if (!(Out->FormatContext->oformat->flags & AVFMT_NOFILE))
     {
-        if (avio_open(&FormatContext->pb, TCHAR_TO_UTF8(*FilePath), AVIO_FLAG_WRITE) < 0)
+        if (avio_open(&Out->FormatContext->pb, TCHAR_TO_UTF8(*FilePath), AVIO_FLAG_WRITE) < 0)
         {
             UE_LOG(LogTemp, Error, TEXT("Failed to open output file: %s"), *FilePath);
-            return false;
+            CloseOutput(*Out);
+            return nullptr;
         }
     }
 
-    // Note: We don't write the header yet. We need the SPS/PPS from the first keyframe.
-    // We will write it in the AddPacket function upon receiving the first keyframe.
+    return Out.Release();
+}
+
+void FMP4Muxer::CloseOutput(FOutput& Out)
+{
+    if (!Out.FormatContext)
+    {
+        return;
+    }
+
+    if (Out.bIsHeaderWritten)
+    {
+        // Write the file trailer. This is essential for a valid MP4.
+        av_write_trailer(Out.FormatContext);
+    }
+
+    // Close the output file
+    if (Out.AsyncOutput)
+    {
+        // Waits for the I/O thread to write the last buffers
+        if (!Out.AsyncOutput->Close())
+        {
+            UE_LOG(LogTemp, Error, TEXT("Writing the recording failed, %s is incomplete"), *Out.FilePath);
+        }
+        Out.FormatContext->pb = nullptr;
+
+        const FSRAsyncFileOutput::FStats IOStats = Out.AsyncOutput->GetStats();
+        FScopeLock Lock(&IOStatsCS);
+        ClosedIOBytes += IOStats.BytesWritten;
+        ClosedIOFlushes += IOStats.NumFlushes;
+        ClosedIOWriteSeconds += IOStats.WriteSeconds;
+        ClosedIOMaxFlushSeconds = FMath::Max(ClosedIOMaxFlushSeconds, IOStats.MaxFlushSeconds);
+        ClosedIOStallSeconds += IOStats.StallSeconds;
+        Out.AsyncOutput.Reset();
+    }
+    else if (Out.FormatContext->pb && !(Out.FormatContext->oformat->flags & AVFMT_NOFILE))
+    {
+        avio_closep(&Out.FormatContext->pb);
+    }
+
+    // Free the context
+    avformat_free_context(Out.FormatContext);
+    Out.FormatContext = nullptr;
+    Out.VideoStream = nullptr;
+    Out.AudioStream = nullptr;
+    Out.bIsHeaderWritten = false;
+    FSRMemoryTracker::Get().Add(ESRMemory::MuxerIndex, -Out.IndexBytes);
+    Out.IndexBytes = 0;
+}
+
+void FMP4Muxer::CloseOutputAsync(TUniquePtr<FOutput> Out)
+{
+    ClosingOutputs.RemoveAll([](const TFuture<void>& Closing) { return Closing.IsReady(); });
 
+    // The trailer of a non-fragmented file holds the whole sample table, so writing it can take a while
+    FOutput* Closing = Out.Release();
+    ClosingOutputs.Add(Async(EAsyncExecution::ThreadPool, [this, Closing]()
+        {
+            CloseOutput(*Closing);
+            delete Closing;
+        }));
+}
+
+FString FMP4Muxer::GetSegmentPath(int32 Index) const
+{
+    return FPaths::GetBaseFilename(BaseFilePath, false) + FString::Printf(TEXT("_%03d"), Index) + FPaths::GetExtension(BaseFilePath, true);
+}
+
+void FMP4Muxer::PrepareNextSegment()
+{
+    // The writer thread changes VideoConfig on a resize, so the pool thread gets its own copy.
+    // ApplyVideoExtradata brings the size up to date before the segment's header is written.
+    const FString FilePath = GetSegmentPath(++SegmentIndex);
+    NextOutput = Async(EAsyncExecution::ThreadPool, [this, FilePath, Config = VideoConfig]()
+        {
+            return OpenOutput(FilePath, Config);
+        });
+}
+
+bool FMP4Muxer::IsSegmentDue(FTimespan Timestamp) const
+{
+    if (!IsSegmented() || !Output->bIsHeaderWritten)
+    {
+        return false;
+    }
+
+    const bool bDurationReached = Options.SegmentDurationSeconds > 0 && (Timestamp - Output->StartTimestamp).GetTotalSeconds() >= Options.SegmentDurationSeconds;
+    const bool bSizeReached = Options.SegmentSizeMB > 0 && Output->PayloadBytes >= int64(Options.SegmentSizeMB) * 1024 * 1024;
+    return bDurationReached || bSizeReached;
+}
+
+bool FMP4Muxer::ShouldStartSegment(FTimespan KeyFrameTimestamp)
+{
+    if (!IsSegmentDue(KeyFrameTimestamp))
+    {
+        return false;
+    }
+
+    // Never wait for the next file to open. Splitting on a later keyframe is better than stalling the writer.
+    if (!NextOutput.IsValid() || !NextOutput.IsReady())
+    {
+        ++SegmentSplitsDeferred;
+        return false;
+    }
     return true;
 }
 
-bool FMP4Muxer::AddVideoStream(const AVEncoder::FVideoConfig& Config)
+void FMP4Muxer::StartNextSegment(FTimespan KeyFrameTimestamp)
+{
+    FOutput* Next = NextOutput.Get();
+    NextOutput = TFuture<FOutput*>();
+    if (!Next)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Failed to open the next segment, continuing %s"), *Output->FilePath);
+        PrepareNextSegment();
+        return;
+    }
+
+    // Two splits within the audio latency are unlikely, but the older segment can't wait any longer
+    if (PreviousOutput)
+    {
+        CloseOutputAsync(MoveTemp(PreviousOutput));
+    }
+
+    Next->StartTimestamp = KeyFrameTimestamp;
+    Next->TimestampOffset = KeyFrameTimestamp;
+    ApplyVideoExtradata(*Next);
+    {
+        FScopeLock Lock(&IOStatsCS);
+        PreviousOutput = MoveTemp(Output);
+        Output.Reset(Next);
+    }
+    ++NumSegments;
+    bSegmentKeyframeRequested = false;
+
+    UE_LOG(LogTemp, Log, TEXT("Recording segment %s started at %.3f s"), *Next->FilePath, KeyFrameTimestamp.GetTotalSeconds());
+    PrepareNextSegment();
+}
+
+bool FMP4Muxer::AddVideoStream(FOutput& Out, const AVEncoder::FVideoConfig& Config)
 {
     // Assuming H.264 codec from FGameplayMediaEncoder
     AVCodecID CodecId = AV_CODEC_ID_H264;
 
-    VideoStream = avformat_new_stream(FormatContext, nullptr);
+    AVStream* VideoStream = avformat_new_stream(Out.FormatContext, nullptr);
     if (!VideoStream) return false;
 
-    VideoStream->id = FormatContext->nb_streams - 1;
+    VideoStream->id = Out.FormatContext->nb_streams - 1;
     AVCodecParameters* CodecParams = VideoStream->codecpar;
     CodecParams->codec_type = AVMEDIA_TYPE_VIDEO;
     CodecParams->codec_id = CodecId;
+    // avc3: the SPS/PPS in the samples take precedence over the avcC, so a change of size plays on in the same file
+    // although its sample description was written for the first size
+    CodecParams->codec_tag = MKTAG('a', 'v', 'c', '3');
     CodecParams->width = Config.Width;
     CodecParams->height = Config.Height;
     CodecParams->format = AV_PIX_FMT_YUV420P; // Common format
@@ -76,18 +326,19 @@ bool FMP4Muxer::AddVideoStream(const AVEncoder::FVideoConfig& Config)
     // We use microseconds since FMediaPacket timestamp is in microseconds.
     VideoStream->time_base = { 1, 1000000 };
 
+    Out.VideoStream = VideoStream;
     return true;
 }
 
-bool FMP4Muxer::AddAudioStream(const AVEncoder::FAudioConfig& Config)
+bool FMP4Muxer::AddAudioStream(FOutput& Out, const AVEncoder::FAudioConfig& Config)
 {
     // Assuming AAC codec
     AVCodecID CodecId = AV_CODEC_ID_AAC;
 
-    AudioStream = avformat_new_stream(FormatContext, nullptr);
+    AVStream* AudioStream = avformat_new_stream(Out.FormatContext, nullptr);
     if (!AudioStream) return false;
 
-    AudioStream->id = FormatContext->nb_streams - 1;
+    AudioStream->id = Out.FormatContext->nb_streams - 1;
     AVCodecParameters* CodecParams = AudioStream->codecpar;
     CodecParams->codec_type = AVMEDIA_TYPE_AUDIO;
     CodecParams->codec_id = CodecId;
@@ -97,6 +348,7 @@ bool FMP4Muxer::AddAudioStream(const AVEncoder::FAudioConfig& Config)
 
     // Set time base for audio stream
     AudioStream->time_base = { 1, (int)Config.Samplerate };
+    Out.AudioStream = AudioStream;
 
     // --- Ӳ extradata ---
     UE_LOG(LogTemp, Warning, TEXT("Using hardcoded AAC extradata for 48kHz, Stereo, AAC-LC. This is not recommended."));
@@ -118,121 +370,695 @@ bool FMP4Muxer::AddAudioStream(const AVEncoder::FAudioConfig& Config)
 
 bool FMP4Muxer::AddPacket(const AVEncoder::FMediaPacket& Packet)
 {
-    if (!FormatContext) return false;
+    FProducerScope Producer(NumProducers);
+    if (!bAcceptingPackets) return false;
 
-    AVPacket* FfmpegPacket = av_packet_alloc();
-    if (!FfmpegPacket) return false;
+    // The caller keeps ownership of Packet.Data, so this is the one place where the payload gets copied.
+    // The payload buffer is recycled, so its allocation is reused once it has grown to the largest packet size.
+    FPayload* Payload = AcquirePayload();
+    Payload->Data.Reset();
+    Payload->Data.Append(Packet.Data);
 
-    AVStream* TargetStream = nullptr;
+    BytesCopied += Packet.Data.Num();
+
+    return EnqueuePacket(Packet, Payload, Packet.Data.Num());
+}
+
+bool FMP4Muxer::AddPacket(const FSRMediaPacketPtr& Packet)
+{
+    FProducerScope Producer(NumProducers);
+    if (!bAcceptingPackets) return false;
+
+    if (Packet->Type != AVEncoder::EPacketType::Video && Packet->Type != AVEncoder::EPacketType::Audio)
+    {
+        return false;
+    }
+
+    FPayload* Payload = AcquirePayload();
+    uint32 CopiedBytes = 0;
+    if (Packet->Type == AVEncoder::EPacketType::Video && !Packet->bIsAvcc)
+    {
+        // Annex-B still has to be rewritten, which can't be done to a payload other sinks are reading
+        Payload->Data.Reset();
+        Payload->Data.Append(Packet->GetData(), Packet->Num());
+        CopiedBytes = Packet->Num();
+        BytesCopied += CopiedBytes;
+    }
+    else
+    {
+        // Keep a reference to the shared packet. Its payload goes to libavformat as a read-only buffer.
+        Payload->Shared = Packet;
+        BytesAdopted += Packet->Num();
+    }
+
+    FQueuedPacket Queued;
+    Queued.Payload = Payload;
+    Queued.Type = Packet->Type;
+    Queued.Timestamp = Packet->Timestamp;
+    Queued.Duration = Packet->Duration;
+    Queued.bKeyFrame = Packet->Type == AVEncoder::EPacketType::Video && Packet->bKeyFrame;
+    Queued.bIsAvcc = Packet->bIsAvcc;
+    Queued.Width = Packet->Width;
+    Queued.Height = Packet->Height;
+    Queued.CopiedBytes = CopiedBytes;
+    Queued.CaptureCycles = Packet->CaptureCycles;
+    return EnqueuePacket(Queued);
+}
+
+bool FMP4Muxer::AddPacket(AVEncoder::FMediaPacket&& Packet)
+{
+    FProducerScope Producer(NumProducers);
+    if (!bAcceptingPackets) return false;
+
+    // Adopt the encoder's storage. No allocation or copy of the payload.
+    FPayload* Payload = AcquirePayload();
+    Payload->Data = MoveTemp(Packet.Data);
+
+    BytesAdopted += Payload->Data.Num();
+
+    return EnqueuePacket(Packet, Payload, 0);
+}
+
+FMP4Muxer::FPayload* FMP4Muxer::AcquirePayload()
+{
+    FPayload* Payload = FreePayloads.Pop();
+    if (!Payload)
+    {
+        Payload = new FPayload();
+        Payload->Owner = this;
+        ++NumPayloads;
+    }
+    return Payload;
+}
+
+void FMP4Muxer::ReleasePayload(void* Opaque, uint8* Data)
+{
+    // Called by libavutil when the last reference to the AVBufferRef goes away.
+    FPayload* Payload = static_cast<FPayload*>(Opaque);
+    Payload->Shared.SafeRelease();
+    Payload->Owner->FreePayloads.Push(Payload);
+}
+
+bool FMP4Muxer::EnqueuePacket(const AVEncoder::FMediaPacket& Packet, FPayload* Payload, uint32 CopiedBytes)
+{
+    if (Packet.Type != AVEncoder::EPacketType::Video && Packet.Type != AVEncoder::EPacketType::Audio)
+    {
+        FreePayloads.Push(Payload);
+        return false; // Unknown packet type
+    }
+
+    FQueuedPacket Queued;
+    Queued.Payload = Payload;
+    Queued.Type = Packet.Type;
+    Queued.Timestamp = Packet.Timestamp;
+    Queued.Duration = Packet.Duration;
+    Queued.bKeyFrame = Packet.Type == AVEncoder::EPacketType::Video && Packet.Video.bKeyFrame;
     if (Packet.Type == AVEncoder::EPacketType::Video)
     {
-        TargetStream = VideoStream;
+        Queued.Width = Packet.Video.Width;
+        Queued.Height = Packet.Video.Height;
+    }
+    Queued.CopiedBytes = CopiedBytes;
 
-        // H.264 packets from hardware encoders often contain the SPS/PPS prefixed to keyframes.
-        // We need to extract this and put it in the stream's extradata before writing the header.
-        if (Packet.Video.bKeyFrame && VideoExtradata.Num() == 0)
+    return EnqueuePacket(Queued);
+}
+
+bool FMP4Muxer::EnqueuePacket(FQueuedPacket& Queued)
+{
+    const bool bIsVideo = Queued.Type == AVEncoder::EPacketType::Video;
+    if (Options.OverflowPolicy == EMP4MuxerOverflowPolicy::DropNonKeyVideo && bIsVideo)
+    {
+        if (Queued.bKeyFrame)
         {
-            // This part is tricky and encoder-dependent.
-            // You need to find the SPS/PPS NAL units in the keyframe data.
-            // A common format is [start_code]SPS[start_code]PPS[start_code]IDR_SLICE
-            // For simplicity, let's assume the encoder provides it in a specific way.
-            // A robust solution would parse NAL units.
-            // For now, let's assume FGameplayMediaEncoder doesn't bundle them and you need to get them separately.
-            // If they ARE bundled, you must copy them to VideoStream->codecpar->extradata.
-            // For example:
-            // VideoStream->codecpar->extradata = (uint8_t*)av_mallocz(sps_pps_size + AV_INPUT_BUFFER_PADDING_SIZE);
-            // FMemory::Memcpy(VideoStream->codecpar->extradata, sps_pps_data, sps_pps_size);
-            // VideoStream->codecpar->extradata_size = sps_pps_size;
+            bDropVideoUntilKeyFrame = false;
         }
+        else if (bDropVideoUntilKeyFrame)
+        {
+            DropPacket(Queued);
+            return false;
+        }
+    }
 
-        if (Packet.Video.bKeyFrame)
+    Queued.QueuedCycles = FPlatformTime::Cycles64();
+    const int32 PayloadBytes = Queued.Payload->Num();
+    while (!Queue->TryEnqueue(MoveTemp(Queued)))
+    {
+        if (!bAcceptingPackets)
         {
-            FfmpegPacket->flags |= AV_PKT_FLAG_KEY;
+            DropPacket(Queued);
+            return false;
         }
+
+        switch (Options.OverflowPolicy)
+        {
+        case EMP4MuxerOverflowPolicy::DropNonKeyVideo:
+            if (bIsVideo && !Queued.bKeyFrame)
+            {
+                // The P frames that follow reference this one, so they have to go as well
+                bDropVideoUntilKeyFrame = true;
+                DropPacket(Queued);
+                return false;
+            }
+            break;
+
+        case EMP4MuxerOverflowPolicy::DropOldestGop:
+            // Only ask once per overflow. The writer thread evicts the GOP at the head of the queue.
+            if (PendingGopDrops.Load() == 0)
+            {
+                ++PendingGopDrops;
+                WorkEvent->Trigger();
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        WaitForQueueSpace();
     }
-    else if (Packet.Type == AVEncoder::EPacketType::Audio)
+
+    const int32 Depth = Queue->Num();
+    int32 CurrentMax = MaxQueueDepth.Load(EMemoryOrder::Relaxed);
+    while (Depth > CurrentMax && !MaxQueueDepth.CompareExchange(CurrentMax, Depth))
     {
-        TargetStream = AudioStream;
+    }
+    FSRStats::Get().SetQueueDepth(ESRQueue::Mux, Depth);
+    FSRMemoryTracker::Get().Add(ESRMemory::MuxerQueue, PayloadBytes);
+
+    WorkEvent->Trigger();
+    return true;
+}
+
+void FMP4Muxer::WaitForQueueSpace()
+{
+    const uint64 StartCycles = FPlatformTime::Cycles64();
+    ++NumBlocked;
+    WorkEvent->Trigger();
+    // Timed wait, since several producers can be waiting on the same auto-reset event
+    SpaceEvent->Wait(1);
+    BlockedCycles += FPlatformTime::Cycles64() - StartCycles;
+}
+
+bool FMP4Muxer::DequeuePacket(FQueuedPacket& Queued)
+{
+    if (!Queue->TryDequeue(Queued))
+    {
+        return false;
+    }
+    FSRMemoryTracker::Get().Add(ESRMemory::MuxerQueue, -Queued.Payload->Num());
+    return true;
+}
+
+void FMP4Muxer::DropPacket(FQueuedPacket& Queued)
+{
+    ++PacketsDropped;
+    BytesDropped += Queued.Payload->Num();
+    FSRStats::Get().Add(ESRCounter::MuxPacketsDropped);
+    Queued.Payload->Shared.SafeRelease();
+    FreePayloads.Push(Queued.Payload);
+    Queued.Payload = nullptr;
+}
+
+uint32 FMP4Muxer::Run()
+{
+    while (!bStopWriter)
+    {
+        WorkEvent->Wait();
+        DrainQueue();
+    }
+
+    // Finalize stopped accepting packets before asking us to stop, so this is everything that is left
+    DrainQueue();
+    return 0;
+}
+
+void FMP4Muxer::DrainQueue()
+{
+    FQueuedPacket Queued;
+    for (;;)
+    {
+        if (PendingGopDrops.Load() > 0)
+        {
+            DropOldestGop();
+            PendingGopDrops = 0;
+        }
+
+        if (!DequeuePacket(Queued))
+        {
+            break;
+        }
+        SpaceEvent->Trigger();
+
+        WritePacket(Queued);
+    }
+}
+
+void FMP4Muxer::DropOldestGop()
+{
+    // Discard from the head of the queue up to (not including) the next video keyframe, so that the
+    // first video packet written afterwards can be decoded on its own.
+    bool bDroppedAny = false;
+    while (FQueuedPacket* Head = Queue->Peek())
+    {
+        if (bDroppedAny && Head->Type == AVEncoder::EPacketType::Video && Head->bKeyFrame)
+        {
+            break;
+        }
+
+        FQueuedPacket Dropped;
+        DequeuePacket(Dropped);
+        DropPacket(Dropped);
+        bDroppedAny = true;
+    }
+
+    SpaceEvent->Trigger();
+}
+
+void FMP4Muxer::UpdateCopyRate(uint32 NumCopiedBytes)
+{
+    CopyRateWindowBytes += NumCopiedBytes;
+
+    const double Now = FPlatformTime::Seconds();
+    if (CopyRateWindowStart == 0)
+    {
+        CopyRateWindowStart = Now;
+    }
+    else if (Now - CopyRateWindowStart >= 1.0)
+    {
+        BytesCopiedPerSecond = static_cast<uint64>(CopyRateWindowBytes / (Now - CopyRateWindowStart));
+        CSV_CUSTOM_STAT(SRMP4Muxer, BytesCopiedPerSecond, static_cast<float>(BytesCopiedPerSecond.Load()), ECsvCustomStatOp::Set);
+        CopyRateWindowBytes = 0;
+        CopyRateWindowStart = Now;
+    }
+}
+
+bool FMP4Muxer::WritePacket(FQueuedPacket& Queued)
+{
+    const bool bIsVideo = Queued.Type == AVEncoder::EPacketType::Video;
+    if (bIsVideo && Queued.bKeyFrame && Queued.Width > 0 && (Queued.Width != VideoConfig.Width || Queued.Height != VideoConfig.Height))
+    {
+        ChangeVideoParameters(Queued.Width, Queued.Height, Queued.Timestamp);
+    }
+    if (bIsVideo && Queued.bKeyFrame && ShouldStartSegment(Queued.Timestamp))
+    {
+        StartNextSegment(Queued.Timestamp);
+    }
+    else if (bIsVideo && !Queued.bKeyFrame && KeyframeRequester && !bSegmentKeyframeRequested && IsSegmentDue(Queued.Timestamp)
+        && NextOutput.IsValid() && NextOutput.IsReady())
+    {
+        // Split on the next frame rather than wait for the encoder's own keyframe. Turned down by the rate limit, ask again next frame.
+        bSegmentKeyframeRequested = KeyframeRequester();
+    }
+
+    if (bIsVideo && Queued.bKeyFrame)
+    {
+        LastVideoKeyframe = Queued.Timestamp;
+        bFragmentKeyframeRequested = false;
+    }
+    else if (bIsVideo && Options.bFragmented && KeyframeRequester && !bFragmentKeyframeRequested
+        && Queued.Timestamp - LastVideoKeyframe >= FTimespan::FromMilliseconds(4.0 * FMath::Max(Options.FragmentDurationMs, 1)))
+    {
+        // The fragment can only end on a keyframe, and this GOP is too long to hold in memory
+        bFragmentKeyframeRequested = KeyframeRequester();
+    }
+
+    // Audio lags behind video, so some of the audio captured before a split only arrives after it.
+    // It still belongs to the previous segment, which stays open until the audio has caught up.
+    FOutput* Target = Output.Get();
+    if (PreviousOutput && !bIsVideo)
+    {
+        if (Queued.Timestamp < Output->StartTimestamp)
+        {
+            Target = PreviousOutput.Get();
+        }
+        else
+        {
+            CloseOutputAsync(MoveTemp(PreviousOutput));
+        }
+    }
+
+    // The file has to start with a keyframe, since the header needs its SPS/PPS. Drop whatever comes before it.
+    if (!Target->bIsHeaderWritten)
+    {
+        if (!(bIsVideo && Queued.bKeyFrame))
+        {
+            DropPacket(Queued);
+            return false;
+        }
+        Target->StartTimestamp = Queued.Timestamp;
+        if (IsSegmented())
+        {
+            Target->TimestampOffset = Queued.Timestamp;
+        }
+    }
+    // Only audio from before the first keyframe of a segmented recording, which would end up with a negative timestamp
+    if (Queued.Timestamp < Target->TimestampOffset)
+    {
+        DropPacket(Queued);
+        return false;
+    }
+
+    FPayload* Payload = Queued.Payload;
+    Queued.Payload = nullptr;
+
+    if (Queued.Type == AVEncoder::EPacketType::Video)
+    {
+        ConvertVideoPayload(Payload, Queued.bKeyFrame, Queued.bIsAvcc);
+    }
+
+    UpdateCopyRate(Queued.CopiedBytes);
+
+    // Hand the payload to FFmpeg as a refcounted buffer. It comes back to FreePayloads through ReleasePayload
+    // once libavformat no longer needs it, which lets av_interleaved_write_frame queue it without copying.
+    // Shared packets are read by other sinks as well, so libavformat must not write to them.
+    AVBufferRef* Buffer = av_buffer_create(const_cast<uint8*>(Payload->GetData()), Payload->Num(), &FMP4Muxer::ReleasePayload, Payload, Payload->Shared ? AV_BUFFER_FLAG_READONLY : 0);
+    if (!Buffer)
+    {
+        Payload->Shared.SafeRelease();
+        FreePayloads.Push(Payload);
+        return false;
+    }
+
+    AVPacket* FfmpegPacket = ScratchPacket;
+    FfmpegPacket->buf = Buffer;
+    FfmpegPacket->data = Buffer->data;
+    FfmpegPacket->size = Buffer->size;
+
+    AVStream* TargetStream = nullptr;
+    if (Queued.Type == AVEncoder::EPacketType::Video)
+    {
+        TargetStream = Target->VideoStream;
+
+        if (Queued.bKeyFrame)
+        {
+            FfmpegPacket->flags |= AV_PKT_FLAG_KEY;
+        }
     }
     else
     {
-        av_packet_free(&FfmpegPacket);
-        return false; // Unknown packet type
+        TargetStream = Target->AudioStream;
     }
 
     // If the file header hasn't been written yet, do it now.
-    // This must be done after streams are configured (including extradata).
-    if (!bIsHeaderWritten)
+    // This must be done after streams are configured (including extradata, set by ConvertVideoPayload).
+    if (!Target->bIsHeaderWritten)
     {
-        if (avformat_write_header(FormatContext, nullptr) < 0)
+        if (!WriteHeader(*Target))
         {
-            UE_LOG(LogTemp, Error, TEXT("Failed to write MP4 header"));
-            av_packet_free(&FfmpegPacket);
+            av_packet_unref(FfmpegPacket);
             return false;
         }
-        bIsHeaderWritten = true;
     }
 
-    // Copy data from FMediaPacket to AVPacket
-    FfmpegPacket->data = (uint8_t*)av_malloc(Packet.Data.Num());
-    FMemory::Memcpy(FfmpegPacket->data, Packet.Data.GetData(), Packet.Data.Num());
-    FfmpegPacket->size = Packet.Data.Num();
-
     // *** CRITICAL: Timestamp Conversion ***
     // We need to convert the timestamp from its original time base (microseconds or samples)
     // to the AVStream's time_base.
-    //FfmpegPacket->pts = av_rescale_q(Packet.Timestamp.GetTotalMicroseconds(), TargetStream == VideoStream ? AVRational{1, 1000000} : AVRational{1, (int)AudioStream->codecpar->sample_rate}, TargetStream->time_base);
-    FfmpegPacket->pts = av_rescale_q(Packet.Timestamp.GetTotalMicroseconds(), AVRational{ 1, 1000000 }, TargetStream->time_base);
+    //FfmpegPacket->pts = av_rescale_q(Queued.Timestamp.GetTotalMicroseconds(), TargetStream == VideoStream ? AVRational{1, 1000000} : AVRational{1, (int)AudioStream->codecpar->sample_rate}, TargetStream->time_base);
+    FfmpegPacket->pts = av_rescale_q((Queued.Timestamp - Target->TimestampOffset).GetTotalMicroseconds(), AVRational{ 1, 1000000 }, TargetStream->time_base);
     FfmpegPacket->dts = FfmpegPacket->pts; // For simple cases, DTS can be same as PTS
-    //FfmpegPacket->duration = av_rescale_q(Packet.Duration.GetTotalMicroseconds(), TargetStream == VideoStream ? AVRational{1, 1000000} : AVRational{1, (int)AudioStream->codecpar->sample_rate}, TargetStream->time_base);
-    FfmpegPacket->duration = av_rescale_q(Packet.Duration.GetTotalMicroseconds(), AVRational{ 1, 1000000 }, TargetStream->time_base);
+    //FfmpegPacket->duration = av_rescale_q(Queued.Duration.GetTotalMicroseconds(), TargetStream == VideoStream ? AVRational{1, 1000000} : AVRational{1, (int)AudioStream->codecpar->sample_rate}, TargetStream->time_base);
+    FfmpegPacket->duration = av_rescale_q(Queued.Duration.GetTotalMicroseconds(), AVRational{ 1, 1000000 }, TargetStream->time_base);
     FfmpegPacket->stream_index = TargetStream->index;
 
-    UE_LOG(LogTemp, Log, TEXT("Muxer AddPacket: Type=%s, Index=%d, Size=%d, Timestamp(us)=%f, PTS=%lld"),
-        (Packet.Type == AVEncoder::EPacketType::Video ? TEXT("Video") : TEXT("Audio")),
+    UE_LOG(LogTemp, Verbose, TEXT("Muxer AddPacket: Type=%s, Index=%d, Size=%d, Timestamp(us)=%f, PTS=%lld"),
+        (Queued.Type == AVEncoder::EPacketType::Video ? TEXT("Video") : TEXT("Audio")),
         TargetStream->index,
         FfmpegPacket->size,
-        Packet.Timestamp.GetTotalMicroseconds(),
+        Queued.Timestamp.GetTotalMicroseconds(),
         FfmpegPacket->pts);
 
-    // Write the packet to the file
-    int Result = av_interleaved_write_frame(FormatContext, FfmpegPacket);
+    // Write the packet to the file.
+    // av_interleaved_write_frame takes ownership of the buffer reference and resets the packet, on success and failure,
+    // so ScratchPacket is blank again afterwards. The unref is only a safety net and is a no-op for a blank packet.
+    Target->PayloadBytes += FfmpegPacket->size;
+    const int32 PacketSize = FfmpegPacket->size;
+    int Result = av_interleaved_write_frame(Target->FormatContext, FfmpegPacket);
+    av_packet_unref(FfmpegPacket);
     if (Result < 0)
     {
-        // Note: av_interleaved_write_frame frees the packet data on success and failure
         UE_LOG(LogTemp, Warning, TEXT("Failed to write frame to MP4 file."));
         return false;
     }
 
-    // av_interleaved_write_frame takes ownership and frees the packet, so we don't call av_packet_free.
-    // However, if it fails, it might not have been freed. The FFmpeg docs are specific about this.
-    // A safer pattern is to use av_packet_unref after the call.
-    // For this example, we assume it's handled.
+    ++PacketsWritten;
+    if (!Options.bFragmented)
+    {
+        Target->IndexBytes += IndexBytesPerSample;
+        FSRMemoryTracker::Get().Add(ESRMemory::MuxerIndex, IndexBytesPerSample);
+    }
+
+    FSRStats& SRStats = FSRStats::Get();
+    const uint64 WrittenCycles = FPlatformTime::Cycles64();
+    SRStats.RecordLatency(ESRStage::Mux, Queued.QueuedCycles, WrittenCycles);
+    if (bIsVideo)
+    {
+        SRStats.RecordLatency(ESRStage::EndToEnd, Queued.CaptureCycles, WrittenCycles);
+    }
+    SRStats.Add(ESRCounter::BytesMuxed, PacketSize);
+    return true;
+}
+
+void FMP4Muxer::ChangeVideoParameters(uint32 Width, uint32 Height, FTimespan Timestamp)
+{
+    UE_LOG(LogTemp, Log, TEXT("Video changes from %ux%u to %ux%u at %.3f s"), VideoConfig.Width, VideoConfig.Height, Width, Height, Timestamp.GetTotalSeconds());
+
+    // Taken from this keyframe by ConvertVideoPayload. A file whose header is written keeps the sample description it
+    // started with and plays on with the in-band SPS/PPS (avc3), only the ones still to be started describe the new size.
+    VideoConfig.Width = Width;
+    VideoConfig.Height = Height;
+    VideoExtradata.Reset();
+}
+
+void FMP4Muxer::ConvertVideoPayload(FPayload* Payload, bool bKeyFrame, bool bIsAvcc)
+{
+    // H.264 packets from hardware encoders are Annex-B, and keyframes carry the SPS/PPS in front of the IDR slice.
+    // MP4 wants length prefixed NAL units, and the SPS/PPS in the stream extradata (avcC) before the header is written.
+    // The parameter sets are left in-band as well, which avc3 relies on to change size and lets players resync on any keyframe.
+    SRH264::FParameterSets ParameterSets;
+    SRH264::FParameterSets* ParameterSetsPtr = (bKeyFrame && VideoExtradata.Num() == 0) ? &ParameterSets : nullptr;
+
+    if (bIsAvcc)
+    {
+        // Already converted by the publisher, only the parameter sets are needed
+        if (ParameterSetsPtr)
+        {
+            SRH264::FindParameterSetsAvcc(Payload->GetData(), Payload->Num(), ParameterSets);
+            SetVideoExtradata(ParameterSets);
+        }
+        return;
+    }
+
+    if (!SRH264::ConvertAnnexBToAvccInPlace(Payload->Data.GetData(), Payload->Data.Num(), ParameterSetsPtr))
+    {
+        // Only happens with encoders that emit 3-byte start codes
+        SRH264::ConvertAnnexBToAvcc(Payload->Data.GetData(), Payload->Data.Num(), AvccScratch, ParameterSetsPtr);
+        BytesCopied += Payload->Data.Num();
+        CopyRateWindowBytes += Payload->Data.Num();
+
+        if (ParameterSetsPtr)
+        {
+            SetVideoExtradata(ParameterSets);
+        }
+        // The old payload storage becomes the scratch buffer for next time
+        Swap(Payload->Data, AvccScratch);
+        return;
+    }
+
+    if (ParameterSetsPtr)
+    {
+        SetVideoExtradata(ParameterSets);
+    }
+}
+
+void FMP4Muxer::SetVideoExtradata(const SRH264::FParameterSets& ParameterSets)
+{
+    if (!ParameterSets.IsValid())
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Keyframe has no SPS/PPS. The MP4 will be written without avcC extradata."));
+        return;
+    }
+
+    SRH264::BuildAvcDecoderConfigurationRecord(ParameterSets, VideoExtradata);
+    ApplyVideoExtradata(*Output);
+}
+
+void FMP4Muxer::ApplyVideoExtradata(FOutput& Out)
+{
+    // libavformat took its copy of the stream parameters with the header
+    if (Out.bIsHeaderWritten)
+    {
+        return;
+    }
+
+    AVCodecParameters* CodecParams = Out.VideoStream->codecpar;
+    // Segments are opened ahead of time, maybe before the last parameter change
+    CodecParams->width = VideoConfig.Width;
+    CodecParams->height = VideoConfig.Height;
+    if (VideoExtradata.Num() == 0)
+    {
+        return;
+    }
+
+    av_freep(&CodecParams->extradata);
+    CodecParams->extradata = (uint8_t*)av_mallocz(VideoExtradata.Num() + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!CodecParams->extradata)
+    {
+        CodecParams->extradata_size = 0;
+        UE_LOG(LogTemp, Error, TEXT("Failed to allocate memory for H.264 extradata."));
+        return;
+    }
+    FMemory::Memcpy(CodecParams->extradata, VideoExtradata.GetData(), VideoExtradata.Num());
+    CodecParams->extradata_size = VideoExtradata.Num();
+}
+
+bool FMP4Muxer::WriteHeader(FOutput& Out)
+{
+    AVDictionary* MuxerOptions = nullptr;
+    if (Options.bFragmented)
+    {
+        // empty_moov: the moov written up front carries no samples, each fragment carries its own index (moof),
+        //             so the muxer never accumulates a sample table and everything before the last moof stays playable.
+        // frag_keyframe + min_frag_duration: cut a new fragment at the first keyframe after FragmentDurationMs.
+        //             No frag_duration, which would cut on any frame: CMAF fragments have to start with a keyframe.
+        //             Long GOPs are bounded by asking the encoder for a keyframe instead (WritePacket).
+        // default_base_moof: CMAF style data offsets, required by MSE and most DASH/HLS players.
+        const int64 FragmentDurationUs = FMath::Max(Options.FragmentDurationMs, 1) * 1000ll;
+        av_dict_set(&MuxerOptions, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        av_dict_set_int(&MuxerOptions, "min_frag_duration", FragmentDurationUs, 0);
+
+        // Push every completed fragment to the file right away instead of waiting for the AVIO buffer to fill up
+        Out.FormatContext->flush_packets = 1;
+    }
+
+    const int Result = avformat_write_header(Out.FormatContext, &MuxerOptions);
+    av_dict_free(&MuxerOptions);
+    if (Result < 0)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Failed to write MP4 header"));
+        return false;
+    }
 
+    Out.bIsHeaderWritten = true;
     return true;
 }
 
+FMP4MuxerStats FMP4Muxer::GetStats() const
+{
+    FMP4MuxerStats Stats;
+    Stats.PacketsWritten = PacketsWritten;
+    Stats.BytesAdopted = BytesAdopted;
+    Stats.BytesCopied = BytesCopied;
+    Stats.BytesCopiedPerSecond = BytesCopiedPerSecond;
+    Stats.QueueCapacity = Queue ? Queue->Capacity() : 0;
+    Stats.QueueDepth = Queue ? Queue->Num() : 0;
+    Stats.MaxQueueDepth = MaxQueueDepth;
+    Stats.PacketsDropped = PacketsDropped;
+    Stats.BytesDropped = BytesDropped;
+    Stats.NumBlocked = NumBlocked;
+    Stats.BlockedSeconds = FPlatformTime::ToSeconds64(BlockedCycles);
+    Stats.NumSegments = NumSegments;
+    Stats.SegmentSplitsDeferred = SegmentSplitsDeferred;
+
+    FScopeLock Lock(&IOStatsCS);
+    Stats.IOBytesWritten = ClosedIOBytes;
+    Stats.IONumFlushes = ClosedIOFlushes;
+    double IOWriteSeconds = ClosedIOWriteSeconds;
+    Stats.IOMaxFlushSeconds = ClosedIOMaxFlushSeconds;
+    Stats.IOStallSeconds = ClosedIOStallSeconds;
+    // Segments that are still being closed on a background thread are missing until they are done
+    if (Output && Output->AsyncOutput)
+    {
+        const FSRAsyncFileOutput::FStats IOStats = Output->AsyncOutput->GetStats();
+        Stats.IOBytesWritten += IOStats.BytesWritten;
+        Stats.IONumFlushes += IOStats.NumFlushes;
+        IOWriteSeconds += IOStats.WriteSeconds;
+        Stats.IOMaxFlushSeconds = FMath::Max(Stats.IOMaxFlushSeconds, IOStats.MaxFlushSeconds);
+        Stats.IOStallSeconds += IOStats.StallSeconds;
+    }
+    Stats.IOAverageFlushSeconds = Stats.IONumFlushes ? IOWriteSeconds / Stats.IONumFlushes : 0;
+    const double IOElapsed = (IOEndTime > 0 ? IOEndTime : FPlatformTime::Seconds()) - IOStartTime;
+    Stats.IOThroughputBytesPerSecond = IOElapsed > 0 ? Stats.IOBytesWritten / IOElapsed : 0;
+    return Stats;
+}
+
 void FMP4Muxer::Finalize()
 {
-    if (FormatContext)
+    // Let the writer thread flush everything that was queued before we touch the outputs.
+    // Producers already inside AddPacket finish first: blocked ones give up and drop their packet, the others get it
+    // queued while the writer is still draining.
+    bAcceptingPackets = false;
+    while (NumProducers.Load() > 0)
     {
-        if (bIsHeaderWritten)
+        if (SpaceEvent)
         {
-            // Write the file trailer. This is essential for a valid MP4.
-            av_write_trailer(FormatContext);
+            SpaceEvent->Trigger();
         }
+        FPlatformProcess::SleepNoStats(0.0005f);
+    }
+    if (WriterThread)
+    {
+        bStopWriter = true;
+        WorkEvent->Trigger();
+        WriterThread->WaitForCompletion();
+        delete WriterThread;
+        WriterThread = nullptr;
+    }
+    if (Queue)
+    {
+        // Only left over if the writer thread never ran
+        FQueuedPacket Leftover;
+        while (DequeuePacket(Leftover))
+        {
+            DropPacket(Leftover);
+        }
+    }
+    if (WorkEvent)
+    {
+        FPlatformProcess::ReturnSynchEventToPool(WorkEvent);
+        WorkEvent = nullptr;
+    }
+    if (SpaceEvent)
+    {
+        FPlatformProcess::ReturnSynchEventToPool(SpaceEvent);
+        SpaceEvent = nullptr;
+    }
+    Queue.Reset();
 
-        // Close the output file
-        if (!(FormatContext->oformat->flags & AVFMT_NOFILE))
+    // A segment that was opened ahead of time but never used is deleted again
+    if (NextOutput.IsValid())
+    {
+        if (FOutput* Unused = NextOutput.Get())
         {
-            avio_closep(&FormatContext->pb);
+            CloseOutput(*Unused);
+            IFileManager::Get().Delete(*Unused->FilePath);
+            delete Unused;
         }
+        NextOutput = TFuture<FOutput*>();
+    }
 
-        // Free the context
-        avformat_free_context(FormatContext);
-        FormatContext = nullptr;
-        VideoStream = nullptr;
-        AudioStream = nullptr;
-        bIsHeaderWritten = false;
+    if (PreviousOutput)
+    {
+        CloseOutput(*PreviousOutput);
+        PreviousOutput.Reset();
+    }
+    if (Output)
+    {
+        CloseOutput(*Output);
+        FScopeLock Lock(&IOStatsCS);
+        Output.Reset();
+    }
+    for (TFuture<void>& Closing : ClosingOutputs)
+    {
+        Closing.Wait();
+    }
+    ClosingOutputs.Reset();
+    if (IOStartTime > 0 && IOEndTime == 0)
+    {
+        IOEndTime = FPlatformTime::Seconds();
+    }
+
+    if (ScratchPacket)
+    {
+        av_packet_free(&ScratchPacket);
     }
 }
\ No newline at end of file
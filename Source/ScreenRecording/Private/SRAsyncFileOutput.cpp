@@ -0,0 +1,340 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRAsyncFileOutput.h"
+#include "SRStats.h"
+#include "HAL/PlatformFilemanager.h"
+#include "HAL/PlatformProcess.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+
+extern "C" {
+#include "libavformat/avio.h"
+#include "libavutil/mem.h"
+}
+
+CSV_DEFINE_CATEGORY(SRFileOutput, true);
+
+namespace
+{
+	// Size of the AVIOContext's own buffer. Small on purpose: it only batches libavformat's tiny writes before
+	// they are copied into one of the big buffers.
+	constexpr int32 AVIOBufferSize = 64 * 1024;
+
+	// Buffers are aligned for unbuffered/DMA friendly writes
+	constexpr uint32 BufferAlignment = 4096;
+
+	void AtomicMax(TAtomic<uint64>& Target, uint64 Value)
+	{
+		uint64 Current = Target.Load(EMemoryOrder::Relaxed);
+		while (Current < Value && !Target.CompareExchange(Current, Value))
+		{
+		}
+	}
+}
+
+TUniquePtr<FSRAsyncFileOutput> FSRAsyncFileOutput::Open(const FString& FilePath, const FSettings& Settings)
+{
+	TUniquePtr<FSRAsyncFileOutput> Output(new FSRAsyncFileOutput(Settings));
+
+	Output->FileHandle = FPlatformFileManager::Get().GetPlatformFile().OpenWrite(*FilePath);
+	if (!Output->FileHandle)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Failed to open output file: %s"), *FilePath);
+		return nullptr;
+	}
+
+	uint8* AVIOBuffer = static_cast<uint8*>(av_malloc(AVIOBufferSize));
+	Output->AVIO = AVIOBuffer ? avio_alloc_context(AVIOBuffer, AVIOBufferSize, 1, Output.Get(), nullptr, &FSRAsyncFileOutput::WritePacket, &FSRAsyncFileOutput::Seek) : nullptr;
+	if (!Output->AVIO)
+	{
+		av_free(AVIOBuffer);
+		UE_LOG(LogTemp, Error, TEXT("Failed to allocate the AVIO context for %s"), *FilePath);
+		return nullptr;
+	}
+
+	Output->Thread = FRunnableThread::Create(Output.Get(), TEXT("SRFileOutput"), 0, TPri_AboveNormal);
+	if (!Output->Thread)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Failed to create the file output thread"));
+		return nullptr;
+	}
+
+	return Output;
+}
+
+FSRAsyncFileOutput::FSRAsyncFileOutput(const FSettings& InSettings)
+	: Settings(InSettings)
+	, SubmittedBuffers(FMath::Max(InSettings.NumBuffers, 2))
+	, FreeBuffers(FMath::Max(InSettings.NumBuffers, 2))
+{
+	Settings.BufferSize = FMath::Clamp(Settings.BufferSize, 1024 * 1024, 64 * 1024 * 1024);
+	Settings.NumBuffers = FMath::Max(Settings.NumBuffers, 2);
+	Settings.GrowthExtent = FMath::Max<int64>(Settings.GrowthExtent, 0);
+
+	Buffers.SetNum(Settings.NumBuffers);
+	for (int32 Index = 0; Index < Buffers.Num(); ++Index)
+	{
+		Buffers[Index].Data = static_cast<uint8*>(FMemory::Malloc(Settings.BufferSize, BufferAlignment));
+		verify(FreeBuffers.TryEnqueue(int32(Index)));
+	}
+
+	SubmittedEvent = FPlatformProcess::GetSynchEventFromPool(false);
+	FreeEvent = FPlatformProcess::GetSynchEventFromPool(false);
+	OpenCycles = FPlatformTime::Cycles64();
+}
+
+FSRAsyncFileOutput::~FSRAsyncFileOutput()
+{
+	Close();
+
+	if (AVIO)
+	{
+		av_freep(&AVIO->buffer);
+		avio_context_free(&AVIO);
+	}
+	for (FBuffer& Buffer : Buffers)
+	{
+		FMemory::Free(Buffer.Data);
+	}
+	FPlatformProcess::ReturnSynchEventToPool(SubmittedEvent);
+	FPlatformProcess::ReturnSynchEventToPool(FreeEvent);
+}
+
+bool FSRAsyncFileOutput::Close()
+{
+	if (bClosed)
+	{
+		return !bWriteError;
+	}
+	bClosed = true;
+
+	if (Thread)
+	{
+		// Whatever libavformat still has in the AVIO buffer goes through WritePacket first
+		if (AVIO)
+		{
+			avio_flush(AVIO);
+		}
+		SubmitCurrentBuffer();
+
+		bStopping = true;
+		SubmittedEvent->Trigger();
+		Thread->WaitForCompletion();
+		delete Thread;
+		Thread = nullptr;
+	}
+
+	if (FileHandle)
+	{
+		// Cut off what was grown ahead and never written
+		if (FileSize > LogicalSize && !FileHandle->Truncate(LogicalSize))
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Failed to trim the recording to its size"));
+		}
+		FileHandle->Flush();
+		delete FileHandle;
+		FileHandle = nullptr;
+	}
+
+	CloseCycles = FPlatformTime::Cycles64();
+	return !bWriteError;
+}
+
+FSRAsyncFileOutput::FStats FSRAsyncFileOutput::GetStats() const
+{
+	FStats Stats;
+	Stats.BytesWritten = BytesWritten;
+	Stats.NumFlushes = NumFlushes;
+	Stats.WriteSeconds = FPlatformTime::ToSeconds64(WriteCycles);
+	Stats.MaxFlushSeconds = FPlatformTime::ToSeconds64(MaxFlushCycles);
+	Stats.StallSeconds = FPlatformTime::ToSeconds64(StallCycles);
+
+	const double Elapsed = FPlatformTime::ToSeconds64((CloseCycles ? CloseCycles : FPlatformTime::Cycles64()) - OpenCycles);
+	Stats.ThroughputBytesPerSecond = Elapsed > 0 ? Stats.BytesWritten / Elapsed : 0;
+	return Stats;
+}
+
+int FSRAsyncFileOutput::WritePacket(void* Opaque, uint8* Data, int Size)
+{
+	FSRAsyncFileOutput* Output = static_cast<FSRAsyncFileOutput*>(Opaque);
+	Output->Append(Data, Size);
+	return Size;
+}
+
+int64 FSRAsyncFileOutput::Seek(void* Opaque, int64 Offset, int Whence)
+{
+	FSRAsyncFileOutput* Output = static_cast<FSRAsyncFileOutput*>(Opaque);
+
+	Whence &= ~AVSEEK_FORCE;
+	if (Whence == AVSEEK_SIZE)
+	{
+		return Output->LogicalSize;
+	}
+
+	int64 NewPosition;
+	switch (Whence)
+	{
+	case SEEK_SET: NewPosition = Offset; break;
+	case SEEK_CUR: NewPosition = Output->Position + Offset; break;
+	case SEEK_END: NewPosition = Output->LogicalSize + Offset; break;
+	default: return AVERROR(EINVAL);
+	}
+	if (NewPosition < 0)
+	{
+		return AVERROR(EINVAL);
+	}
+
+	// Don't wait for anything: the buffer in progress is queued as is, and the next write starts a new one at the
+	// new position. The I/O thread writes buffers in submission order, so later writes still win over earlier ones.
+	if (NewPosition != Output->Position)
+	{
+		Output->SubmitCurrentBuffer();
+		Output->Position = NewPosition;
+	}
+	return NewPosition;
+}
+
+void FSRAsyncFileOutput::Append(const uint8* Data, int32 Size)
+{
+	while (Size > 0)
+	{
+		if (CurrentBuffer == INDEX_NONE)
+		{
+			int32 Index;
+			if (!FreeBuffers.TryDequeue(Index))
+			{
+				// Every buffer is waiting for the disk
+				CSV_SCOPED_TIMING_STAT(SRFileOutput, WaitForBuffer);
+				const uint64 StartCycles = FPlatformTime::Cycles64();
+				while (!FreeBuffers.TryDequeue(Index))
+				{
+					FreeEvent->Wait(1);
+				}
+				StallCycles += FPlatformTime::Cycles64() - StartCycles;
+			}
+
+			CurrentBuffer = Index;
+			FBuffer& Buffer = Buffers[Index];
+			Buffer.Size = 0;
+			Buffer.FileOffset = Position;
+			Buffer.FirstWriteCycles = FPlatformTime::Cycles64();
+		}
+
+		FBuffer& Buffer = Buffers[CurrentBuffer];
+		const int32 NumToCopy = FMath::Min(Size, Settings.BufferSize - Buffer.Size);
+		FMemory::Memcpy(Buffer.Data + Buffer.Size, Data, NumToCopy);
+		Buffer.Size += NumToCopy;
+		Data += NumToCopy;
+		Size -= NumToCopy;
+
+		Position += NumToCopy;
+		LogicalSize = FMath::Max(LogicalSize, Position);
+
+		if (Buffer.Size == Settings.BufferSize)
+		{
+			SubmitCurrentBuffer();
+		}
+	}
+
+	// Fragmented files should reach the disk a fragment at a time, not once 8 MB have piled up
+	if (CurrentBuffer != INDEX_NONE && Settings.FlushIntervalMs > 0)
+	{
+		const double Age = FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - Buffers[CurrentBuffer].FirstWriteCycles);
+		if (Age >= Settings.FlushIntervalMs)
+		{
+			SubmitCurrentBuffer();
+		}
+	}
+}
+
+void FSRAsyncFileOutput::SubmitCurrentBuffer()
+{
+	if (CurrentBuffer == INDEX_NONE)
+	{
+		return;
+	}
+
+	if (Buffers[CurrentBuffer].Size == 0)
+	{
+		verify(FreeBuffers.TryEnqueue(int32(CurrentBuffer)));
+	}
+	else
+	{
+		// There are as many queue slots as buffers, so this can't fail
+		verify(SubmittedBuffers.TryEnqueue(int32(CurrentBuffer)));
+		SubmittedEvent->Trigger();
+	}
+	CurrentBuffer = INDEX_NONE;
+}
+
+uint32 FSRAsyncFileOutput::Run()
+{
+	for (;;)
+	{
+		int32 Index;
+		while (SubmittedBuffers.TryDequeue(Index))
+		{
+			WriteBuffer(Buffers[Index]);
+			verify(FreeBuffers.TryEnqueue(int32(Index)));
+			FreeEvent->Trigger();
+		}
+
+		if (bStopping)
+		{
+			// Close submitted the last buffer before setting bStopping
+			if (SubmittedBuffers.Num() == 0)
+			{
+				break;
+			}
+			continue;
+		}
+		SubmittedEvent->Wait();
+	}
+
+	return 0;
+}
+
+void FSRAsyncFileOutput::WriteBuffer(FBuffer& Buffer)
+{
+	CSV_SCOPED_TIMING_STAT(SRFileOutput, WriteBuffer);
+
+	const uint64 StartCycles = FPlatformTime::Cycles64();
+	const int64 End = Buffer.FileOffset + Buffer.Size;
+
+	// Move the end of the file ahead of the writes in big steps rather than on every write, so its size (and metadata)
+	// changes rarely. This is not fallocate: NTFS allocates the clusters for it, a filesystem with sparse files may not.
+	if (Settings.GrowthExtent > 0 && End > FileSize)
+	{
+		const int64 NewFileSize = (End + Settings.GrowthExtent - 1) / Settings.GrowthExtent * Settings.GrowthExtent;
+		if (FileHandle->Truncate(NewFileSize))
+		{
+			FileSize = NewFileSize;
+		}
+		else
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Growing the file ahead failed, extending it with each write from now on"));
+			Settings.GrowthExtent = 0;
+		}
+	}
+
+	if (FileHandle->Tell() != Buffer.FileOffset)
+	{
+		FileHandle->Seek(Buffer.FileOffset);
+	}
+	if (!FileHandle->Write(Buffer.Data, Buffer.Size))
+	{
+		if (!bWriteError)
+		{
+			UE_LOG(LogTemp, Error, TEXT("Failed to write %d bytes to the recording at offset %lld"), Buffer.Size, Buffer.FileOffset);
+		}
+		bWriteError = true;
+	}
+	FileSize = FMath::Max(FileSize, End);
+
+	const uint64 FlushCycles = FPlatformTime::Cycles64() - StartCycles;
+	WriteCycles += FlushCycles;
+	AtomicMax(MaxFlushCycles, FlushCycles);
+	BytesWritten += Buffer.Size;
+	FSRStats::Get().RecordLatency(ESRStage::Write, StartCycles, StartCycles + FlushCycles);
+	FSRStats::Get().Add(ESRCounter::BytesWritten, Buffer.Size);
+	++NumFlushes;
+}
@@ -0,0 +1,114 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "HAL/Event.h"
+#include "SRBoundedQueue.h"
+
+struct AVIOContext;
+class IFileHandle;
+
+/**
+ * File backend for libavformat that never blocks on the filesystem.
+ *
+ * libavformat writes into an AVIOContext whose callbacks fill large aligned buffers. Full buffers are handed to a
+ * background I/O thread which writes them out, while the muxer carries on with the next one. Each buffer remembers
+ * the file offset it starts at, so the seeks the MP4 muxer does (mdat size, moov) don't need to wait for I/O either.
+ * The file is extended in large steps ahead of the writes and trimmed to its real size on Close. That only moves the
+ * end of the file: whether disk space is reserved along with it is up to the filesystem (NTFS does, sparse files don't).
+ */
+class FSRAsyncFileOutput final : private FRunnable
+{
+public:
+	struct FSettings
+	{
+		// Size of each buffer. Clamped to [1, 64] MB.
+		int32 BufferSize = 8 * 1024 * 1024;
+		int32 NumBuffers = 2;
+		// The end of the file is moved this much at a time ahead of the writes. 0 extends it with each write.
+		int64 GrowthExtent = 256 * 1024 * 1024;
+		// Hand a partially filled buffer to the I/O thread if it holds data older than this. 0 only submits full buffers.
+		int32 FlushIntervalMs = 0;
+	};
+
+	struct FStats
+	{
+		uint64 BytesWritten = 0;
+		uint64 NumFlushes = 0;
+		// Time spent inside the file write calls
+		double WriteSeconds = 0;
+		double MaxFlushSeconds = 0;
+		// Time the muxer waited for a free buffer, i.e. the disk could not keep up
+		double StallSeconds = 0;
+		// Session throughput, from Open to now (or Close)
+		double ThroughputBytesPerSecond = 0;
+	};
+
+	static TUniquePtr<FSRAsyncFileOutput> Open(const FString& FilePath, const FSettings& Settings);
+	~FSRAsyncFileOutput();
+
+	/** The context to assign to AVFormatContext::pb. Owned by this object. */
+	AVIOContext* GetAVIOContext() const { return AVIO; }
+
+	/** Flushes everything, waits for the I/O thread, trims the file to what was written and closes it. */
+	bool Close();
+
+	FStats GetStats() const;
+
+private:
+	struct FBuffer
+	{
+		uint8* Data = nullptr;
+		int32 Size = 0;
+		int64 FileOffset = 0;
+		uint64 FirstWriteCycles = 0;
+	};
+
+	FSRAsyncFileOutput(const FSettings& InSettings);
+
+	// FRunnable interface
+	uint32 Run() override;
+
+	static int WritePacket(void* Opaque, uint8* Data, int Size);
+	static int64 Seek(void* Opaque, int64 Offset, int Whence);
+
+	void Append(const uint8* Data, int32 Size);
+	void SubmitCurrentBuffer();
+	void WriteBuffer(FBuffer& Buffer);
+
+	FSettings Settings;
+
+	IFileHandle* FileHandle = nullptr;
+	AVIOContext* AVIO = nullptr;
+
+	TArray<FBuffer> Buffers;
+	// Indices into Buffers. The muxer's writer thread is the only producer of Submitted, the I/O thread the only producer of Free.
+	TSRBoundedMpscQueue<int32> SubmittedBuffers;
+	TSRBoundedMpscQueue<int32> FreeBuffers;
+	FEvent* SubmittedEvent = nullptr;
+	FEvent* FreeEvent = nullptr;
+	FRunnableThread* Thread = nullptr;
+	TAtomic<bool> bStopping{ false };
+	bool bClosed = false;
+
+	// Muxer side state
+	int32 CurrentBuffer = INDEX_NONE;
+	int64 Position = 0;
+	int64 LogicalSize = 0;
+
+	// I/O thread state
+	// Where the end of the file is, GrowthExtent ahead of the writes
+	int64 FileSize = 0;
+	bool bWriteError = false;
+
+	uint64 OpenCycles = 0;
+	uint64 CloseCycles = 0;
+	TAtomic<uint64> BytesWritten{ 0 };
+	TAtomic<uint64> NumFlushes{ 0 };
+	TAtomic<uint64> WriteCycles{ 0 };
+	TAtomic<uint64> MaxFlushCycles{ 0 };
+	TAtomic<uint64> StallCycles{ 0 };
+};
@@ -0,0 +1,411 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRAudioConvert.h"
+#include "Math/VectorRegister.h"
+
+namespace SRAudio
+{
+	namespace
+	{
+		// -3 dB
+		constexpr float SideGain = 0.70710678f;
+
+		constexpr float S16Scale = 32768.0f;
+		constexpr float S32Scale = 2147483648.0f;
+		// Largest float below 2^31, the float to int32 conversion overflows at 2^31 itself
+		constexpr float S32MaxScaled = 2147483520.0f;
+
+		uint32 XorShift(uint32& State)
+		{
+			State ^= State << 13;
+			State ^= State >> 17;
+			State ^= State << 5;
+			return State;
+		}
+
+		// Uniform in [0, 1) from the top 23 bits, by making them the mantissa of a float in [1, 2)
+		float UniformFloat(uint32 Bits)
+		{
+			const uint32 FloatBits = (Bits >> 9) | 0x3F800000u;
+			float Value;
+			FMemory::Memcpy(&Value, &FloatBits, sizeof(Value));
+			return Value - 1.0f;
+		}
+
+		// Triangular noise in (-1, 1), the difference of two uniform draws
+		float TriangularNoise(uint32& State)
+		{
+			const float A = UniformFloat(XorShift(State));
+			return A - UniformFloat(XorShift(State));
+		}
+
+		void FloatToS16Scalar(const float* In, int32 Num, int16* Out, FDither* Dither)
+		{
+			for (int32 Index = 0; Index < Num; ++Index)
+			{
+				float Scaled = FMath::Clamp(In[Index], -1.0f, 1.0f) * S16Scale;
+				if (Dither)
+				{
+					Scaled += TriangularNoise(Dither->State[0]);
+				}
+				Out[Index] = static_cast<int16>(FMath::Clamp(FMath::RoundToInt(Scaled), int32(MIN_int16), int32(MAX_int16)));
+			}
+		}
+
+		void FloatToS32Scalar(const float* In, int32 Num, int32* Out)
+		{
+			for (int32 Index = 0; Index < Num; ++Index)
+			{
+				const float Scaled = FMath::Min(FMath::Clamp(In[Index], -1.0f, 1.0f) * S32Scale, S32MaxScaled);
+				Out[Index] = static_cast<int32>(FMath::RoundToDouble(Scaled));
+			}
+		}
+
+#if PLATFORM_CPU_X86_FAMILY
+		__m128i XorShiftSSE2(__m128i& State)
+		{
+			State = _mm_xor_si128(State, _mm_slli_epi32(State, 13));
+			State = _mm_xor_si128(State, _mm_srli_epi32(State, 17));
+			State = _mm_xor_si128(State, _mm_slli_epi32(State, 5));
+			return State;
+		}
+
+		__m128 UniformFloatSSE2(__m128i Bits)
+		{
+			return _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(Bits, 9), _mm_set1_epi32(0x3F800000))), _mm_set1_ps(1.0f));
+		}
+
+		__m128 TriangularNoiseSSE2(__m128i& State)
+		{
+			const __m128 A = UniformFloatSSE2(XorShiftSSE2(State));
+			return _mm_sub_ps(A, UniformFloatSSE2(XorShiftSSE2(State)));
+		}
+
+		void FloatToS16SSE2(const float* In, int32 Num, int16* Out, FDither* Dither)
+		{
+			const __m128 Min = _mm_set1_ps(-1.0f);
+			const __m128 Max = _mm_set1_ps(1.0f);
+			const __m128 Scale = _mm_set1_ps(S16Scale);
+			__m128i State = Dither ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(Dither->State)) : _mm_setzero_si128();
+
+			int32 Index = 0;
+			for (; Index + 8 <= Num; Index += 8)
+			{
+				__m128 A = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(In + Index), Min), Max), Scale);
+				__m128 B = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(In + Index + 4), Min), Max), Scale);
+				if (Dither)
+				{
+					A = _mm_add_ps(A, TriangularNoiseSSE2(State));
+					B = _mm_add_ps(B, TriangularNoiseSSE2(State));
+				}
+				// Rounds to nearest, and the pack saturates what the dither pushed past full scale
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(Out + Index), _mm_packs_epi32(_mm_cvtps_epi32(A), _mm_cvtps_epi32(B)));
+			}
+
+			if (Dither)
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(Dither->State), State);
+			}
+			FloatToS16Scalar(In + Index, Num - Index, Out + Index, Dither);
+		}
+
+		void FloatToS32SSE2(const float* In, int32 Num, int32* Out)
+		{
+			const __m128 Min = _mm_set1_ps(-1.0f);
+			const __m128 Max = _mm_set1_ps(1.0f);
+			const __m128 Scale = _mm_set1_ps(S32Scale);
+			const __m128 MaxScaled = _mm_set1_ps(S32MaxScaled);
+
+			int32 Index = 0;
+			for (; Index + 4 <= Num; Index += 4)
+			{
+				const __m128 Scaled = _mm_min_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(In + Index), Min), Max), Scale), MaxScaled);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(Out + Index), _mm_cvtps_epi32(Scaled));
+			}
+			FloatToS32Scalar(In + Index, Num - Index, Out + Index);
+		}
+
+		SR_TARGET_AVX2 __m256i XorShiftAVX2(__m256i& State)
+		{
+			State = _mm256_xor_si256(State, _mm256_slli_epi32(State, 13));
+			State = _mm256_xor_si256(State, _mm256_srli_epi32(State, 17));
+			State = _mm256_xor_si256(State, _mm256_slli_epi32(State, 5));
+			return State;
+		}
+
+		SR_TARGET_AVX2 __m256 TriangularNoiseAVX2(__m256i& State)
+		{
+			const __m256i One = _mm256_set1_epi32(0x3F800000);
+			const __m256 A = _mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(XorShiftAVX2(State), 9), One));
+			const __m256 B = _mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(XorShiftAVX2(State), 9), One));
+			// The two 1.0 offsets cancel out
+			return _mm256_sub_ps(A, B);
+		}
+
+		SR_TARGET_AVX2 void FloatToS16AVX2(const float* In, int32 Num, int16* Out, FDither* Dither)
+		{
+			const __m256 Min = _mm256_set1_ps(-1.0f);
+			const __m256 Max = _mm256_set1_ps(1.0f);
+			const __m256 Scale = _mm256_set1_ps(S16Scale);
+			__m256i State = Dither ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Dither->State)) : _mm256_setzero_si256();
+
+			int32 Index = 0;
+			for (; Index + 16 <= Num; Index += 16)
+			{
+				__m256 A = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(In + Index), Min), Max), Scale);
+				__m256 B = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(In + Index + 8), Min), Max), Scale);
+				if (Dither)
+				{
+					A = _mm256_add_ps(A, TriangularNoiseAVX2(State));
+					B = _mm256_add_ps(B, TriangularNoiseAVX2(State));
+				}
+				// The pack works within 128-bit lanes, the permute puts the samples back in order
+				const __m256i Packed = _mm256_packs_epi32(_mm256_cvtps_epi32(A), _mm256_cvtps_epi32(B));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + Index), _mm256_permute4x64_epi64(Packed, 0xD8));
+			}
+
+			if (Dither)
+			{
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(Dither->State), State);
+			}
+			FloatToS16SSE2(In + Index, Num - Index, Out + Index, Dither);
+		}
+
+		SR_TARGET_AVX2 void FloatToS32AVX2(const float* In, int32 Num, int32* Out)
+		{
+			const __m256 Min = _mm256_set1_ps(-1.0f);
+			const __m256 Max = _mm256_set1_ps(1.0f);
+			const __m256 Scale = _mm256_set1_ps(S32Scale);
+			const __m256 MaxScaled = _mm256_set1_ps(S32MaxScaled);
+
+			int32 Index = 0;
+			for (; Index + 8 <= Num; Index += 8)
+			{
+				const __m256 Scaled = _mm256_min_ps(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(In + Index), Min), Max), Scale), MaxScaled);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(Out + Index), _mm256_cvtps_epi32(Scaled));
+			}
+			FloatToS32SSE2(In + Index, Num - Index, Out + Index);
+		}
+#endif // PLATFORM_CPU_X86_FAMILY
+
+#if SR_WITH_NEON
+		float32x4_t TriangularNoiseNEON(uint32x4_t& State)
+		{
+			const uint32x4_t One = vdupq_n_u32(0x3F800000u);
+			float32x4_t Draws[2];
+			for (float32x4_t& Draw : Draws)
+			{
+				State = veorq_u32(State, vshlq_n_u32(State, 13));
+				State = veorq_u32(State, vshrq_n_u32(State, 17));
+				State = veorq_u32(State, vshlq_n_u32(State, 5));
+				Draw = vreinterpretq_f32_u32(vorrq_u32(vshrq_n_u32(State, 9), One));
+			}
+			return vsubq_f32(Draws[0], Draws[1]);
+		}
+
+		void FloatToS16NEON(const float* In, int32 Num, int16* Out, FDither* Dither)
+		{
+			const float32x4_t Min = vdupq_n_f32(-1.0f);
+			const float32x4_t Max = vdupq_n_f32(1.0f);
+			const float32x4_t Scale = vdupq_n_f32(S16Scale);
+			uint32x4_t State = Dither ? vld1q_u32(Dither->State) : vdupq_n_u32(0);
+
+			int32 Index = 0;
+			for (; Index + 8 <= Num; Index += 8)
+			{
+				float32x4_t A = vmulq_f32(vminq_f32(vmaxq_f32(vld1q_f32(In + Index), Min), Max), Scale);
+				float32x4_t B = vmulq_f32(vminq_f32(vmaxq_f32(vld1q_f32(In + Index + 4), Min), Max), Scale);
+				if (Dither)
+				{
+					A = vaddq_f32(A, TriangularNoiseNEON(State));
+					B = vaddq_f32(B, TriangularNoiseNEON(State));
+				}
+				vst1q_s16(Out + Index, vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(A)), vqmovn_s32(vcvtnq_s32_f32(B))));
+			}
+
+			if (Dither)
+			{
+				vst1q_u32(Dither->State, State);
+			}
+			FloatToS16Scalar(In + Index, Num - Index, Out + Index, Dither);
+		}
+
+		void FloatToS32NEON(const float* In, int32 Num, int32* Out)
+		{
+			const float32x4_t Min = vdupq_n_f32(-1.0f);
+			const float32x4_t Max = vdupq_n_f32(1.0f);
+			const float32x4_t Scale = vdupq_n_f32(S32Scale);
+
+			int32 Index = 0;
+			for (; Index + 4 <= Num; Index += 4)
+			{
+				// The conversion saturates on its own
+				vst1q_s32(Out + Index, vcvtnq_s32_f32(vmulq_f32(vminq_f32(vmaxq_f32(vld1q_f32(In + Index), Min), Max), Scale)));
+			}
+			FloatToS32Scalar(In + Index, Num - Index, Out + Index);
+		}
+#endif // SR_WITH_NEON
+
+		float ClampSample(float Sample)
+		{
+			return FMath::Clamp(Sample, -1.0f, 1.0f);
+		}
+
+		// Two stereo frames at a time, [L0 R0 L1 R1], with the clamp fused in
+
+		void MonoToStereo(const float* In, int32 NumFrames, float* Out)
+		{
+			const VectorRegister Min = VectorSetFloat1(-1.0f);
+			const VectorRegister Max = VectorSetFloat1(1.0f);
+
+			int32 Frame = 0;
+			for (; Frame + 4 <= NumFrames; Frame += 4)
+			{
+				const VectorRegister M = VectorMin(VectorMax(VectorLoad(In + Frame), Min), Max);
+				VectorStore(VectorShuffle(M, M, 0, 0, 1, 1), Out + Frame * 2);
+				VectorStore(VectorShuffle(M, M, 2, 2, 3, 3), Out + Frame * 2 + 4);
+			}
+			for (; Frame < NumFrames; ++Frame)
+			{
+				Out[Frame * 2] = Out[Frame * 2 + 1] = ClampSample(In[Frame]);
+			}
+		}
+
+		void StereoToStereo(const float* In, int32 NumFrames, float* Out)
+		{
+			const VectorRegister Min = VectorSetFloat1(-1.0f);
+			const VectorRegister Max = VectorSetFloat1(1.0f);
+
+			const int32 NumSamples = NumFrames * 2;
+			int32 Sample = 0;
+			for (; Sample + 4 <= NumSamples; Sample += 4)
+			{
+				VectorStore(VectorMin(VectorMax(VectorLoad(In + Sample), Min), Max), Out + Sample);
+			}
+			for (; Sample < NumSamples; ++Sample)
+			{
+				Out[Sample] = ClampSample(In[Sample]);
+			}
+		}
+
+		void FivePointOneToStereo(const float* In, int32 NumFrames, float* Out)
+		{
+			const VectorRegister Min = VectorSetFloat1(-1.0f);
+			const VectorRegister Max = VectorSetFloat1(1.0f);
+			const VectorRegister Gain = VectorSetFloat1(SideGain);
+
+			int32 Frame = 0;
+			for (; Frame + 2 <= NumFrames; Frame += 2)
+			{
+				// [FL0 FR0 C0 LFE0] [SL0 SR0 FL1 FR1] [C1 LFE1 SL1 SR1]
+				const float* Src = In + Frame * 6;
+				const VectorRegister V0 = VectorLoad(Src);
+				const VectorRegister V1 = VectorLoad(Src + 4);
+				const VectorRegister V2 = VectorLoad(Src + 8);
+
+				const VectorRegister Front = VectorShuffle(V0, V1, 0, 1, 2, 3);
+				const VectorRegister Center = VectorShuffle(V0, V2, 2, 2, 0, 0);
+				const VectorRegister Surround = VectorShuffle(V1, V2, 0, 1, 2, 3);
+
+				const VectorRegister Mixed = VectorMultiplyAdd(VectorAdd(Center, Surround), Gain, Front);
+				VectorStore(VectorMin(VectorMax(Mixed, Min), Max), Out + Frame * 2);
+			}
+			for (; Frame < NumFrames; ++Frame)
+			{
+				const float* Src = In + Frame * 6;
+				Out[Frame * 2] = ClampSample(Src[0] + (Src[2] + Src[4]) * SideGain);
+				Out[Frame * 2 + 1] = ClampSample(Src[1] + (Src[2] + Src[5]) * SideGain);
+			}
+		}
+
+		void SevenPointOneToStereo(const float* In, int32 NumFrames, float* Out)
+		{
+			const VectorRegister Min = VectorSetFloat1(-1.0f);
+			const VectorRegister Max = VectorSetFloat1(1.0f);
+			const VectorRegister Gain = VectorSetFloat1(SideGain);
+
+			int32 Frame = 0;
+			for (; Frame + 2 <= NumFrames; Frame += 2)
+			{
+				// [FL FR C LFE] [BL BR SL SR] per frame
+				const float* Src = In + Frame * 8;
+				const VectorRegister V0 = VectorLoad(Src);
+				const VectorRegister V1 = VectorLoad(Src + 4);
+				const VectorRegister V2 = VectorLoad(Src + 8);
+				const VectorRegister V3 = VectorLoad(Src + 12);
+
+				const VectorRegister Front = VectorShuffle(V0, V2, 0, 1, 0, 1);
+				const VectorRegister Center = VectorShuffle(V0, V2, 2, 2, 2, 2);
+				const VectorRegister Back = VectorShuffle(V1, V3, 0, 1, 0, 1);
+				const VectorRegister Side = VectorShuffle(V1, V3, 2, 3, 2, 3);
+
+				const VectorRegister Mixed = VectorMultiplyAdd(VectorAdd(VectorAdd(Center, Back), Side), Gain, Front);
+				VectorStore(VectorMin(VectorMax(Mixed, Min), Max), Out + Frame * 2);
+			}
+			for (; Frame < NumFrames; ++Frame)
+			{
+				const float* Src = In + Frame * 8;
+				Out[Frame * 2] = ClampSample(Src[0] + (Src[2] + Src[4] + Src[6]) * SideGain);
+				Out[Frame * 2 + 1] = ClampSample(Src[1] + (Src[2] + Src[5] + Src[7]) * SideGain);
+			}
+		}
+	}
+
+	FDither::FDither(uint32 Seed)
+	{
+		// Every lane needs its own, non-zero, xorshift state
+		for (int32 Lane = 0; Lane < UE_ARRAY_COUNT(State); ++Lane)
+		{
+			uint32 LaneState = Seed + Lane * 0x9E3779B9u;
+			State[Lane] = LaneState ? LaneState : 0x2545F491u;
+			XorShift(State[Lane]);
+		}
+	}
+
+	void FloatToS16(const float* In, int32 Num, int16* Out, FDither* Dither, EKernel Kernel)
+	{
+		checkSlow(IsKernelSupported(Kernel));
+		switch (Kernel)
+		{
+#if PLATFORM_CPU_X86_FAMILY
+		case EKernel::AVX2: FloatToS16AVX2(In, Num, Out, Dither); break;
+		case EKernel::SSE2: FloatToS16SSE2(In, Num, Out, Dither); break;
+#elif SR_WITH_NEON
+		case EKernel::NEON: FloatToS16NEON(In, Num, Out, Dither); break;
+#endif
+		default: FloatToS16Scalar(In, Num, Out, Dither); break;
+		}
+	}
+
+	void FloatToS32(const float* In, int32 Num, int32* Out, EKernel Kernel)
+	{
+		checkSlow(IsKernelSupported(Kernel));
+		switch (Kernel)
+		{
+#if PLATFORM_CPU_X86_FAMILY
+		case EKernel::AVX2: FloatToS32AVX2(In, Num, Out); break;
+		case EKernel::SSE2: FloatToS32SSE2(In, Num, Out); break;
+#elif SR_WITH_NEON
+		case EKernel::NEON: FloatToS32NEON(In, Num, Out); break;
+#endif
+		default: FloatToS32Scalar(In, Num, Out); break;
+		}
+	}
+
+	bool CanDownmixToStereo(int32 NumChannels)
+	{
+		return NumChannels == 1 || NumChannels == 2 || NumChannels == 6 || NumChannels == 8;
+	}
+
+	void DownmixToStereo(const float* In, int32 NumFrames, int32 NumChannels, float* Out)
+	{
+		switch (NumChannels)
+		{
+		case 1: MonoToStereo(In, NumFrames, Out); break;
+		case 2: StereoToStereo(In, NumFrames, Out); break;
+		case 6: FivePointOneToStereo(In, NumFrames, Out); break;
+		case 8: SevenPointOneToStereo(In, NumFrames, Out); break;
+		default: checkf(false, TEXT("No downmix kernel for %d channels"), NumChannels); break;
+		}
+	}
+}
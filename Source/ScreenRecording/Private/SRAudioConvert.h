@@ -0,0 +1,52 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "SRSimd.h"
+
+//
+// Sample format kernels for the audio capture path. Submix buffers are interleaved floats in the audio mixer's
+// channel order (FL, FR, FC, LFE, BL, BR, SL, SR), the encoders want stereo, some of them as integer PCM.
+//
+namespace SRAudio
+{
+	using SRSimd::EKernel;
+	using SRSimd::GetBestKernel;
+	using SRSimd::IsKernelSupported;
+	using SRSimd::LexToString;
+
+	/**
+	 * State of the triangular (TPDF) dither noise, one xorshift generator per SIMD lane.
+	 * Keep one per stream so the noise carries on across buffers. FloatToS16 advances it, so threads don't share one.
+	 */
+	struct FDither
+	{
+		explicit FDither(uint32 Seed = 0x9E3779B9u);
+
+		uint32 State[8];
+	};
+
+	/**
+	 * Converts [-1, 1] floats to signed 16-bit PCM, scaling by 32768 and saturating (out of range input included).
+	 * @param Dither If not null, adds +-1 LSB of triangular noise before rounding, which turns the truncation distortion
+	 *               of quiet signals into a constant noise floor
+	 */
+	void FloatToS16(const float* In, int32 Num, int16* Out, FDither* Dither = nullptr, EKernel Kernel = GetBestKernel());
+
+	/**
+	 * Converts [-1, 1] floats to signed 32-bit PCM, saturating. There is no dither option: a float only has 24 bits of
+	 * precision, so 1 LSB of noise at 32 bits would not change anything.
+	 */
+	void FloatToS32(const float* In, int32 Num, int32* Out, EKernel Kernel = GetBestKernel());
+
+	/** True if DownmixToStereo has a kernel for this many channels: mono, stereo, 5.1 and 7.1. */
+	bool CanDownmixToStereo(int32 NumChannels);
+
+	/**
+	 * Downmixes interleaved audio to interleaved stereo and clamps it to [-1, 1] in the same pass.
+	 * Uses the ITU-R BS.775 coefficients (center and surrounds at -3 dB, LFE dropped).
+	 * In and Out must not overlap. Out needs room for NumFrames * 2 floats.
+	 */
+	void DownmixToStereo(const float* In, int32 NumFrames, int32 NumChannels, float* Out);
+}
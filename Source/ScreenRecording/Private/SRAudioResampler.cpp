@@ -0,0 +1,100 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRAudioResampler.h"
+
+extern "C" {
+#include "libswresample/swresample.h"
+#include "libavutil/channel_layout.h"
+}
+
+namespace
+{
+	// Input further off the timeline than this is a gap (dropped submix buffers, a hitch), not jitter
+	const FTimespan MaxTimelineError = FTimespan::FromMilliseconds(5);
+
+	FTimespan FramesToTimespan(int64 Frames, int32 SampleRate)
+	{
+		return FTimespan(Frames * ETimespan::TicksPerSecond / SampleRate);
+	}
+}
+
+FSRAudioResampler::~FSRAudioResampler()
+{
+	swr_free(&Context);
+}
+
+bool FSRAudioResampler::Configure(int32 InInSampleRate, int32 InOutSampleRate, int32 InNumChannels)
+{
+	if (Context && InInSampleRate == InSampleRate && InOutSampleRate == OutSampleRate && InNumChannels == NumChannels)
+	{
+		return true;
+	}
+
+	swr_free(&Context);
+	InSampleRate = InInSampleRate;
+	OutSampleRate = InOutSampleRate;
+	NumChannels = InNumChannels;
+
+	const int64 ChannelLayout = av_get_default_channel_layout(NumChannels);
+	Context = swr_alloc_set_opts(nullptr, ChannelLayout, AV_SAMPLE_FMT_FLT, OutSampleRate, ChannelLayout, AV_SAMPLE_FMT_FLT, InSampleRate, 0, nullptr);
+	if (!Context || swr_init(Context) < 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Failed to set up resampling of %d channels from %d Hz to %d Hz"), NumChannels, InSampleRate, OutSampleRate);
+		swr_free(&Context);
+		return false;
+	}
+
+	UE_LOG(LogTemp, Log, TEXT("Resampling audio from %d Hz to %d Hz"), InSampleRate, OutSampleRate);
+	Reset();
+	return true;
+}
+
+void FSRAudioResampler::Reset()
+{
+	if (Context)
+	{
+		// Reinitializing drops the samples the filter holds
+		swr_close(Context);
+		swr_init(Context);
+	}
+	bAnchored = false;
+	InputFrames = 0;
+	OutputFrames = 0;
+}
+
+int32 FSRAudioResampler::Process(const float* In, int32 NumFrames, FTimespan Timestamp, FTimespan& OutTimestamp)
+{
+	check(Context);
+
+	if (bAnchored && FMath::Abs((Timestamp - (Anchor + FramesToTimespan(InputFrames, InSampleRate))).GetTicks()) > MaxTimelineError.GetTicks())
+	{
+		// What the filter holds belongs before the gap, and the timeline has to jump over it
+		Reset();
+	}
+	if (!bAnchored)
+	{
+		bAnchored = true;
+		Anchor = Timestamp;
+	}
+
+	const int32 MaxOutFrames = swr_get_out_samples(Context, NumFrames);
+	if (Output.Num() < MaxOutFrames * NumChannels)
+	{
+		Output.SetNumUninitialized(MaxOutFrames * NumChannels);
+	}
+
+	uint8* OutPlanes[] = { reinterpret_cast<uint8*>(Output.GetData()) };
+	const uint8* InPlanes[] = { reinterpret_cast<const uint8*>(In) };
+	const int32 NumOutFrames = swr_convert(Context, OutPlanes, MaxOutFrames, InPlanes, NumFrames);
+	if (NumOutFrames < 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Audio resampling failed"));
+		Reset();
+		return 0;
+	}
+
+	OutTimestamp = Anchor + FramesToTimespan(OutputFrames, OutSampleRate);
+	InputFrames += NumFrames;
+	OutputFrames += NumOutFrames;
+	return NumOutFrames;
+}
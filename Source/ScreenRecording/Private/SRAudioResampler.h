@@ -0,0 +1,59 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct SwrContext;
+
+/**
+ * Streaming sample rate converter for interleaved float audio, on top of libswresample's polyphase filter.
+ *
+ * Output timestamps come from a sample counter anchored at the first input timestamp, so they are exact at the
+ * output rate however the input is chunked. The filter holds back a few input samples (well under a millisecond),
+ * which come out with the next call. Nothing is allocated per call once the output buffer has grown to the
+ * biggest chunk.
+ */
+class FSRAudioResampler
+{
+public:
+	FSRAudioResampler() = default;
+	~FSRAudioResampler();
+
+	FSRAudioResampler(const FSRAudioResampler&) = delete;
+	FSRAudioResampler& operator=(const FSRAudioResampler&) = delete;
+
+	/** Sets the conversion up, or keeps the current one if nothing changed. */
+	bool Configure(int32 InSampleRate, int32 OutSampleRate, int32 NumChannels);
+
+	/**
+	 * Converts NumFrames frames.
+	 * @param Timestamp Of the first input frame. Anchors the output timeline at the start, and again after a gap in the input.
+	 * @param OutTimestamp Receives the timestamp of the first output frame
+	 * @return Number of output frames, in GetOutput()
+	 */
+	int32 Process(const float* In, int32 NumFrames, FTimespan Timestamp, FTimespan& OutTimestamp);
+
+	const float* GetOutput() const { return Output.GetData(); }
+
+	/** Drops the filter history and the timeline, for when the stream restarts. */
+	void Reset();
+
+	int32 GetInSampleRate() const { return InSampleRate; }
+	int32 GetOutSampleRate() const { return OutSampleRate; }
+
+private:
+	SwrContext* Context = nullptr;
+	int32 InSampleRate = 0;
+	int32 OutSampleRate = 0;
+	int32 NumChannels = 0;
+
+	// Only grown
+	TArray<float> Output;
+
+	// Output frame N is at Anchor + N / OutSampleRate. Input frame N was expected at Anchor + N / InSampleRate.
+	bool bAnchored = false;
+	FTimespan Anchor;
+	int64 InputFrames = 0;
+	int64 OutputFrames = 0;
+};
@@ -0,0 +1,320 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+// Console commands that measure the capture and conversion kernels. Development builds only.
+
+#include "CoreMinimal.h"
+
+#if !UE_BUILD_SHIPPING
+
+#include "HAL/IConsoleManager.h"
+#include "Math/RandomStream.h"
+#include "SRGameplayMediaEncoder.h"
+#include "SRAudioConvert.h"
+#include "SRSampleRing.h"
+#include "SRVideoConvert.h"
+
+extern "C" {
+#include "libswscale/swscale.h"
+}
+
+namespace
+{
+	// What the encoder downmixes to and runs at by default
+	const int32 BenchSampleRate = 48000;
+	const int32 BenchNumChannels = 2;
+
+	// Per submix buffer cost of the audio render thread's part of the capture, before and after moving the work to
+	// the audio worker, and of the worker's downmix kernel against the audio mixer's.
+	void BenchAudioCapture(const TArray<FString>& Args)
+	{
+		const int32 NumChannels = Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 6;
+		const int32 NumFrames = Args.Num() > 1 ? FCString::Atoi(*Args[1]) : 1024;
+		const int32 Iterations = Args.Num() > 2 ? FCString::Atoi(*Args[2]) : 10000;
+		if(NumChannels <= 0 || NumFrames <= 0 || Iterations <= 0)
+		{
+			UE_LOG(SRGameplayMediaEncoder, Error, TEXT("Usage: GameplayMediaEncoder.BenchAudioCapture [NumChannels] [NumFrames] [Iterations]"));
+			return;
+		}
+
+		const int32 NumSamples = NumFrames * NumChannels;
+		TArray<float> Input;
+		Input.SetNumUninitialized(NumSamples);
+		FRandomStream Random(42);
+		for(float& Sample : Input)
+		{
+			Sample = Random.FRandRange(-1.2f, 1.2f);
+		}
+
+		// Before: copy, wrap, downmix and clamp on the audio render thread, with the encode on top of that
+		double Start = FPlatformTime::Seconds();
+		for(int32 Iteration = 0; Iteration < Iterations; ++Iteration)
+		{
+			Audio::AlignedFloatBuffer InData;
+			InData.Append(Input.GetData(), NumSamples);
+			Audio::TSampleBuffer<float> FloatBuffer(InData, NumChannels, BenchSampleRate);
+			if(FloatBuffer.GetNumChannels() != BenchNumChannels)
+			{
+				FloatBuffer.MixBufferToChannels(BenchNumChannels);
+			}
+			FloatBuffer.Clamp();
+		}
+		const double BeforeSeconds = FPlatformTime::Seconds() - Start;
+
+		// Now: a copy into the ring. Drained in batches outside the timing, the way the worker would.
+		constexpr int32 BatchSize = 4;
+		TSRSampleRing<float> Ring(NumSamples * BatchSize);
+		TArray<float> Drained;
+		Drained.SetNumUninitialized(NumSamples);
+		double NowSeconds = 0;
+		for(int32 Iteration = 0; Iteration < Iterations; Iteration += BatchSize)
+		{
+			Start = FPlatformTime::Seconds();
+			for(int32 Index = 0; Index < BatchSize; ++Index)
+			{
+				Ring.Write(Input.GetData(), NumSamples);
+			}
+			NowSeconds += FPlatformTime::Seconds() - Start;
+			while(Ring.Read(Drained.GetData(), NumSamples))
+			{
+			}
+		}
+		const int32 RingIterations = FMath::DivideAndRoundUp(Iterations, BatchSize) * BatchSize;
+
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Audio render thread, %d channels x %d frames: %.2f us per buffer before, %.2f us now"),
+			NumChannels, NumFrames, BeforeSeconds * 1e6 / Iterations, NowSeconds * 1e6 / RingIterations);
+
+		if(SRAudio::CanDownmixToStereo(NumChannels))
+		{
+			Audio::TSampleBuffer<float> MixerBuffer;
+			Start = FPlatformTime::Seconds();
+			for(int32 Iteration = 0; Iteration < Iterations; ++Iteration)
+			{
+				MixerBuffer = Audio::TSampleBuffer<float>(Input.GetData(), NumSamples, NumChannels, BenchSampleRate);
+				MixerBuffer.MixBufferToChannels(BenchNumChannels);
+				MixerBuffer.Clamp();
+			}
+			const double MixerSeconds = FPlatformTime::Seconds() - Start;
+
+			TArray<float> Stereo;
+			Stereo.SetNumUninitialized(NumFrames * BenchNumChannels);
+			Start = FPlatformTime::Seconds();
+			for(int32 Iteration = 0; Iteration < Iterations; ++Iteration)
+			{
+				SRAudio::DownmixToStereo(Input.GetData(), NumFrames, NumChannels, Stereo.GetData());
+			}
+			const double KernelSeconds = FPlatformTime::Seconds() - Start;
+
+			UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Audio worker downmix and clamp: %.2f us per buffer with the audio mixer, %.2f us with the fused kernel"),
+				MixerSeconds * 1e6 / Iterations, KernelSeconds * 1e6 / Iterations);
+		}
+	}
+}
+
+FAutoConsoleCommand SRGameplayMediaEncoderBenchAudioCapture(TEXT("GameplayMediaEncoder.BenchAudioCapture"), TEXT("Measures the per submix buffer cost of audio capture. Args: [NumChannels] [NumFrames] [Iterations]"),
+                                                          FConsoleCommandWithArgsDelegate::CreateStatic(&BenchAudioCapture));
+
+namespace
+{
+	// Each float to PCM kernel this CPU supports against the scalar one, and how far its output is from the scalar output
+	void BenchPCMConversion(const TArray<FString>& Args)
+	{
+		const int32 NumSamples = Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 2048;
+		const int32 Iterations = Args.Num() > 1 ? FCString::Atoi(*Args[1]) : 20000;
+		if(NumSamples <= 0 || Iterations <= 0)
+		{
+			UE_LOG(SRGameplayMediaEncoder, Error, TEXT("Usage: GameplayMediaEncoder.BenchPCMConversion [NumSamples] [Iterations]"));
+			return;
+		}
+
+		TArray<float> Input;
+		Input.SetNumUninitialized(NumSamples);
+		FRandomStream Random(42);
+		for(float& Sample : Input)
+		{
+			Sample = Random.FRandRange(-1.2f, 1.2f);
+		}
+
+		TArray<int16> ReferenceS16, S16;
+		TArray<int32> ReferenceS32, S32;
+		ReferenceS16.SetNumUninitialized(NumSamples);
+		ReferenceS32.SetNumUninitialized(NumSamples);
+		S16.SetNumUninitialized(NumSamples);
+		S32.SetNumUninitialized(NumSamples);
+		SRAudio::FloatToS16(Input.GetData(), NumSamples, ReferenceS16.GetData(), nullptr, SRAudio::EKernel::Scalar);
+		SRAudio::FloatToS32(Input.GetData(), NumSamples, ReferenceS32.GetData(), SRAudio::EKernel::Scalar);
+
+		const auto NanosecondsPerSample = [NumSamples, Iterations](double Seconds) { return Seconds * 1e9 / (double(NumSamples) * Iterations); };
+		double ScalarS16Seconds = 0;
+
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Float to PCM, %d samples x %d, best kernel %s"), NumSamples, Iterations, SRAudio::LexToString(SRAudio::GetBestKernel()));
+		for(SRAudio::EKernel Kernel : { SRAudio::EKernel::Scalar, SRAudio::EKernel::SSE2, SRAudio::EKernel::AVX2, SRAudio::EKernel::NEON })
+		{
+			if(!SRAudio::IsKernelSupported(Kernel))
+			{
+				continue;
+			}
+
+			double Start = FPlatformTime::Seconds();
+			for(int32 Iteration = 0; Iteration < Iterations; ++Iteration)
+			{
+				SRAudio::FloatToS16(Input.GetData(), NumSamples, S16.GetData(), nullptr, Kernel);
+			}
+			const double S16Seconds = FPlatformTime::Seconds() - Start;
+
+			SRAudio::FDither Dither;
+			Start = FPlatformTime::Seconds();
+			for(int32 Iteration = 0; Iteration < Iterations; ++Iteration)
+			{
+				SRAudio::FloatToS16(Input.GetData(), NumSamples, S16.GetData(), &Dither, Kernel);
+			}
+			const double DitheredSeconds = FPlatformTime::Seconds() - Start;
+
+			Start = FPlatformTime::Seconds();
+			for(int32 Iteration = 0; Iteration < Iterations; ++Iteration)
+			{
+				SRAudio::FloatToS32(Input.GetData(), NumSamples, S32.GetData(), Kernel);
+			}
+			const double S32Seconds = FPlatformTime::Seconds() - Start;
+
+			// Only rounding ties may differ: the scalar code rounds them up, the SIMD conversions to even
+			SRAudio::FloatToS16(Input.GetData(), NumSamples, S16.GetData(), nullptr, Kernel);
+			SRAudio::FloatToS32(Input.GetData(), NumSamples, S32.GetData(), Kernel);
+			int32 MaxS16Error = 0;
+			int64 MaxS32Error = 0;
+			for(int32 Index = 0; Index < NumSamples; ++Index)
+			{
+				MaxS16Error = FMath::Max(MaxS16Error, FMath::Abs(int32(S16[Index]) - int32(ReferenceS16[Index])));
+				MaxS32Error = FMath::Max(MaxS32Error, FMath::Abs(int64(S32[Index]) - int64(ReferenceS32[Index])));
+			}
+
+			if(Kernel == SRAudio::EKernel::Scalar)
+			{
+				ScalarS16Seconds = S16Seconds;
+			}
+			UE_LOG(SRGameplayMediaEncoder, Log, TEXT("  %-6s S16 %.3f ns/sample (x%.1f), S16 dithered %.3f, S32 %.3f, max error S16 %d S32 %lld"),
+				SRAudio::LexToString(Kernel), NanosecondsPerSample(S16Seconds), ScalarS16Seconds / FMath::Max(S16Seconds, 1e-9),
+				NanosecondsPerSample(DitheredSeconds), NanosecondsPerSample(S32Seconds), MaxS16Error, MaxS32Error);
+		}
+	}
+}
+
+FAutoConsoleCommand SRGameplayMediaEncoderBenchPCMConversion(TEXT("GameplayMediaEncoder.BenchPCMConversion"), TEXT("Compares the float to PCM kernels. Args: [NumSamples] [Iterations]"),
+                                                           FConsoleCommandWithArgsDelegate::CreateStatic(&BenchPCMConversion));
+
+namespace
+{
+	// The BGRA to YUV kernels against each other, on one thread and in bands, and against libswscale
+	void BenchVideoConversion(const TArray<FString>& Args)
+	{
+		const int32 SrcWidth = Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 1920;
+		const int32 SrcHeight = Args.Num() > 1 ? FCString::Atoi(*Args[1]) : 1080;
+		const int32 DstWidth = Args.Num() > 2 ? FCString::Atoi(*Args[2]) : SrcWidth;
+		const int32 DstHeight = Args.Num() > 3 ? FCString::Atoi(*Args[3]) : SrcHeight;
+		const int32 Iterations = Args.Num() > 4 ? FCString::Atoi(*Args[4]) : 100;
+
+		TArray<uint8> Pixels;
+		FSRVideoFrame Source;
+		Source.Format = ESRPixelFormat::BGRA8;
+		Source.Width = SrcWidth;
+		Source.Height = SrcHeight;
+		Source.Strides[0] = SrcWidth * 4;
+
+		TArray<uint8> Reference, Output;
+		const auto MakeImage = [DstWidth, DstHeight](TArray<uint8>& Buffer, ESRPixelFormat Format)
+		{
+			SRVideo::FYUVImage Image;
+			Image.Format = Format;
+			Image.Width = DstWidth;
+			Image.Height = DstHeight;
+			Image.Planes[0] = Buffer.GetData();
+			Image.Planes[1] = Buffer.GetData() + DstWidth * DstHeight;
+			Image.Planes[2] = Format == ESRPixelFormat::I420 ? Image.Planes[1] + DstWidth * DstHeight / 4 : nullptr;
+			Image.Strides[0] = DstWidth;
+			Image.Strides[1] = Format == ESRPixelFormat::I420 ? DstWidth / 2 : DstWidth;
+			Image.Strides[2] = DstWidth / 2;
+			return Image;
+		};
+
+		if(SrcWidth <= 0 || SrcHeight <= 0 || Iterations <= 0 || !SRVideo::CanConvertRGBToYUV(Source, MakeImage(Reference, ESRPixelFormat::I420)))
+		{
+			UE_LOG(SRGameplayMediaEncoder, Error, TEXT("Usage: GameplayMediaEncoder.BenchVideoConversion [SrcWidth] [SrcHeight] [DstWidth] [DstHeight] [Iterations], the destination even and dividing the source"));
+			return;
+		}
+
+		// Noise, so every chroma block is different
+		Pixels.SetNumUninitialized(SrcWidth * SrcHeight * 4);
+		FRandomStream Random(42);
+		for(uint8& Byte : Pixels)
+		{
+			Byte = static_cast<uint8>(Random.RandHelper(256));
+		}
+		Source.Planes[0] = Pixels.GetData();
+
+		const int32 YUVSize = DstWidth * DstHeight * 3 / 2;
+		Reference.SetNumZeroed(YUVSize);
+		Output.SetNumZeroed(YUVSize);
+		const SRVideo::FYUVImage ReferenceI420 = MakeImage(Reference, ESRPixelFormat::I420);
+		const SRVideo::FYUVImage I420 = MakeImage(Output, ESRPixelFormat::I420);
+		const SRVideo::FYUVImage NV12 = MakeImage(Output, ESRPixelFormat::NV12);
+		SRVideo::RGBToYUV(Source, ReferenceI420, SRVideo::EColorRange::Limited, 1, SRVideo::EKernel::Scalar);
+
+		const auto MillisecondsPerFrame = [Iterations](TFunctionRef<void()> Convert)
+		{
+			const double Start = FPlatformTime::Seconds();
+			for(int32 Iteration = 0; Iteration < Iterations; ++Iteration)
+			{
+				Convert();
+			}
+			return (FPlatformTime::Seconds() - Start) * 1e3 / Iterations;
+		};
+
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("BGRA %dx%d to %dx%d YUV, %d iterations, best kernel %s"),
+			SrcWidth, SrcHeight, DstWidth, DstHeight, Iterations, SRVideo::LexToString(SRVideo::GetBestKernel()));
+		for(SRVideo::EKernel Kernel : { SRVideo::EKernel::Scalar, SRVideo::EKernel::SSE2, SRVideo::EKernel::AVX2 })
+		{
+			if(!SRVideo::IsKernelSupported(Kernel))
+			{
+				continue;
+			}
+
+			const double OneBand = MillisecondsPerFrame([&]() { SRVideo::RGBToYUV(Source, I420, SRVideo::EColorRange::Limited, 1, Kernel); });
+			const double Banded = MillisecondsPerFrame([&]() { SRVideo::RGBToYUV(Source, I420, SRVideo::EColorRange::Limited, 0, Kernel); });
+			int32 MaxError = 0;
+			for(int32 Index = 0; Index < YUVSize; ++Index)
+			{
+				MaxError = FMath::Max(MaxError, FMath::Abs(int32(Output[Index]) - int32(Reference[Index])));
+			}
+			const double BandedNV12 = MillisecondsPerFrame([&]() { SRVideo::RGBToYUV(Source, NV12, SRVideo::EColorRange::Limited, 0, Kernel); });
+			const double BandedFullRange = MillisecondsPerFrame([&]() { SRVideo::RGBToYUV(Source, I420, SRVideo::EColorRange::Full, 0, Kernel); });
+
+			UE_LOG(SRGameplayMediaEncoder, Log, TEXT("  %-6s I420 %.3f ms on one thread, %.3f ms in bands, NV12 %.3f ms, full range %.3f ms, max error %d"),
+				SRVideo::LexToString(Kernel), OneBand, Banded, BandedNV12, BandedFullRange, MaxError);
+		}
+
+		// What FFrameConverter used to do with every frame: same matrix and range, bilinear scaling, one thread
+		SwsContext* Context = sws_getContext(SrcWidth, SrcHeight, AV_PIX_FMT_BGRA, DstWidth, DstHeight, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+		if(!Context)
+		{
+			UE_LOG(SRGameplayMediaEncoder, Error, TEXT("  libswscale can't do this conversion"));
+			return;
+		}
+		const int* Coefficients = sws_getCoefficients(SWS_CS_ITU709);
+		sws_setColorspaceDetails(Context, Coefficients, 1, Coefficients, 0, 0, 1 << 16, 1 << 16);
+		const uint8* const SrcPlanes[] = { Source.Planes[0] };
+		uint8* const DstPlanes[] = { I420.Planes[0], I420.Planes[1], I420.Planes[2] };
+		const double Swscale = MillisecondsPerFrame([&]() { sws_scale(Context, SrcPlanes, Source.Strides, 0, SrcHeight, DstPlanes, I420.Strides); });
+		sws_freeContext(Context);
+
+		int64 LumaError = 0;
+		for(int32 Index = 0; Index < DstWidth * DstHeight; ++Index)
+		{
+			LumaError += FMath::Abs(int32(Output[Index]) - int32(Reference[Index]));
+		}
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("  sws_scale %.3f ms, mean luma difference %.2f"), Swscale, double(LumaError) / (DstWidth * DstHeight));
+	}
+}
+
+FAutoConsoleCommand SRGameplayMediaEncoderBenchVideoConversion(TEXT("GameplayMediaEncoder.BenchVideoConversion"), TEXT("Compares the BGRA to YUV kernels with libswscale. Args: [SrcWidth] [SrcHeight] [DstWidth] [DstHeight] [Iterations]"),
+                                                             FConsoleCommandWithArgsDelegate::CreateStatic(&BenchVideoConversion));
+
+#endif // !UE_BUILD_SHIPPING
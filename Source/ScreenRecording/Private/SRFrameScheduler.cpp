@@ -0,0 +1,138 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRFrameScheduler.h"
+
+FSRFrameScheduler::FSRFrameScheduler(TUniquePtr<ISRClock> InClock)
+	: Clock(MoveTemp(InClock))
+{
+	check(Clock.IsValid());
+}
+
+void FSRFrameScheduler::Configure(ESRFrameRateMode InMode, uint32 InFramerate, int32 InMaxRepeats)
+{
+	// A constant frame rate needs a grid
+	check(InMode == ESRFrameRateMode::Variable || InFramerate > 0);
+
+	FScopeLock Lock(&CS);
+	Mode = InMode;
+	Framerate = InFramerate;
+	MaxRepeats = FMath::Max(InMaxRepeats, 0);
+	GridOrigin = bHasFrame ? LastTimestamp : FTimespan(0);
+	NextSlot = bHasFrame ? 1 : 0;
+}
+
+void FSRFrameScheduler::SetFramerate(uint32 InFramerate)
+{
+	FScopeLock Lock(&CS);
+	if(InFramerate == Framerate || (Mode == ESRFrameRateMode::Constant && InFramerate == 0))
+	{
+		return;
+	}
+
+	if(Framerate > 0)
+	{
+		GridOrigin = GetSlotTime(NextSlot);
+	}
+	else if(InFramerate > 0)
+	{
+		// Coming from no limit, the new grid starts one frame after the last one
+		GridOrigin = bHasFrame ? LastTimestamp + FTimespan(ETimespan::TicksPerSecond / InFramerate) : FTimespan(0);
+	}
+	NextSlot = 0;
+	Framerate = InFramerate;
+}
+
+void FSRFrameScheduler::Reset()
+{
+	FScopeLock Lock(&CS);
+	Clock->Reset();
+	GridOrigin = 0;
+	NextSlot = 0;
+	bHasFrame = false;
+	LastTimestamp = 0;
+	Stats = FSRFrameSchedulerStats();
+}
+
+bool FSRFrameScheduler::Schedule(FTimestamps& OutTimestamps)
+{
+	return Schedule(Clock->Now(), OutTimestamps);
+}
+
+bool FSRFrameScheduler::Schedule(FTimespan CaptureTime, FTimestamps& OutTimestamps)
+{
+	OutTimestamps.Reset();
+
+	FScopeLock Lock(&CS);
+	++Stats.NumFrames;
+
+	if(Framerate == 0)
+	{
+		// Unlimited variable frame rate: only the order matters
+		if(bHasFrame && CaptureTime <= LastTimestamp)
+		{
+			++Stats.NumDropped;
+			return false;
+		}
+		OutTimestamps.Add(CaptureTime);
+	}
+	else
+	{
+		const int64 Slot = GetNearestSlot(CaptureTime);
+		if(!bHasFrame && Slot >= 0)
+		{
+			// Nothing before the first frame to fill
+			NextSlot = Slot;
+		}
+		if(Slot < NextSlot)
+		{
+			// Another frame already took this grid point
+			++Stats.NumDropped;
+			return false;
+		}
+
+		if(Mode == ESRFrameRateMode::Constant)
+		{
+			const int64 FirstSlot = FMath::Max(NextSlot, Slot - MaxRepeats);
+			Stats.NumSkipped += FirstSlot - NextSlot;
+			Stats.NumRepeats += Slot - FirstSlot;
+			for(int64 Repeat = FirstSlot; Repeat <= Slot; ++Repeat)
+			{
+				OutTimestamps.Add(GetSlotTime(Repeat));
+			}
+		}
+		else
+		{
+			// The grid only decides which frames to keep. Two frames can't have the same time, but a frame can come out
+			// after its grid point, so keep the order explicit.
+			if(bHasFrame && CaptureTime <= LastTimestamp)
+			{
+				++Stats.NumDropped;
+				return false;
+			}
+			OutTimestamps.Add(CaptureTime);
+		}
+		NextSlot = Slot + 1;
+	}
+
+	bHasFrame = true;
+	LastTimestamp = OutTimestamps.Last();
+	return true;
+}
+
+FSRFrameSchedulerStats FSRFrameScheduler::GetStats() const
+{
+	FScopeLock Lock(&CS);
+	return Stats;
+}
+
+int64 FSRFrameScheduler::GetNearestSlot(FTimespan Time) const
+{
+	// Rounded to the nearest, so capture jitter of up to half a frame either way keeps a steady cadence
+	const int64 Scaled = (Time - GridOrigin).GetTicks() * Framerate + ETimespan::TicksPerSecond / 2;
+	return Scaled >= 0 ? Scaled / ETimespan::TicksPerSecond : -((-Scaled + ETimespan::TicksPerSecond - 1) / ETimespan::TicksPerSecond);
+}
+
+FTimespan FSRFrameScheduler::GetSlotTime(int64 Slot) const
+{
+	return GridOrigin + FTimespan(Slot * ETimespan::TicksPerSecond / Framerate);
+}
@@ -10,7 +10,16 @@
 #include "ShaderCore.h"
 #include "PipelineStateCache.h"
 #include "ProfilingDebugging/CsvProfiler.h"
+#include "RenderingThread.h"
 #include "SRIbmLiveStreaming.h"
+#include "SRH264Bitstream.h"
+#include "SRAudioConvert.h"
+#include "SRAudioResampler.h"
+#include "SRVideoConvert.h"
+#include "SRX264Encoder.h"
+#include "SRFrameScheduler.h"
+#include "SRStats.h"
+#include "SRMemoryTracker.h"
 
 #include "VideoEncoderFactory.h"
 #include "VideoEncoderInput.h"
@@ -24,10 +33,11 @@
 DEFINE_LOG_CATEGORY(SRGameplayMediaEncoder);
 CSV_DEFINE_CATEGORY(SRGameplayMediaEncoder, true);
 
-FTimespan SRMasterAudioClock = FTimespan::Zero();
+// Ticks of audio captured so far, counted in samples. Advanced by the audio render thread.
+TAtomic<int64> SRMasterAudioClock{ 0 };
 
-// right now we support only 48KHz audio sample rate as it's the only config UE4 seems to output
-// WMF AAC encoder supports also 44100Hz so its support can be easily added
+// default encoder sample rate, GameplayMediaEncoder.AudioSampleRate= can pick 44100Hz instead (the other rate the
+// WMF AAC encoder supports). Audio from the audio device is resampled to it.
 const uint32 HardcodedAudioSamplerate = 48000;
 // for now we downsample to stereo. WMF AAC encoder also supports 6 (5.1) channels
 // so it can be added too
@@ -35,6 +45,15 @@ const uint32 HardcodedAudioNumChannels = 2;
 // currently neither IVideoRecordingSystem neither HighlightFeature APIs allow to configure
 // audio stream parameters
 const uint32 HardcodedAudioBitrate = 192000;
+// samples per channel in an AAC-LC frame
+const int32 AACFrameSize = 1024;
+// audio further off the expected timeline than this follows a gap (dropped buffers, a device change), not jitter
+const FTimespan MaxAudioTimelineError = FTimespan::FromMilliseconds(5);
+// How many submix buffers the offset between the audio and video clocks is averaged over, to smooth out callback jitter
+const int64 AudioClockSmoothing = 64;
+// How fast the audio timeline follows that offset, in seconds per second of audio. Well above any real clock drift,
+// and too little to hear.
+const double MaxAudioSlew = 0.001;
 
 // currently neither IVideoRecordingSystem neither HighlightFeature APIs allow to configure
 // video stream parameters
@@ -48,9 +67,27 @@ const uint32 MinVideoBitrate = 1000000;
 const uint32 MaxVideoBitrate = 20000000;
 const uint32 MinVideoFPS = 10;
 const uint32 MaxVideoFPS = 60;
-
-const uint32 MaxWidth = 1920;
-const uint32 MaxHeight = 1080;
+// How many times a frame can be repeated to hold a constant frame rate, GameplayMediaEncoder.MaxRepeatedFrames= on
+// the command line. At 60 fps, two repeats keep the grid down to 20 fps of rendering.
+const int32 DefaultMaxRepeatedFrames = 2;
+
+// Any even size up to 4K, GameplayMediaEncoder.ResX= and ResY= on the command line
+const uint32 DefaultVideoWidth = 1920;
+const uint32 DefaultVideoHeight = 1080;
+const uint32 MinVideoSize = 64;
+const uint32 MaxVideoWidth = 3840;
+const uint32 MaxVideoHeight = 2160;
+
+// Longest time between keyframes, GameplayMediaEncoder.GopSeconds= on the command line: how long a new viewer or a
+// decoder that lost a packet waits at most
+const float DefaultGopSeconds = 2.0f;
+const float MinGopSeconds = 0.1f;
+const float MaxGopSeconds = 60.0f;
+
+// How long the video worker waits for the GPU to finish a back buffer copy before dropping the frame
+const double MaxCopyWaitSeconds = 0.1;
+// Back buffer readbacks the software encoding path keeps in flight. The GPU usually needs a frame or two to finish one.
+const int32 NumReadbackSlots = 3;
 
 FAutoConsoleCommand SRGameplayMediaEncoderInitialize(TEXT("GameplayMediaEncoder.Initialize"), TEXT("Constructs the audio/video encoding objects. Does not start encoding"),
                                                    FConsoleCommandDelegate::CreateStatic(&FSRGameplayMediaEncoder::InitializeCmd));
@@ -61,6 +98,53 @@ FAutoConsoleCommand SRGameplayMediaEncoderStop(TEXT("GameplayMediaEncoder.Stop")
 
 FAutoConsoleCommand SRGameplayMediaEncoderShutdown(TEXT("GameplayMediaEncoder.Shutdown"), TEXT("Releases all systems."), FConsoleCommandDelegate::CreateStatic(&FSRGameplayMediaEncoder::ShutdownCmd));
 
+FAutoConsoleCommand SRGameplayMediaEncoderSetResolution(TEXT("GameplayMediaEncoder.SetResolution"), TEXT("Changes the encoded picture size while recording. Args: Width [Height]"),
+                                                      FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+                                                      {
+                                                          FSRGameplayMediaEncoder::Get()->SetResolution(Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 0, Args.Num() > 1 ? FCString::Atoi(*Args[1]) : 0);
+                                                      }));
+
+FAutoConsoleCommand SRGameplayMediaEncoderLayerStats(TEXT("GameplayMediaEncoder.LayerStats"), TEXT("Logs what each simulcast layer costs"),
+                                                   FConsoleCommandDelegate::CreateLambda([]() { FSRGameplayMediaEncoder::Get()->LogVideoLayerStats(); }));
+
+FAutoConsoleCommand SRGameplayMediaEncoderRequestKeyframe(TEXT("GameplayMediaEncoder.RequestKeyframe"), TEXT("Makes the next frame encoded a keyframe"),
+                                                       FConsoleCommandDelegate::CreateLambda([]() { FSRGameplayMediaEncoder::Get()->RequestKeyframe(); }));
+
+namespace
+{
+	// Even, since the encoders take 4:2:0, and no bigger than 4K. A missing side follows from the other at 16:9, the way
+	// ResY=720 and ResY=1080 always gave 1280x720 and 1920x1080, and a size over the limit is scaled down with its aspect ratio.
+	FIntPoint GetValidResolution(uint32 Width, uint32 Height)
+	{
+		uint64 FullWidth = Width;
+		uint64 FullHeight = Height;
+		if(FullWidth == 0 && FullHeight == 0)
+		{
+			FullWidth = DefaultVideoWidth;
+			FullHeight = DefaultVideoHeight;
+		}
+		else if(FullWidth == 0)
+		{
+			FullWidth = (FullHeight * 16 + 8) / 9;
+		}
+		else if(FullHeight == 0)
+		{
+			FullHeight = (FullWidth * 9 + 8) / 16;
+		}
+
+		const double Scale = FMath::Min3(1.0, double(MaxVideoWidth) / FullWidth, double(MaxVideoHeight) / FullHeight);
+		return FIntPoint(
+			FMath::Clamp(uint32(FullWidth * Scale), MinVideoSize, MaxVideoWidth) & ~1u,
+			FMath::Clamp(uint32(FullHeight * Scale), MinVideoSize, MaxVideoHeight) & ~1u);
+	}
+
+	// For FSRMemoryTracker. What the driver pads or keeps on the side isn't counted.
+	int64 GetTextureBytes(const FTexture2DRHIRef& Texture)
+	{
+		return Texture ? int64(Texture->GetSizeX()) * Texture->GetSizeY() * GPixelFormats[Texture->GetFormat()].BlockBytes : 0;
+	}
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 // FSRGameplayMediaEncoder
@@ -78,16 +162,85 @@ FSRGameplayMediaEncoder* FSRGameplayMediaEncoder::Get()
 	return Singleton;
 }
 
-FSRGameplayMediaEncoder::FSRGameplayMediaEncoder() {}
+/**
+ * Gives a legacy listener the same treatment as a sink: its own bounded queue and thread.
+ */
+class FSRAsyncListener final : public ISRMediaSink
+{
+public:
+	FSRAsyncListener(IGameplayMediaEncoderListener* InListener, int32 QueueCapacity)
+		: Listener(InListener)
+		, Runner(*this, QueueCapacity)
+	{
+	}
+
+	void OnMediaPacket(const FSRMediaPacketPtr& Packet) override
+	{
+		AVEncoder::FMediaPacket Sample(Packet->Type);
+		Sample.Timestamp = Packet->Timestamp;
+		Sample.Duration = Packet->Duration;
+		Sample.Data = TArray<uint8>(Packet->GetData(), Packet->Num());
+		if(Packet->Type == AVEncoder::EPacketType::Video)
+		{
+			Sample.Video.bKeyFrame = Packet->bKeyFrame;
+			Sample.Video.Width = Packet->Width;
+			Sample.Video.Height = Packet->Height;
+			Sample.Video.FrameAvgQP = Packet->FrameAvgQP;
+			Sample.Video.Framerate = Packet->Framerate;
+		}
+		Listener->OnMediaSample(Sample);
+	}
+
+	const TCHAR* GetSinkName() const override { return TEXT("Listener"); }
+
+	IGameplayMediaEncoderListener* const Listener;
+	FSRMediaSinkRunner Runner;
+};
+
+FSRGameplayMediaEncoder::FSRGameplayMediaEncoder()
+	: AudioResampler(MakeUnique<FSRAudioResampler>())
+	, FrameConverter(MakeUnique<SRVideo::FFrameConverter>())
+	, FrameScheduler(MakeUnique<FSRFrameScheduler>())
+{
+	FSRMemoryTracker::Get().Add(ESRMemory::AudioRing, int64(AudioRing.Capacity() * sizeof(float)));
+}
 
-FSRGameplayMediaEncoder::~FSRGameplayMediaEncoder() { Shutdown(); }
+FSRGameplayMediaEncoder::~FSRGameplayMediaEncoder()
+{
+	Shutdown();
+	delete Consumers.Exchange(nullptr);
+	FSRMemoryTracker::Get().Add(ESRMemory::AudioRing, -int64(AudioRing.Capacity() * sizeof(float)));
+}
 
-bool FSRGameplayMediaEncoder::RegisterListener(IGameplayMediaEncoderListener* Listener)
+bool FSRGameplayMediaEncoder::RegisterListener(IGameplayMediaEncoderListener* Listener, bool bAsync, int32 QueueCapacity, uint32 LayerIndex, const FSRKeyframePolicy& KeyframePolicy)
 {
 	check(IsInGameThread());
 	FScopeLock Lock(&ListenersCS);
 
-	if(Listeners.Num() == 0)
+	if(LayerIndex >= MaxVideoLayers)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Error, TEXT("Can't register a listener for layer %u, there are at most %d"), LayerIndex, MaxVideoLayers);
+		return false;
+	}
+
+	if(Listeners.Contains(Listener) || AsyncListeners.ContainsByPredicate([Listener](const TUniquePtr<FSRAsyncListener>& Async) { return Async->Listener == Listener; }))
+	{
+		return true;
+	}
+
+	TUniquePtr<FSRAsyncListener> Async;
+	if(bAsync)
+	{
+		Async = MakeUnique<FSRAsyncListener>(Listener, QueueCapacity);
+		if(!Async->Runner.Start())
+		{
+			return false;
+		}
+	}
+
+	// The first consumer starts encoding, and the first frame is a keyframe anyway
+	const bool bRunning = HasConsumers();
+	if(!bRunning)
 	{
 		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Registering the first listener"));
 		if(!Start())
@@ -96,7 +249,17 @@ bool FSRGameplayMediaEncoder::RegisterListener(IGameplayMediaEncoderListener* Li
 		}
 	}
 
-	Listeners.AddUnique(Listener);
+	if(Async)
+	{
+		AsyncListeners.Add(MoveTemp(Async));
+	}
+	else
+	{
+		Listeners.Add(Listener);
+	}
+	ConsumerLayers.Add(Listener, LayerIndex);
+	PublishConsumers();
+	AddKeyframeLimiter(Listener, KeyframePolicy, bRunning);
 	return true;
 }
 
@@ -104,11 +267,35 @@ void FSRGameplayMediaEncoder::UnregisterListener(IGameplayMediaEncoderListener*
 {
 	check(IsInGameThread());
 
+	TUniquePtr<FSRAsyncListener> Removed;
 	ListenersCS.Lock();
+	RemoveKeyframeLimiter(Listener);
+	ConsumerLayers.Remove(Listener);
 	Listeners.Remove(Listener);
-	bool bAnyListenersLeft = Listeners.Num() > 0;
+	for(int32 Index = 0; Index < AsyncListeners.Num(); ++Index)
+	{
+		if(AsyncListeners[Index]->Listener == Listener)
+		{
+			Removed = MoveTemp(AsyncListeners[Index]);
+			AsyncListeners.RemoveAt(Index);
+			break;
+		}
+	}
+	// A synchronous listener isn't called anymore once this returns
+	PublishConsumers();
+	bool bAnyListenersLeft = HasConsumers();
 	ListenersCS.Unlock();
 
+	if(Removed)
+	{
+		// Nothing publishes to it anymore, so this delivers the rest and returns
+		Removed->Runner.Stop();
+
+		const FSRMediaSinkStats Stats = Removed->Runner.GetStats();
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Async listener: %llu packets delivered, %llu dropped, max queue depth %d of %d"),
+			Stats.PacketsDelivered, Stats.PacketsDropped, Stats.MaxQueueDepth, Stats.QueueCapacity);
+	}
+
 	if(bAnyListenersLeft == false)
 	{
 		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Unregistered the last listener"));
@@ -116,10 +303,165 @@ void FSRGameplayMediaEncoder::UnregisterListener(IGameplayMediaEncoderListener*
 	}
 }
 
-bool FSRGameplayMediaEncoder::Initialize()
+bool FSRGameplayMediaEncoder::AddSink(ISRMediaSink* Sink, int32 QueueCapacity, uint32 LayerIndex, const FSRKeyframePolicy& KeyframePolicy)
+{
+	check(IsInGameThread());
+	FScopeLock Lock(&ListenersCS);
+
+	if(LayerIndex >= MaxVideoLayers)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Error, TEXT("Can't add sink %s for layer %u, there are at most %d"), Sink->GetSinkName(), LayerIndex, MaxVideoLayers);
+		return false;
+	}
+
+	for(const TUniquePtr<FSRMediaSinkRunner>& Runner : Sinks)
+	{
+		if(&Runner->GetSink() == Sink)
+		{
+			return true;
+		}
+	}
+
+	TUniquePtr<FSRMediaSinkRunner> Runner = MakeUnique<FSRMediaSinkRunner>(*Sink, QueueCapacity);
+	if(!Runner->Start())
+	{
+		return false;
+	}
+
+	const bool bRunning = HasConsumers();
+	if(!bRunning)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Registering the first sink"));
+		if(!Start())
+		{
+			return false;
+		}
+	}
+
+	// The encoder is a singleton that outlives its sinks, and requests from a removed sink find no limiter
+	Sink->SetKeyframeRequester([this, Sink]() { return RequestKeyframe(Sink); });
+	Sinks.Add(MoveTemp(Runner));
+	ConsumerLayers.Add(Sink, LayerIndex);
+	PublishConsumers();
+	AddKeyframeLimiter(Sink, KeyframePolicy, bRunning);
+	return true;
+}
+
+void FSRGameplayMediaEncoder::RemoveSink(ISRMediaSink* Sink)
+{
+	check(IsInGameThread());
+
+	TUniquePtr<FSRMediaSinkRunner> Removed = DetachSink(Sink);
+
+	ListenersCS.Lock();
+	bool bAnyListenersLeft = HasConsumers();
+	ListenersCS.Unlock();
+
+	if(Removed)
+	{
+		// Nothing publishes to it anymore, so this delivers the rest and returns
+		Removed->Stop();
+
+		const FSRMediaSinkStats Stats = Removed->GetStats();
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Sink %s: %llu packets delivered, %llu dropped, max queue depth %d of %d"),
+			Sink->GetSinkName(), Stats.PacketsDelivered, Stats.PacketsDropped, Stats.MaxQueueDepth, Stats.QueueCapacity);
+	}
+
+	if(bAnyListenersLeft == false)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Removed the last sink"));
+		Stop();
+	}
+}
+
+TUniquePtr<FSRMediaSinkRunner> FSRGameplayMediaEncoder::DetachSink(ISRMediaSink* Sink)
+{
+	TUniquePtr<FSRMediaSinkRunner> Removed;
+	ListenersCS.Lock();
+	RemoveKeyframeLimiter(Sink);
+	ConsumerLayers.Remove(Sink);
+	for(int32 Index = 0; Index < Sinks.Num(); ++Index)
+	{
+		if(&Sinks[Index]->GetSink() == Sink)
+		{
+			Removed = MoveTemp(Sinks[Index]);
+			Sinks.RemoveAt(Index);
+			break;
+		}
+	}
+	// Nothing is enqueued to the runner anymore once this returns
+	PublishConsumers();
+	ListenersCS.Unlock();
+	return Removed;
+}
+
+void FSRGameplayMediaEncoder::PublishConsumers()
+{
+	FConsumerSnapshot* Snapshot = new FConsumerSnapshot;
+	auto GetVideoLayer = [this, &Snapshot](const void* Consumer) -> FConsumerSnapshot::FVideoLayerConsumers&
+	{
+		const int32 LayerIndex = ConsumerLayers.FindRef(Consumer);
+		if(LayerIndex >= Snapshot->VideoLayers.Num())
+		{
+			Snapshot->VideoLayers.SetNum(LayerIndex + 1);
+		}
+		return Snapshot->VideoLayers[LayerIndex];
+	};
+
+	Snapshot->Listeners = Listeners;
+	for(IGameplayMediaEncoderListener* Listener : Listeners)
+	{
+		GetVideoLayer(Listener).Listeners.Add(Listener);
+	}
+	for(const TUniquePtr<FSRAsyncListener>& Async : AsyncListeners)
+	{
+		Snapshot->ListenerRunners.Add(&Async->Runner);
+		GetVideoLayer(Async->Listener).ListenerRunners.Add(&Async->Runner);
+	}
+	for(const TUniquePtr<FSRMediaSinkRunner>& Runner : Sinks)
+	{
+		Snapshot->Sinks.Add(Runner.Get());
+		GetVideoLayer(&Runner->GetSink()).Sinks.Add(Runner.Get());
+	}
+
+	const FConsumerSnapshot* Previous = Consumers.Exchange(Snapshot);
+
+	// Dispatches pinned from here on count on the other side and see the new snapshot. The ones on this side drain:
+	// dispatching only queues packets (or calls synchronous listeners), so this waits for a packet or two at most.
+	// ListenersCS keeps publishes in order, the next one waits on this side again.
+	const uint32 Epoch = ConsumersEpoch.Load();
+	ConsumersEpoch = Epoch + 1;
+	while(ConsumersPins[Epoch & 1].Load() > 0)
+	{
+		FPlatformProcess::SleepNoStats(0.0001f);
+	}
+	delete Previous;
+}
+
+FSRGameplayMediaEncoder::FConsumersScope::FConsumersScope(const FSRGameplayMediaEncoder& Encoder)
+{
+	for(;;)
+	{
+		const uint32 Epoch = Encoder.ConsumersEpoch.Load();
+		Pins = &Encoder.ConsumersPins[Epoch & 1];
+		++*Pins;
+		// A publish that moved on in between doesn't wait for this side, so pin the new epoch instead
+		if(Encoder.ConsumersEpoch.Load() == Epoch)
+		{
+			break;
+		}
+		--*Pins;
+	}
+	Snapshot = Encoder.Consumers.Load();
+}
+
+FSRGameplayMediaEncoder::FConsumersScope::~FConsumersScope()
 {
-	SRMemoryCheckpoint("Initial");
+	--*Pins;
+}
 
+bool FSRGameplayMediaEncoder::Initialize()
+{
 	if(VideoEncoder)
 	{
 		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Already initialized"));
@@ -155,6 +497,14 @@ bool FSRGameplayMediaEncoder::Initialize()
 
 	AVEncoder::FAudioConfig AudioConfig;
 	AudioConfig.Samplerate = HardcodedAudioSamplerate;
+	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.AudioSampleRate="), AudioConfig.Samplerate);
+	// The AAC encoder only takes these. The audio device can run at anything, it gets resampled.
+	if(AudioConfig.Samplerate != 44100 && AudioConfig.Samplerate != 48000)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("Audio sample rate %u is not supported, using %u"), AudioConfig.Samplerate, HardcodedAudioSamplerate);
+		AudioConfig.Samplerate = HardcodedAudioSamplerate;
+	}
+	AudioSampleRate = AudioConfig.Samplerate;
 	AudioConfig.NumChannels = HardcodedAudioNumChannels;
 	AudioConfig.Bitrate = HardcodedAudioBitrate;
 	if(!AudioEncoder->Initialize(AudioConfig))
@@ -165,47 +515,57 @@ bool FSRGameplayMediaEncoder::Initialize()
 
 	AudioEncoder->RegisterListener(*this);
 
-	SRMemoryCheckpoint("Audio encoder initialized");
-
 	//
 	// Video
 	//
 
 	VideoConfig.Codec = "h264";
 	VideoConfig.Height = VideoConfig.Width = VideoConfig.Framerate = VideoConfig.Bitrate = 0;
+	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.ResX="), VideoConfig.Width);
 	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.ResY="), VideoConfig.Height);
-	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("GameplayMediaEncoder.ResY = %d"), VideoConfig.Height);
-	if(VideoConfig.Height == 720)
-	{
-		VideoConfig.Width = 1280;
-		VideoConfig.Height = 720;
-	}
-	else if(VideoConfig.Height == 0 || VideoConfig.Height == 1080)
+	const FIntPoint Resolution = GetValidResolution(VideoConfig.Width, VideoConfig.Height);
+	if((VideoConfig.Width != 0 && VideoConfig.Width != uint32(Resolution.X)) || (VideoConfig.Height != 0 && VideoConfig.Height != uint32(Resolution.Y)))
 	{
-		VideoConfig.Width = 1920;
-		VideoConfig.Height = 1080;
+		UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("GameplayMediaEncoder.ResX/ResY %ux%u is not supported, using %dx%d"), VideoConfig.Width, VideoConfig.Height, Resolution.X, Resolution.Y);
 	}
-	else
+	VideoConfig.Width = Resolution.X;
+	VideoConfig.Height = Resolution.Y;
+	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Resolution %ux%u"), VideoConfig.Width, VideoConfig.Height);
+
+	// GameplayMediaEncoder.FrameRateMode=CFR (default) puts the frames on a fixed grid, repeating and dropping them as
+	// needed, VFR keeps the time each one was captured at and only drops those over the frame rate
+	ESRFrameRateMode FrameRateMode = ESRFrameRateMode::Constant;
+	FString FrameRateModeName;
+	if(FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.FrameRateMode="), FrameRateModeName))
 	{
-		UE_LOG(SRGameplayMediaEncoder, Fatal, TEXT("GameplayMediaEncoder.ResY can only have a value of 720 or 1080"));
-		return false;
+		if(FrameRateModeName == TEXT("VFR"))
+		{
+			FrameRateMode = ESRFrameRateMode::Variable;
+		}
+		else if(FrameRateModeName != TEXT("CFR"))
+		{
+			UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("Unknown GameplayMediaEncoder.FrameRateMode '%s', using CFR"), *FrameRateModeName);
+		}
 	}
+	int32 MaxRepeatedFrames = DefaultMaxRepeatedFrames;
+	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.MaxRepeatedFrames="), MaxRepeatedFrames);
 
-	// Specifying 0 will completely disable frame skipping (therefore encoding as many frames as possible)
+	// Specifying 0 encodes every frame rendered, at the time it was rendered
 	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.FPS="), VideoConfig.Framerate);
 	if(VideoConfig.Framerate == 0)
 	{
-		// Note : When disabling frame skipping, we lie to the encoder when initializing.
-		// We still specify a framerate, but then feed frames without skipping
+		// Note : When uncapped, we lie to the encoder when initializing.
+		// We still specify a framerate for its rate control, but then feed frames as they come
 		VideoConfig.Framerate = HardcodedVideoFPS;
-		bDoFrameSkipping = false;
+		FrameScheduler->Configure(ESRFrameRateMode::Variable, 0, 0);
 		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Uncapping FPS"));
 	}
 	else
 	{
 		VideoConfig.Framerate = FMath::Clamp(VideoConfig.Framerate, (uint32)MinVideoFPS, (uint32)MaxVideoFPS);
-		bDoFrameSkipping = true;
-		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Capping FPS %u"), VideoConfig.Framerate);
+		FrameScheduler->Configure(FrameRateMode, VideoConfig.Framerate, MaxRepeatedFrames);
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("%s %u FPS, up to %d repeats"), FrameRateMode == ESRFrameRateMode::Constant ? TEXT("Constant") : TEXT("Capping to variable"),
+			VideoConfig.Framerate, MaxRepeatedFrames);
 	}
 
 	VideoConfig.Bitrate = HardcodedVideoBitrate;
@@ -219,7 +579,16 @@ bool FSRGameplayMediaEncoder::Initialize()
 	videoInit.TargetBitrate = VideoConfig.Bitrate;
 	videoInit.MaxFramerate = VideoConfig.Framerate;
 
-	if(GDynamicRHI)
+	float GopSeconds = DefaultGopSeconds;
+	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.GopSeconds="), GopSeconds);
+	GopLength = FTimespan::FromSeconds(FMath::Clamp(GopSeconds, MinGopSeconds, MaxGopSeconds));
+	bOpenGop = FParse::Param(FCommandLine::Get(), TEXT("GameplayMediaEncoder.OpenGop"));
+	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("%s GOP of %.2f s"), bOpenGop ? TEXT("Open") : TEXT("Closed"), GopLength.GetTotalSeconds());
+
+	bSoftwareVideoEncoding = false;
+	const bool bForceSoftwareEncoder = FParse::Param(FCommandLine::Get(), TEXT("GameplayMediaEncoder.SoftwareEncoder"));
+
+	if(GDynamicRHI && !bForceSoftwareEncoder)
 	{
 		FString RHIName = GDynamicRHI->GetName();
 		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("RHIName %s"), *RHIName);
@@ -236,55 +605,101 @@ bool FSRGameplayMediaEncoder::Initialize()
 		else
 #endif
 		{
-			UE_LOG(SRGameplayMediaEncoder, Fatal, TEXT("GameplayMediaEncoder does not currently support the current Platform/RHI combo."));
-			unimplemented();
+			UE_LOG(SRGameplayMediaEncoder, Log, TEXT("No hardware encoder input for the %s RHI, using the software encoder"), *RHIName);
 		}
 	}
 
-	const TArray<AVEncoder::FVideoEncoderInfo>& AvailableEncodersInfo = AVEncoder::FVideoEncoderFactory::Get().GetAvailable();
-
-	if (AvailableEncodersInfo.Num() == 0)
+	if(VideoEncoderInput)
 	{
-		UE_LOG(SRGameplayMediaEncoder, Error, TEXT("No video encoders found. Check if relevent encoder plugins have been enabled for this project."));
-		return false;
+		const TArray<AVEncoder::FVideoEncoderInfo>& AvailableEncodersInfo = AVEncoder::FVideoEncoderFactory::Get().GetAvailable();
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("%d video encoders available"), AvailableEncodersInfo.Num());
+
+		for (const auto& EncoderInfo : AvailableEncodersInfo)
+		{
+			if (EncoderInfo.CodecType == AVEncoder::ECodecType::H264)
+			{
+				UE_LOG(SRGameplayMediaEncoder, Log, TEXT("EncoderInfo.CodecType %d"), EncoderInfo.CodecType);
+				VideoEncoder = AVEncoder::FVideoEncoderFactory::Get().Create(EncoderInfo.ID, VideoEncoderInput, videoInit);
+				UE_LOG(SRGameplayMediaEncoder, Log, TEXT("VideoEncoder %d"), VideoEncoder.IsValid());
+				if (VideoEncoder)
+				{
+					break;
+				}
+			}
+		}
+
+		if (!VideoEncoder)
+		{
+			UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("No H264 hardware encoder could be created, using the software encoder. Check if relevent encoder plugins have been enabled for this project."));
+		}
 	}
-	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("RHIName %d"), AvailableEncodersInfo.Num());
 
-	for (const auto& EncoderInfo : AvailableEncodersInfo)
+	if (!VideoEncoder)
 	{
-		if (EncoderInfo.CodecType == AVEncoder::ECodecType::H264)
+		// Fed from GPU readbacks (or system memory frames), so it works on any RHI
+		VideoEncoderInput = AVEncoder::FVideoEncoderInput::CreateForYUV420P(VideoConfig.Width, VideoConfig.Height, true);
+		FSRX264Options X264Options = FSRX264Options::FromCommandLine();
+		X264Options.GopSeconds = GopLength.GetTotalSeconds();
+		X264Options.bOpenGop = bOpenGop;
+		TUniquePtr<FSRX264Encoder> X264Encoder = MakeUnique<FSRX264Encoder>(X264Options);
+		if (VideoEncoderInput && X264Encoder->Setup(VideoEncoderInput.ToSharedRef(), videoInit))
 		{
-			UE_LOG(SRGameplayMediaEncoder, Log, TEXT("EncoderInfo.CodecType %d"), EncoderInfo.CodecType);
-			UE_LOG(SRGameplayMediaEncoder, Log, TEXT("VideoEncoderInput %d"), VideoEncoderInput.IsValid());
-			VideoEncoder = AVEncoder::FVideoEncoderFactory::Get().Create(EncoderInfo.ID, VideoEncoderInput, videoInit);
-			UE_LOG(SRGameplayMediaEncoder, Log, TEXT("VideoEncoder %d"), VideoEncoder.IsValid());
+			VideoEncoder = MoveTemp(X264Encoder);
+			bSoftwareVideoEncoding = true;
+			ReadbackSlots.SetNum(NumReadbackSlots);
+			NextReadbackSlot = OldestReadbackSlot = 0;
 		}
 	}
 
 	if (!VideoEncoder)
 	{
-		UE_LOG(SRGameplayMediaEncoder, Error, TEXT("No H264 video encoder found. Check if relevent encoder plugins have been enabled for this project."));
+		UE_LOG(SRGameplayMediaEncoder, Error, TEXT("No H264 video encoder found."));
 		return false;
 	}
 
+	if(bOpenGop && !bSoftwareVideoEncoding)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("GameplayMediaEncoder.OpenGop only applies to the software encoder, the hardware encoder's keyframes are IDRs"));
+	}
+
 	VideoEncoder->SetOnEncodedPacket([this](uint32 LayerIndex, const AVEncoder::FVideoEncoderInputFrame* Frame, const AVEncoder::FCodecPacket& Packet)
 		{ OnEncodedVideoFrame(LayerIndex, Frame, Packet); });
+	NumVideoLayers = 1;
 
-	if (!VideoEncoder)
+	// GameplayMediaEncoder.Layers=1280x720:4000,854x480 adds simulcast layers, in kbps. Without a bitrate they get as
+	// many bits per pixel as the first.
+	FString LayerSpecs;
+	if(FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.Layers="), LayerSpecs, false))
 	{
-		UE_LOG(SRGameplayMediaEncoder, Fatal, TEXT("Creating video encoder failed."));
-		return false;
+		TArray<FString> Specs;
+		LayerSpecs.ParseIntoArray(Specs, TEXT(","));
+		for(const FString& Spec : Specs)
+		{
+			FString Size, Kbps, Width, Height;
+			if(!Spec.Split(TEXT(":"), &Size, &Kbps))
+			{
+				Size = Spec;
+			}
+			if(!Size.Split(TEXT("x"), &Width, &Height) || AddVideoLayerImpl(FCString::Atoi(*Width), FCString::Atoi(*Height), FCString::Atoi(*Kbps) * 1000) == INDEX_NONE)
+			{
+				UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("GameplayMediaEncoder.Layers: can't add '%s'"), *Spec);
+			}
+		}
 	}
 
-	SRMemoryCheckpoint("Video encoder initialized");
-
 	bIsOk = true; // So Shutdown is not called due to the ON_SCOPE_EXIT
 	return true;
 }
 
 bool FSRGameplayMediaEncoder::Start()
 {
-	FScopeLock Lock(&ProcessingCS);
+	check(IsInGameThread());
+
+	if(bStopping)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Still stopping"));
+		return false;
+	}
 
 	if(StartTime != 0)
 	{
@@ -305,8 +720,33 @@ bool FSRGameplayMediaEncoder::Start()
 	StartTime = 1;
 	AudioClock = 0;
 	NumCapturedFrames = 0;
-	SRMasterAudioClock = FTimespan::Zero();
-	LastVideoInputTimestamp = FTimespan::Zero();
+	// The video frames' clock starts at zero now, and audio is stamped on it too
+	FrameScheduler->Reset();
+	SRMasterAudioClock = 0;
+	CapturedAudioSampleRate = 0;
+	bHasAudioClockOffset = false;
+	LastVideoInputTimestamp = 0;
+	VideoFramesDropped = 0;
+	AudioChunksDropped = 0;
+	bKeyframeRequested = false;
+	LastKeyframeTimestamp = 0;
+	KeyframesForced = 0;
+	KeyframeRequestsLimited = 0;
+	VideoEncodeSeconds = 0;
+	for(FFrameTiming& Timing : FrameTimings)
+	{
+		Timing.TimestampUs = -1;
+	}
+	FSRStats::Get().Reset();
+	for(FLayerCounters& Counters : LayerCounters)
+	{
+		Counters.Frames = 0;
+		Counters.Keyframes = 0;
+		Counters.Bytes = 0;
+	}
+
+	StartAudioWorker();
+	StartVideoWorker();
 
 	//
 	// subscribe to engine delegates for audio output and back buffer
@@ -315,7 +755,6 @@ bool FSRGameplayMediaEncoder::Start()
 	FAudioDeviceHandle AudioDevice = GEngine->GetMainAudioDevice();
 	if(AudioDevice)
 	{
-		bAudioFormatChecked = false;
 		AudioDevice->RegisterSubmixBufferListener(this);
 	}
 
@@ -326,15 +765,20 @@ bool FSRGameplayMediaEncoder::Start()
 
 void FSRGameplayMediaEncoder::Stop()
 {
-	check(IsInGameThread());
+	BeginStop();
+	FinishStop();
+}
 
-	FScopeLock Lock(&ProcessingCS);
+void FSRGameplayMediaEncoder::BeginStop()
+{
+	check(IsInGameThread());
 
-	if(StartTime == 0)
+	if(StartTime == 0 || bStopping)
 	{
 		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Not running"));
 		return;
 	}
+	bStopping = true;
 
 	if(UGameEngine* GameEngine = Cast<UGameEngine>(GEngine))
 	{
@@ -358,10 +802,70 @@ void FSRGameplayMediaEncoder::Stop()
 		FSlateApplication::Get().GetRenderer()->OnBackBufferReadyToPresent().RemoveAll(this);
 	}
 
+	// Runs after any capture in flight, so once it is done the video worker has all the frames it will get
+	CaptureStoppedEvent = FPlatformProcess::GetSynchEventFromPool(true);
+	ENQUEUE_RENDER_COMMAND(SRStopCapture)([this, Event = CaptureStoppedEvent, bDeliverReadbacks = bSoftwareVideoEncoding](FRHICommandListImmediate&)
+	{
+		if(bDeliverReadbacks)
+		{
+			// The last frames are still on their way back from the GPU
+			DeliverReadbacks(true);
+		}
+		Event->Trigger();
+	});
+}
+
+void FSRGameplayMediaEncoder::FinishStop()
+{
+	if(!bStopping)
+	{
+		return;
+	}
+
+	CaptureStoppedEvent->Wait();
+	FPlatformProcess::ReturnSynchEventToPool(CaptureStoppedEvent);
+	CaptureStoppedEvent = nullptr;
+
+	// The submix listener is gone, so nothing is added to AudioRing anymore
+	StopAudioWorker();
+	StopVideoWorker();
+
+	if(bSoftwareVideoEncoding)
+	{
+		// x264 still holds a lookahead's worth of frames, and they belong to this recording
+		FScopeLock Lock(&VideoProcessingCS);
+		static_cast<FSRX264Encoder*>(VideoEncoder.Get())->Flush();
+	}
+
+	if(AudioChunksDropped > 0)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("%llu submix buffers dropped because the audio encoder fell behind"), AudioChunksDropped);
+	}
+
+	if(VideoFramesDropped > 0)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("%llu captured frames dropped because the video encoder fell behind"), VideoFramesDropped.Load());
+	}
+
+	const FSRFrameSchedulerStats PacingStats = FrameScheduler->GetStats();
+	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Frame pacing: %llu frames, %llu dropped, %llu repeats, %llu grid points skipped"),
+		PacingStats.NumFrames, PacingStats.NumDropped, PacingStats.NumRepeats, PacingStats.NumSkipped);
+
+	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Keyframes: %llu forced, %llu requests turned down by a keyframe policy"),
+		KeyframesForced.Load(), KeyframeRequestsLimited.Load());
+	LogVideoLayerStats();
+
+	const FSRPacketPoolStats PoolStats = FSRPacketPool::Get().GetStats();
+	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Packet pool: %d packets (%.1f MB), at most %d in use, %llu of %llu acquires allocated"),
+		PoolStats.NumPackets, PoolStats.BytesAllocated / (1024.0 * 1024.0), PoolStats.HighWaterMark, PoolStats.NumAllocations, PoolStats.NumAcquired);
+	FSRStats::Get().Log();
+	FSRMemoryTracker::Get().Log();
+
 	StartTime = 0;
 	AudioClock = 0;
-	SRMasterAudioClock = FTimespan::Zero();
-	LastVideoInputTimestamp = FTimespan::Zero();
+	SRMasterAudioClock = 0;
+	LastVideoInputTimestamp = 0;
+	bStopping = false;
 }
 
 AVEncoder::FAudioConfig FSRGameplayMediaEncoder::GetAudioConfig() const
@@ -380,15 +884,18 @@ AVEncoder::FAudioConfig FSRGameplayMediaEncoder::GetAudioConfig() const
 
 void FSRGameplayMediaEncoder::Shutdown()
 {
-	if(StartTime != 0)
+	if(bStopping)
+	{
+		FinishStop();
+	}
+	else if(StartTime != 0)
 	{
 		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Currently running, so also performing a Stop()"));
 		Stop();
 	}
 
 	{
-		FScopeLock Lock(&ProcessingCS);
-		//FScopeLock Lock(&AudioProcessingCS);
+		FScopeLock Lock(&AudioProcessingCS);
 		if(AudioEncoder)
 		{
 			// AudioEncoder->Reset();
@@ -397,16 +904,38 @@ void FSRGameplayMediaEncoder::Shutdown()
 		}
 	}
 	{
-		FScopeLock Lock(&ProcessingCS);
-		//FScopeLock Lock(&VideoProcessingCS);
+		FScopeLock Lock(&VideoProcessingCS);
 		if(VideoEncoder)
 		{
 			VideoEncoder->Shutdown();
 			VideoEncoder.Reset();
 
-			BackBuffers.Empty();
+			int64 TextureBytes = 0;
+			for(const TPair<AVEncoder::FVideoEncoderInputFrame*, FTexture2DRHIRef>& BackBuffer : BackBuffers)
+			{
+				TextureBytes += GetTextureBytes(BackBuffer.Value);
+			}
+			for(const FReadbackSlot& Slot : ReadbackSlots)
+			{
+				TextureBytes += 2 * GetTextureBytes(Slot.Texture);
+			}
+			FSRMemoryTracker::Get().Add(ESRMemory::EncoderInput, -TextureBytes);
+
+			// Render commands queued before may still use them, and RHI resources are released on the render thread
+			ENQUEUE_RENDER_COMMAND(SRReleaseEncoderInput)(
+				[OldBackBuffers = MoveTemp(BackBuffers), OldReadbackSlots = MoveTemp(ReadbackSlots), OldUploadTexture = MoveTemp(UploadTexture)](FRHICommandListImmediate&) mutable
+				{
+					OldBackBuffers.Empty();
+					OldReadbackSlots.Empty();
+					OldUploadTexture.SafeRelease();
+				});
+			NextReadbackSlot = 0;
+			OldestReadbackSlot = 0;
 		}
 	}
+
+	// Packets still held by sinks go back to the pool when released, and stay there until the next Shutdown
+	FSRPacketPool::Get().Trim();
 }
 
 FTimespan FSRGameplayMediaEncoder::GetMediaTimestamp() const { return FTimespan::FromSeconds(FPlatformTime::Seconds()) - StartTime; }
@@ -414,18 +943,8 @@ FTimespan FSRGameplayMediaEncoder::GetMediaTimestamp() const { return FTimespan:
 void FSRGameplayMediaEncoder::OnNewSubmixBuffer(const USoundSubmix* OwningSubmix, float* AudioData, int32 NumSamples, int32 NumChannels, const int32 SampleRate, double /*AudioClock*/)
 {
 	CSV_SCOPED_TIMING_STAT(SRGameplayMediaEncoder, OnNewSubmixBuffer);
-	if(SampleRate != HardcodedAudioSamplerate)
-	{
-		// Only report the problem once
-		if(!bAudioFormatChecked)
-		{
-			bAudioFormatChecked = true;
-			UE_LOG(SRGameplayMediaEncoder, Error, TEXT("Audio SampleRate needs to be %d HZ, current value is %d. VideoRecordingSystem won't record audio"), HardcodedAudioSamplerate, SampleRate);
-		}
-		return;
-	}
-
-	ProcessAudioFrame(AudioData, NumSamples, NumChannels, SampleRate);
+	// Any sample rate goes, the audio worker resamples
+	CaptureAudioFrame(AudioData, NumSamples, NumChannels, SampleRate);
 }
 
 void FSRGameplayMediaEncoder::OnFrameBufferReady(SWindow& SlateWindow, const FTexture2DRHIRef& FrameBuffer)
@@ -435,75 +954,158 @@ void FSRGameplayMediaEncoder::OnFrameBufferReady(SWindow& SlateWindow, const FTe
 	ProcessVideoFrame(FrameBuffer);
 }
 
-void FSRGameplayMediaEncoder::FloatToPCM16(float const* floatSamples, int32 numSamples, TArray<int16>& out) const
+void FSRGameplayMediaEncoder::CaptureAudioFrame(const float* AudioData, int32 NumSamples, int32 NumChannels, int32 SampleRate)
 {
-	out.Reset(numSamples);
-	out.AddZeroed(numSamples);
+	// Don't capture audio if the encoder is not setup or destroyed.
+	if(!AudioEncoder.IsValid() || NumChannels <= 0)
+	{
+		return;
+	}
 
-	float const* ptr = floatSamples;
-	for(auto&& sample : out)
+	FAudioChunk Chunk;
+	Chunk.NumFrames = NumSamples / NumChannels;
+	Chunk.NumChannels = NumChannels;
+	Chunk.SampleRate = SampleRate;
+
+	if(SampleRate != CapturedAudioSampleRate)
+	{
+		CapturedAudioClockBase = SRMasterAudioClock.Load();
+		CapturedAudioFrames = 0;
+		CapturedAudioSampleRate = SampleRate;
+	}
+	const int64 ChunkStart = SRMasterAudioClock.Load();
+	CapturedAudioFrames += Chunk.NumFrames;
+	SRMasterAudioClock = CapturedAudioClockBase + CapturedAudioFrames * ETimespan::TicksPerSecond / SampleRate;
+
+	// The buffer was just rendered, so it ends about now on the video frames' clock. The sample clock runs on the audio
+	// device's crystal and drifts from it, which the offset picks up while averaging out when the callbacks come.
+	const int64 ClockOffset = FrameScheduler->Now().GetTicks() - SRMasterAudioClock.Load();
+	AudioClockOffset = bHasAudioClockOffset ? AudioClockOffset + (ClockOffset - AudioClockOffset) / AudioClockSmoothing : ClockOffset;
+	bHasAudioClockOffset = true;
+	Chunk.Timestamp = ChunkStart + AudioClockOffset;
+
+	// The clock runs on even when the chunk has to be dropped, so what comes after the gap is stamped where it belongs.
+	// This thread is the only producer, so the room checked for here is still there when enqueuing.
+	if(AudioChunks.Num() >= AudioChunks.Capacity() || !AudioRing.Write(AudioData, Chunk.NumFrames * NumChannels))
+	{
+		++AudioChunksDropped;
+	}
+	else
 	{
-		int32 N = *ptr >= 0 ? *ptr * int32(MAX_int16) : *ptr * (int32(MAX_int16) + 1);
-		sample = static_cast<int16>(FMath::Clamp(N, int32(MIN_int16), int32(MAX_int16)));
-		ptr++;
+		verify(AudioChunks.TryEnqueue(MoveTemp(Chunk)));
+		AudioWorkEvent->Trigger();
 	}
 }
 
-void FSRGameplayMediaEncoder::ProcessAudioFrame(const float* AudioData, int32 NumSamples, int32 NumChannels, int32 SampleRate)
+void FSRGameplayMediaEncoder::StartAudioWorker()
 {
+	check(!AudioThread.IsJoinable());
+	bStopAudioWorker = false;
+	// Nothing from the previous recording is still in the filter, and the timeline starts over
+	AudioResampler->Reset();
+	bAudioTimelineStarted = false;
+	NumPendingAudioFrames = 0;
+	AudioWorkEvent = FPlatformProcess::GetSynchEventFromPool(false);
+	AudioThread = FThread(TEXT("SRAudioEncoder"), [this]() { RunAudioWorker(); }, 0, TPri_AboveNormal);
+}
 
-	// Don't encode audio encoder is not setup or destroyed.
-	if(!AudioEncoder.IsValid())
+void FSRGameplayMediaEncoder::StopAudioWorker()
+{
+	if(AudioThread.IsJoinable())
 	{
-		return;
+		bStopAudioWorker = true;
+		AudioWorkEvent->Trigger();
+		AudioThread.Join();
 	}
-
-	FScopeLock Lock(&ProcessingCS);
-
-	//// convert to PCM data
-	// TArray<int16> conversionBuffer;
-	// FloatToPCM16(AudioData, NumSamples, conversionBuffer);
-
-	//// add to any remainder data
-	// PCM16.Append(conversionBuffer);
-
-	//// encode the 10ms blocks
-	// size_t const encodeBlockSize = AudioConfig.Samplerate / 100 * AudioConfig.NumChannels;
-	// int32 bufferSize = PCM16.Num();
-	// auto timestamp = GetMediaTimestamp().GetTicks();
-	// auto bufferStart = PCM16.GetData();
-
-	// while (bufferSize >= encodeBlockSize)
-	//{
-	//	rtc::Buffer encoded;
-	//	auto encodedInfo = AudioEncoder->Encode(timestamp, { bufferStart, encodeBlockSize }, &encoded);
-	//	if (encodedInfo.encoded_bytes > 0 || encodedInfo.send_even_if_empty)
-	//		OnEncodedAudioFrame(encodedInfo, &encoded);
-	//	timestamp += 10 * ETimespan::TicksPerMillisecond;
-	//	bufferStart += encodeBlockSize;
-	//	bufferSize -= encodeBlockSize;
-	//}
-
-	//// move the remainder to the start of the buffer
-	// int32 const remainderIdx = bufferStart - PCM16.GetData();
-	// for (int32 i = 0; i < bufferSize; ++i)
-	//{
-	//	PCM16[i] = PCM16[remainderIdx + i];
-	//}
-	// PCM16.SetNum(bufferSize, false);
-
-	Audio::AlignedFloatBuffer InData;
-	InData.Append(AudioData, NumSamples);
-	Audio::TSampleBuffer<float> FloatBuffer(InData, NumChannels, SampleRate);
-
-	// Mix to stereo if required, since PixelStreaming only accept stereo at the moment
-	if(FloatBuffer.GetNumChannels() != HardcodedAudioNumChannels)
+	if(AudioWorkEvent)
 	{
-		FloatBuffer.MixBufferToChannels(HardcodedAudioNumChannels);
+		FPlatformProcess::ReturnSynchEventToPool(AudioWorkEvent);
+		AudioWorkEvent = nullptr;
 	}
+}
 
-	// Adjust the AudioClock if for some reason it falls behind real time. This can happen if the game spikes, or if we break into the debugger.
-	/*
+void FSRGameplayMediaEncoder::RunAudioWorker()
+{
+	for(;;)
+	{
+		FAudioChunk Chunk;
+		if(!AudioChunks.TryDequeue(Chunk))
+		{
+			// Stop unregisters the submix listener first, so the queue is really empty
+			if(bStopAudioWorker)
+			{
+				FlushAudioFrames();
+				break;
+			}
+			AudioWorkEvent->Wait();
+			continue;
+		}
+
+		const int32 NumSamples = Chunk.NumFrames * Chunk.NumChannels;
+		if(AudioScratch.Num() < NumSamples)
+		{
+			AudioScratch.SetNumUninitialized(NumSamples);
+		}
+		// Enqueued after its samples were written
+		verify(AudioRing.Read(AudioScratch.GetData(), NumSamples));
+
+		ProcessAudioFrame(AudioScratch.GetData(), Chunk.NumFrames, Chunk.NumChannels, Chunk.SampleRate, FTimespan(Chunk.Timestamp));
+	}
+}
+
+void FSRGameplayMediaEncoder::ProcessAudioFrame(const float* AudioData, int32 NumFrames, int32 NumChannels, int32 SampleRate, FTimespan Timestamp)
+{
+	CSV_SCOPED_TIMING_STAT(SRGameplayMediaEncoder, ProcessAudioFrame);
+
+	FScopeLock Lock(&AudioProcessingCS);
+
+	// Don't encode audio encoder is not setup or destroyed.
+	if(!AudioEncoder.IsValid())
+	{
+		return;
+	}
+
+	const float* StereoData = nullptr;
+	Audio::TSampleBuffer<float> MixerBuffer;
+	if(SRAudio::CanDownmixToStereo(NumChannels))
+	{
+		// Mix to stereo, since PixelStreaming only accept stereo at the moment. Clamps in the same pass.
+		const int32 NumStereoSamples = NumFrames * HardcodedAudioNumChannels;
+		if(StereoScratch.Num() < NumStereoSamples)
+		{
+			StereoScratch.SetNumUninitialized(NumStereoSamples);
+		}
+		SRAudio::DownmixToStereo(AudioData, NumFrames, NumChannels, StereoScratch.GetData());
+		StereoData = StereoScratch.GetData();
+	}
+	else
+	{
+		// Uncommon layout, let the audio mixer do it
+		MixerBuffer = Audio::TSampleBuffer<float>(AudioData, NumFrames * NumChannels, NumChannels, SampleRate);
+		MixerBuffer.MixBufferToChannels(HardcodedAudioNumChannels);
+		MixerBuffer.Clamp();
+		StereoData = MixerBuffer.GetData();
+	}
+
+	// Resampling after the downmix, there are fewer channels to filter. The output is stamped from the resampler's
+	// own sample count, so it stays sample-accurate across chunks.
+	if(SampleRate != AudioSampleRate)
+	{
+		if(!AudioResampler->Configure(SampleRate, AudioSampleRate, HardcodedAudioNumChannels))
+		{
+			return;
+		}
+		NumFrames = AudioResampler->Process(StereoData, NumFrames, Timestamp, Timestamp);
+		if(NumFrames == 0)
+		{
+			return;
+		}
+		StereoData = AudioResampler->GetOutput();
+	}
+
+
+	// Adjust the AudioClock if for some reason it falls behind real time. This can happen if the game spikes, or if we break into the debugger.
+	/*
 	FTimespan Now = GetMediaTimestamp();
 	if(AudioClock < Now.GetTotalSeconds())
 	{
@@ -512,57 +1114,103 @@ void FSRGameplayMediaEncoder::ProcessAudioFrame(const float* AudioData, int32 Nu
 		AudioClock = Now.GetTotalSeconds() + (FloatBuffer.GetSampleDuration() / 2);
 	}*/
 
-	// Convert to signed PCM 16-bits
-	// PCM16.Reset(FloatBuffer.GetNumSamples());
-	// PCM16.AddZeroed(FloatBuffer.GetNumSamples());
-	// int blockSize = AudioConfig.Samplerate / 100 * AudioConfig.NumChannels;
-	// PCM16.Reset(blockSize);
-	// PCM16.AddZeroed(blockSize);
-	// const float* Ptr = reinterpret_cast<const float*>(FloatBuffer.GetData());
-	// auto timestamp = GetMediaTimestamp().GetTotalMilliseconds();
-	// for (int i = 0; i < NumSamples * NumChannels; ++i)
-	//{
-	//	int u;
-	//	for (u = 0; u < blockSize && i < NumSamples; ++u, ++i, ++Ptr)
-	//	{
-	//		int32 N = *Ptr >= 0 ? *Ptr * int32(MAX_int16) : *Ptr * (int32(MAX_int16) + 1);
-	//		PCM16[u] = static_cast<int16>(FMath::Clamp(N, int32(MIN_int16), int32(MAX_int16)));
-	//	}
-
-	//	rtc::Buffer encoded;
-	//	auto encodedInfo = AudioEncoder->Encode(timestamp, { PCM16.GetData(), static_cast<size_t>(u) }, &encoded);
-	//	OnEncodedAudioFrame(encodedInfo, &encoded);
-	//	timestamp += 10;
-	//}
-
-	// for (int16& S : PCM16)
-	//{
-	//	int32 N = *Ptr >= 0 ? *Ptr * int32(MAX_int16) : *Ptr * (int32(MAX_int16) + 1);
-	//	S = static_cast<int16>(FMath::Clamp(N, int32(MIN_int16), int32(MAX_int16)));
-	//	Ptr++;
-	//}
-
-	////rtc::ArrayView<const int16_t> audio(PCM16.GetData(), FloatBuffer.GetNumSamples());
-	// rtc::ArrayView<const int16_t> audio(PCM16.GetData(), blockSize);
-	// auto testSampleRate = AudioEncoder->SampleRateHz();
-	// auto testNumChannels = AudioEncoder->NumChannels();
-	// check(testSampleRate == AudioConfig.Samplerate);
-	// check(testNumChannels == AudioConfig.NumChannels);
-	// auto timestamp = GetMediaTimestamp().GetTotalMilliseconds();
-	// auto encodedInfo = AudioEncoder->Encode(timestamp, audio, &encoded);
-	// OnEncodedAudioFrame(encodedInfo, &encoded);
-
-	FTimespan TimestampForThisPacket = SRMasterAudioClock;
-	AVEncoder::FAudioFrame Frame;
+	// Stamped with the master audio clock when it was captured
 	//Frame.Timestamp = FTimespan::FromSeconds(AudioClock);
-	Frame.Timestamp = TimestampForThisPacket;
-	Frame.Duration = FTimespan::FromSeconds(FloatBuffer.GetSampleDuration());
-	FloatBuffer.Clamp();
-	Frame.Data = FloatBuffer;
-	AudioEncoder->Encode(Frame);
+	EncodeAudioFrames(StereoData, NumFrames, Timestamp);
 
 	//AudioClock += FloatBuffer.GetSampleDuration();
-	SRMasterAudioClock += FTimespan::FromSeconds(FloatBuffer.GetSampleDuration());
+}
+
+FTimespan FSRGameplayMediaEncoder::AudioFramesToTimespan(int64 NumFrames) const
+{
+	return FTimespan(NumFrames * ETimespan::TicksPerSecond / AudioSampleRate);
+}
+
+void FSRGameplayMediaEncoder::EncodeAudioFrames(const float* StereoData, int32 NumFrames, FTimespan Timestamp)
+{
+	const int32 NumChannels = HardcodedAudioNumChannels;
+
+	if(bAudioTimelineStarted)
+	{
+		const FTimespan Expected = AudioTimelineStart + AudioFramesToTimespan(EncodedAudioFrames + NumPendingAudioFrames);
+		const int64 Error = (Timestamp - Expected).GetTicks();
+		if(FMath::Abs(Error) > MaxAudioTimelineError.GetTicks())
+		{
+			// The pending frames would end up stamped across the gap, drop them and start a new timeline
+			UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("Audio timeline off by %.1f ms, restarting it"), (Timestamp - Expected).GetTotalMilliseconds());
+			bAudioTimelineStarted = false;
+		}
+		else
+		{
+			// Clock drift: the timeline follows the video clock a little at a time, instead of jumping once it is too far off
+			const int64 MaxStep = int64(AudioFramesToTimespan(NumFrames).GetTicks() * MaxAudioSlew);
+			AudioTimelineStart += FTimespan(FMath::Clamp(Error, -MaxStep, MaxStep));
+		}
+	}
+	if(!bAudioTimelineStarted)
+	{
+		bAudioTimelineStarted = true;
+		AudioTimelineStart = Timestamp;
+		EncodedAudioFrames = 0;
+		NumPendingAudioFrames = 0;
+	}
+
+	if(PendingAudio.Num() < AACFrameSize * NumChannels)
+	{
+		PendingAudio.SetNumUninitialized(AACFrameSize * NumChannels);
+	}
+
+	while(NumFrames > 0)
+	{
+		// Whole frames go straight from the input, only the ends get copied
+		if(NumPendingAudioFrames == 0 && NumFrames >= AACFrameSize)
+		{
+			EncodeAACFrame(StereoData);
+			StereoData += AACFrameSize * NumChannels;
+			NumFrames -= AACFrameSize;
+			continue;
+		}
+
+		const int32 NumToCopy = FMath::Min(NumFrames, AACFrameSize - NumPendingAudioFrames);
+		FMemory::Memcpy(PendingAudio.GetData() + NumPendingAudioFrames * NumChannels, StereoData, NumToCopy * NumChannels * sizeof(float));
+		NumPendingAudioFrames += NumToCopy;
+		StereoData += NumToCopy * NumChannels;
+		NumFrames -= NumToCopy;
+
+		if(NumPendingAudioFrames == AACFrameSize)
+		{
+			EncodeAACFrame(PendingAudio.GetData());
+			NumPendingAudioFrames = 0;
+		}
+	}
+}
+
+void FSRGameplayMediaEncoder::EncodeAACFrame(const float* StereoData)
+{
+	const int32 NumChannels = HardcodedAudioNumChannels;
+
+	AVEncoder::FAudioFrame Frame;
+	Frame.Timestamp = AudioTimelineStart + AudioFramesToTimespan(EncodedAudioFrames);
+	EncodedAudioFrames += AACFrameSize;
+	// Not a constant: whole ticks, so consecutive frames tile the timeline exactly
+	Frame.Duration = AudioTimelineStart + AudioFramesToTimespan(EncodedAudioFrames) - Frame.Timestamp;
+	Frame.Data = Audio::TSampleBuffer<float>(StereoData, AACFrameSize * NumChannels, NumChannels, AudioSampleRate);
+	AudioEncoder->Encode(Frame);
+}
+
+void FSRGameplayMediaEncoder::FlushAudioFrames()
+{
+	FScopeLock Lock(&AudioProcessingCS);
+
+	if(!AudioEncoder.IsValid() || NumPendingAudioFrames == 0)
+	{
+		return;
+	}
+
+	const int32 NumChannels = HardcodedAudioNumChannels;
+	FMemory::Memzero(PendingAudio.GetData() + NumPendingAudioFrames * NumChannels, (AACFrameSize - NumPendingAudioFrames) * NumChannels * sizeof(float));
+	EncodeAACFrame(PendingAudio.GetData());
+	NumPendingAudioFrames = 0;
 }
 
 void FSRGameplayMediaEncoder::ProcessVideoFrame(const FTexture2DRHIRef& FrameBuffer)
@@ -573,10 +1221,17 @@ void FSRGameplayMediaEncoder::ProcessVideoFrame(const FTexture2DRHIRef& FrameBuf
 		return;
 	}
 
-	//FScopeLock Lock(&VideoProcessingCS);
-	FScopeLock Lock(&ProcessingCS);
+	const uint64 CaptureCycles = FPlatformTime::Cycles64();
+	if(bSoftwareVideoEncoding)
+	{
+		// Hand over what the GPU has finished reading back, which frees slots for this frame
+		DeliverReadbacks(false);
+	}
 
-	FTimespan Now = GetMediaTimestamp();
+	if(!bCaptureBackBuffer)
+	{
+		return;
+	}
 
 	//UE_LOG(LogTemp, Log, TEXT("W:%d H:%d"), FrameBuffer->GetSizeX(), FrameBuffer->GetSizeY());
 	if (FrameBuffer->GetSizeY() < 500)
@@ -584,66 +1239,549 @@ void FSRGameplayMediaEncoder::ProcessVideoFrame(const FTexture2DRHIRef& FrameBuf
 		return;
 	}
 
-	if(bDoFrameSkipping)
+	if(CapturedFrames.Num() >= CapturedFrames.Capacity())
 	{
-		uint64 NumExpectedFrames = static_cast<uint64>(Now.GetTotalSeconds() * VideoConfig.Framerate);
-		UE_LOG(SRGameplayMediaEncoder, VeryVerbose, TEXT("time %.3f: captured %d, expected %d"), Now.GetTotalSeconds(), NumCapturedFrames + 1, NumExpectedFrames);
-		if(NumCapturedFrames + 1 > NumExpectedFrames)
+		// The encoder is behind. Skipping the frame is better than holding up rendering. Checked before pacing, so
+		// the next frame can still take the grid point.
+		UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("Video worker is behind, dropped captured frame"));
+		++VideoFramesDropped;
+		FSRStats::Get().Add(ESRCounter::FramesDropped);
+		return;
+	}
+
+	FSRFrameScheduler::FTimestamps Timestamps;
+	if(!FrameScheduler->Schedule(Timestamps))
+	{
+		UE_LOG(SRGameplayMediaEncoder, VeryVerbose, TEXT("Frame pacing dropped captured frame"));
+		return;
+	}
+
+	if(bSoftwareVideoEncoding)
+	{
+		if(!StartReadback(FrameBuffer, Timestamps, CaptureCycles))
 		{
-			UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("Framerate control dropped captured frame"));
+			UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("GPU readbacks are behind, dropped captured frame"));
+			++VideoFramesDropped;
+			FSRStats::Get().Add(ESRCounter::FramesDropped);
 			return;
 		}
 	}
+	else
+	{
+		// The hardware encoders read the texture when they get to the frame, so each repeat is a copy of its own
+		for(FTimespan Timestamp : Timestamps)
+		{
+			CaptureTexture(FrameBuffer, Timestamp.GetTicks(), CaptureCycles);
+		}
+	}
 
-	UpdateVideoConfig();
+	AdvanceLastVideoTimestamp(Timestamps.Last().GetTicks());
+	NumCapturedFrames++;
+	FSRStats::Get().Add(ESRCounter::FramesCaptured);
+	FSRStats::Get().Add(ESRCounter::FramesRepeated, Timestamps.Num() - 1);
+}
 
+void FSRGameplayMediaEncoder::CaptureTexture(const FTexture2DRHIRef& Texture, int64 TimestampUs, uint64 CaptureCycles)
+{
 	AVEncoder::FVideoEncoderInputFrame* InputFrame = ObtainInputFrame();
-	const int32 FrameId = InputFrame->GetFrameID();
-	//InputFrame->SetTimestampUs(Now.GetTicks());
-	if (LastVideoInputTimestamp.GetTicks() == 0)
+	InputFrame->SetTimestampUs(TimestampUs);
+
+	// Only queue the copy here. The fence tells the worker when the GPU is done with it.
+	FRHICommandListImmediate& RHICmdList = FRHICommandListExecutor::GetImmediateCommandList();
+	CopyTexture(Texture, BackBuffers[InputFrame]);
+
+	FCapturedFrame Captured;
+	Captured.InputFrame = InputFrame;
+	Captured.TimestampUs = TimestampUs;
+	Captured.CaptureCycles = CaptureCycles;
+	Captured.CopyFence = RHICreateGPUFence(TEXT("SRVideoCapture"));
+	RHICmdList.WriteGPUFence(Captured.CopyFence);
+	RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+
+	EnqueueCapturedFrame(MoveTemp(Captured));
+}
+
+bool FSRGameplayMediaEncoder::EnqueueCapturedFrame(FCapturedFrame&& Frame)
+{
+	// There was room when the caller checked, but SubmitVideoFrame can enqueue from other threads
+	const uint64 CaptureCycles = Frame.CaptureCycles;
+	const uint64 QueuedCycles = FPlatformTime::Cycles64();
+	Frame.QueuedCycles = QueuedCycles;
+	if(!CapturedFrames.TryEnqueue(MoveTemp(Frame)))
+	{
+		UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("Video worker is behind, dropped captured frame"));
+		++VideoFramesDropped;
+		FSRStats::Get().Add(ESRCounter::FramesDropped);
+		if(Frame.InputFrame)
+		{
+			Frame.InputFrame->Release();
+		}
+		if(Frame.SystemMemoryFrame.IsSet())
+		{
+			Frame.SystemMemoryFrame->Release();
+		}
+		return false;
+	}
+
+	FSRStats& Stats = FSRStats::Get();
+	Stats.RecordLatency(ESRStage::Capture, CaptureCycles, QueuedCycles);
+	Stats.SetQueueDepth(ESRQueue::Video, CapturedFrames.Num());
+	VideoWorkEvent->Trigger();
+	return true;
+}
+
+void FSRGameplayMediaEncoder::AdvanceLastVideoTimestamp(int64 TimestampUs)
+{
+	// The scheduler hands out increasing timestamps, but the threads it hands them to can store them in any order
+	int64 Last = LastVideoInputTimestamp.Load();
+	while(Last < TimestampUs && !LastVideoInputTimestamp.CompareExchange(Last, TimestampUs))
 	{
-		InputFrame->SetTimestampUs(SRMasterAudioClock.GetTicks());
 	}
-	else
+}
+
+bool FSRGameplayMediaEncoder::SubmitVideoFrame(FSRVideoFrame Frame)
+{
+	const uint64 CaptureCycles = FPlatformTime::Cycles64();
+	if(!VideoEncoder.IsValid() || StartTime == 0 || bStopping)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("Not recording, system memory frame ignored"));
+		Frame.Release();
+		return false;
+	}
+
+	if(!Frame.IsValid())
+	{
+		UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("Invalid %dx%d system memory frame of format %d"), Frame.Width, Frame.Height, int32(Frame.Format));
+		Frame.Release();
+		return false;
+	}
+
+	if(!bSoftwareVideoEncoding && Frame.Format != ESRPixelFormat::BGRA8)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("The hardware encoder only takes BGRA8 system memory frames, -GameplayMediaEncoder.SoftwareEncoder takes the others"));
+		Frame.Release();
+		return false;
+	}
+
+	if(CapturedFrames.Num() >= CapturedFrames.Capacity())
+	{
+		UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("Video worker is behind, dropped system memory frame"));
+		++VideoFramesDropped;
+		FSRStats::Get().Add(ESRCounter::FramesDropped);
+		Frame.Release();
+		return false;
+	}
+
+	FSRFrameScheduler::FTimestamps Timestamps;
+	const bool bScheduled = Frame.Timestamp.IsSet() ? FrameScheduler->Schedule(Frame.Timestamp.GetValue(), Timestamps) : FrameScheduler->Schedule(Timestamps);
+	if(!bScheduled)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("Frame pacing dropped system memory frame (over the frame rate, or not after the previous frame)"));
+		Frame.Release();
+		return false;
+	}
+	AdvanceLastVideoTimestamp(Timestamps.Last().GetTicks());
+	NumCapturedFrames++;
+	FSRStats::Get().Add(ESRCounter::FramesCaptured);
+	FSRStats::Get().Add(ESRCounter::FramesRepeated, Timestamps.Num() - 1);
+
+	if(bSoftwareVideoEncoding)
+	{
+		// Converted straight from the caller's memory on the video worker
+		FCapturedFrame Captured;
+		Captured.TimestampUs = Timestamps[0].GetTicks();
+		Captured.RepeatTimestamps.Append(Timestamps.GetData() + 1, Timestamps.Num() - 1);
+		Captured.SystemMemoryFrame.Emplace(MoveTemp(Frame));
+		Captured.CaptureCycles = CaptureCycles;
+		return EnqueueCapturedFrame(MoveTemp(Captured));
+	}
+
+	ENQUEUE_RENDER_COMMAND(SRUploadVideoFrame)(
+		[this, Frame = MoveTemp(Frame), Timestamps, CaptureCycles](FRHICommandListImmediate&) mutable
+		{
+			UploadVideoFrame(Frame, Timestamps, CaptureCycles);
+		});
+	return true;
+}
+
+void FSRGameplayMediaEncoder::UploadVideoFrame(FSRVideoFrame& Frame, const FSRFrameScheduler::FTimestamps& Timestamps, uint64 CaptureCycles)
+{
+	if(!VideoEncoder.IsValid())
+	{
+		Frame.Release();
+		return;
+	}
+
+	if(!UploadTexture || UploadTexture->GetSizeX() != Frame.Width || UploadTexture->GetSizeY() != Frame.Height)
+	{
+		FRHIResourceCreateInfo CreateInfo(TEXT("VideoCapturerUpload"));
+		UploadTexture = RHICreateTexture2D(Frame.Width, Frame.Height, EPixelFormat::PF_B8G8R8A8, 1, 1, TexCreate_ShaderResource, ERHIAccess::SRVMask, CreateInfo);
+	}
+
+	// The command list keeps its own copy of the pixels, the caller's memory can go back right away
+	RHIUpdateTexture2D(UploadTexture, 0, FUpdateTextureRegion2D(0, 0, 0, 0, Frame.Width, Frame.Height), Frame.Strides[0], Frame.Planes[0]);
+	Frame.Release();
+
+	// Scaled to the encoder's size by the copy, like a back buffer
+	for(FTimespan Timestamp : Timestamps)
+	{
+		CaptureTexture(UploadTexture, Timestamp.GetTicks(), CaptureCycles);
+	}
+}
+
+namespace
+{
+	SRVideo::FYUVImage GetYUVImage(const AVEncoder::FVideoEncoderInputFrame& InputFrame)
+	{
+		// The input frame owns its planes, they are only const to the encoders
+		const AVEncoder::FVideoEncoderInputFrame::FYUV420P& Planes = InputFrame.GetYUV420P();
+		SRVideo::FYUVImage Image;
+		Image.Format = ESRPixelFormat::I420;
+		Image.Width = InputFrame.GetWidth();
+		Image.Height = InputFrame.GetHeight();
+		Image.Planes[0] = const_cast<uint8*>(Planes.Data[0]);
+		Image.Planes[1] = const_cast<uint8*>(Planes.Data[1]);
+		Image.Planes[2] = const_cast<uint8*>(Planes.Data[2]);
+		Image.Strides[0] = Planes.StrideY;
+		Image.Strides[1] = Planes.StrideU;
+		Image.Strides[2] = Planes.StrideV;
+		return Image;
+	}
+}
+
+bool FSRGameplayMediaEncoder::FillInputFrame(FCapturedFrame& Frame)
+{
+	CSV_SCOPED_TIMING_STAT(SRGameplayMediaEncoder, ConvertSystemMemoryFrame);
+
+	FSRVideoFrame& Source = Frame.SystemMemoryFrame.GetValue();
+	AVEncoder::FVideoEncoderInputFrame* InputFrame = VideoEncoderInput->ObtainInputFrame();
+	InputFrame->SetTimestampUs(Frame.TimestampUs);
+
+	const bool bConverted = FrameConverter->Convert(Source, GetYUVImage(*InputFrame));
+	Source.Release();
+
+	if(!bConverted)
+	{
+		InputFrame->Release();
+		++VideoFramesDropped;
+		FSRStats::Get().Add(ESRCounter::FramesDropped);
+		return false;
+	}
+
+	Frame.InputFrame = InputFrame;
+	return true;
+}
+
+bool FSRGameplayMediaEncoder::StartReadback(const FTexture2DRHIRef& FrameBuffer, const FSRFrameScheduler::FTimestamps& Timestamps, uint64 CaptureCycles)
+{
+	FReadbackSlot& Slot = ReadbackSlots[NextReadbackSlot];
+	if(Slot.bInFlight)
+	{
+		return false;
+	}
+
+	// Sized like the input frames, which SetResolution changes on this thread
+	const uint32 Width = VideoEncoderInput->GetWidth();
+	const uint32 Height = VideoEncoderInput->GetHeight();
+	if(!Slot.Texture || Slot.Texture->GetSizeX() != Width || Slot.Texture->GetSizeY() != Height)
+	{
+		// The texture and the staging copy it is read back through
+		FSRMemoryTracker::Get().Add(ESRMemory::EncoderInput, -2 * GetTextureBytes(Slot.Texture));
+		FRHIResourceCreateInfo CreateInfo(TEXT("VideoCapturerReadback"));
+		Slot.Texture = RHICreateTexture2D(Width, Height, EPixelFormat::PF_B8G8R8A8, 1, 1, TexCreate_RenderTargetable, ERHIAccess::CopyDest, CreateInfo);
+		Slot.Readback = MakeUnique<FRHIGPUTextureReadback>(TEXT("SRVideoReadback"));
+		FSRMemoryTracker::Get().Add(ESRMemory::EncoderInput, 2 * GetTextureBytes(Slot.Texture));
+	}
+
+	// Scaled and converted to BGRA on the GPU, so the readback is only as big as the encoded frame
+	FRHICommandListImmediate& RHICmdList = FRHICommandListExecutor::GetImmediateCommandList();
+	CopyTexture(FrameBuffer, Slot.Texture);
+	Slot.Readback->EnqueueCopy(RHICmdList, Slot.Texture);
+	RHICmdList.ImmediateFlush(EImmediateFlushType::DispatchToRHIThread);
+
+	Slot.Timestamps = Timestamps;
+	Slot.CaptureCycles = CaptureCycles;
+	Slot.bInFlight = true;
+	NextReadbackSlot = (NextReadbackSlot + 1) % ReadbackSlots.Num();
+	return true;
+}
+
+void FSRGameplayMediaEncoder::DeliverReadbacks(bool bWait)
+{
+	CSV_SCOPED_TIMING_STAT(SRGameplayMediaEncoder, DeliverReadbacks);
+	FRHICommandListImmediate& RHICmdList = FRHICommandListExecutor::GetImmediateCommandList();
+
+	// Mapping a staging texture is only safe on the render thread, so the conversion happens here too
+	while(ReadbackSlots.Num() > 0 && ReadbackSlots[OldestReadbackSlot].bInFlight)
+	{
+		FReadbackSlot& Slot = ReadbackSlots[OldestReadbackSlot];
+		if(!Slot.Readback->IsReady())
+		{
+			if(!bWait)
+			{
+				break;
+			}
+			RHICmdList.BlockUntilGPUIdle();
+			while(!Slot.Readback->IsReady())
+			{
+				FPlatformProcess::SleepNoStats(0.0005f);
+			}
+		}
+
+		// Read back before SetResolution, the input frames are another size now
+		const bool bOutdated = Slot.Texture->GetSizeX() != VideoEncoderInput->GetWidth() || Slot.Texture->GetSizeY() != VideoEncoderInput->GetHeight();
+		if(bOutdated || CapturedFrames.Num() >= CapturedFrames.Capacity())
+		{
+			UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("%s, dropped captured frame"), bOutdated ? TEXT("Resolution changed") : TEXT("Video worker is behind"));
+			++VideoFramesDropped;
+			FSRStats::Get().Add(ESRCounter::FramesDropped);
+		}
+		else
+		{
+			const int64 TimestampUs = Slot.Timestamps[0].GetTicks();
+			AVEncoder::FVideoEncoderInputFrame* InputFrame = VideoEncoderInput->ObtainInputFrame();
+			InputFrame->SetTimestampUs(TimestampUs);
+
+			void* Pixels = nullptr;
+			int32 RowPitchInPixels = 0;
+			Slot.Readback->LockTexture(RHICmdList, Pixels, RowPitchInPixels);
+			FSRVideoFrame Readback;
+			Readback.Format = ESRPixelFormat::BGRA8;
+			Readback.Width = InputFrame->GetWidth();
+			Readback.Height = InputFrame->GetHeight();
+			Readback.Planes[0] = static_cast<const uint8*>(Pixels);
+			Readback.Strides[0] = RowPitchInPixels * 4;
+			// Spread over the task graph workers, the render thread only waits for the last band
+			SRVideo::RGBToYUV(Readback, GetYUVImage(*InputFrame));
+			Slot.Readback->Unlock();
+
+			// Already in system memory, no fence for the worker to wait on. Repeats are copied by the worker.
+			FCapturedFrame Captured;
+			Captured.InputFrame = InputFrame;
+			Captured.TimestampUs = TimestampUs;
+			Captured.RepeatTimestamps.Append(Slot.Timestamps.GetData() + 1, Slot.Timestamps.Num() - 1);
+			Captured.CaptureCycles = Slot.CaptureCycles;
+			EnqueueCapturedFrame(MoveTemp(Captured));
+		}
+
+		Slot.bInFlight = false;
+		OldestReadbackSlot = (OldestReadbackSlot + 1) % ReadbackSlots.Num();
+	}
+}
+
+void FSRGameplayMediaEncoder::StartVideoWorker()
+{
+	check(!VideoThread.IsJoinable());
+	bStopVideoWorker = false;
+	VideoWorkEvent = FPlatformProcess::GetSynchEventFromPool(false);
+	VideoThread = FThread(TEXT("SRVideoEncoder"), [this]() { RunVideoWorker(); }, 0, TPri_AboveNormal);
+}
+
+void FSRGameplayMediaEncoder::StopVideoWorker()
+{
+	if(VideoThread.IsJoinable())
+	{
+		bStopVideoWorker = true;
+		VideoWorkEvent->Trigger();
+		VideoThread.Join();
+	}
+	if(VideoWorkEvent)
+	{
+		FPlatformProcess::ReturnSynchEventToPool(VideoWorkEvent);
+		VideoWorkEvent = nullptr;
+	}
+}
+
+void FSRGameplayMediaEncoder::RunVideoWorker()
+{
+	for(;;)
+	{
+		FCapturedFrame* Next = CapturedFrames.Peek();
+		if(!Next)
+		{
+			// The render thread is done capturing and SubmitVideoFrame turns frames away by the time bStopVideoWorker is set,
+			// so the queue is really empty
+			if(bStopVideoWorker)
+			{
+				break;
+			}
+			VideoWorkEvent->Wait();
+			continue;
+		}
+
+		// The encoder reads the texture behind the RHI's back, so the copy has to be done first
+		bool bCopied = true;
+		if(Next->CopyFence.IsValid() && !Next->CopyFence->Poll())
+		{
+			CSV_SCOPED_TIMING_STAT(SRGameplayMediaEncoder, WaitForCopy);
+			const double WaitStart = FPlatformTime::Seconds();
+			while(!(bCopied = Next->CopyFence->Poll()) && FPlatformTime::Seconds() - WaitStart < MaxCopyWaitSeconds)
+			{
+				FPlatformProcess::SleepNoStats(0.0005f);
+			}
+		}
+
+		FCapturedFrame Frame;
+		verify(CapturedFrames.TryDequeue(Frame));
+		FSRStats::Get().RecordLatency(ESRStage::Queue, Frame.QueuedCycles);
+		if(!bCopied)
+		{
+			// A GPU that far behind may still be writing the texture, and the encoder would read half a frame
+			UE_LOG(SRGameplayMediaEncoder, Verbose, TEXT("Copy to the encoder not done after %.0f ms, dropped captured frame"), MaxCopyWaitSeconds * 1000);
+			Frame.InputFrame->Release();
+			++VideoFramesDropped;
+			FSRStats::Get().Add(ESRCounter::FramesDropped);
+			continue;
+		}
+		if(Frame.SystemMemoryFrame.IsSet() && !FillInputFrame(Frame))
+		{
+			continue;
+		}
+		EncodeVideoFrame(Frame);
+	}
+}
+
+void FSRGameplayMediaEncoder::EncodeVideoFrame(FCapturedFrame& Frame)
+{
+	CSV_SCOPED_TIMING_STAT(SRGameplayMediaEncoder, EncodeVideoFrame);
+	FScopeLock Lock(&VideoProcessingCS);
+
+	bool bHasInput = true;
+#if PLATFORM_WINDOWS && PLATFORM_DESKTOP
+	bHasInput = bSoftwareVideoEncoding || Frame.InputFrame->GetD3D11().EncoderTexture;
+#endif
+	if(!VideoEncoder.IsValid() || !bHasInput)
 	{
-		InputFrame->SetTimestampUs(FMath::Max(SRMasterAudioClock.GetTicks(), LastVideoInputTimestamp.GetTicks() + 10));
+		Frame.InputFrame->Release();
+		return;
 	}
-	//InputFrame->SetTimestampUs(SRMasterAudioClock.GetTicks());
 
-	CopyTexture(FrameBuffer, BackBuffers[InputFrame]);
 	AVEncoder::FVideoEncoder::FEncodeOptions EncodeOptions;
-	if (InputFrame->GetD3D11().EncoderTexture)
+	const bool bResized = UpdateVideoConfig(*Frame.InputFrame);
+	const bool bKeyframeTaken = TakeKeyframeRequest(Frame.TimestampUs);
+	EncodeOptions.bForceKeyFrame = bResized || bKeyframeTaken;
+	if(EncodeOptions.bForceKeyFrame)
+	{
+		LastKeyframeTimestamp = Frame.TimestampUs;
+		KeyframesForced += bKeyframeTaken ? 1 : 0;
+	}
+
+	// Software encoding repeats a frame with copies of it. Made first: the encoder may be done with the original, and
+	// release it for the render thread to reuse, before Encode returns.
+	TArray<AVEncoder::FVideoEncoderInputFrame*, TInlineAllocator<4>> Repeats;
+	for(FTimespan Timestamp : Frame.RepeatTimestamps)
+	{
+		AVEncoder::FVideoEncoderInputFrame* Repeat = VideoEncoderInput->ObtainInputFrame();
+		if(Repeat->GetWidth() != Frame.InputFrame->GetWidth() || Repeat->GetHeight() != Frame.InputFrame->GetHeight())
+		{
+			// SetResolution came in between, the next frame takes over at the new size
+			Repeat->Release();
+			break;
+		}
+		Repeat->SetTimestampUs(Timestamp.GetTicks());
+		SRVideo::CopyYUV(GetYUVImage(*Frame.InputFrame), GetYUVImage(*Repeat));
+		Repeats.Add(Repeat);
+	}
+
+	// Before Encode, whose packets can come out on another thread before it returns
+	const uint64 SubmitCycles = FPlatformTime::Cycles64();
+	SetFrameTiming(Frame.TimestampUs, Frame.CaptureCycles, SubmitCycles);
+	for(const AVEncoder::FVideoEncoderInputFrame* Repeat : Repeats)
 	{
+		SetFrameTiming(Repeat->GetTimestampUs(), Frame.CaptureCycles, SubmitCycles);
+	}
+
+	// OnEncodedVideoFrame releases the input frames, once for every layer's packet
+	const double StartSeconds = FPlatformTime::Seconds();
+	auto Encode = [this, &EncodeOptions](const AVEncoder::FVideoEncoderInputFrame* InputFrame)
+	{
+		for(int32 LayerIndex = 1; LayerIndex < NumVideoLayers; ++LayerIndex)
+		{
+			InputFrame->Obtain();
+		}
 		VideoEncoder->Encode(InputFrame, EncodeOptions);
+	};
+	Encode(Frame.InputFrame);
+	EncodeOptions.bForceKeyFrame = false;
+	for(AVEncoder::FVideoEncoderInputFrame* Repeat : Repeats)
+	{
+		Encode(Repeat);
+	}
+	VideoEncodeSeconds += FPlatformTime::Seconds() - StartSeconds;
+}
+
+bool FSRGameplayMediaEncoder::TakeKeyframeRequest(int64 TimestampUs)
+{
+	bool bTake = bKeyframeRequested.Exchange(false);
+	// x264 keeps to the GOP length itself, and with its lookahead the keyframes come out too late to go by
+	if(!bSoftwareVideoEncoding && TimestampUs - LastKeyframeTimestamp.Load() >= GopLength.GetTicks())
+	{
+		bTake = true;
+	}
+	return bTake;
+}
 
-		LastVideoInputTimestamp = FTimespan(InputFrame->GetTimestampUs());
-		NumCapturedFrames++;
+void FSRGameplayMediaEncoder::SetFrameTiming(int64 TimestampUs, uint64 CaptureCycles, uint64 SubmitCycles)
+{
+	FFrameTiming& Timing = FrameTimings[NextFrameTiming];
+	NextFrameTiming = (NextFrameTiming + 1) % NumFrameTimings;
+	Timing.TimestampUs = -1;
+	Timing.CaptureCycles = CaptureCycles;
+	Timing.SubmitCycles = SubmitCycles;
+	Timing.TimestampUs = TimestampUs;
+}
+
+bool FSRGameplayMediaEncoder::FindFrameTiming(int64 TimestampUs, uint64& OutCaptureCycles, uint64& OutSubmitCycles) const
+{
+	for(const FFrameTiming& Timing : FrameTimings)
+	{
+		if(Timing.TimestampUs.Load() == TimestampUs)
+		{
+			OutCaptureCycles = Timing.CaptureCycles;
+			OutSubmitCycles = Timing.SubmitCycles;
+			// Overwritten while we read it otherwise
+			return Timing.TimestampUs.Load() == TimestampUs;
+		}
 	}
+	return false;
 }
 
 AVEncoder::FVideoEncoderInputFrame* FSRGameplayMediaEncoder::ObtainInputFrame()
 {
 	AVEncoder::FVideoEncoderInputFrame* InputFrame = VideoEncoderInput->ObtainInputFrame();
 
-	if(!BackBuffers.Contains(InputFrame))
+	// A frame from before SetResolution comes back with the new size, and needs a texture to match
+	const FTexture2DRHIRef* BackBuffer = BackBuffers.Find(InputFrame);
+	if(!BackBuffer || (*BackBuffer)->GetSizeX() != InputFrame->GetWidth() || (*BackBuffer)->GetSizeY() != InputFrame->GetHeight())
 	{
 #if PLATFORM_WINDOWS && PLATFORM_DESKTOP
+		// Only forgets the texture the frame lets go of, which may be after it was given the next one
+		const auto OnTextureReleased = [this, InputFrame](void* NativeTexture)
+		{
+			const FTexture2DRHIRef* Texture = BackBuffers.Find(InputFrame);
+			if(Texture && (*Texture)->GetNativeResource() == NativeTexture)
+			{
+				FSRMemoryTracker::Get().Add(ESRMemory::EncoderInput, -GetTextureBytes(*Texture));
+				BackBuffers.Remove(InputFrame);
+			}
+		};
+
 		FString RHIName = GDynamicRHI->GetName();
 		if(RHIName == TEXT("D3D11"))
 		{
 			FRHIResourceCreateInfo CreateInfo(TEXT("VideoCapturerBackBuffer"));
-			FTexture2DRHIRef Texture = GDynamicRHI->RHICreateTexture2D(VideoConfig.Width, VideoConfig.Height, EPixelFormat::PF_B8G8R8A8, 1, 1,
+			FTexture2DRHIRef Texture = GDynamicRHI->RHICreateTexture2D(InputFrame->GetWidth(), InputFrame->GetHeight(), EPixelFormat::PF_B8G8R8A8, 1, 1,
 			                                                           TexCreate_Shared | TexCreate_RenderTargetable | TexCreate_UAV, ERHIAccess::CopyDest, CreateInfo);
-			InputFrame->SetTexture((ID3D11Texture2D*)Texture->GetNativeResource(), [&, InputFrame](ID3D11Texture2D* NativeTexture) { BackBuffers.Remove(InputFrame); });
-			BackBuffers.Add(InputFrame, Texture);
+			InputFrame->SetTexture((ID3D11Texture2D*)Texture->GetNativeResource(), [OnTextureReleased](ID3D11Texture2D* NativeTexture) { OnTextureReleased(NativeTexture); });
+			SetBackBuffer(InputFrame, Texture);
 		}
 		else if(RHIName == TEXT("D3D12"))
 		{
 			FRHIResourceCreateInfo CreateInfo(TEXT("VideoCapturerBackBuffer"));
-			FTexture2DRHIRef Texture = GDynamicRHI->RHICreateTexture2D(VideoConfig.Width, VideoConfig.Height, EPixelFormat::PF_B8G8R8A8, 1, 1,
+			FTexture2DRHIRef Texture = GDynamicRHI->RHICreateTexture2D(InputFrame->GetWidth(), InputFrame->GetHeight(), EPixelFormat::PF_B8G8R8A8, 1, 1,
 			                                                           TexCreate_Shared | TexCreate_RenderTargetable | TexCreate_UAV, ERHIAccess::CopyDest, CreateInfo);
-			InputFrame->SetTexture((ID3D12Resource*)Texture->GetNativeResource(), [&, InputFrame](ID3D12Resource* NativeTexture) { BackBuffers.Remove(InputFrame); });
-			BackBuffers.Add(InputFrame, Texture);
+			InputFrame->SetTexture((ID3D12Resource*)Texture->GetNativeResource(), [OnTextureReleased](ID3D12Resource* NativeTexture) { OnTextureReleased(NativeTexture); });
+			SetBackBuffer(InputFrame, Texture);
 		}
 
 		UE_LOG(LogTemp, Log, TEXT("%d backbuffers currently allocated"), BackBuffers.Num());
@@ -655,24 +1793,227 @@ AVEncoder::FVideoEncoderInputFrame* FSRGameplayMediaEncoder::ObtainInputFrame()
 	return InputFrame;
 }
 
+void FSRGameplayMediaEncoder::SetBackBuffer(AVEncoder::FVideoEncoderInputFrame* InputFrame, const FTexture2DRHIRef& Texture)
+{
+	FSRMemoryTracker& Memory = FSRMemoryTracker::Get();
+	if(const FTexture2DRHIRef* Previous = BackBuffers.Find(InputFrame))
+	{
+		Memory.Add(ESRMemory::EncoderInput, -GetTextureBytes(*Previous));
+	}
+	Memory.Add(ESRMemory::EncoderInput, GetTextureBytes(Texture));
+	BackBuffers.Add(InputFrame, Texture);
+}
+
 void FSRGameplayMediaEncoder::SetVideoBitrate(uint32 Bitrate)
 {
 	NewVideoBitrate = Bitrate;
 	bChangeBitrate = true;
 }
 
+int32 FSRGameplayMediaEncoder::AddVideoLayer(uint32 Width, uint32 Height, uint32 Bitrate)
+{
+	check(IsInGameThread());
+	return AddVideoLayerImpl(Width, Height, Bitrate);
+}
+
+int32 FSRGameplayMediaEncoder::AddVideoLayerImpl(uint32 Width, uint32 Height, uint32 Bitrate)
+{
+	if(!VideoEncoder)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("Can't add a video layer before the encoder is initialized"));
+		return INDEX_NONE;
+	}
+
+	FScopeLock Lock(&VideoProcessingCS);
+	const int32 LayerIndex = NumVideoLayers;
+	if(LayerIndex >= MaxVideoLayers)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("Can't add more than %d video layers"), MaxVideoLayers);
+		return INDEX_NONE;
+	}
+
+	AVEncoder::FVideoEncoder::FLayerConfig Config = VideoEncoder->GetLayerConfig(0);
+	const FIntPoint Resolution = GetValidResolution(Width, Height);
+	if(Bitrate == 0)
+	{
+		// As many bits per pixel as the first layer
+		Bitrate = uint32(double(Config.TargetBitrate) * Resolution.X * Resolution.Y / (double(Config.Width) * Config.Height));
+	}
+	Config.Width = Resolution.X;
+	Config.Height = Resolution.Y;
+	Config.TargetBitrate = FMath::Clamp(Bitrate, MinVideoBitrate, MaxVideoBitrate);
+	Config.MaxBitrate = MaxVideoBitrate;
+
+	// Packets of the layer can come out as soon as it is added
+	LayerCounters[LayerIndex].Width = Config.Width;
+	LayerCounters[LayerIndex].Height = Config.Height;
+	if(!VideoEncoder->AddLayer(Config))
+	{
+		UE_LOG(SRGameplayMediaEncoder, Error, TEXT("The video encoder can't add a %ux%u layer"), Config.Width, Config.Height);
+		return INDEX_NONE;
+	}
+
+	NumVideoLayers = LayerIndex + 1;
+	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Video layer %d: %ux%u, %u kbps"), LayerIndex, Config.Width, Config.Height, uint32(Config.TargetBitrate) / 1000);
+	return LayerIndex;
+}
+
+TArray<FSRVideoLayerStats> FSRGameplayMediaEncoder::GetVideoLayerStats() const
+{
+	TArray<FSRVideoLayerStats> Result;
+
+	FScopeLock Lock(&VideoProcessingCS);
+	if(!VideoEncoder)
+	{
+		return Result;
+	}
+
+	const double RecordedSeconds = FTimespan(LastVideoInputTimestamp.Load()).GetTotalSeconds();
+	for(int32 LayerIndex = 0; LayerIndex < NumVideoLayers; ++LayerIndex)
+	{
+		const AVEncoder::FVideoEncoder::FLayerConfig& Config = VideoEncoder->GetLayerConfig(LayerIndex);
+		const FLayerCounters& Counters = LayerCounters[LayerIndex];
+
+		FSRVideoLayerStats& Stats = Result.AddDefaulted_GetRef();
+		Stats.Width = Config.Width;
+		Stats.Height = Config.Height;
+		Stats.TargetBitrate = Config.TargetBitrate;
+		Stats.Frames = Counters.Frames;
+		Stats.Keyframes = Counters.Keyframes;
+		Stats.Bytes = Counters.Bytes;
+		Stats.AverageBitrate = RecordedSeconds > 0 ? Stats.Bytes * 8 / RecordedSeconds : 0;
+		if(bSoftwareVideoEncoding)
+		{
+			const FSRX264LayerStats X264Stats = static_cast<const FSRX264Encoder*>(VideoEncoder.Get())->GetLayerStats(LayerIndex);
+			Stats.ScaleSeconds = X264Stats.ScaleSeconds;
+			Stats.EncodeSeconds = X264Stats.EncodeSeconds;
+		}
+	}
+	return Result;
+}
+
+void FSRGameplayMediaEncoder::LogVideoLayerStats() const
+{
+	const TArray<FSRVideoLayerStats> Layers = GetVideoLayerStats();
+	FSRVideoLayerStats Total;
+	for(int32 LayerIndex = 0; LayerIndex < Layers.Num(); ++LayerIndex)
+	{
+		const FSRVideoLayerStats& Stats = Layers[LayerIndex];
+		UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Video layer %d %ux%u: %llu frames, %llu keyframes, %.1f MB, %.2f of %.2f Mbps, scale %.2f s, encode %.2f s (%.2f ms a frame)"),
+			LayerIndex, Stats.Width, Stats.Height, Stats.Frames, Stats.Keyframes, Stats.Bytes / (1024.0 * 1024.0), Stats.AverageBitrate / 1000000.0,
+			Stats.TargetBitrate / 1000000.0, Stats.ScaleSeconds, Stats.EncodeSeconds, Stats.Frames > 0 ? (Stats.ScaleSeconds + Stats.EncodeSeconds) * 1000.0 / Stats.Frames : 0.0);
+		Total.Frames += Stats.Frames;
+		Total.Bytes += Stats.Bytes;
+		Total.AverageBitrate += Stats.AverageBitrate;
+	}
+
+	// Hardware encoders encode all the layers in one call, so only the total is known there
+	FScopeLock Lock(&VideoProcessingCS);
+	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("All %d video layers: %llu frames, %.1f MB, %.2f Mbps, %.2f s in the encoder"),
+		Layers.Num(), Total.Frames, Total.Bytes / (1024.0 * 1024.0), Total.AverageBitrate / 1000000.0, VideoEncodeSeconds);
+}
+
+bool FSRGameplayMediaEncoder::RequestKeyframe(const void* Consumer)
+{
+	if(Consumer)
+	{
+		FScopeLock Lock(&KeyframeCS);
+		FKeyframeLimiter* Limiter = KeyframeLimiters.Find(Consumer);
+		if(!Limiter)
+		{
+			return false;
+		}
+
+		const double Now = FPlatformTime::Seconds();
+		if(Limiter->LastForcedSeconds > 0 && Now - Limiter->LastForcedSeconds < Limiter->Policy.MinInterval.GetTotalSeconds())
+		{
+			++KeyframeRequestsLimited;
+			return false;
+		}
+		Limiter->LastForcedSeconds = Now;
+	}
+
+	bKeyframeRequested = true;
+	return true;
+}
+
+void FSRGameplayMediaEncoder::AddKeyframeLimiter(const void* Consumer, const FSRKeyframePolicy& Policy, bool bRunning)
+{
+	{
+		FScopeLock Lock(&KeyframeCS);
+		KeyframeLimiters.FindOrAdd(Consumer).Policy = Policy;
+	}
+
+	if(bRunning && Policy.bOnRegister)
+	{
+		RequestKeyframe(Consumer);
+	}
+}
+
+void FSRGameplayMediaEncoder::RemoveKeyframeLimiter(const void* Consumer)
+{
+	FScopeLock Lock(&KeyframeCS);
+	KeyframeLimiters.Remove(Consumer);
+}
+
+bool FSRGameplayMediaEncoder::SetResolution(uint32 Width, uint32 Height)
+{
+	check(IsInGameThread());
+
+	if(!VideoEncoderInput)
+	{
+		UE_LOG(SRGameplayMediaEncoder, Warning, TEXT("Not initialized, the resolution to start with is GameplayMediaEncoder.ResX= and ResY="));
+		return false;
+	}
+
+	const FIntPoint Resolution = GetValidResolution(Width, Height);
+	if(uint32(Resolution.X) == VideoConfig.Width && uint32(Resolution.Y) == VideoConfig.Height)
+	{
+		return true;
+	}
+
+	UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Resolution %ux%u requested, changing from %ux%u to %dx%d"), Width, Height, VideoConfig.Width, VideoConfig.Height, Resolution.X, Resolution.Y);
+	VideoConfig.Width = Resolution.X;
+	VideoConfig.Height = Resolution.Y;
+
+	// The render thread obtains the input frames and sizes the textures after them, so that is where the size changes.
+	// The video worker and the system memory path only ever look at the size of the frame they hold.
+	ENQUEUE_RENDER_COMMAND(SRSetResolution)([this, Resolution](FRHICommandListImmediate&)
+		{
+			if(VideoEncoderInput)
+			{
+				VideoEncoderInput->SetResolution(Resolution.X, Resolution.Y);
+			}
+		});
+	return true;
+}
+
 void FSRGameplayMediaEncoder::SetVideoFramerate(uint32 Framerate)
 {
 	NewVideoFramerate = FMath::Clamp(Framerate, MinVideoFPS, MaxVideoFPS);
 	bChangeFramerate = true;
+	// Pacing follows right away, the grid carries on from the last frame at the new rate. Uncapped stays uncapped.
+	if(FrameScheduler->GetMode() == ESRFrameRateMode::Constant)
+	{
+		FrameScheduler->SetFramerate(NewVideoFramerate);
+	}
 }
 
-void FSRGameplayMediaEncoder::UpdateVideoConfig()
+bool FSRGameplayMediaEncoder::UpdateVideoConfig(const AVEncoder::FVideoEncoderInputFrame& InputFrame)
 {
-	if(bChangeBitrate || bChangeFramerate)
+	// The encoder follows the size of the frames, so the ones captured before SetResolution still go out at the old size
+	const bool bResize = InputFrame.GetWidth() != VideoEncoder->GetLayerConfig(0).Width || InputFrame.GetHeight() != VideoEncoder->GetLayerConfig(0).Height;
+	if(bChangeBitrate || bChangeFramerate || bResize)
 	{
 		auto config = VideoEncoder->GetLayerConfig(0);
 
+		if(bResize)
+		{
+			UE_LOG(SRGameplayMediaEncoder, Log, TEXT("Encoder resized from %ux%u to %ux%u"), config.Width, config.Height, InputFrame.GetWidth(), InputFrame.GetHeight());
+			config.Width = InputFrame.GetWidth();
+			config.Height = InputFrame.GetHeight();
+		}
+
 		if(bChangeBitrate)
 		{
 			config.MaxBitrate = MaxVideoBitrate;
@@ -682,54 +2023,173 @@ void FSRGameplayMediaEncoder::UpdateVideoConfig()
 		if(bChangeFramerate)
 		{
 			config.MaxFramerate = NewVideoFramerate;
-			NumCapturedFrames = 0;
 		}
 
 		VideoEncoder->UpdateLayerConfig(0, config);
+		for(int32 LayerIndex = 1; bChangeFramerate && LayerIndex < NumVideoLayers; ++LayerIndex)
+		{
+			AVEncoder::FVideoEncoder::FLayerConfig LayerConfig = VideoEncoder->GetLayerConfig(LayerIndex);
+			LayerConfig.MaxFramerate = NewVideoFramerate;
+			VideoEncoder->UpdateLayerConfig(LayerIndex, LayerConfig);
+		}
 		bChangeFramerate = false;
 		bChangeBitrate = false;
 	}
+	// New parameter sets only come with a keyframe
+	return bResize;
 }
 
 void FSRGameplayMediaEncoder::OnEncodedAudioFrame(const AVEncoder::FMediaPacket& Packet)
 {
-
-	FScopeLock Lock(&ListenersCS);
-	
-	if (Packet.Timestamp > SRMasterAudioClock)
+	const FConsumersScope Scope(*this);
+	const FConsumerSnapshot* Snapshot = Scope.Snapshot;
+	if(!Snapshot)
 	{
 		return;
 	}
 
-	for(auto&& Listener : Listeners)
+	FSRStats::Get().Add(ESRCounter::AudioPackets);
+
+	for(auto&& Listener : Snapshot->Listeners)
 	{
 		Listener->OnMediaSample(Packet);
 	}
+
+	if(Snapshot->Sinks.Num() > 0 || Snapshot->ListenerRunners.Num() > 0)
+	{
+		// The one copy every sink and async listener shares
+		FSRMutableMediaPacketPtr Shared = FSRPacketPool::Get().Acquire(Packet.Data.Num());
+		Shared->Type = AVEncoder::EPacketType::Audio;
+		Shared->Timestamp = Packet.Timestamp;
+		Shared->Duration = Packet.Duration;
+		FMemory::Memcpy(Shared->GetData(), Packet.Data.GetData(), Packet.Data.Num());
+		Shared->PublishCycles = FPlatformTime::Cycles64();
+
+		const FSRMediaPacketPtr SharedPtr(Shared.GetReference());
+		for(FSRMediaSinkRunner* Runner : Snapshot->Sinks)
+		{
+			Runner->Enqueue(SharedPtr);
+		}
+		for(FSRMediaSinkRunner* Runner : Snapshot->ListenerRunners)
+		{
+			Runner->Enqueue(SharedPtr);
+		}
+	}
 }
 
 void FSRGameplayMediaEncoder::OnEncodedVideoFrame(uint32 LayerIndex, const AVEncoder::FVideoEncoderInputFrame* InputFrame, const AVEncoder::FCodecPacket& Packet)
 {
-	AVEncoder::FMediaPacket packet(AVEncoder::EPacketType::Video);
+	const FConsumersScope Scope(*this);
+	const FConsumerSnapshot* Snapshot = Scope.Snapshot;
+
+	if (!Snapshot || InputFrame->GetTimestampUs() > LastVideoInputTimestamp.Load())
+	{
+		InputFrame->Release();
+		return;
+	}
 
-	packet.Timestamp = InputFrame->GetTimestampUs();
-	packet.Duration = 0; // This should probably be 1.0f / fps in ms
-	packet.Data = TArray<uint8>(Packet.Data, Packet.DataSize);
-	packet.Video.bKeyFrame = Packet.IsKeyFrame;
-	packet.Video.Width = InputFrame->GetWidth();
-	packet.Video.Height = InputFrame->GetHeight();
-	packet.Video.FrameAvgQP = Packet.VideoQP;
-	packet.Video.Framerate = VideoConfig.Framerate;
+	if(LayerIndex == 0 && Packet.IsKeyFrame && InputFrame->GetTimestampUs() > LastKeyframeTimestamp.Load())
+	{
+		LastKeyframeTimestamp = InputFrame->GetTimestampUs();
+	}
 
-	FScopeLock Lock(&ListenersCS);
+	if(LayerIndex >= uint32(MaxVideoLayers))
+	{
+		InputFrame->Release();
+		return;
+	}
+	FLayerCounters& Counters = LayerCounters[LayerIndex];
+	++Counters.Frames;
+	Counters.Keyframes += Packet.IsKeyFrame ? 1 : 0;
+	Counters.Bytes += Packet.DataSize;
+
+	FSRStats& Stats = FSRStats::Get();
+	Stats.Add(ESRCounter::VideoPackets);
+	Stats.Add(ESRCounter::BytesEncoded, Packet.DataSize);
+	// Every layer's packet carries the capture time on to the muxer, the encode time is the first layer's
+	uint64 CaptureCycles = 0;
+	uint64 SubmitCycles = 0;
+	const uint64 PublishCycles = FPlatformTime::Cycles64();
+	if(FindFrameTiming(InputFrame->GetTimestampUs(), CaptureCycles, SubmitCycles) && LayerIndex == 0)
+	{
+		Stats.RecordLatency(ESRStage::Encode, SubmitCycles, PublishCycles);
+	}
 
-	if (packet.Timestamp > LastVideoInputTimestamp)
+	if(LayerIndex >= uint32(Snapshot->VideoLayers.Num()))
 	{
+		// Nobody takes this layer
+		InputFrame->Release();
 		return;
 	}
+	const FConsumerSnapshot::FVideoLayerConsumers& Layer = Snapshot->VideoLayers[LayerIndex];
+	// The first layer follows the input frames, the others keep the size they were added with
+	const uint32 Width = LayerIndex == 0 ? InputFrame->GetWidth() : Counters.Width.Load();
+	const uint32 Height = LayerIndex == 0 ? InputFrame->GetHeight() : Counters.Height.Load();
+
+	if(Layer.Listeners.Num() > 0)
+	{
+		AVEncoder::FMediaPacket packet(AVEncoder::EPacketType::Video);
+
+		packet.Timestamp = InputFrame->GetTimestampUs();
+		packet.Duration = 0; // This should probably be 1.0f / fps in ms
+		packet.Data = TArray<uint8>(Packet.Data, Packet.DataSize);
+		packet.Video.bKeyFrame = Packet.IsKeyFrame;
+		packet.Video.Width = Width;
+		packet.Video.Height = Height;
+		packet.Video.FrameAvgQP = Packet.VideoQP;
+		packet.Video.Framerate = VideoConfig.Framerate;
+
+		for(auto&& Listener : Layer.Listeners)
+		{
+			Listener->OnMediaSample(packet);
+		}
+	}
 
-	for(auto&& Listener : Listeners)
+	if(Layer.ListenerRunners.Num() > 0)
 	{
-		Listener->OnMediaSample(packet);
+		// Listeners expect the encoder's Annex B output
+		FSRMutableMediaPacketPtr Shared = FSRPacketPool::Get().Acquire(Packet.DataSize);
+		Shared->Type = AVEncoder::EPacketType::Video;
+		Shared->Timestamp = InputFrame->GetTimestampUs();
+		Shared->bKeyFrame = Packet.IsKeyFrame;
+		Shared->Width = Width;
+		Shared->Height = Height;
+		Shared->FrameAvgQP = Packet.VideoQP;
+		Shared->Framerate = VideoConfig.Framerate;
+		Shared->CaptureCycles = CaptureCycles;
+		Shared->PublishCycles = PublishCycles;
+		FMemory::Memcpy(Shared->GetData(), Packet.Data, Packet.DataSize);
+
+		const FSRMediaPacketPtr SharedPtr(Shared.GetReference());
+		for(FSRMediaSinkRunner* Runner : Layer.ListenerRunners)
+		{
+			Runner->Enqueue(SharedPtr);
+		}
+	}
+
+	if(Layer.Sinks.Num() > 0)
+	{
+		// Copy out of the encoder's bitstream buffer and convert to AVCC in the same pass. This is the only copy:
+		// every sink shares the result, and the muxer can hand it to libavformat as is.
+		// The payload comes from the packet pool, sized for the worst case and trimmed to what the conversion wrote.
+		FSRMutableMediaPacketPtr Shared = FSRPacketPool::Get().Acquire(SRH264::GetMaxAvccSize(Packet.DataSize));
+		Shared->Type = AVEncoder::EPacketType::Video;
+		Shared->Timestamp = InputFrame->GetTimestampUs();
+		Shared->bKeyFrame = Packet.IsKeyFrame;
+		Shared->Width = Width;
+		Shared->Height = Height;
+		Shared->FrameAvgQP = Packet.VideoQP;
+		Shared->Framerate = VideoConfig.Framerate;
+		Shared->SetNum(SRH264::ConvertAnnexBToAvcc(Packet.Data, Packet.DataSize, Shared->GetData()));
+		Shared->bIsAvcc = true;
+		Shared->CaptureCycles = CaptureCycles;
+		Shared->PublishCycles = PublishCycles;
+
+		const FSRMediaPacketPtr SharedPtr(Shared.GetReference());
+		for(FSRMediaSinkRunner* Runner : Layer.Sinks)
+		{
+			Runner->Enqueue(SharedPtr);
+		}
 	}
 
 	InputFrame->Release();
@@ -755,6 +2215,13 @@ void FSRGameplayMediaEncoder::CopyTexture(const FTexture2DRHIRef& SourceTexture,
 		{
 			RHICmdList.SetViewport(0, 0, 0.0f, DestinationTexture->GetSizeX(), DestinationTexture->GetSizeY(), 1.0f);
 
+			// A back buffer of another aspect ratio keeps it, with black bars
+			const FIntRect Picture = SRVideo::GetAspectFitRect(SourceTexture->GetSizeX(), SourceTexture->GetSizeY(), DestinationTexture->GetSizeX(), DestinationTexture->GetSizeY());
+			if(Picture.Size() != DestinationTexture->GetSizeXY())
+			{
+				DrawClearQuad(RHICmdList, FLinearColor::Black);
+			}
+
 			FGraphicsPipelineStateInitializer GraphicsPSOInit;
 			RHICmdList.ApplyCachedRenderTargets(GraphicsPSOInit);
 			GraphicsPSOInit.BlendState = TStaticBlendState<>::GetRHI();
@@ -783,9 +2250,9 @@ void FSRGameplayMediaEncoder::CopyTexture(const FTexture2DRHIRef& SourceTexture,
 				PixelShader->SetParameters(RHICmdList, TStaticSamplerState<SF_Point>::GetRHI(), SourceTexture);
 			}
 
-			RendererModule->DrawRectangle(RHICmdList, 0, 0,                // Dest X, Y
-			                              DestinationTexture->GetSizeX(),  // Dest Width
-			                              DestinationTexture->GetSizeY(),  // Dest Height
+			RendererModule->DrawRectangle(RHICmdList, Picture.Min.X, Picture.Min.Y, // Dest X, Y
+			                              Picture.Width(),                 // Dest Width
+			                              Picture.Height(),                // Dest Height
 			                              0, 0,                            // Source U, V
 			                              1, 1,                            // Source USize, VSize
 			                              DestinationTexture->GetSizeXY(), // Target buffer size
@@ -32,14 +32,3 @@
 
 DECLARE_LOG_CATEGORY_EXTERN(SRGameplayMediaEncoder, Log, VeryVerbose);
 
-struct FMemoryCheckpoint
-{
-	FString Name;
-	float UsedPhysicalMB;
-	float DeltaMB;
-	float AccumulatedMB;
-};
-extern TArray<FMemoryCheckpoint> gSRMemoryCheckpoints;
-uint64 SRMemoryCheckpoint(const FString& Name);
-void SRLogMemoryCheckpoints(const FString& Name);
-
@@ -0,0 +1,244 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRH264Bitstream.h"
+
+namespace SRH264
+{
+	namespace
+	{
+		bool IsStartCode(const uint8* P)
+		{
+			return P[0] == 0 && P[1] == 0 && P[2] == 1;
+		}
+
+		void WriteBigEndian32(uint8* Dest, uint32 Value)
+		{
+			Dest[0] = static_cast<uint8>(Value >> 24);
+			Dest[1] = static_cast<uint8>(Value >> 16);
+			Dest[2] = static_cast<uint8>(Value >> 8);
+			Dest[3] = static_cast<uint8>(Value);
+		}
+
+		uint32 ReadBigEndian32(const uint8* Src)
+		{
+			return (uint32(Src[0]) << 24) | (uint32(Src[1]) << 16) | (uint32(Src[2]) << 8) | uint32(Src[3]);
+		}
+
+		void RecordParameterSet(const uint8* Nal, int32 NalSize, FParameterSets* OutParameterSets)
+		{
+			if (!OutParameterSets || NalSize <= 0)
+			{
+				return;
+			}
+
+			const ENalUnitType Type = static_cast<ENalUnitType>(Nal[0] & 0x1F);
+			// Keep the first of each, like FIbmLiveStreaming::GetAvccHeader does
+			if (Type == ENalUnitType::Sps && OutParameterSets->SpsSize == 0)
+			{
+				OutParameterSets->Sps = Nal;
+				OutParameterSets->SpsSize = NalSize;
+			}
+			else if (Type == ENalUnitType::Pps && OutParameterSets->PpsSize == 0)
+			{
+				OutParameterSets->Pps = Nal;
+				OutParameterSets->PpsSize = NalSize;
+			}
+		}
+
+		// Puts the start codes back on the NAL units a failed in-place conversion already rewrote
+		void RestoreAnnexB(uint8* Data, const uint8* ConvertedEnd)
+		{
+			uint8* Prefix = Data;
+			while (Prefix < ConvertedEnd)
+			{
+				const uint32 NalSize = ReadBigEndian32(Prefix);
+				WriteBigEndian32(Prefix, 1);
+				Prefix += AvccLengthSize + NalSize;
+			}
+		}
+	}
+
+	const uint8* FindStartCode(const uint8* Begin, const uint8* End)
+	{
+		const uint8* P = Begin;
+
+		// Byte by byte until P is 4-byte aligned
+		while (P + 3 <= End && (reinterpret_cast<UPTRINT>(P) & 3) != 0)
+		{
+			if (IsStartCode(P))
+			{
+				return P;
+			}
+			++P;
+		}
+
+		// A start code begins with a zero byte, so words without a zero byte can be skipped as a whole.
+		// Emulation prevention guarantees zero bytes are rare inside NAL units, so this is where the time goes.
+		// The loop bound leaves room for the 2 bytes past the word that the closer look reads.
+		while (P + 6 <= End)
+		{
+			uint32 Word;
+			FMemory::Memcpy(&Word, P, sizeof(Word));
+			if (((Word - 0x01010101u) & ~Word & 0x80808080u) != 0)
+			{
+				for (int32 Index = 0; Index < 4; ++Index)
+				{
+					if (IsStartCode(P + Index))
+					{
+						return P + Index;
+					}
+				}
+			}
+			P += 4;
+		}
+
+		while (P + 3 <= End)
+		{
+			if (IsStartCode(P))
+			{
+				return P;
+			}
+			++P;
+		}
+
+		return End;
+	}
+
+	bool ConvertAnnexBToAvccInPlace(uint8* Data, int32 Size, FParameterSets* OutParameterSets)
+	{
+		if (Size < AvccLengthSize || ReadBigEndian32(Data) != 1)
+		{
+			// Not starting with a 4-byte start code
+			return false;
+		}
+
+		uint8* const End = Data + Size;
+		uint8* Prefix = Data;
+		while (Prefix < End)
+		{
+			uint8* const Nal = Prefix + AvccLengthSize;
+			uint8* const NextStartCode = const_cast<uint8*>(FindStartCode(Nal, End));
+
+			uint8* NalEnd = End;
+			if (NextStartCode != End)
+			{
+				if (NextStartCode[-1] != 0)
+				{
+					// 3-byte start code, the length would overwrite the last byte of this NAL unit
+					RestoreAnnexB(Data, Prefix);
+					return false;
+				}
+				NalEnd = NextStartCode - 1;
+			}
+
+			const int32 NalSize = static_cast<int32>(NalEnd - Nal);
+			WriteBigEndian32(Prefix, static_cast<uint32>(NalSize));
+			RecordParameterSet(Nal, NalSize, OutParameterSets);
+
+			Prefix = NalEnd;
+		}
+
+		return true;
+	}
+
+	int32 ConvertAnnexBToAvcc(const uint8* Data, int32 Size, uint8* Out)
+	{
+		uint8* Prefix = Out;
+		const uint8* const End = Data + Size;
+		const uint8* StartCode = FindStartCode(Data, End);
+		while (StartCode != End)
+		{
+			const uint8* const Nal = StartCode + 3;
+			const uint8* const NextStartCode = FindStartCode(Nal, End);
+
+			// The zero byte in front of a 4-byte start code does not belong to the NAL unit
+			const uint8* NalEnd = NextStartCode;
+			if (NalEnd != End && NalEnd[-1] == 0)
+			{
+				--NalEnd;
+			}
+
+			const int32 NalSize = static_cast<int32>(NalEnd - Nal);
+			if (NalSize > 0)
+			{
+				WriteBigEndian32(Prefix, static_cast<uint32>(NalSize));
+				FMemory::Memcpy(Prefix + AvccLengthSize, Nal, NalSize);
+				Prefix += AvccLengthSize + NalSize;
+			}
+
+			StartCode = NextStartCode;
+		}
+
+		return static_cast<int32>(Prefix - Out);
+	}
+
+	void ConvertAnnexBToAvcc(const uint8* Data, int32 Size, TArray<uint8>& Out, FParameterSets* OutParameterSets)
+	{
+		Out.SetNumUninitialized(GetMaxAvccSize(Size), false);
+		Out.SetNum(ConvertAnnexBToAvcc(Data, Size, Out.GetData()), false);
+
+		// Only look the parameter sets up once Out is not going to move anymore
+		if (OutParameterSets)
+		{
+			FindParameterSetsAvcc(Out.GetData(), Out.Num(), *OutParameterSets);
+		}
+	}
+
+	bool FindParameterSetsAvcc(const uint8* Data, int32 Size, FParameterSets& OutParameterSets)
+	{
+		const uint8* const End = Data + Size;
+		const uint8* Prefix = Data;
+		while (Prefix + AvccLengthSize <= End)
+		{
+			const uint32 NalSize = ReadBigEndian32(Prefix);
+			const uint8* const Nal = Prefix + AvccLengthSize;
+			if (NalSize > static_cast<uint32>(End - Nal))
+			{
+				break;
+			}
+
+			RecordParameterSet(Nal, static_cast<int32>(NalSize), &OutParameterSets);
+			if (OutParameterSets.IsValid())
+			{
+				return true;
+			}
+
+			Prefix = Nal + NalSize;
+		}
+
+		return OutParameterSets.IsValid();
+	}
+
+	void BuildAvcDecoderConfigurationRecord(const FParameterSets& ParameterSets, TArray<uint8>& OutRecord)
+	{
+		check(ParameterSets.IsValid());
+
+		const uint8 Profile = ParameterSets.Sps[1];
+
+		OutRecord.Reset(11 + ParameterSets.SpsSize + ParameterSets.PpsSize + 4);
+		OutRecord.Add(0x01); // configurationVersion
+		OutRecord.Add(Profile); // AVCProfileIndication
+		OutRecord.Add(ParameterSets.Sps[2]); // profile_compatibility
+		OutRecord.Add(ParameterSets.Sps[3]); // AVCLevelIndication
+		OutRecord.Add(0xFC | (AvccLengthSize - 1)); // reserved (6 bits), lengthSizeMinusOne (2 bits)
+
+		OutRecord.Add(0xE0 | 1); // reserved (3 bits), numOfSequenceParameterSets (5 bits)
+		OutRecord.Add(static_cast<uint8>(ParameterSets.SpsSize >> 8));
+		OutRecord.Add(static_cast<uint8>(ParameterSets.SpsSize));
+		OutRecord.Append(ParameterSets.Sps, ParameterSets.SpsSize);
+
+		OutRecord.Add(1); // numOfPictureParameterSets
+		OutRecord.Add(static_cast<uint8>(ParameterSets.PpsSize >> 8));
+		OutRecord.Add(static_cast<uint8>(ParameterSets.PpsSize));
+		OutRecord.Append(ParameterSets.Pps, ParameterSets.PpsSize);
+
+		// High profiles carry the chroma format and bit depths as well. The encoders we use only produce 8-bit 4:2:0.
+		if (Profile == 100 || Profile == 110 || Profile == 122 || Profile == 144)
+		{
+			OutRecord.Add(0xFC | 1); // reserved (6 bits), chroma_format_idc = 1 (4:2:0)
+			OutRecord.Add(0xF8 | 0); // reserved (5 bits), bit_depth_luma_minus8
+			OutRecord.Add(0xF8 | 0); // reserved (5 bits), bit_depth_chroma_minus8
+			OutRecord.Add(0); // numOfSequenceParameterSetExt
+		}
+	}
+}
@@ -0,0 +1,72 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+//
+// H.264 bitstream helpers used when muxing encoder output into MP4.
+// Hardware encoders emit Annex-B (start code prefixed NAL units), while MP4 expects AVCC
+// (NAL units prefixed with their big-endian length) plus an avcC record in the stream extradata.
+//
+namespace SRH264
+{
+	enum class ENalUnitType : uint8
+	{
+		Slice = 1,
+		IdrSlice = 5,
+		Sei = 6,
+		Sps = 7,
+		Pps = 8,
+		Aud = 9,
+	};
+
+	// Size of the NAL length prefix we write. Same size as a 4-byte start code, which is what makes the in-place rewrite possible.
+	constexpr int32 AvccLengthSize = 4;
+
+	struct FParameterSets
+	{
+		// Views into the packet the parameter sets were found in
+		const uint8* Sps = nullptr;
+		int32 SpsSize = 0;
+		const uint8* Pps = nullptr;
+		int32 PpsSize = 0;
+
+		bool IsValid() const { return SpsSize >= 4 && PpsSize > 0; }
+	};
+
+	/**
+	 * Returns the first 3-byte start code (00 00 01) in [Begin, End), or End if there is none.
+	 * Skips a 32-bit word at a time unless the word contains a zero byte.
+	 */
+	const uint8* FindStartCode(const uint8* Begin, const uint8* End);
+
+	/**
+	 * Rewrites Annex-B to AVCC in a single pass, without reallocating: every 4-byte start code is overwritten with the
+	 * length of the NAL unit that follows it. AUD/SEI NAL units in front of the SPS (AMD AMF does that) are handled.
+	 * Fails and leaves the buffer untouched if a 3-byte start code is found, since its NAL unit would not fit a 4-byte length.
+	 * @param OutParameterSets If not null, receives the SPS/PPS found in the packet
+	 */
+	bool ConvertAnnexBToAvccInPlace(uint8* Data, int32 Size, FParameterSets* OutParameterSets = nullptr);
+
+	/**
+	 * Out of place fallback for streams that use 3-byte start codes.
+	 * @param OutParameterSets If not null, receives the SPS/PPS, pointing into Out
+	 */
+	void ConvertAnnexBToAvcc(const uint8* Data, int32 Size, TArray<uint8>& Out, FParameterSets* OutParameterSets = nullptr);
+
+	/** Upper bound of the AVCC size of an Annex-B packet: 3-byte start codes grow by one byte each. */
+	constexpr int32 GetMaxAvccSize(int32 AnnexBSize) { return AnnexBSize + AnnexBSize / 3 + AvccLengthSize; }
+
+	/**
+	 * Out of place conversion into a caller provided buffer of at least GetMaxAvccSize(Size) bytes.
+	 * @return Number of bytes written to Out
+	 */
+	int32 ConvertAnnexBToAvcc(const uint8* Data, int32 Size, uint8* Out);
+
+	/** Finds the SPS/PPS in a packet that is already in AVCC format. */
+	bool FindParameterSetsAvcc(const uint8* Data, int32 Size, FParameterSets& OutParameterSets);
+
+	/** Builds an AVCDecoderConfigurationRecord (the avcC box payload) from a SPS/PPS pair. */
+	void BuildAvcDecoderConfigurationRecord(const FParameterSets& ParameterSets, TArray<uint8>& OutRecord);
+}
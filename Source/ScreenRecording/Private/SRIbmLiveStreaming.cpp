@@ -1,6 +1,7 @@
 // Copyright Epic Games, Inc. All Rights Reserved.
 
 #include "SRIbmLiveStreaming.h"
+#include "SRMemoryTracker.h"
 
 #include "HttpModule.h"
 #include "Interfaces/IHttpResponse.h"
@@ -251,9 +252,6 @@ bool FIbmLiveStreaming::Start()
 
 bool FIbmLiveStreaming::Start(const FString& ClientId, const FString& ClientSecret, const FString& Channel, uint32 AudioSampleRate, uint32 AudioNumChannels, uint32 AudioBitrate)
 {
-
-	SRMemoryCheckpoint("IbmLiveStreaming: Before start");
-
 	check(IsInGameThread());
 
 	if (!CheckState(__FUNCTIONW__, EState::None))
@@ -301,8 +299,6 @@ bool FIbmLiveStreaming::Start(const FString& ClientId, const FString& ClientSecr
 
 	State = EState::GettingAccessToken;
 
-	SRMemoryCheckpoint("IbmLiveStreaming: After start");
-
 	return true;
 }
 
@@ -797,8 +793,7 @@ void FIbmLiveStreaming::OnMediaSample(const FGameplayMediaEncoderSample& Sample)
 	if (FirstPacket)
 	{
 		FirstPacket = false;
-		SRMemoryCheckpoint("IbmLiveStreaming: After sending first packet");
-		SRLogMemoryCheckpoints("After live streaming the first packet");
+		FSRMemoryTracker::Get().Log();
 	}
 }
 
@@ -0,0 +1,123 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRMediaSink.h"
+#include "SRStats.h"
+#include "HAL/PlatformProcess.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+
+CSV_DEFINE_CATEGORY(SRMediaSink, true);
+
+FSRMediaSinkRunner::FSRMediaSinkRunner(ISRMediaSink& InSink, int32 QueueCapacity)
+	: Sink(InSink)
+	, Queue(FMath::Max(QueueCapacity, 2))
+{
+	WorkEvent = FPlatformProcess::GetSynchEventFromPool(false);
+}
+
+FSRMediaSinkRunner::~FSRMediaSinkRunner()
+{
+	Stop();
+	FPlatformProcess::ReturnSynchEventToPool(WorkEvent);
+}
+
+bool FSRMediaSinkRunner::Start()
+{
+	check(!Thread);
+	bStopping = false;
+	Thread = FRunnableThread::Create(this, *FString::Printf(TEXT("SRMediaSink %s"), Sink.GetSinkName()), 0, TPri_AboveNormal);
+	if (!Thread)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Failed to create the thread of media sink %s"), Sink.GetSinkName());
+		return false;
+	}
+	return true;
+}
+
+void FSRMediaSinkRunner::Stop()
+{
+	if (Thread)
+	{
+		bStopping = true;
+		WorkEvent->Trigger();
+		Thread->WaitForCompletion();
+		delete Thread;
+		Thread = nullptr;
+	}
+}
+
+void FSRMediaSinkRunner::Enqueue(const FSRMediaPacketPtr& Packet)
+{
+	const bool bIsVideo = Packet->Type == AVEncoder::EPacketType::Video;
+	if (bIsVideo)
+	{
+		if (Packet->bKeyFrame)
+		{
+			bDropVideoUntilKeyFrame = false;
+		}
+		else if (bDropVideoUntilKeyFrame)
+		{
+			++PacketsDropped;
+			FSRStats::Get().Add(ESRCounter::SinkPacketsDropped);
+			return;
+		}
+	}
+
+	FSRMediaPacketPtr Queued = Packet;
+	if (!Queue.TryEnqueue(MoveTemp(Queued)))
+	{
+		// The sink fell behind. Never wait for it, that would stall the encoder and every other sink.
+		++PacketsDropped;
+		FSRStats::Get().Add(ESRCounter::SinkPacketsDropped);
+		if (bIsVideo)
+		{
+			bDropVideoUntilKeyFrame = true;
+		}
+		return;
+	}
+
+	const int32 Depth = Queue.Num();
+	int32 CurrentMax = MaxQueueDepth.Load(EMemoryOrder::Relaxed);
+	while (Depth > CurrentMax && !MaxQueueDepth.CompareExchange(CurrentMax, Depth))
+	{
+	}
+	FSRStats::Get().SetQueueDepth(ESRQueue::Sink, Depth);
+
+	WorkEvent->Trigger();
+}
+
+uint32 FSRMediaSinkRunner::Run()
+{
+	while (!bStopping)
+	{
+		WorkEvent->Wait();
+		Drain();
+	}
+
+	// Stop is only called once the runner no longer receives packets, so this is everything that is left
+	Drain();
+	return 0;
+}
+
+void FSRMediaSinkRunner::Drain()
+{
+	CSV_SCOPED_TIMING_STAT(SRMediaSink, Deliver);
+
+	FSRMediaPacketPtr Packet;
+	while (Queue.TryDequeue(Packet))
+	{
+		FSRStats::Get().RecordLatency(ESRStage::Sink, Packet->PublishCycles);
+		Sink.OnMediaPacket(Packet);
+		Packet.SafeRelease();
+		++PacketsDelivered;
+	}
+}
+
+FSRMediaSinkStats FSRMediaSinkRunner::GetStats() const
+{
+	FSRMediaSinkStats Stats;
+	Stats.PacketsDelivered = PacketsDelivered;
+	Stats.PacketsDropped = PacketsDropped;
+	Stats.QueueCapacity = Queue.Capacity();
+	Stats.MaxQueueDepth = MaxQueueDepth;
+	return Stats;
+}
@@ -0,0 +1,185 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRMemoryTracker.h"
+#include "HAL/IConsoleManager.h"
+#include "Misc/CommandLine.h"
+#include "Misc/ScopeLock.h"
+
+namespace
+{
+	bool ParseSubsystem(const FString& Name, ESRMemory& OutSubsystem)
+	{
+		for (int32 Subsystem = 0; Subsystem < int32(ESRMemory::Num); ++Subsystem)
+		{
+			if (Name == LexToString(ESRMemory(Subsystem)))
+			{
+				OutSubsystem = ESRMemory(Subsystem);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	double ToMB(int64 Bytes)
+	{
+		return Bytes / (1024.0 * 1024.0);
+	}
+}
+
+FAutoConsoleCommand SRMemoryCommand(TEXT("SR.Memory"), TEXT("Logs the memory the recording pipeline holds, per subsystem. SR.Memory reset starts the high-water marks over."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			FSRMemoryTracker::Get().ResetHighWater();
+			return;
+		}
+		FSRMemoryTracker::Get().Log();
+	}));
+
+FAutoConsoleCommand SRMemoryBudgetCommand(TEXT("SR.MemoryBudget"), TEXT("SR.MemoryBudget <Subsystem> <MB> sets the memory budget of a subsystem of the recording pipeline, 0 removes it."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		ESRMemory Subsystem;
+		if (Args.Num() < 2 || !ParseSubsystem(Args[0], Subsystem))
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Usage: SR.MemoryBudget <EncoderInput|PacketPool|MuxerQueue|MuxerIndex|AudioRing|ReplayBuffer> <MB>"));
+			return;
+		}
+		FSRMemoryTracker::Get().SetBudget(Subsystem, int64(FCString::Atod(*Args[1]) * 1024 * 1024));
+	}));
+
+const TCHAR* LexToString(ESRMemory Subsystem)
+{
+	switch (Subsystem)
+	{
+	case ESRMemory::EncoderInput: return TEXT("EncoderInput");
+	case ESRMemory::PacketPool: return TEXT("PacketPool");
+	case ESRMemory::MuxerQueue: return TEXT("MuxerQueue");
+	case ESRMemory::MuxerIndex: return TEXT("MuxerIndex");
+	case ESRMemory::AudioRing: return TEXT("AudioRing");
+	case ESRMemory::ReplayBuffer: return TEXT("ReplayBuffer");
+	default: return TEXT("Unknown");
+	}
+}
+
+FSRMemoryTracker& FSRMemoryTracker::Get()
+{
+	// Leaked on purpose: static destructors (replay buffers, the encoder singleton) still report to it on exit
+	static FSRMemoryTracker* Tracker = new FSRMemoryTracker();
+	return *Tracker;
+}
+
+FSRMemoryTracker::FSRMemoryTracker()
+{
+	for (int32 Subsystem = 0; Subsystem < int32(ESRMemory::Num); ++Subsystem)
+	{
+		double BudgetMB = 0;
+		if (FParse::Value(FCommandLine::Get(), *FString::Printf(TEXT("SR.MemoryBudget.%s="), LexToString(ESRMemory(Subsystem))), BudgetMB) && BudgetMB > 0)
+		{
+			Subsystems[Subsystem].Budget = int64(BudgetMB * 1024 * 1024);
+		}
+	}
+}
+
+void FSRMemoryTracker::Add(ESRMemory Subsystem, int64 Bytes)
+{
+	FSubsystem& Tracked = Subsystems[int32(Subsystem)];
+	const int64 Current = Tracked.Current.AddExchange(Bytes) + Bytes;
+
+	int64 HighWater = Tracked.HighWater.Load(EMemoryOrder::Relaxed);
+	while (Current > HighWater && !Tracked.HighWater.CompareExchange(HighWater, Current))
+	{
+	}
+
+	const int64 Budget = Tracked.Budget.Load(EMemoryOrder::Relaxed);
+	if (Budget <= 0)
+	{
+		return;
+	}
+	if (Current > Budget)
+	{
+		// Only whoever crosses it reports it
+		if (!Tracked.bOverBudget.Exchange(true))
+		{
+			OnOverBudget(Subsystem, Current, Budget);
+		}
+	}
+	else if (Tracked.bOverBudget.Load(EMemoryOrder::Relaxed))
+	{
+		Tracked.bOverBudget = false;
+	}
+}
+
+void FSRMemoryTracker::OnOverBudget(ESRMemory Subsystem, int64 Current, int64 Budget)
+{
+	UE_LOG(LogTemp, Warning, TEXT("Recording memory over budget: %s holds %.1f MB of %.1f MB"), LexToString(Subsystem), ToMB(Current), ToMB(Budget));
+
+	FScopeLock Lock(&CallbackCS);
+	if (OverBudgetCallback)
+	{
+		FSRMemoryStats Stats = GetStats(Subsystem);
+		Stats.Current = Current;
+		OverBudgetCallback(Subsystem, Stats);
+	}
+}
+
+FSRMemoryStats FSRMemoryTracker::GetStats(ESRMemory Subsystem) const
+{
+	const FSubsystem& Tracked = Subsystems[int32(Subsystem)];
+	FSRMemoryStats Stats;
+	Stats.Current = Tracked.Current.Load(EMemoryOrder::Relaxed);
+	Stats.HighWater = Tracked.HighWater.Load(EMemoryOrder::Relaxed);
+	Stats.Budget = Tracked.Budget.Load(EMemoryOrder::Relaxed);
+	return Stats;
+}
+
+int64 FSRMemoryTracker::GetTotal() const
+{
+	int64 Total = 0;
+	for (const FSubsystem& Tracked : Subsystems)
+	{
+		Total += Tracked.Current.Load(EMemoryOrder::Relaxed);
+	}
+	return Total;
+}
+
+void FSRMemoryTracker::SetBudget(ESRMemory Subsystem, int64 Bytes)
+{
+	FSubsystem& Tracked = Subsystems[int32(Subsystem)];
+	Tracked.Budget = FMath::Max<int64>(Bytes, 0);
+	// Reported by the next Add if it is already over
+	Tracked.bOverBudget = false;
+}
+
+void FSRMemoryTracker::SetOverBudgetCallback(FOverBudgetCallback Callback)
+{
+	FScopeLock Lock(&CallbackCS);
+	OverBudgetCallback = MoveTemp(Callback);
+}
+
+void FSRMemoryTracker::ResetHighWater()
+{
+	for (FSubsystem& Tracked : Subsystems)
+	{
+		Tracked.HighWater = Tracked.Current.Load();
+	}
+}
+
+void FSRMemoryTracker::Log() const
+{
+	UE_LOG(LogTemp, Log, TEXT("Recording memory, %.1f MB in all:"), ToMB(GetTotal()));
+	for (int32 Subsystem = 0; Subsystem < int32(ESRMemory::Num); ++Subsystem)
+	{
+		const FSRMemoryStats Stats = GetStats(ESRMemory(Subsystem));
+		if (Stats.Budget > 0)
+		{
+			UE_LOG(LogTemp, Log, TEXT("  %-12s %8.1f MB  high-water %8.1f MB  budget %8.1f MB"), LexToString(ESRMemory(Subsystem)),
+				ToMB(Stats.Current), ToMB(Stats.HighWater), ToMB(Stats.Budget));
+		}
+		else
+		{
+			UE_LOG(LogTemp, Log, TEXT("  %-12s %8.1f MB  high-water %8.1f MB"), LexToString(ESRMemory(Subsystem)), ToMB(Stats.Current), ToMB(Stats.HighWater));
+		}
+	}
+}
@@ -0,0 +1,114 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRPacketPool.h"
+#include "SRMemoryTracker.h"
+
+uint32 FSRMediaPacket::Release() const
+{
+	const int32 Refs = --NumRefs;
+	check(Refs >= 0);
+	if (Refs == 0)
+	{
+		FSRPacketPool::Get().Recycle(const_cast<FSRMediaPacket*>(this));
+	}
+	return uint32(Refs);
+}
+
+FSRPacketPool& FSRPacketPool::Get()
+{
+	static FSRPacketPool* Pool = new FSRPacketPool();
+	return *Pool;
+}
+
+FSRMutableMediaPacketPtr FSRPacketPool::Acquire(int32 PayloadSize)
+{
+	check(PayloadSize >= 0);
+
+	int32 SizeClass = FMath::Max(int32(FMath::CeilLogTwo(uint32(FMath::Max(PayloadSize, 1)))) - MinSizeClassLog2, 0);
+	if (SizeClass >= NumSizeClasses)
+	{
+		SizeClass = INDEX_NONE;
+	}
+
+	FSRMediaPacket* Packet = SizeClass != INDEX_NONE ? SizeClasses[SizeClass].FreePackets.Pop() : nullptr;
+	if (!Packet)
+	{
+		Packet = new FSRMediaPacket();
+		Packet->SizeClass = SizeClass;
+		Packet->BufferSize = SizeClass != INDEX_NONE ? 1 << (SizeClass + MinSizeClassLog2) : PayloadSize;
+		Packet->Data = static_cast<uint8*>(FMemory::Malloc(FMath::Max(Packet->BufferSize, 1)));
+		++NumPackets;
+		BytesAllocated += Packet->BufferSize;
+		FSRMemoryTracker::Get().Add(ESRMemory::PacketPool, Packet->BufferSize);
+		++NumAllocations;
+	}
+	else
+	{
+		// Back to how a new packet looks
+		Packet->Type = AVEncoder::EPacketType::Video;
+		Packet->Timestamp = FTimespan::Zero();
+		Packet->Duration = FTimespan::Zero();
+		Packet->bKeyFrame = false;
+		Packet->bIsAvcc = false;
+		Packet->Width = 0;
+		Packet->Height = 0;
+		Packet->FrameAvgQP = 0;
+		Packet->Framerate = 0;
+		Packet->CaptureCycles = 0;
+		Packet->PublishCycles = 0;
+	}
+	Packet->Size = PayloadSize;
+
+	++NumAcquired;
+	const int32 InUse = ++NumInUse;
+	int32 CurrentMax = HighWaterMark.Load(EMemoryOrder::Relaxed);
+	while (InUse > CurrentMax && !HighWaterMark.CompareExchange(CurrentMax, InUse))
+	{
+	}
+
+	return FSRMutableMediaPacketPtr(Packet);
+}
+
+void FSRPacketPool::Recycle(FSRMediaPacket* Packet)
+{
+	--NumInUse;
+	if (Packet->SizeClass == INDEX_NONE)
+	{
+		Free(Packet);
+		return;
+	}
+	SizeClasses[Packet->SizeClass].FreePackets.Push(Packet);
+}
+
+void FSRPacketPool::Free(FSRMediaPacket* Packet)
+{
+	--NumPackets;
+	BytesAllocated -= Packet->BufferSize;
+	FSRMemoryTracker::Get().Add(ESRMemory::PacketPool, -Packet->BufferSize);
+	FMemory::Free(Packet->Data);
+	delete Packet;
+}
+
+void FSRPacketPool::Trim()
+{
+	for (FSizeClass& SizeClass : SizeClasses)
+	{
+		while (FSRMediaPacket* Packet = SizeClass.FreePackets.Pop())
+		{
+			Free(Packet);
+		}
+	}
+	HighWaterMark = NumInUse.Load();
+}
+
+FSRPacketPoolStats FSRPacketPool::GetStats() const
+{
+	FSRPacketPoolStats Stats;
+	Stats.NumPackets = NumPackets;
+	Stats.BytesAllocated = BytesAllocated;
+	Stats.HighWaterMark = HighWaterMark;
+	Stats.NumInUse = NumInUse;
+	Stats.NumAcquired = NumAcquired;
+	Stats.NumAllocations = NumAllocations;
+	return Stats;
+}
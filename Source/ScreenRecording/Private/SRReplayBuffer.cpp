@@ -0,0 +1,333 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRReplayBuffer.h"
+#include "SRMemoryTracker.h"
+#include "Async/Async.h"
+#include "Misc/ScopeLock.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+
+CSV_DEFINE_CATEGORY(SRReplayBuffer, true);
+
+FSRReplayBuffer::FSRReplayBuffer(const FSRReplayBufferOptions& InOptions)
+	: Options(InOptions)
+{
+	SlabSize = int64(FMath::Max(Options.SlabSizeMB, 1)) * 1024 * 1024;
+	Slab = static_cast<uint8*>(FMemory::Malloc(SlabSize));
+	Entries.SetNum(FMath::Max(Options.MaxPackets, 64));
+	GopStarts.Reserve(256);
+
+	TrackedBytes = SlabSize + Entries.GetAllocatedSize() + GopStarts.GetAllocatedSize();
+	FSRMemoryTracker::Get().Add(ESRMemory::ReplayBuffer, TrackedBytes);
+}
+
+FSRReplayBuffer::~FSRReplayBuffer()
+{
+	// The save reads straight from the slab
+	if (SaveFuture.IsValid())
+	{
+		SaveFuture.Wait();
+	}
+	FMemory::Free(Slab);
+	FSRMemoryTracker::Get().Add(ESRMemory::ReplayBuffer, -TrackedBytes);
+}
+
+void FSRReplayBuffer::AddPacket(const FSRMediaPacket& Packet)
+{
+	const int32 Size = Packet.Num();
+	const bool bIsVideo = Packet.Type == AVEncoder::EPacketType::Video;
+	const bool bKeyFrame = bIsVideo && Packet.bKeyFrame;
+	if (Size == 0 || (!bIsVideo && Packet.Type != AVEncoder::EPacketType::Audio))
+	{
+		return;
+	}
+
+	FScopeLock Lock(&CS);
+
+	// The buffer has to start with a keyframe
+	if (bKeyFrame)
+	{
+		bWaitForKeyFrame = false;
+	}
+	else if (bWaitForKeyFrame && (bIsVideo || IsEmpty()))
+	{
+		return;
+	}
+
+	if (Size > SlabSize)
+	{
+		++PacketsDropped;
+		bWaitForKeyFrame |= bIsVideo;
+		return;
+	}
+
+	int64 Offset = FindSpace(Size);
+	while (Offset == INDEX_NONE || NextSequence - FirstSequence == Entries.Num())
+	{
+		if (!EvictOldestGop())
+		{
+			// A save is copying the oldest GOP out. Losing new packets is better than stalling the encoder.
+			++PacketsDropped;
+			++PacketsDroppedWhilePinned;
+			bWaitForKeyFrame |= bIsVideo;
+			return;
+		}
+		if (IsEmpty() && !bKeyFrame)
+		{
+			// Evicted the only GOP, and this packet can't start a new one
+			bWaitForKeyFrame = true;
+			return;
+		}
+		Offset = FindSpace(Size);
+	}
+
+	FMemory::Memcpy(Slab + Offset, Packet.GetData(), Size);
+	WriteOffset = Offset + Size;
+
+	if (bKeyFrame)
+	{
+		GopStarts.Add(NextSequence);
+	}
+	FEntry& Entry = GetEntry(NextSequence++);
+	Entry.Offset = Offset;
+	Entry.Size = Size;
+	Entry.Type = Packet.Type;
+	Entry.bKeyFrame = bKeyFrame;
+	Entry.bIsAvcc = Packet.bIsAvcc;
+	Entry.Timestamp = Packet.Timestamp;
+	Entry.Duration = Packet.Duration;
+	Entry.Width = Packet.Width;
+	Entry.Height = Packet.Height;
+
+	TrimToDuration();
+}
+
+int64 FSRReplayBuffer::FindSpace(int32 Size) const
+{
+	if (IsEmpty())
+	{
+		return 0;
+	}
+
+	// Payloads are contiguous, so the free space is either after the newest payload and before the oldest one,
+	// or, once the ring has wrapped around, the gap between them
+	const int64 HeadOffset = GetEntry(FirstSequence).Offset;
+	if (WriteOffset > HeadOffset)
+	{
+		if (SlabSize - WriteOffset >= Size)
+		{
+			return WriteOffset;
+		}
+		if (HeadOffset >= Size)
+		{
+			// The end of the slab is left unused this time around
+			return 0;
+		}
+	}
+	else if (WriteOffset < HeadOffset && HeadOffset - WriteOffset >= Size)
+	{
+		return WriteOffset;
+	}
+	// WriteOffset == HeadOffset means the slab is full
+	return INDEX_NONE;
+}
+
+bool FSRReplayBuffer::EvictOldestGop()
+{
+	if (IsEmpty())
+	{
+		return false;
+	}
+
+	const uint64 End = GopStarts.Num() > 1 ? GopStarts[1] : NextSequence;
+	if (End > PinnedSequence)
+	{
+		return false;
+	}
+
+	GopStarts.RemoveAt(0, 1, false);
+	FirstSequence = End;
+	++GopsEvicted;
+	if (IsEmpty())
+	{
+		WriteOffset = 0;
+	}
+	return true;
+}
+
+void FSRReplayBuffer::TrimToDuration()
+{
+	// Drop the oldest GOP as long as the ones after it still cover MaxSeconds
+	const FTimespan MaxDuration = FTimespan::FromSeconds(Options.MaxSeconds);
+	const FTimespan Newest = GetEntry(NextSequence - 1).Timestamp;
+	while (GopStarts.Num() > 1 && Newest - GetEntry(GopStarts[1]).Timestamp >= MaxDuration)
+	{
+		if (!EvictOldestGop())
+		{
+			break;
+		}
+	}
+}
+
+void FSRReplayBuffer::Reset()
+{
+	FScopeLock Lock(&CS);
+	while (EvictOldestGop())
+	{
+	}
+	bWaitForKeyFrame = true;
+}
+
+bool FSRReplayBuffer::SaveReplay(float Seconds, const FString& FilePath, TFunction<void(bool)> OnCompleted)
+{
+	bool bExpected = false;
+	if (!bSaving.CompareExchange(bExpected, true))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("A replay is already being saved"));
+		return false;
+	}
+
+	uint64 Begin;
+	uint64 End;
+	{
+		FScopeLock Lock(&CS);
+		if (GopStarts.Num() == 0)
+		{
+			bSaving = false;
+			return false;
+		}
+
+		// Nearest keyframe at or before the requested start, or the oldest one if we don't have that much
+		End = NextSequence;
+		const FTimespan Start = GetEntry(End - 1).Timestamp - FTimespan::FromSeconds(FMath::Max(Seconds, 0.0f));
+		Begin = GopStarts[0];
+		for (int32 Index = GopStarts.Num() - 1; Index >= 0; --Index)
+		{
+			if (GetEntry(GopStarts[Index]).Timestamp <= Start)
+			{
+				Begin = GopStarts[Index];
+				break;
+			}
+		}
+
+		// Keep the packets the save copies from being evicted. Newer ones are still added and trimmed as usual.
+		PinnedSequence = Begin;
+		PacketsDroppedWhilePinned = 0;
+	}
+
+	// bSaving was clear, so the previous save no longer touches the buffer and its future can go
+	SaveFuture = Async(EAsyncExecution::ThreadPool, [this, Begin, End, FilePath, OnCompleted = MoveTemp(OnCompleted)]() mutable
+		{
+			WriteReplay(Begin, End, MoveTemp(FilePath), MoveTemp(OnCompleted));
+		});
+	return true;
+}
+
+void FSRReplayBuffer::WriteReplay(uint64 Begin, uint64 End, FString FilePath, TFunction<void(bool)> OnCompleted)
+{
+	CSV_SCOPED_TIMING_STAT(SRReplayBuffer, WriteReplay);
+	const double StartTime = FPlatformTime::Seconds();
+
+	// The replay starts with a keyframe, whose size may not be the one the recording started at
+	AVEncoder::FVideoConfig VideoConfig = Options.VideoConfig;
+	{
+		FScopeLock Lock(&CS);
+		const FEntry& First = GetEntry(Begin);
+		if (First.Type == AVEncoder::EPacketType::Video && First.Width > 0 && First.Height > 0)
+		{
+			VideoConfig.Width = First.Width;
+			VideoConfig.Height = First.Height;
+		}
+	}
+
+	// Copy the packets out first and unpin them, so the buffer only stops evicting for as long as the copy takes
+	// rather than until the file is written
+	TArray<FSRMediaPacketPtr> Packets;
+	Packets.Reserve(static_cast<int32>(End - Begin));
+	{
+		FTimespan FirstTimestamp;
+		for (uint64 Sequence = Begin; Sequence < End; ++Sequence)
+		{
+			FEntry Entry;
+			{
+				// The entry can't be evicted, but the lock makes the encoder thread's writes to it visible here
+				FScopeLock Lock(&CS);
+				Entry = GetEntry(Sequence);
+			}
+			if (Sequence == Begin)
+			{
+				FirstTimestamp = Entry.Timestamp;
+			}
+
+			// Rebase so the file starts at 0. Audio from before the first keyframe can't be played anyway.
+			const FTimespan Timestamp = Entry.Timestamp - FirstTimestamp;
+			if (Timestamp < FTimespan::Zero())
+			{
+				continue;
+			}
+
+			FSRMutableMediaPacketPtr Packet = FSRPacketPool::Get().Acquire(Entry.Size);
+			Packet->Type = Entry.Type;
+			Packet->Timestamp = Timestamp;
+			Packet->Duration = Entry.Duration;
+			Packet->bKeyFrame = Entry.bKeyFrame;
+			Packet->bIsAvcc = Entry.bIsAvcc;
+			Packet->Width = Entry.Width;
+			Packet->Height = Entry.Height;
+			FMemory::Memcpy(Packet->GetData(), Slab + Entry.Offset, Entry.Size);
+			Packets.Add(FSRMediaPacketPtr(Packet.GetReference()));
+		}
+	}
+
+	uint64 DroppedWhilePinned;
+	{
+		FScopeLock Lock(&CS);
+		PinnedSequence = MAX_uint64;
+		DroppedWhilePinned = PacketsDroppedWhilePinned;
+	}
+	if (DroppedWhilePinned > 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Replay buffer full while copying the replay out, %llu packets dropped"), DroppedWhilePinned);
+	}
+
+	FMP4Muxer Muxer;
+	bool bSuccess = Muxer.Initialize(FilePath, VideoConfig, Options.AudioConfig, Options.MuxerOptions);
+	if (bSuccess)
+	{
+		for (const FSRMediaPacketPtr& Packet : Packets)
+		{
+			Muxer.AddPacket(Packet);
+		}
+	}
+	Packets.Empty();
+
+	Muxer.Finalize();
+	bSuccess = bSuccess && Muxer.GetStats().PacketsWritten > 0;
+
+	UE_LOG(LogTemp, Log, TEXT("Saved replay of %llu packets to %s in %.3f s"), End - Begin, *FilePath, FPlatformTime::Seconds() - StartTime);
+
+	if (OnCompleted)
+	{
+		OnCompleted(bSuccess);
+	}
+	// Last, since the next save replaces SaveFuture
+	bSaving = false;
+}
+
+FSRReplayBufferStats FSRReplayBuffer::GetStats() const
+{
+	FScopeLock Lock(&CS);
+
+	FSRReplayBufferStats Stats;
+	Stats.NumPackets = static_cast<int32>(NextSequence - FirstSequence);
+	Stats.NumGops = GopStarts.Num();
+	Stats.SlabSize = SlabSize;
+	Stats.GopsEvicted = GopsEvicted;
+	Stats.PacketsDropped = PacketsDropped;
+	if (!IsEmpty())
+	{
+		const int64 HeadOffset = GetEntry(FirstSequence).Offset;
+		Stats.BytesUsed = WriteOffset > HeadOffset ? WriteOffset - HeadOffset : SlabSize - HeadOffset + WriteOffset;
+		Stats.BufferedSeconds = (GetEntry(NextSequence - 1).Timestamp - GetEntry(FirstSequence).Timestamp).GetTotalSeconds();
+	}
+	return Stats;
+}
@@ -0,0 +1,101 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRSimd.h"
+
+#if PLATFORM_CPU_X86_FAMILY
+	#if defined(_MSC_VER) && !defined(__clang__)
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+#endif
+
+namespace SRSimd
+{
+#if PLATFORM_CPU_X86_FAMILY
+	namespace
+	{
+		bool DetectAVX2()
+		{
+			// AVX2 needs the CPU feature and an OS that saves the YMM registers
+			uint32 Leaf1[4] = {};
+			uint32 Leaf7[4] = {};
+#if defined(_MSC_VER) && !defined(__clang__)
+			int32 Info[4];
+			__cpuid(Info, 0);
+			if (Info[0] < 7)
+			{
+				return false;
+			}
+			__cpuid(Info, 1);
+			FMemory::Memcpy(Leaf1, Info, sizeof(Leaf1));
+			__cpuidex(Info, 7, 0);
+			FMemory::Memcpy(Leaf7, Info, sizeof(Leaf7));
+#else
+			if (__get_cpuid_max(0, nullptr) < 7)
+			{
+				return false;
+			}
+			__get_cpuid(1, &Leaf1[0], &Leaf1[1], &Leaf1[2], &Leaf1[3]);
+			__get_cpuid_count(7, 0, &Leaf7[0], &Leaf7[1], &Leaf7[2], &Leaf7[3]);
+#endif
+			const bool bOSXSave = (Leaf1[2] & (1u << 27)) != 0;
+			const bool bAVX = (Leaf1[2] & (1u << 28)) != 0;
+			const bool bAVX2 = (Leaf7[1] & (1u << 5)) != 0;
+			if (!bOSXSave || !bAVX || !bAVX2)
+			{
+				return false;
+			}
+
+#if defined(_MSC_VER) && !defined(__clang__)
+			const uint64 XCR0 = _xgetbv(0);
+#else
+			uint32 XCR0Low, XCR0High;
+			__asm__("xgetbv" : "=a"(XCR0Low), "=d"(XCR0High) : "c"(0));
+			const uint64 XCR0 = (uint64(XCR0High) << 32) | XCR0Low;
+#endif
+			// XMM and YMM state
+			return (XCR0 & 0x6) == 0x6;
+		}
+	}
+#endif
+
+	EKernel GetBestKernel()
+	{
+#if PLATFORM_CPU_X86_FAMILY
+		static const EKernel Best = DetectAVX2() ? EKernel::AVX2 : EKernel::SSE2;
+		return Best;
+#elif SR_WITH_NEON
+		return EKernel::NEON;
+#else
+		return EKernel::Scalar;
+#endif
+	}
+
+	bool IsKernelSupported(EKernel Kernel)
+	{
+		switch (Kernel)
+		{
+		case EKernel::Scalar: return true;
+#if PLATFORM_CPU_X86_FAMILY
+		case EKernel::SSE2: return true;
+		case EKernel::AVX2: return GetBestKernel() == EKernel::AVX2;
+#elif SR_WITH_NEON
+		case EKernel::NEON: return true;
+#endif
+		default: return false;
+		}
+	}
+
+	const TCHAR* LexToString(EKernel Kernel)
+	{
+		switch (Kernel)
+		{
+		case EKernel::Scalar: return TEXT("Scalar");
+		case EKernel::SSE2: return TEXT("SSE2");
+		case EKernel::AVX2: return TEXT("AVX2");
+		case EKernel::NEON: return TEXT("NEON");
+		default: return TEXT("Unknown");
+		}
+	}
+}
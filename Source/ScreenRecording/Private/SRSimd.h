@@ -0,0 +1,43 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#if PLATFORM_CPU_X86_FAMILY
+	#include <immintrin.h>
+	#if defined(_MSC_VER) && !defined(__clang__)
+		// MSVC compiles AVX2 intrinsics anywhere, the functions just must not run on older CPUs
+		#define SR_TARGET_AVX2
+	#else
+		#define SR_TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#elif PLATFORM_CPU_ARM_FAMILY && PLATFORM_ENABLE_VECTORINTRINSICS_NEON && PLATFORM_64BITS
+	#include <arm_neon.h>
+	#define SR_WITH_NEON 1
+#endif
+
+#ifndef SR_WITH_NEON
+	#define SR_WITH_NEON 0
+#endif
+
+//
+// Runtime instruction set dispatch shared by the audio and video conversion kernels. SSE2 is part of x86-64, AVX2 is
+// detected, NEON is part of arm64.
+//
+namespace SRSimd
+{
+	/** Instruction sets the conversions have kernels for. */
+	enum class EKernel : uint8
+	{
+		Scalar,
+		SSE2,
+		AVX2,
+		NEON,
+	};
+
+	/** The fastest kernel this CPU can run, detected once at first use. */
+	EKernel GetBestKernel();
+	bool IsKernelSupported(EKernel Kernel);
+	const TCHAR* LexToString(EKernel Kernel);
+}
@@ -0,0 +1,272 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRStats.h"
+#include "HAL/IConsoleManager.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+
+CSV_DEFINE_CATEGORY(SRStats, true);
+
+namespace
+{
+	// The CSV profiler keys custom stats by pointer, so these have to stay the same literals
+	const char* const StageCsvNames[] = { "CaptureMs", "QueueMs", "EncodeMs", "SinkMs", "MuxMs", "WriteMs", "EndToEndMs" };
+	const char* const CounterCsvNames[] = { "FramesCaptured", "FramesDropped", "FramesRepeated", "VideoPackets", "AudioPackets", "BytesEncoded",
+		"SinkPacketsDropped", "BytesMuxed", "MuxPacketsDropped", "BytesWritten" };
+	static_assert(UE_ARRAY_COUNT(StageCsvNames) == int32(ESRStage::Num), "One CSV stat per stage");
+	static_assert(UE_ARRAY_COUNT(CounterCsvNames) == int32(ESRCounter::Num), "One CSV stat per counter");
+
+	void AtomicMax(TAtomic<uint64>& Target, uint64 Value)
+	{
+		uint64 Current = Target.Load(EMemoryOrder::Relaxed);
+		while (Value > Current && !Target.CompareExchange(Current, Value))
+		{
+		}
+	}
+}
+
+FAutoConsoleCommand SRStatsCommand(TEXT("SR.Stats"), TEXT("Logs the latency of each stage of the recording pipeline, its counters and queue depths. SR.Stats reset starts over."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			FSRStats::Get().Reset();
+			return;
+		}
+		FSRStats::Get().Log();
+	}));
+
+const TCHAR* LexToString(ESRStage Stage)
+{
+	switch (Stage)
+	{
+	case ESRStage::Capture: return TEXT("Capture");
+	case ESRStage::Queue: return TEXT("Queue");
+	case ESRStage::Encode: return TEXT("Encode");
+	case ESRStage::Sink: return TEXT("Sink");
+	case ESRStage::Mux: return TEXT("Mux");
+	case ESRStage::Write: return TEXT("Write");
+	case ESRStage::EndToEnd: return TEXT("EndToEnd");
+	default: return TEXT("Unknown");
+	}
+}
+
+const TCHAR* LexToString(ESRCounter Counter)
+{
+	switch (Counter)
+	{
+	case ESRCounter::FramesCaptured: return TEXT("FramesCaptured");
+	case ESRCounter::FramesDropped: return TEXT("FramesDropped");
+	case ESRCounter::FramesRepeated: return TEXT("FramesRepeated");
+	case ESRCounter::VideoPackets: return TEXT("VideoPackets");
+	case ESRCounter::AudioPackets: return TEXT("AudioPackets");
+	case ESRCounter::BytesEncoded: return TEXT("BytesEncoded");
+	case ESRCounter::SinkPacketsDropped: return TEXT("SinkPacketsDropped");
+	case ESRCounter::BytesMuxed: return TEXT("BytesMuxed");
+	case ESRCounter::MuxPacketsDropped: return TEXT("MuxPacketsDropped");
+	case ESRCounter::BytesWritten: return TEXT("BytesWritten");
+	default: return TEXT("Unknown");
+	}
+}
+
+const TCHAR* LexToString(ESRQueue Queue)
+{
+	switch (Queue)
+	{
+	case ESRQueue::Video: return TEXT("Video");
+	case ESRQueue::Sink: return TEXT("Sink");
+	case ESRQueue::Mux: return TEXT("Mux");
+	default: return TEXT("Unknown");
+	}
+}
+
+int32 FSRLatencyHistogram::GetBucket(uint64 Microseconds)
+{
+	if (Microseconds < NumSubBuckets)
+	{
+		return int32(Microseconds);
+	}
+
+	// The top SubBucketBits bits below the leading one pick the bucket within its power of two
+	const int32 Shift = int32(FMath::FloorLog2_64(Microseconds)) - SubBucketBits;
+	const int32 Bucket = NumSubBuckets * (Shift + 1) + int32(Microseconds >> Shift) - NumSubBuckets;
+	return FMath::Min(Bucket, NumBuckets - 1);
+}
+
+uint64 FSRLatencyHistogram::GetBucketMax(int32 Bucket)
+{
+	if (Bucket < NumSubBuckets)
+	{
+		return uint64(Bucket);
+	}
+
+	const int32 Shift = Bucket / NumSubBuckets - 1;
+	const uint64 Low = uint64(NumSubBuckets + Bucket % NumSubBuckets) << Shift;
+	return Low + (uint64(1) << Shift) - 1;
+}
+
+void FSRLatencyHistogram::Record(uint64 Microseconds)
+{
+	Buckets[GetBucket(Microseconds)].IncrementExchange();
+	Count.IncrementExchange();
+	Sum.AddExchange(Microseconds);
+	AtomicMax(Max, Microseconds);
+}
+
+void FSRLatencyHistogram::Reset()
+{
+	for (TAtomic<uint64>& Bucket : Buckets)
+	{
+		Bucket = 0;
+	}
+	Count = 0;
+	Sum = 0;
+	Max = 0;
+}
+
+FSRLatencyStats FSRLatencyHistogram::GetStats() const
+{
+	// Recording goes on while this reads, so the buckets are summed up rather than trusting Count
+	uint64 Counts[NumBuckets];
+	uint64 Total = 0;
+	for (int32 Bucket = 0; Bucket < NumBuckets; ++Bucket)
+	{
+		Counts[Bucket] = Buckets[Bucket].Load(EMemoryOrder::Relaxed);
+		Total += Counts[Bucket];
+	}
+
+	FSRLatencyStats Stats;
+	Stats.Count = Total;
+	if (Total == 0)
+	{
+		return Stats;
+	}
+	Stats.Max = double(Max.Load());
+	Stats.Mean = double(Sum.Load()) / FMath::Max<uint64>(Count.Load(), 1);
+
+	auto GetPercentile = [&Counts, Total, &Stats](double Fraction)
+	{
+		const uint64 Rank = FMath::Max<uint64>(uint64(FMath::CeilToDouble(Fraction * Total)), 1);
+		uint64 Seen = 0;
+		for (int32 Bucket = 0; Bucket < NumBuckets; ++Bucket)
+		{
+			Seen += Counts[Bucket];
+			if (Seen >= Rank)
+			{
+				return FMath::Min(double(GetBucketMax(Bucket)), Stats.Max);
+			}
+		}
+		return Stats.Max;
+	};
+	Stats.P50 = GetPercentile(0.5);
+	Stats.P99 = GetPercentile(0.99);
+	Stats.P999 = GetPercentile(0.999);
+	return Stats;
+}
+
+FSRStats& FSRStats::Get()
+{
+	// Never destroyed, the threads that record can outlive the module's shutdown order
+	static FSRStats* Stats = new FSRStats();
+	return *Stats;
+}
+
+FSRStats::FSRStats()
+{
+	Reset();
+}
+
+void FSRStats::RecordLatency(ESRStage Stage, uint64 StartCycles, uint64 EndCycles)
+{
+	if (StartCycles == 0 || EndCycles < StartCycles)
+	{
+		return;
+	}
+
+	const double Seconds = FPlatformTime::ToSeconds64(EndCycles - StartCycles);
+	Stages[int32(Stage)].Record(uint64(Seconds * 1000000.0));
+#if CSV_PROFILER
+	FCsvProfiler::RecordCustomStat(StageCsvNames[int32(Stage)], CSV_CATEGORY_INDEX(SRStats), float(Seconds * 1000.0), ECsvCustomStatOp::Max);
+#endif
+}
+
+void FSRStats::Add(ESRCounter Counter, uint64 Value)
+{
+	Counters[int32(Counter)].AddExchange(Value);
+#if CSV_PROFILER
+	FCsvProfiler::RecordCustomStat(CounterCsvNames[int32(Counter)], CSV_CATEGORY_INDEX(SRStats), float(Value), ECsvCustomStatOp::Accumulate);
+#endif
+}
+
+void FSRStats::SetQueueDepth(ESRQueue Queue, int32 Depth)
+{
+	QueueDepths[int32(Queue)].Store(Depth, EMemoryOrder::Relaxed);
+	TAtomic<int32>& MaxDepth = MaxQueueDepths[int32(Queue)];
+	int32 Current = MaxDepth.Load(EMemoryOrder::Relaxed);
+	while (Depth > Current && !MaxDepth.CompareExchange(Current, Depth))
+	{
+	}
+}
+
+FSRStatsSnapshot FSRStats::GetSnapshot() const
+{
+	FSRStatsSnapshot Snapshot;
+	for (int32 Stage = 0; Stage < int32(ESRStage::Num); ++Stage)
+	{
+		Snapshot.Stages[Stage] = Stages[Stage].GetStats();
+	}
+	for (int32 Counter = 0; Counter < int32(ESRCounter::Num); ++Counter)
+	{
+		Snapshot.Counters[Counter] = Counters[Counter].Load(EMemoryOrder::Relaxed);
+	}
+	for (int32 Queue = 0; Queue < int32(ESRQueue::Num); ++Queue)
+	{
+		Snapshot.Queues[Queue].Depth = QueueDepths[Queue].Load(EMemoryOrder::Relaxed);
+		Snapshot.Queues[Queue].MaxDepth = MaxQueueDepths[Queue].Load(EMemoryOrder::Relaxed);
+	}
+	Snapshot.Seconds = FPlatformTime::ToSeconds64(FPlatformTime::Cycles64() - ResetCycles.Load());
+	return Snapshot;
+}
+
+void FSRStats::Reset()
+{
+	for (FSRLatencyHistogram& Stage : Stages)
+	{
+		Stage.Reset();
+	}
+	for (TAtomic<uint64>& Counter : Counters)
+	{
+		Counter = 0;
+	}
+	for (int32 Queue = 0; Queue < int32(ESRQueue::Num); ++Queue)
+	{
+		QueueDepths[Queue] = 0;
+		MaxQueueDepths[Queue] = 0;
+	}
+	ResetCycles = FPlatformTime::Cycles64();
+}
+
+void FSRStats::Log() const
+{
+	const FSRStatsSnapshot Snapshot = GetSnapshot();
+	UE_LOG(LogTemp, Log, TEXT("Recording pipeline over the last %.1f s, in ms:"), Snapshot.Seconds);
+	for (int32 Stage = 0; Stage < int32(ESRStage::Num); ++Stage)
+	{
+		const FSRLatencyStats& Stats = Snapshot.Stages[Stage];
+		UE_LOG(LogTemp, Log, TEXT("  %-9s %8llu  mean %8.2f  p50 %8.2f  p99 %8.2f  p999 %8.2f  max %8.2f"), LexToString(ESRStage(Stage)), Stats.Count,
+			Stats.Mean / 1000.0, Stats.P50 / 1000.0, Stats.P99 / 1000.0, Stats.P999 / 1000.0, Stats.Max / 1000.0);
+	}
+
+	FString Counters;
+	for (int32 Counter = 0; Counter < int32(ESRCounter::Num); ++Counter)
+	{
+		Counters += FString::Printf(TEXT(" %s %llu"), LexToString(ESRCounter(Counter)), Snapshot.Counters[Counter]);
+	}
+	UE_LOG(LogTemp, Log, TEXT(" %s"), *Counters);
+
+	FString Queues;
+	for (int32 Queue = 0; Queue < int32(ESRQueue::Num); ++Queue)
+	{
+		Queues += FString::Printf(TEXT(" %s %d (max %d)"), LexToString(ESRQueue(Queue)), Snapshot.Queues[Queue].Depth, Snapshot.Queues[Queue].MaxDepth);
+	}
+	UE_LOG(LogTemp, Log, TEXT("  Queue depths:%s"), *Queues);
+}
@@ -0,0 +1,593 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRVideoConvert.h"
+#include "Async/ParallelFor.h"
+#include "Async/TaskGraphInterfaces.h"
+
+extern "C" {
+#include "libswscale/swscale.h"
+#include "libavutil/pixfmt.h"
+}
+
+namespace SRVideo
+{
+	namespace
+	{
+		// Fewer rows per band than this and waking the workers costs more than it saves
+		constexpr int32 MinRowPairsPerBand = 16;
+
+		/**
+		 * BT.709 in fixed point, by byte of the source pixel: 0, 1 and 2 are B, G and R for BGRA, R, G and B for RGBA.
+		 * Luma has 8 fractional bits. Chroma has 10, because it is computed from the sums of 2x2 blocks. The offsets and
+		 * the rounding are in the biases. Each row of chroma coefficients sums to zero, so grey stays grey.
+		 */
+		struct FCoefficients
+		{
+			int16 Y0, Y1, Y2;
+			int32 YBias;
+			int16 U0, U1, U2;
+			int16 V0, V1, V2;
+			int32 ChromaBias;
+		};
+
+		constexpr FCoefficients LimitedRangeBGRA{ 16, 157, 47, (16 << 8) + 128, 112, -86, -26, -10, -102, 112, (128 << 10) + 512 };
+		constexpr FCoefficients LimitedRangeRGBA{ 47, 157, 16, (16 << 8) + 128, -26, -86, 112, 112, -102, -10, (128 << 10) + 512 };
+		// The luma coefficients sum to 256, so white comes out as 255
+		constexpr FCoefficients FullRangeBGRA{ 19, 183, 54, 128, 128, -99, -29, -12, -116, 128, (128 << 10) + 512 };
+		constexpr FCoefficients FullRangeRGBA{ 54, 183, 19, 128, -29, -99, 128, 128, -116, -12, (128 << 10) + 512 };
+
+		const FCoefficients& GetCoefficients(ESRPixelFormat Format, EColorRange Range)
+		{
+			const bool bBGRA = Format == ESRPixelFormat::BGRA8;
+			if(Range == EColorRange::Full)
+			{
+				return bBGRA ? FullRangeBGRA : FullRangeRGBA;
+			}
+			return bBGRA ? LimitedRangeBGRA : LimitedRangeRGBA;
+		}
+
+		// Two rows of pixels to two rows of luma and one of chroma. V is null for NV12, where U takes both.
+		using FRowPairKernel = void (*)(const uint8* Row0, const uint8* Row1, int32 Width, uint8* Y0, uint8* Y1, uint8* U, uint8* V, const FCoefficients& C);
+		// FactorY rows of the source to one row of Width pixels, each the average of a FactorX by FactorY block
+		using FDownscaleKernel = void (*)(const uint8* Src, int32 SrcStride, int32 FactorX, int32 FactorY, int32 Width, uint8* Dst);
+
+		FORCEINLINE uint8 PixelToY(const FCoefficients& C, const uint8* Pixel)
+		{
+			return static_cast<uint8>((C.Y0 * Pixel[0] + C.Y1 * Pixel[1] + C.Y2 * Pixel[2] + C.YBias) >> 8);
+		}
+
+		FORCEINLINE uint8 SumToChroma(int32 C0, int32 C1, int32 C2, int32 Bias, int32 Sum0, int32 Sum1, int32 Sum2)
+		{
+			// Full range chroma overshoots by one for saturated colors
+			return static_cast<uint8>(FMath::Clamp((C0 * Sum0 + C1 * Sum1 + C2 * Sum2 + Bias) >> 10, 0, 255));
+		}
+
+		// Also finishes the columns the SIMD kernels leave over
+		template<bool bInterleaved>
+		void RowPairScalarFrom(int32 Begin, const uint8* Row0, const uint8* Row1, int32 Width, uint8* Y0, uint8* Y1, uint8* U, uint8* V, const FCoefficients& C)
+		{
+			for(int32 X = Begin; X < Width; X += 2)
+			{
+				const uint8* P00 = Row0 + X * 4;
+				const uint8* P01 = P00 + 4;
+				const uint8* P10 = Row1 + X * 4;
+				const uint8* P11 = P10 + 4;
+
+				Y0[X] = PixelToY(C, P00);
+				Y0[X + 1] = PixelToY(C, P01);
+				Y1[X] = PixelToY(C, P10);
+				Y1[X + 1] = PixelToY(C, P11);
+
+				const int32 Sum0 = P00[0] + P01[0] + P10[0] + P11[0];
+				const int32 Sum1 = P00[1] + P01[1] + P10[1] + P11[1];
+				const int32 Sum2 = P00[2] + P01[2] + P10[2] + P11[2];
+				const uint8 Cb = SumToChroma(C.U0, C.U1, C.U2, C.ChromaBias, Sum0, Sum1, Sum2);
+				const uint8 Cr = SumToChroma(C.V0, C.V1, C.V2, C.ChromaBias, Sum0, Sum1, Sum2);
+				if(bInterleaved)
+				{
+					U[X] = Cb;
+					U[X + 1] = Cr;
+				}
+				else
+				{
+					U[X / 2] = Cb;
+					V[X / 2] = Cr;
+				}
+			}
+		}
+
+		template<bool bInterleaved>
+		void RowPairScalar(const uint8* Row0, const uint8* Row1, int32 Width, uint8* Y0, uint8* Y1, uint8* U, uint8* V, const FCoefficients& C)
+		{
+			RowPairScalarFrom<bInterleaved>(0, Row0, Row1, Width, Y0, Y1, U, V, C);
+		}
+
+		void DownscaleScalar(const uint8* Src, int32 SrcStride, int32 FactorX, int32 FactorY, int32 Width, uint8* Dst)
+		{
+			const uint32 Area = FactorX * FactorY;
+			for(int32 X = 0; X < Width; ++X)
+			{
+				uint32 Sum[4] = { 0, 0, 0, 0 };
+				for(int32 Row = 0; Row < FactorY; ++Row)
+				{
+					const uint8* Pixel = Src + Row * SrcStride + X * FactorX * 4;
+					for(int32 Column = 0; Column < FactorX; ++Column, Pixel += 4)
+					{
+						Sum[0] += Pixel[0];
+						Sum[1] += Pixel[1];
+						Sum[2] += Pixel[2];
+						Sum[3] += Pixel[3];
+					}
+				}
+				for(int32 Channel = 0; Channel < 4; ++Channel)
+				{
+					Dst[X * 4 + Channel] = static_cast<uint8>((Sum[Channel] + Area / 2) / Area);
+				}
+			}
+		}
+
+#if PLATFORM_CPU_X86_FAMILY
+		// The coefficients laid out for the SIMD kernels: luma as unsigned 16-bit lanes, chroma as pairs for madd
+		struct FCoefficientsSSE2
+		{
+			explicit FCoefficientsSSE2(const FCoefficients& C)
+				: Y0(_mm_set1_epi16(C.Y0))
+				, Y1(_mm_set1_epi16(C.Y1))
+				, Y2(_mm_set1_epi16(C.Y2))
+				, YBias(_mm_set1_epi16(static_cast<int16>(C.YBias)))
+				, U01(_mm_set1_epi32(Pair(C.U0, C.U1)))
+				, U2(_mm_set1_epi32(Pair(C.U2, 0)))
+				, V01(_mm_set1_epi32(Pair(C.V0, C.V1)))
+				, V2(_mm_set1_epi32(Pair(C.V2, 0)))
+				, ChromaBias(_mm_set1_epi32(C.ChromaBias))
+			{
+			}
+
+			static int32 Pair(int16 Low, int16 High)
+			{
+				return static_cast<int32>(uint32(uint16(Low)) | (uint32(uint16(High)) << 16));
+			}
+
+			__m128i Y0, Y1, Y2, YBias;
+			__m128i U01, U2, V01, V2, ChromaBias;
+		};
+
+		// 8 pixels to 8 16-bit lanes of each of their first three bytes
+		FORCEINLINE void DeinterleaveSSE2(__m128i P0, __m128i P1, __m128i& C0, __m128i& C1, __m128i& C2)
+		{
+			const __m128i LowByte = _mm_set1_epi16(0x00FF);
+			const __m128i LowWord = _mm_set1_epi32(0x0000FFFF);
+			const __m128i Even0 = _mm_and_si128(P0, LowByte);
+			const __m128i Even1 = _mm_and_si128(P1, LowByte);
+			const __m128i Odd0 = _mm_srli_epi16(P0, 8);
+			const __m128i Odd1 = _mm_srli_epi16(P1, 8);
+			C0 = _mm_packs_epi32(_mm_and_si128(Even0, LowWord), _mm_and_si128(Even1, LowWord));
+			C1 = _mm_packs_epi32(_mm_and_si128(Odd0, LowWord), _mm_and_si128(Odd1, LowWord));
+			C2 = _mm_packs_epi32(_mm_srli_epi32(Even0, 16), _mm_srli_epi32(Even1, 16));
+		}
+
+		FORCEINLINE __m128i LumaSSE2(__m128i C0, __m128i C1, __m128i C2, const FCoefficientsSSE2& K)
+		{
+			// Unsigned 16-bit math is enough: the largest sum, 255 * 256 + bias, still fits
+			const __m128i Sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(C0, K.Y0), _mm_mullo_epi16(C1, K.Y1)), _mm_add_epi16(_mm_mullo_epi16(C2, K.Y2), K.YBias));
+			return _mm_srli_epi16(Sum, 8);
+		}
+
+		// Sums of 2x2 blocks are at most 1020, in the low half of 32-bit lanes, so madd against a (coefficient, 0) pair multiplies them
+		FORCEINLINE __m128i ChromaSSE2(__m128i Sum0, __m128i Sum1, __m128i Sum2, __m128i K01, __m128i K2, __m128i Bias)
+		{
+			const __m128i Sum01 = _mm_or_si128(Sum0, _mm_slli_epi32(Sum1, 16));
+			const __m128i Dot = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(Sum01, K01), _mm_madd_epi16(Sum2, K2)), Bias);
+			return _mm_srai_epi32(Dot, 10);
+		}
+
+		template<bool bInterleaved>
+		void RowPairSSE2(const uint8* Row0, const uint8* Row1, int32 Width, uint8* Y0, uint8* Y1, uint8* U, uint8* V, const FCoefficients& C)
+		{
+			const FCoefficientsSSE2 K(C);
+			const __m128i Ones = _mm_set1_epi16(1);
+
+			int32 X = 0;
+			for(; X + 8 <= Width; X += 8)
+			{
+				__m128i A0, A1, A2, B0, B1, B2;
+				DeinterleaveSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Row0 + X * 4)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(Row0 + X * 4 + 16)), A0, A1, A2);
+				DeinterleaveSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Row1 + X * 4)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(Row1 + X * 4 + 16)), B0, B1, B2);
+
+				const __m128i Luma = _mm_packus_epi16(LumaSSE2(A0, A1, A2, K), LumaSSE2(B0, B1, B2, K));
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(Y0 + X), Luma);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(Y1 + X), _mm_srli_si128(Luma, 8));
+
+				// Vertical pairs in 16 bits, then horizontal pairs into 32 bits
+				const __m128i Sum0 = _mm_madd_epi16(_mm_add_epi16(A0, B0), Ones);
+				const __m128i Sum1 = _mm_madd_epi16(_mm_add_epi16(A1, B1), Ones);
+				const __m128i Sum2 = _mm_madd_epi16(_mm_add_epi16(A2, B2), Ones);
+				const __m128i Cb = ChromaSSE2(Sum0, Sum1, Sum2, K.U01, K.U2, K.ChromaBias);
+				const __m128i Cr = ChromaSSE2(Sum0, Sum1, Sum2, K.V01, K.V2, K.ChromaBias);
+
+				// 4 U then 4 V, saturated to bytes
+				const __m128i Chroma = _mm_packus_epi16(_mm_packs_epi32(Cb, Cr), _mm_setzero_si128());
+				if(bInterleaved)
+				{
+					_mm_storel_epi64(reinterpret_cast<__m128i*>(U + X), _mm_unpacklo_epi8(Chroma, _mm_srli_si128(Chroma, 4)));
+				}
+				else
+				{
+					const int32 UBytes = _mm_cvtsi128_si32(Chroma);
+					const int32 VBytes = _mm_cvtsi128_si32(_mm_srli_si128(Chroma, 4));
+					FMemory::Memcpy(U + X / 2, &UBytes, sizeof(UBytes));
+					FMemory::Memcpy(V + X / 2, &VBytes, sizeof(VBytes));
+				}
+			}
+			RowPairScalarFrom<bInterleaved>(X, Row0, Row1, Width, Y0, Y1, U, V, C);
+		}
+
+		void Downscale2x2SSE2(const uint8* Src, int32 SrcStride, int32 FactorX, int32 FactorY, int32 Width, uint8* Dst)
+		{
+			checkSlow(FactorX == 2 && FactorY == 2);
+			const __m128i Zero = _mm_setzero_si128();
+			const __m128i Two = _mm_set1_epi16(2);
+
+			int32 X = 0;
+			for(; X + 4 <= Width; X += 4)
+			{
+				const uint8* Top = Src + X * 8;
+				const uint8* Bottom = Top + SrcStride;
+				const __m128i T0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Top));
+				const __m128i T1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Top + 16));
+				const __m128i B0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Bottom));
+				const __m128i B1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Bottom + 16));
+
+				// Vertical sums of source pixels 0 and 1, 2 and 3, and so on, 16 bits per channel
+				const __m128i S01 = _mm_add_epi16(_mm_unpacklo_epi8(T0, Zero), _mm_unpacklo_epi8(B0, Zero));
+				const __m128i S23 = _mm_add_epi16(_mm_unpackhi_epi8(T0, Zero), _mm_unpackhi_epi8(B0, Zero));
+				const __m128i S45 = _mm_add_epi16(_mm_unpacklo_epi8(T1, Zero), _mm_unpacklo_epi8(B1, Zero));
+				const __m128i S67 = _mm_add_epi16(_mm_unpackhi_epi8(T1, Zero), _mm_unpackhi_epi8(B1, Zero));
+
+				// Then the horizontal neighbours: [0 + 1, 2 + 3] and [4 + 5, 6 + 7]
+				const __m128i Q0 = _mm_add_epi16(_mm_unpacklo_epi64(S01, S23), _mm_unpackhi_epi64(S01, S23));
+				const __m128i Q1 = _mm_add_epi16(_mm_unpacklo_epi64(S45, S67), _mm_unpackhi_epi64(S45, S67));
+				const __m128i Average = _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(Q0, Two), 2), _mm_srli_epi16(_mm_add_epi16(Q1, Two), 2));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + X * 4), Average);
+			}
+			DownscaleScalar(Src + X * 8, SrcStride, 2, 2, Width - X, Dst + X * 4);
+		}
+
+		struct FCoefficientsAVX2
+		{
+			SR_TARGET_AVX2 explicit FCoefficientsAVX2(const FCoefficients& C)
+				: Y0(_mm256_set1_epi16(C.Y0))
+				, Y1(_mm256_set1_epi16(C.Y1))
+				, Y2(_mm256_set1_epi16(C.Y2))
+				, YBias(_mm256_set1_epi16(static_cast<int16>(C.YBias)))
+				, U01(_mm256_set1_epi32(FCoefficientsSSE2::Pair(C.U0, C.U1)))
+				, U2(_mm256_set1_epi32(FCoefficientsSSE2::Pair(C.U2, 0)))
+				, V01(_mm256_set1_epi32(FCoefficientsSSE2::Pair(C.V0, C.V1)))
+				, V2(_mm256_set1_epi32(FCoefficientsSSE2::Pair(C.V2, 0)))
+				, ChromaBias(_mm256_set1_epi32(C.ChromaBias))
+			{
+			}
+
+			__m256i Y0, Y1, Y2, YBias;
+			__m256i U01, U2, V01, V2, ChromaBias;
+		};
+
+		// Same as the SSE2 version on 16 pixels. The packs work per 128-bit lane, so the lanes hold pixels 0-3, 8-11, 4-7, 12-15.
+		SR_TARGET_AVX2 FORCEINLINE void DeinterleaveAVX2(__m256i P0, __m256i P1, __m256i& C0, __m256i& C1, __m256i& C2)
+		{
+			const __m256i LowByte = _mm256_set1_epi16(0x00FF);
+			const __m256i LowWord = _mm256_set1_epi32(0x0000FFFF);
+			const __m256i Even0 = _mm256_and_si256(P0, LowByte);
+			const __m256i Even1 = _mm256_and_si256(P1, LowByte);
+			const __m256i Odd0 = _mm256_srli_epi16(P0, 8);
+			const __m256i Odd1 = _mm256_srli_epi16(P1, 8);
+			C0 = _mm256_packs_epi32(_mm256_and_si256(Even0, LowWord), _mm256_and_si256(Even1, LowWord));
+			C1 = _mm256_packs_epi32(_mm256_and_si256(Odd0, LowWord), _mm256_and_si256(Odd1, LowWord));
+			C2 = _mm256_packs_epi32(_mm256_srli_epi32(Even0, 16), _mm256_srli_epi32(Even1, 16));
+		}
+
+		SR_TARGET_AVX2 FORCEINLINE __m256i LumaAVX2(__m256i C0, __m256i C1, __m256i C2, const FCoefficientsAVX2& K)
+		{
+			const __m256i Sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(C0, K.Y0), _mm256_mullo_epi16(C1, K.Y1)), _mm256_add_epi16(_mm256_mullo_epi16(C2, K.Y2), K.YBias));
+			return _mm256_srli_epi16(Sum, 8);
+		}
+
+		SR_TARGET_AVX2 FORCEINLINE __m256i ChromaAVX2(__m256i Sum0, __m256i Sum1, __m256i Sum2, __m256i K01, __m256i K2, __m256i Bias)
+		{
+			const __m256i Sum01 = _mm256_or_si256(Sum0, _mm256_slli_epi32(Sum1, 16));
+			const __m256i Dot = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(Sum01, K01), _mm256_madd_epi16(Sum2, K2)), Bias);
+			// Blocks come out as 0, 1, 4, 5, 2, 3, 6, 7, swapping the middle 64 bits puts them in order
+			return _mm256_permute4x64_epi64(_mm256_srai_epi32(Dot, 10), _MM_SHUFFLE(3, 1, 2, 0));
+		}
+
+		template<bool bInterleaved>
+		SR_TARGET_AVX2 void RowPairAVX2(const uint8* Row0, const uint8* Row1, int32 Width, uint8* Y0, uint8* Y1, uint8* U, uint8* V, const FCoefficients& C)
+		{
+			const FCoefficientsAVX2 K(C);
+			const __m256i Ones = _mm256_set1_epi16(1);
+			// Luma bytes come out as 32-bit groups of row 0 pixels 0-3, 8-11, row 1 0-3, 8-11, row 0 4-7, 12-15, row 1 4-7, 12-15
+			const __m256i LumaOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+			int32 X = 0;
+			for(; X + 16 <= Width; X += 16)
+			{
+				__m256i A0, A1, A2, B0, B1, B2;
+				DeinterleaveAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(Row0 + X * 4)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Row0 + X * 4 + 32)), A0, A1, A2);
+				DeinterleaveAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(Row1 + X * 4)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Row1 + X * 4 + 32)), B0, B1, B2);
+
+				const __m256i Luma = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(LumaAVX2(A0, A1, A2, K), LumaAVX2(B0, B1, B2, K)), LumaOrder);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(Y0 + X), _mm256_castsi256_si128(Luma));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(Y1 + X), _mm256_extracti128_si256(Luma, 1));
+
+				// Horizontal pairs never straddle the pixel groups, so the sums only need reordering at the end
+				const __m256i Sum0 = _mm256_madd_epi16(_mm256_add_epi16(A0, B0), Ones);
+				const __m256i Sum1 = _mm256_madd_epi16(_mm256_add_epi16(A1, B1), Ones);
+				const __m256i Sum2 = _mm256_madd_epi16(_mm256_add_epi16(A2, B2), Ones);
+				const __m256i Cb = ChromaAVX2(Sum0, Sum1, Sum2, K.U01, K.U2, K.ChromaBias);
+				const __m256i Cr = ChromaAVX2(Sum0, Sum1, Sum2, K.V01, K.V2, K.ChromaBias);
+
+				// 8 U then 8 V, saturated to bytes
+				const __m128i Chroma = _mm_packus_epi16(
+					_mm_packs_epi32(_mm256_castsi256_si128(Cb), _mm256_extracti128_si256(Cb, 1)),
+					_mm_packs_epi32(_mm256_castsi256_si128(Cr), _mm256_extracti128_si256(Cr, 1)));
+				if(bInterleaved)
+				{
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(U + X), _mm_unpacklo_epi8(Chroma, _mm_srli_si128(Chroma, 8)));
+				}
+				else
+				{
+					_mm_storel_epi64(reinterpret_cast<__m128i*>(U + X / 2), Chroma);
+					_mm_storel_epi64(reinterpret_cast<__m128i*>(V + X / 2), _mm_srli_si128(Chroma, 8));
+				}
+			}
+			RowPairScalarFrom<bInterleaved>(X, Row0, Row1, Width, Y0, Y1, U, V, C);
+		}
+#endif // PLATFORM_CPU_X86_FAMILY
+
+		FRowPairKernel GetRowPairKernel(EKernel Kernel, bool bInterleaved)
+		{
+			switch(Kernel)
+			{
+#if PLATFORM_CPU_X86_FAMILY
+			case EKernel::AVX2: return bInterleaved ? &RowPairAVX2<true> : &RowPairAVX2<false>;
+			case EKernel::SSE2: return bInterleaved ? &RowPairSSE2<true> : &RowPairSSE2<false>;
+#endif
+			// No NEON kernel yet, arm64 runs the scalar one
+			default: return bInterleaved ? &RowPairScalar<true> : &RowPairScalar<false>;
+			}
+		}
+
+		FDownscaleKernel GetDownscaleKernel(EKernel Kernel, int32 FactorX, int32 FactorY)
+		{
+#if PLATFORM_CPU_X86_FAMILY
+			// Only the common 2:1 is worth vectorizing, and SSE2 already loads a cache line per row per iteration
+			if(FactorX == 2 && FactorY == 2 && (Kernel == EKernel::SSE2 || Kernel == EKernel::AVX2))
+			{
+				return &Downscale2x2SSE2;
+			}
+#endif
+			return &DownscaleScalar;
+		}
+
+		void CopyPlane(const uint8* Src, int32 SrcStride, uint8* Dst, int32 DstStride, int32 RowBytes, int32 NumRows)
+		{
+			if(SrcStride == DstStride && SrcStride == RowBytes)
+			{
+				FMemory::Memcpy(Dst, Src, RowBytes * NumRows);
+				return;
+			}
+			for(int32 Row = 0; Row < NumRows; ++Row)
+			{
+				FMemory::Memcpy(Dst + Row * DstStride, Src + Row * SrcStride, RowBytes);
+			}
+		}
+
+		AVPixelFormat ToAVPixelFormat(ESRPixelFormat Format)
+		{
+			switch(Format)
+			{
+			case ESRPixelFormat::BGRA8: return AV_PIX_FMT_BGRA;
+			case ESRPixelFormat::RGBA8: return AV_PIX_FMT_RGBA;
+			case ESRPixelFormat::NV12:  return AV_PIX_FMT_NV12;
+			case ESRPixelFormat::I420:  return AV_PIX_FMT_YUV420P;
+			}
+			return AV_PIX_FMT_NONE;
+		}
+	}
+
+	bool CanConvertRGBToYUV(const FSRVideoFrame& Src, const FYUVImage& Dst)
+	{
+		const bool bRGB = Src.Format == ESRPixelFormat::BGRA8 || Src.Format == ESRPixelFormat::RGBA8;
+		const bool bYUV = Dst.Format == ESRPixelFormat::I420 || Dst.Format == ESRPixelFormat::NV12;
+		return bRGB && bYUV
+			&& Dst.Width > 0 && Dst.Height > 0 && Dst.Width % 2 == 0 && Dst.Height % 2 == 0
+			&& Src.Width % Dst.Width == 0 && Src.Height % Dst.Height == 0;
+	}
+
+	void RGBToYUV(const FSRVideoFrame& Src, const FYUVImage& Dst, EColorRange Range, int32 MaxBands, EKernel Kernel)
+	{
+		check(CanConvertRGBToYUV(Src, Dst));
+		checkSlow(IsKernelSupported(Kernel));
+
+		const FCoefficients& Coefficients = GetCoefficients(Src.Format, Range);
+		const bool bInterleaved = Dst.Format == ESRPixelFormat::NV12;
+		const FRowPairKernel RowPairKernel = GetRowPairKernel(Kernel, bInterleaved);
+		const int32 FactorX = Src.Width / Dst.Width;
+		const int32 FactorY = Src.Height / Dst.Height;
+		const bool bDownscale = FactorX > 1 || FactorY > 1;
+		const FDownscaleKernel DownscaleKernel = GetDownscaleKernel(Kernel, FactorX, FactorY);
+
+		const int32 NumRowPairs = Dst.Height / 2;
+		int32 NumBands = MaxBands > 0 ? MaxBands : FTaskGraphInterface::Get().GetNumWorkerThreads() + 1;
+		NumBands = FMath::Clamp(NumBands, 1, FMath::DivideAndRoundUp(NumRowPairs, MinRowPairsPerBand));
+
+		ParallelFor(NumBands, [&](int32 Band)
+		{
+			const int32 BeginPair = Band * NumRowPairs / NumBands;
+			const int32 EndPair = (Band + 1) * NumRowPairs / NumBands;
+
+			// The downscaled row pair being converted, small enough to stay in the cache
+			TArray<uint8> Scaled;
+			if(bDownscale)
+			{
+				Scaled.SetNumUninitialized(Dst.Width * 4 * 2);
+			}
+
+			for(int32 Pair = BeginPair; Pair < EndPair; ++Pair)
+			{
+				const int32 Row = Pair * 2;
+				const uint8* Row0 = Src.Planes[0] + Row * Src.Strides[0];
+				const uint8* Row1 = Row0 + Src.Strides[0];
+				if(bDownscale)
+				{
+					const int32 SrcRow = Row * FactorY;
+					DownscaleKernel(Src.Planes[0] + SrcRow * Src.Strides[0], Src.Strides[0], FactorX, FactorY, Dst.Width, Scaled.GetData());
+					DownscaleKernel(Src.Planes[0] + (SrcRow + FactorY) * Src.Strides[0], Src.Strides[0], FactorX, FactorY, Dst.Width, Scaled.GetData() + Dst.Width * 4);
+					Row0 = Scaled.GetData();
+					Row1 = Row0 + Dst.Width * 4;
+				}
+
+				uint8* Y0 = Dst.Planes[0] + Row * Dst.Strides[0];
+				uint8* U = Dst.Planes[1] + Pair * Dst.Strides[1];
+				uint8* V = bInterleaved ? nullptr : Dst.Planes[2] + Pair * Dst.Strides[2];
+				RowPairKernel(Row0, Row1, Dst.Width, Y0, Y0 + Dst.Strides[0], U, V, Coefficients);
+			}
+		}, NumBands == 1 ? EParallelForFlags::ForceSingleThread : EParallelForFlags::None);
+	}
+
+	void CopyYUV(const FYUVImage& Src, const FYUVImage& Dst)
+	{
+		check(Src.Format == Dst.Format && Src.Width == Dst.Width && Src.Height == Dst.Height);
+
+		const int32 ChromaRowBytes = Dst.Format == ESRPixelFormat::NV12 ? Dst.Width : Dst.Width / 2;
+		CopyPlane(Src.Planes[0], Src.Strides[0], Dst.Planes[0], Dst.Strides[0], Dst.Width, Dst.Height);
+		for(int32 Plane = 1; Plane < FSRVideoFrame::GetNumPlanes(Dst.Format); ++Plane)
+		{
+			CopyPlane(Src.Planes[Plane], Src.Strides[Plane], Dst.Planes[Plane], Dst.Strides[Plane], ChromaRowBytes, Dst.Height / 2);
+		}
+	}
+
+	void ClearYUV(const FYUVImage& Image, EColorRange Range)
+	{
+		const uint8 Black = Range == EColorRange::Limited ? 16 : 0;
+		for(int32 Row = 0; Row < Image.Height; ++Row)
+		{
+			FMemory::Memset(Image.Planes[0] + Row * Image.Strides[0], Black, Image.Width);
+		}
+
+		const int32 ChromaRowBytes = Image.Format == ESRPixelFormat::NV12 ? Image.Width : Image.Width / 2;
+		for(int32 Plane = 1; Plane < FSRVideoFrame::GetNumPlanes(Image.Format); ++Plane)
+		{
+			for(int32 Row = 0; Row < Image.Height / 2; ++Row)
+			{
+				FMemory::Memset(Image.Planes[Plane] + Row * Image.Strides[Plane], 128, ChromaRowBytes);
+			}
+		}
+	}
+
+	FIntRect GetAspectFitRect(int32 SrcWidth, int32 SrcHeight, int32 DstWidth, int32 DstHeight)
+	{
+		const FIntRect Frame(0, 0, DstWidth, DstHeight);
+		if(SrcWidth <= 0 || SrcHeight <= 0)
+		{
+			return Frame;
+		}
+
+		// The full width or the full height, whichever leaves the other side inside the frame
+		int32 Width = DstWidth;
+		int32 Height = DstHeight;
+		if(int64(SrcWidth) * DstHeight > int64(SrcHeight) * DstWidth)
+		{
+			Height = FMath::Max(int32(int64(DstWidth) * SrcHeight / SrcWidth) & ~1, 2);
+		}
+		else
+		{
+			Width = FMath::Max(int32(int64(DstHeight) * SrcWidth / SrcHeight) & ~1, 2);
+		}
+
+		if(Width * 100 >= DstWidth * 99 && Height * 100 >= DstHeight * 99)
+		{
+			return Frame;
+		}
+
+		const int32 X = ((DstWidth - Width) / 2) & ~1;
+		const int32 Y = ((DstHeight - Height) / 2) & ~1;
+		return FIntRect(X, Y, X + Width, Y + Height);
+	}
+
+	FYUVImage GetSubImage(const FYUVImage& Image, const FIntRect& Rect)
+	{
+		check(Rect.Min.X % 2 == 0 && Rect.Min.Y % 2 == 0 && Rect.Width() % 2 == 0 && Rect.Height() % 2 == 0);
+
+		FYUVImage Sub = Image;
+		Sub.Width = Rect.Width();
+		Sub.Height = Rect.Height();
+		Sub.Planes[0] += Rect.Min.Y * Image.Strides[0] + Rect.Min.X;
+		if(Image.Format == ESRPixelFormat::NV12)
+		{
+			Sub.Planes[1] += Rect.Min.Y / 2 * Image.Strides[1] + Rect.Min.X;
+		}
+		else
+		{
+			Sub.Planes[1] += Rect.Min.Y / 2 * Image.Strides[1] + Rect.Min.X / 2;
+			Sub.Planes[2] += Rect.Min.Y / 2 * Image.Strides[2] + Rect.Min.X / 2;
+		}
+		return Sub;
+	}
+
+	FFrameConverter::~FFrameConverter()
+	{
+		sws_freeContext(Context);
+	}
+
+	bool FFrameConverter::Convert(const FSRVideoFrame& Frame, const FYUVImage& Dst)
+	{
+		const FIntRect Rect = GetAspectFitRect(Frame.Width, Frame.Height, Dst.Width, Dst.Height);
+		if(Rect.Width() == Dst.Width && Rect.Height() == Dst.Height)
+		{
+			return ConvertPicture(Frame, Dst);
+		}
+
+		// Cheaper than working out the bars, and the picture is written over the rest anyway
+		ClearYUV(Dst);
+		return ConvertPicture(Frame, GetSubImage(Dst, Rect));
+	}
+
+	bool FFrameConverter::ConvertPicture(const FSRVideoFrame& Frame, const FYUVImage& Dst)
+	{
+		if(CanConvertRGBToYUV(Frame, Dst))
+		{
+			RGBToYUV(Frame, Dst);
+			return true;
+		}
+
+		if(Frame.Format == Dst.Format && Frame.Width == Dst.Width && Frame.Height == Dst.Height)
+		{
+			const int32 ChromaRowBytes = Dst.Format == ESRPixelFormat::NV12 ? Dst.Width : Dst.Width / 2;
+			CopyPlane(Frame.Planes[0], Frame.Strides[0], Dst.Planes[0], Dst.Strides[0], Dst.Width, Dst.Height);
+			for(int32 Plane = 1; Plane < FSRVideoFrame::GetNumPlanes(Dst.Format); ++Plane)
+			{
+				CopyPlane(Frame.Planes[Plane], Frame.Strides[Plane], Dst.Planes[Plane], Dst.Strides[Plane], ChromaRowBytes, Dst.Height / 2);
+			}
+			return true;
+		}
+
+		const AVPixelFormat SrcFormat = ToAVPixelFormat(Frame.Format);
+		const AVPixelFormat DstFormat = ToAVPixelFormat(Dst.Format);
+		Context = sws_getCachedContext(Context, Frame.Width, Frame.Height, SrcFormat, Dst.Width, Dst.Height, DstFormat, SWS_BILINEAR, nullptr, nullptr, nullptr);
+		if(!Context)
+		{
+			UE_LOG(LogTemp, Error, TEXT("libswscale can't convert %dx%d format %d to %dx%d format %d"), Frame.Width, Frame.Height, int32(Frame.Format), Dst.Width, Dst.Height, int32(Dst.Format));
+			return false;
+		}
+
+		// Same matrix as RGBToYUV. RGB input is full range, YUV input is taken as limited range BT.709 too.
+		const bool bSrcIsRGB = Frame.Format == ESRPixelFormat::BGRA8 || Frame.Format == ESRPixelFormat::RGBA8;
+		const int* Coefficients = sws_getCoefficients(SWS_CS_ITU709);
+		sws_setColorspaceDetails(Context, Coefficients, bSrcIsRGB ? 1 : 0, Coefficients, 0, 0, 1 << 16, 1 << 16);
+
+		uint8* const DstPlanes[] = { Dst.Planes[0], Dst.Planes[1], Dst.Planes[2] };
+		sws_scale(Context, Frame.Planes, Frame.Strides, 0, Frame.Height, DstPlanes, Dst.Strides);
+		return true;
+	}
+}
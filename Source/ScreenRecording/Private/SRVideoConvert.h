@@ -0,0 +1,95 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "SRVideoFrame.h"
+#include "SRSimd.h"
+
+struct SwsContext;
+
+//
+// Color conversion for the software video encoding path, which reads the back buffer back as BGRA8 and takes system
+// memory frames, while the encoders want 4:2:0 YUV.
+//
+namespace SRVideo
+{
+	using SRSimd::EKernel;
+	using SRSimd::GetBestKernel;
+	using SRSimd::IsKernelSupported;
+	using SRSimd::LexToString;
+
+	/** Luma and chroma ranges of the YUV output: 16-235 and 16-240, or all of 0-255. */
+	enum class EColorRange : uint8
+	{
+		Limited,
+		Full,
+	};
+
+	/** Writable 4:2:0 image. I420 uses all three planes, NV12 the first two. */
+	struct FYUVImage
+	{
+		/** I420 or NV12 */
+		ESRPixelFormat Format = ESRPixelFormat::I420;
+		int32 Width = 0;
+		int32 Height = 0;
+		uint8* Planes[3] = { nullptr, nullptr, nullptr };
+		int32 Strides[3] = { 0, 0, 0 };
+	};
+
+	/**
+	 * True if RGBToYUV can do this conversion: BGRA8 or RGBA8 to I420 or NV12, an even destination size, and a source that
+	 * is a whole multiple of it on each axis.
+	 */
+	bool CanConvertRGBToYUV(const FSRVideoFrame& Src, const FYUVImage& Dst);
+
+	/**
+	 * Converts BGRA8 or RGBA8 to I420 or NV12 with the BT.709 matrix. Chroma is the average of each 2x2 block.
+	 * A source larger than Dst is box filtered down in the same pass, one pair of rows at a time, so the downscaled
+	 * pixels never leave the cache. Kernels give the same bits, SIMD ones only exist for 1:1 and 2:1 (others are scalar).
+	 *
+	 * The rows are split into bands run on the task graph workers and the calling thread.
+	 * @param MaxBands 0 picks from the number of workers, 1 converts on the calling thread only
+	 */
+	void RGBToYUV(const FSRVideoFrame& Src, const FYUVImage& Dst, EColorRange Range = EColorRange::Limited, int32 MaxBands = 0, EKernel Kernel = GetBestKernel());
+
+	/** Copies a YUV image into another of the same format and size. */
+	void CopyYUV(const FYUVImage& Src, const FYUVImage& Dst);
+
+	/** Fills a YUV image with black. */
+	void ClearYUV(const FYUVImage& Image, EColorRange Range = EColorRange::Limited);
+
+	/**
+	 * Where a SrcWidth x SrcHeight picture goes in a DstWidth x DstHeight frame to keep its aspect ratio: the whole frame,
+	 * or a centred rectangle with black bars on two sides. Position and size are even, so the rectangle is a 4:2:0 image
+	 * of its own. Bars thinner than 1% of the frame aren't worth it, the picture is stretched over them instead.
+	 */
+	FIntRect GetAspectFitRect(int32 SrcWidth, int32 SrcHeight, int32 DstWidth, int32 DstHeight);
+
+	/** The part of Image inside an even Rect, sharing its memory. */
+	FYUVImage GetSubImage(const FYUVImage& Image, const FIntRect& Rect);
+
+	/**
+	 * Converts system memory frames of any FSRVideoFrame layout and size to I420 or NV12 of a given size (BT.709 limited range).
+	 * A frame of another aspect ratio is fitted in with black bars. RGB frames RGBToYUV can do and YUV frames of the right
+	 * layout and size take the direct route, everything else libswscale, whose context is kept for as long as the input
+	 * does not change. One per thread.
+	 */
+	class FFrameConverter
+	{
+	public:
+		FFrameConverter() = default;
+		~FFrameConverter();
+
+		FFrameConverter(const FFrameConverter&) = delete;
+		FFrameConverter& operator=(const FFrameConverter&) = delete;
+
+		bool Convert(const FSRVideoFrame& Frame, const FYUVImage& Dst);
+
+	private:
+		// Fills all of Dst, which is the picture's part of the frame
+		bool ConvertPicture(const FSRVideoFrame& Frame, const FYUVImage& Dst);
+
+		SwsContext* Context = nullptr;
+	};
+}
@@ -0,0 +1,391 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "SRX264Encoder.h"
+#include "SRVideoConvert.h"
+#include "VideoEncoderInput.h"
+#include "Misc/CommandLine.h"
+
+#include <stdint.h>
+#include "x264.h"
+
+namespace
+{
+	bool IsValidName(const FString& Name, const char* const* Names)
+	{
+		for(; *Names; ++Names)
+		{
+			if(Name == ANSI_TO_TCHAR(*Names))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void SetRateControl(x264_param_t& Param, const AVEncoder::FVideoEncoder::FLayerConfig& Config)
+	{
+		Param.i_fps_num = FMath::Max<uint32>(Config.MaxFramerate, 1);
+		Param.i_fps_den = 1;
+		Param.rc.i_rc_method = X264_RC_ABR;
+		Param.rc.i_bitrate = FMath::Max(Config.TargetBitrate / 1000, 1);
+		// One second of VBV, so the bitrate holds over short windows, which is what streaming needs
+		Param.rc.i_vbv_max_bitrate = FMath::Max(Config.MaxBitrate, Config.TargetBitrate) / 1000;
+		Param.rc.i_vbv_buffer_size = Param.rc.i_bitrate;
+	}
+}
+
+FSRX264Options FSRX264Options::FromCommandLine()
+{
+	FSRX264Options Options;
+	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.X264Preset="), Options.Preset);
+	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.X264Tune="), Options.Tune);
+	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.X264Threads="), Options.Threads);
+	Options.bSlicedThreads = FParse::Param(FCommandLine::Get(), TEXT("GameplayMediaEncoder.X264SlicedThreads"));
+	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.X264Lookahead="), Options.LookaheadFrames);
+	return Options;
+}
+
+class FSRX264Encoder::FX264Layer final : public AVEncoder::FVideoEncoder::FLayer
+{
+public:
+	FX264Layer(FSRX264Encoder& InOwner, uint32 InIndex, const FLayerConfig& Config)
+		: FLayer(Config)
+		, Owner(InOwner)
+		, Index(InIndex)
+	{
+	}
+
+	~FX264Layer()
+	{
+		Close();
+	}
+
+	bool Open(const FLayerConfig& Config);
+	void Encode(const AVEncoder::FVideoEncoderInputFrame* Frame, const FEncodeOptions& EncodeOptions, const FLayerConfig& Config);
+	// Encodes what is left in the lookahead and frame threads
+	void Drain();
+	void Close();
+	bool IsOpen() const { return Encoder != nullptr; }
+
+	const FLayerConfig& GetAppliedConfig() const { return AppliedConfig; }
+	const FSRX264LayerStats& GetStats() const { return Stats; }
+
+private:
+	// Applies bitrate and framerate changes made with UpdateLayerConfig
+	void Reconfigure(const FLayerConfig& Config);
+	// The frame at the layer's size, scaled into Scaled if it has another
+	bool GetPicture(const AVEncoder::FVideoEncoderInputFrame& Frame, SRVideo::FYUVImage& OutImage);
+	// Hands what x264_encoder_encode returned to the packet callback
+	void DeliverOutput(int32 FrameSize, const x264_nal_t* NALs, const x264_picture_t& Picture);
+
+	FSRX264Encoder& Owner;
+	const uint32 Index;
+	x264_t* Encoder = nullptr;
+	FLayerConfig AppliedConfig;
+	// x264 copies the picture before Encode returns, so one buffer does
+	TArray<uint8> Scaled;
+	SRVideo::FFrameConverter Scaler;
+	FSRX264LayerStats Stats;
+};
+
+bool FSRX264Encoder::FX264Layer::Open(const FLayerConfig& Config)
+{
+	const FSRX264Options& Options = Owner.Options;
+
+	x264_param_t Param;
+	if(x264_param_default_preset(&Param, TCHAR_TO_ANSI(*Options.Preset), Options.Tune.IsEmpty() ? nullptr : TCHAR_TO_ANSI(*Options.Tune)) < 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("x264 rejected preset '%s' tune '%s'"), *Options.Preset, *Options.Tune);
+		return false;
+	}
+
+	Param.i_log_level = X264_LOG_WARNING;
+	Param.i_csp = X264_CSP_I420;
+	Param.i_width = Config.Width;
+	Param.i_height = Config.Height;
+	SetRateControl(Param, Config);
+
+	Param.i_threads = Options.Threads > 0 ? Options.Threads : X264_THREADS_AUTO;
+	Param.b_sliced_threads = Options.bSlicedThreads ? 1 : 0;
+	if(Options.LookaheadFrames >= 0)
+	{
+		Param.rc.i_lookahead = Options.LookaheadFrames;
+	}
+
+	// The muxer writes DTS = PTS and listeners expect packets in presentation order
+	Param.i_bframe = 0;
+	// Keyframes often enough that a stream can be joined without waiting long
+	Param.i_keyint_max = FMath::Max(FMath::RoundToInt(Options.GopSeconds * Param.i_fps_num / Param.i_fps_den), 1);
+	Param.b_open_gop = Options.bOpenGop ? 1 : 0;
+	// Timestamps go through untouched, in FTimespan ticks
+	Param.b_vfr_input = 0;
+	Param.i_timebase_num = 1;
+	Param.i_timebase_den = ETimespan::TicksPerSecond;
+	// Same bitstream shape as the hardware encoders: Annex B, parameter sets in band
+	Param.b_annexb = 1;
+	Param.b_repeat_headers = 1;
+
+	if(x264_param_apply_profile(&Param, "high") < 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("x264 could not apply the high profile"));
+		return false;
+	}
+
+	Encoder = x264_encoder_open(&Param);
+	if(!Encoder)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Failed to open x264 for %ux%u"), Config.Width, Config.Height);
+		return false;
+	}
+
+	UE_LOG(LogTemp, Log, TEXT("x264 layer %u: %ux%u@%u, %d kbps, preset %s%s%s, %s threads %d, lookahead %d"),
+		Index, Config.Width, Config.Height, Config.MaxFramerate, Param.rc.i_bitrate, *Options.Preset, Options.Tune.IsEmpty() ? TEXT("") : TEXT(" tune "), *Options.Tune,
+		Param.b_sliced_threads ? TEXT("sliced") : TEXT("frame"), Param.i_threads, Param.rc.i_lookahead);
+
+	AppliedConfig = Config;
+	return true;
+}
+
+void FSRX264Encoder::FX264Layer::Encode(const AVEncoder::FVideoEncoderInputFrame* Frame, const FEncodeOptions& EncodeOptions, const FLayerConfig& Config)
+{
+	if(Config.Width != AppliedConfig.Width || Config.Height != AppliedConfig.Height)
+	{
+		// x264 can't change the size of an open encoder. The frames it holds go out at the old size, then the stream
+		// starts over with an IDR and new parameter sets.
+		Close();
+		if(!Open(Config))
+		{
+			Frame->Release();
+			return;
+		}
+	}
+	else if(Config.TargetBitrate != AppliedConfig.TargetBitrate || Config.MaxBitrate != AppliedConfig.MaxBitrate || Config.MaxFramerate != AppliedConfig.MaxFramerate)
+	{
+		Reconfigure(Config);
+	}
+
+	SRVideo::FYUVImage Image;
+	if(!Encoder || !GetPicture(*Frame, Image))
+	{
+		Frame->Release();
+		return;
+	}
+
+	x264_picture_t Picture;
+	x264_picture_init(&Picture);
+	Picture.img.i_csp = X264_CSP_I420;
+	Picture.img.i_plane = 3;
+	// x264 copies the planes before returning, no need to keep them around
+	for(int32 Plane = 0; Plane < 3; ++Plane)
+	{
+		Picture.img.plane[Plane] = Image.Planes[Plane];
+		Picture.img.i_stride[Plane] = Image.Strides[Plane];
+	}
+	Picture.i_pts = Frame->GetTimestampUs();
+	Picture.i_type = EncodeOptions.bForceKeyFrame ? X264_TYPE_IDR : X264_TYPE_AUTO;
+	// The frame itself comes back with its packet, maybe several calls later. Held until then.
+	Picture.opaque = const_cast<AVEncoder::FVideoEncoderInputFrame*>(Frame->Obtain());
+
+	const double StartSeconds = FPlatformTime::Seconds();
+	x264_nal_t* NALs = nullptr;
+	int32 NumNALs = 0;
+	x264_picture_t Output;
+	const int32 FrameSize = x264_encoder_encode(Encoder, &NALs, &NumNALs, &Picture, &Output);
+	Stats.EncodeSeconds += FPlatformTime::Seconds() - StartSeconds;
+	if(FrameSize < 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("x264 failed to encode a frame on layer %u"), Index);
+		// x264 didn't keep the picture, so the reference taken for it won't come back with a packet
+		static_cast<AVEncoder::FVideoEncoderInputFrame*>(Picture.opaque)->Release();
+		Frame->Release();
+		return;
+	}
+
+	DeliverOutput(FrameSize, NALs, Output);
+}
+
+bool FSRX264Encoder::FX264Layer::GetPicture(const AVEncoder::FVideoEncoderInputFrame& Frame, SRVideo::FYUVImage& OutImage)
+{
+	const AVEncoder::FVideoEncoderInputFrame::FYUV420P& Planes = Frame.GetYUV420P();
+	if(Frame.GetWidth() == AppliedConfig.Width && Frame.GetHeight() == AppliedConfig.Height)
+	{
+		OutImage.Width = Frame.GetWidth();
+		OutImage.Height = Frame.GetHeight();
+		OutImage.Planes[0] = const_cast<uint8*>(Planes.Data[0]);
+		OutImage.Planes[1] = const_cast<uint8*>(Planes.Data[1]);
+		OutImage.Planes[2] = const_cast<uint8*>(Planes.Data[2]);
+		OutImage.Strides[0] = Planes.StrideY;
+		OutImage.Strides[1] = Planes.StrideU;
+		OutImage.Strides[2] = Planes.StrideV;
+		return true;
+	}
+
+	const double StartSeconds = FPlatformTime::Seconds();
+	const int32 Width = AppliedConfig.Width;
+	const int32 Height = AppliedConfig.Height;
+	Scaled.SetNumUninitialized(Width * Height * 3 / 2, false);
+	OutImage.Width = Width;
+	OutImage.Height = Height;
+	OutImage.Planes[0] = Scaled.GetData();
+	OutImage.Planes[1] = OutImage.Planes[0] + Width * Height;
+	OutImage.Planes[2] = OutImage.Planes[1] + Width * Height / 4;
+	OutImage.Strides[0] = Width;
+	OutImage.Strides[1] = OutImage.Strides[2] = Width / 2;
+
+	FSRVideoFrame Source;
+	Source.Format = ESRPixelFormat::I420;
+	Source.Width = Frame.GetWidth();
+	Source.Height = Frame.GetHeight();
+	Source.Planes[0] = Planes.Data[0];
+	Source.Planes[1] = Planes.Data[1];
+	Source.Planes[2] = Planes.Data[2];
+	Source.Strides[0] = Planes.StrideY;
+	Source.Strides[1] = Planes.StrideU;
+	Source.Strides[2] = Planes.StrideV;
+	const bool bScaled = Scaler.Convert(Source, OutImage);
+	Stats.ScaleSeconds += FPlatformTime::Seconds() - StartSeconds;
+	return bScaled;
+}
+
+void FSRX264Encoder::FX264Layer::DeliverOutput(int32 FrameSize, const x264_nal_t* NALs, const x264_picture_t& Picture)
+{
+	if(FrameSize == 0)
+	{
+		// Still in the lookahead or a frame thread
+		return;
+	}
+
+	const AVEncoder::FVideoEncoderInputFrame* Frame = static_cast<const AVEncoder::FVideoEncoderInputFrame*>(Picture.opaque);
+
+	// x264 puts the NAL units of a frame next to each other, start codes included
+	AVEncoder::FCodecPacket Packet;
+	Packet.Data = NALs[0].p_payload;
+	Packet.DataSize = FrameSize;
+	Packet.IsKeyFrame = Picture.b_keyframe != 0;
+	Packet.VideoQP = FMath::Max(FMath::RoundToInt(Picture.prop.f_crf_avg), 0);
+	Packet.Framerate = AppliedConfig.MaxFramerate;
+
+	if(Owner.OnEncodedPacket)
+	{
+		Owner.OnEncodedPacket(Index, Frame, Packet);
+	}
+	Frame->Release();
+}
+
+void FSRX264Encoder::FX264Layer::Reconfigure(const FLayerConfig& Config)
+{
+	x264_param_t Param;
+	x264_encoder_parameters(Encoder, &Param);
+	SetRateControl(Param, Config);
+	if(x264_encoder_reconfig(Encoder, &Param) < 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("x264 rejected %d kbps at %u fps on layer %u"), Config.TargetBitrate / 1000, Config.MaxFramerate, Index);
+	}
+	AppliedConfig = Config;
+}
+
+void FSRX264Encoder::FX264Layer::Drain()
+{
+	while(Encoder && x264_encoder_delayed_frames(Encoder) > 0)
+	{
+		x264_nal_t* NALs = nullptr;
+		int32 NumNALs = 0;
+		x264_picture_t Output;
+		const int32 FrameSize = x264_encoder_encode(Encoder, &NALs, &NumNALs, nullptr, &Output);
+		if(FrameSize < 0)
+		{
+			// The frames x264 still holds can't come back, and neither can their input frames
+			UE_LOG(LogTemp, Error, TEXT("x264 failed to flush layer %u, %d frames lost"), Index, x264_encoder_delayed_frames(Encoder));
+			break;
+		}
+		DeliverOutput(FrameSize, NALs, Output);
+	}
+}
+
+void FSRX264Encoder::FX264Layer::Close()
+{
+	if(Encoder)
+	{
+		Drain();
+		x264_encoder_close(Encoder);
+		Encoder = nullptr;
+	}
+}
+
+FSRX264Encoder::FSRX264Encoder(const FSRX264Options& InOptions)
+	: Options(InOptions)
+{
+	if(!IsValidName(Options.Preset, x264_preset_names))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Unknown x264 preset '%s', using veryfast"), *Options.Preset);
+		Options.Preset = TEXT("veryfast");
+	}
+	if(!Options.Tune.IsEmpty() && !IsValidName(Options.Tune, x264_tune_names))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Unknown x264 tune '%s', ignored"), *Options.Tune);
+		Options.Tune.Empty();
+	}
+}
+
+FSRX264Encoder::~FSRX264Encoder()
+{
+	Shutdown();
+}
+
+bool FSRX264Encoder::Setup(TSharedRef<AVEncoder::FVideoEncoderInput> Input, FLayerConfig const& Config)
+{
+	return AddLayer(Config);
+}
+
+void FSRX264Encoder::Encode(AVEncoder::FVideoEncoderInputFrame const* Frame, FEncodeOptions const& EncodeOptions)
+{
+	// The caller holds the frame once per layer, and each layer hands one of those back with its packet
+	for(int32 Index = 0; Index < X264Layers.Num(); ++Index)
+	{
+		X264Layers[Index]->Encode(Frame, EncodeOptions, GetLayerConfig(Index));
+	}
+}
+
+void FSRX264Encoder::Flush()
+{
+	// x264 takes no more frames once flushing has started, so it has to be opened again
+	for(FX264Layer* Layer : X264Layers)
+	{
+		if(Layer->IsOpen())
+		{
+			Layer->Close();
+			Layer->Open(Layer->GetAppliedConfig());
+		}
+	}
+}
+
+void FSRX264Encoder::Shutdown()
+{
+	for(FX264Layer* Layer : X264Layers)
+	{
+		Layer->Close();
+	}
+}
+
+FSRX264LayerStats FSRX264Encoder::GetLayerStats(uint32 LayerIndex) const
+{
+	return X264Layers.IsValidIndex(LayerIndex) ? X264Layers[LayerIndex]->GetStats() : FSRX264LayerStats();
+}
+
+AVEncoder::FVideoEncoder::FLayer* FSRX264Encoder::CreateLayer(uint32 LayerIdx, FLayerConfig const& Config)
+{
+	FX264Layer* Layer = new FX264Layer(*this, LayerIdx, Config);
+	if(!Layer->Open(Config))
+	{
+		delete Layer;
+		return nullptr;
+	}
+	X264Layers.Add(Layer);
+	return Layer;
+}
+
+void FSRX264Encoder::DestroyLayer(FLayer* Layer)
+{
+	X264Layers.Remove(static_cast<FX264Layer*>(Layer));
+	delete Layer;
+}
@@ -0,0 +1,78 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VideoEncoder.h"
+
+typedef struct x264_t x264_t;
+typedef struct x264_nal_t x264_nal_t;
+typedef struct x264_picture_t x264_picture_t;
+
+/** Where the time of one layer went, on the video worker. */
+struct FSRX264LayerStats
+{
+	double ScaleSeconds = 0;
+	double EncodeSeconds = 0;
+};
+
+/** libx264 settings the hardware encoders have no equivalent for. */
+struct FSRX264Options
+{
+	/** x264 preset, ultrafast to placebo */
+	FString Preset = TEXT("veryfast");
+	/** Optional x264 tune, e.g. zerolatency, film or animation */
+	FString Tune;
+	/** Frame threads, 0 lets x264 pick from the core count */
+	int32 Threads = 0;
+	/** Split each frame into slices across threads instead of encoding frames in parallel: less latency, a little less quality */
+	bool bSlicedThreads = false;
+	/** Frames of rate control lookahead, -1 keeps what the preset and tune pick */
+	int32 LookaheadFrames = -1;
+	/** Longest time between keyframes. FSRGameplayMediaEncoder sets it from GameplayMediaEncoder.GopSeconds=. */
+	double GopSeconds = 2.0;
+	/** Periodic keyframes are I frames with a recovery point instead of IDRs. Forced keyframes are always IDRs. */
+	bool bOpenGop = false;
+
+	/** Reads GameplayMediaEncoder.X264Preset=, X264Tune=, X264Threads=, X264SlicedThreads and X264Lookahead= from the command line. */
+	static FSRX264Options FromCommandLine();
+};
+
+/**
+ * Software H.264 encoder for when there is no hardware one: other RHIs than D3D11/D3D12, no GPU at all, or when asked
+ * for with GameplayMediaEncoder.SoftwareEncoder.
+ *
+ * Takes YUV420P input frames (FVideoEncoderInput::CreateForYUV420P). x264 copies the planes when a frame is submitted,
+ * but keeps it for its lookahead and frame threads, so the packet for a frame can come out of a later Encode call.
+ * The input frame is held until then and handed to the packet callback like the hardware encoders do.
+ * Packets are Annex B, with SPS and PPS in front of every keyframe, and there are no B-frames.
+ *
+ * Every layer is an x264 encoder of its own. A layer of another size than the input frames gets them scaled, with black
+ * bars if the aspect ratio differs, which is how simulcast layers come from one capture.
+ */
+class FSRX264Encoder final : public AVEncoder::FVideoEncoder
+{
+public:
+	explicit FSRX264Encoder(const FSRX264Options& InOptions = FSRX264Options());
+	~FSRX264Encoder() override;
+
+	bool Setup(TSharedRef<AVEncoder::FVideoEncoderInput> Input, FLayerConfig const& Config) override;
+	void Encode(AVEncoder::FVideoEncoderInputFrame const* Frame, FEncodeOptions const& Options) override;
+	/** Encodes the frames x264 still holds, then closes it. */
+	void Shutdown() override;
+	/** Encodes the frames x264 still holds and starts over, so they make it into the recording that is ending. */
+	void Flush();
+	/** Since the layer was added */
+	FSRX264LayerStats GetLayerStats(uint32 LayerIndex) const;
+
+protected:
+	FLayer* CreateLayer(uint32 LayerIdx, FLayerConfig const& Config) override;
+	void DestroyLayer(FLayer* Layer) override;
+
+private:
+	class FX264Layer;
+
+	FSRX264Options Options;
+	// In layer index order. FVideoEncoder owns them.
+	TArray<FX264Layer*> X264Layers;
+};
@@ -8,12 +8,7 @@
 #include "RHIResources.h"
 #include "IImageWrapper.h"
 #include "IImageWrapperModule.h"
-
-void SRM_Listener::OnMediaSample(const AVEncoder::FMediaPacket& Sample)
-{
-	AScreenRecordingManager* CastOwner = Cast< AScreenRecordingManager>(Owner);
-	CastOwner->OnMediaSample(Sample);
-}
+#include "Async/Async.h"
 
 // Sets default values
 AScreenRecordingManager::AScreenRecordingManager()
@@ -25,6 +20,12 @@ AScreenRecordingManager::AScreenRecordingManager()
 AScreenRecordingManager::~AScreenRecordingManager()
 {
 	Stop();
+
+	// Don't let the file be cut short when the actor goes away with the engine
+	if (FinalizeFuture.IsValid())
+	{
+		FinalizeFuture.Wait();
+	}
 }
 
 // Called when the game starts or when spawned
@@ -48,6 +49,13 @@ void AScreenRecordingManager::Initialize()
 		return;
 	}
 
+	if (bIsFinalizing)
+	{
+		// The encoders are still being shut down by the previous Stop
+		UE_LOG(LogTemp, Warning, TEXT("The previous recording is still being finalized, try again after OnRecordingFinalized"));
+		return;
+	}
+
 	TWeakObjectPtr<AScreenRecordingManager> WeakThis(this);
 
 	AsyncTask(ENamedThreads::AnyThread, [WeakThis]()
@@ -93,60 +101,88 @@ void AScreenRecordingManager::PerformAsyncInitialization()
 	bIsInitialize = GME->Initialize();
 
 	FString FilePath = FPaths::ProjectSavedDir() / "CapturedVideo.mp4";
+	RecordingFilePath = FilePath;
 
 	AVEncoder::FAudioConfig AudioConfig;
 	AudioConfig.Codec = "aac";
-	AudioConfig.Samplerate = 48000;
+	// The encoder's rate is configurable (GameplayMediaEncoder.AudioSampleRate=), the muxer has to match it
+	AudioConfig.Samplerate = bIsInitialize ? GME->GetAudioConfig().Samplerate : 48000;
 	AudioConfig.NumChannels = 2;
 	AudioConfig.Bitrate = 192000;
 
-	AVEncoder::FVideoConfig VideoConfig;
-	VideoConfig.Codec = "h264";
-	VideoConfig.Height = VideoConfig.Width = VideoConfig.Framerate = VideoConfig.Bitrate = 0;
-	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.ResY="), VideoConfig.Height);
-	UE_LOG(LogTemp, Log, TEXT("GameplayMediaEncoder.ResY = %d"), VideoConfig.Height);
-	if (VideoConfig.Height == 720)
+	// The encoder has the command line settings already. The muxer follows later SetResolution calls from the packets.
+	const AVEncoder::FVideoConfig VideoConfig = GME->GetVideoConfig();
+
+	FMP4MuxerOptions MuxerOptions;
+	FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.MuxerQueue="), MuxerOptions.QueueCapacity);
+	FString OverflowPolicy;
+	if (FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.MuxerOverflow="), OverflowPolicy))
 	{
-		VideoConfig.Width = 1280;
-		VideoConfig.Height = 720;
+		if (OverflowPolicy == TEXT("DropNonKey"))
+		{
+			MuxerOptions.OverflowPolicy = EMP4MuxerOverflowPolicy::DropNonKeyVideo;
+		}
+		else if (OverflowPolicy == TEXT("DropGop"))
+		{
+			MuxerOptions.OverflowPolicy = EMP4MuxerOverflowPolicy::DropOldestGop;
+		}
+		else
+		{
+			MuxerOptions.OverflowPolicy = EMP4MuxerOverflowPolicy::Block;
+		}
 	}
-	else if (VideoConfig.Height == 0 || VideoConfig.Height == 1080)
+
+	MuxerOptions.bFragmented = FParse::Param(FCommandLine::Get(), TEXT("ScreenRecording.Fragmented"));
+	FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.FragmentMs="), MuxerOptions.FragmentDurationMs);
+	// 0 falls back to avio_open
+	FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.IOBufferMB="), MuxerOptions.IOBufferSizeMB);
+	FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.IOBuffers="), MuxerOptions.IONumBuffers);
+	FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.FileGrowthMB="), MuxerOptions.IOGrowthMB);
+	// Rollover to CapturedVideo_000.mp4, CapturedVideo_001.mp4, ...
+	FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.SegmentSeconds="), MuxerOptions.SegmentDurationSeconds);
+	FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.SegmentMB="), MuxerOptions.SegmentSizeMB);
+
+	FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.ReplaySeconds="), ReplayBufferSeconds);
+	if (FParse::Param(FCommandLine::Get(), TEXT("ScreenRecording.NoFileRecording")))
 	{
-		VideoConfig.Width = 1920;
-		VideoConfig.Height = 1080;
+		bContinuousRecording = false;
 	}
-	else
+
+	if (ReplayBufferSeconds > 0)
 	{
-		UE_LOG(LogTemp, Fatal, TEXT("GameplayMediaEncoder.ResY can only have a value of 720 or 1080"));
-		VideoConfig.Width = 1920;
-		VideoConfig.Height = 1080;
+		FSRReplayBufferOptions ReplayOptions;
+		ReplayOptions.MaxSeconds = ReplayBufferSeconds;
+		// Room for the requested duration at the maximum bitrate, plus one extra GOP and the audio
+		ReplayOptions.SlabSizeMB = FMath::CeilToInt((ReplayBufferSeconds + 2.0f) * (VideoConfig.Bitrate + AudioConfig.Bitrate) / 8.0f / (1024.0f * 1024.0f)) + 4;
+		FParse::Value(FCommandLine::Get(), TEXT("ScreenRecording.ReplayMB="), ReplayOptions.SlabSizeMB);
+		ReplayOptions.VideoConfig = VideoConfig;
+		ReplayOptions.AudioConfig = AudioConfig;
+		ReplayOptions.MuxerOptions = MuxerOptions;
+		// A replay always goes into the one file it was asked for
+		ReplayOptions.MuxerOptions.SegmentDurationSeconds = 0;
+		ReplayOptions.MuxerOptions.SegmentSizeMB = 0;
+		ReplayBuffer = MakeUnique<FSRReplayBuffer>(ReplayOptions);
 	}
 
-	// Specifying 0 will completely disable frame skipping (therefore encoding as many frames as possible)
-	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.FPS="), VideoConfig.Framerate);
-	if (VideoConfig.Framerate == 0)
+	if (bContinuousRecording)
 	{
-		// Note : When disabling frame skipping, we lie to the encoder when initializing.
-		// We still specify a framerate, but then feed frames without skipping
-		VideoConfig.Framerate = 30;
-		UE_LOG(LogTemp, Log, TEXT("Uncapping FPS"));
+		Muxer = MakeUnique<FMP4Muxer>();
+		if (!Muxer->Initialize(FilePath, VideoConfig, AudioConfig, MuxerOptions))
+		{
+			// Handle initialization failure
+			Muxer.Reset();
+			bIsInitialize = false;
+		}
 	}
-	else
+	else if (!ReplayBuffer)
 	{
-		VideoConfig.Framerate = FMath::Clamp(VideoConfig.Framerate, (uint32)10, (uint32)60);
-		UE_LOG(LogTemp, Log, TEXT("Capping FPS %u"), VideoConfig.Framerate);
+		UE_LOG(LogTemp, Error, TEXT("Continuous recording is off and there is no replay buffer, nothing to record to"));
+		bIsInitialize = false;
 	}
 
-	VideoConfig.Bitrate = 20000000;
-	FParse::Value(FCommandLine::Get(), TEXT("GameplayMediaEncoder.Bitrate="), VideoConfig.Bitrate);
-	VideoConfig.Bitrate = FMath::Clamp(VideoConfig.Bitrate, (uint32)1000000, (uint32)20000000);
-
-	Muxer = MakeUnique<FMP4Muxer>();
-	if (!Muxer->Initialize(FilePath, VideoConfig, AudioConfig))
+	if (!bIsInitialize)
 	{
-		// Handle initialization failure
-		Muxer.Reset();
-		bIsInitialize = false;
+		ReplayBuffer.Reset();
 	}
 
 	bSuccess = bIsInitialize;
@@ -173,8 +209,20 @@ bool AScreenRecordingManager::Start()
 		return false;
 	}
 
-	Temp_Listener.Owner = this;
-	bIsRecording = GME->RegisterListener(&Temp_Listener);
+	// The file and the replay buffer share every encoded packet, and neither can hold up the other
+	bIsRecording = true;
+	if (Muxer)
+	{
+		bIsRecording &= GME->AddSink(Muxer.Get(), MuxerSinkQueueCapacity);
+	}
+	if (ReplayBuffer)
+	{
+		bIsRecording &= GME->AddSink(ReplayBuffer.Get());
+	}
+	if (!bIsRecording)
+	{
+		RemoveSinks();
+	}
 	//bIsRecording = GME->Start();
 
 	return bIsRecording;
@@ -187,25 +235,148 @@ void AScreenRecordingManager::Stop()
 		return;
 	}
 
-	GME->UnregisterListener(&Temp_Listener);
+	// Stops capturing without waiting for the render thread. Everything that waits happens in the finalize task.
+	GME->BeginStop();
 	bIsRecording = false;
 	//GME->Stop();
+	bIsInitialize = false;
+	bIsFinalizing = true;
 
-	if (Muxer)
+	TUniquePtr<FMP4Muxer> FinalizingMuxer = MoveTemp(Muxer);
+	TUniquePtr<FSRReplayBuffer> FinalizingReplayBuffer = MoveTemp(ReplayBuffer);
+
+	// Encoding the last frames, draining the sinks and the muxer queue, writing the trailer and tearing the encoders
+	// down grows with the recording length, so it happens on a worker thread and the result comes back through OnRecordingFinalized
+	TWeakObjectPtr<AScreenRecordingManager> WeakThis(this);
+	FinalizeFuture = Async(EAsyncExecution::ThreadPool,
+		[WeakThis, Encoder = GME, FilePath = RecordingFilePath, Muxer = MoveTemp(FinalizingMuxer), ReplayBuffer = MoveTemp(FinalizingReplayBuffer)]() mutable
+		{
+			const double StartTime = FPlatformTime::Seconds();
+			FScreenRecordingStats RecordingStats;
+			bool bSuccess = true;
+
+			// The frames still in flight and the encoders' lookahead go to the sinks, then each delivers what it has queued
+			Encoder->FinishStop();
+			auto DrainSink = [Encoder](ISRMediaSink* Sink)
+			{
+				TUniquePtr<FSRMediaSinkRunner> Runner = Encoder->DetachSink(Sink);
+				if (Runner)
+				{
+					Runner->Stop();
+
+					const FSRMediaSinkStats Stats = Runner->GetStats();
+					UE_LOG(LogTemp, Log, TEXT("Sink %s: %llu packets delivered, %llu dropped, max queue depth %d of %d"),
+						Sink->GetSinkName(), Stats.PacketsDelivered, Stats.PacketsDropped, Stats.MaxQueueDepth, Stats.QueueCapacity);
+				}
+			};
+			if (Muxer)
+			{
+				DrainSink(Muxer.Get());
+			}
+			if (ReplayBuffer)
+			{
+				DrainSink(ReplayBuffer.Get());
+			}
+
+			if (Muxer)
+			{
+				Muxer->Finalize();
+
+				const FMP4MuxerStats Stats = Muxer->GetStats();
+				UE_LOG(LogTemp, Log, TEXT("Muxer wrote %llu packets, %llu bytes adopted, %llu bytes copied"), Stats.PacketsWritten, Stats.BytesAdopted, Stats.BytesCopied);
+				UE_LOG(LogTemp, Log, TEXT("Muxer queue: capacity %d, max depth %d, dropped %llu packets (%llu bytes), blocked %llu times for %.3f s"),
+					Stats.QueueCapacity, Stats.MaxQueueDepth, Stats.PacketsDropped, Stats.BytesDropped, Stats.NumBlocked, Stats.BlockedSeconds);
+				if (Stats.NumSegments > 1)
+				{
+					UE_LOG(LogTemp, Log, TEXT("Muxer wrote %d segments, %llu splits postponed waiting for the next file"), Stats.NumSegments, Stats.SegmentSplitsDeferred);
+				}
+				if (Stats.IONumFlushes > 0)
+				{
+					UE_LOG(LogTemp, Log, TEXT("Muxer I/O: %llu bytes in %llu flushes, %.2f MB/s, flush latency avg %.2f ms max %.2f ms, stalled %.3f s"),
+						Stats.IOBytesWritten, Stats.IONumFlushes, Stats.IOThroughputBytesPerSecond / (1024.0 * 1024.0),
+						Stats.IOAverageFlushSeconds * 1000.0, Stats.IOMaxFlushSeconds * 1000.0, Stats.IOStallSeconds);
+				}
+
+				RecordingStats.PacketsWritten = Stats.PacketsWritten;
+				RecordingStats.PacketsDropped = Stats.PacketsDropped;
+				RecordingStats.BytesWritten = Stats.IONumFlushes > 0 ? Stats.IOBytesWritten : Stats.BytesAdopted + Stats.BytesCopied;
+				RecordingStats.NumSegments = Stats.NumSegments;
+				RecordingStats.MaxQueueDepth = Stats.MaxQueueDepth;
+				RecordingStats.BlockedSeconds = Stats.BlockedSeconds;
+				bSuccess = Stats.PacketsWritten > 0;
+
+				Muxer.Reset();
+			}
+
+			if (ReplayBuffer)
+			{
+				const FSRReplayBufferStats Stats = ReplayBuffer->GetStats();
+				UE_LOG(LogTemp, Log, TEXT("Replay buffer: %d packets in %d GOPs, %.1f s, %lld of %lld bytes, %llu GOPs evicted, %llu packets dropped"),
+					Stats.NumPackets, Stats.NumGops, Stats.BufferedSeconds, Stats.BytesUsed, Stats.SlabSize, Stats.GopsEvicted, Stats.PacketsDropped);
+
+				// Waits for a replay that is still being saved
+				ReplayBuffer.Reset();
+			}
+
+			Encoder->Shutdown();
+
+			RecordingStats.FinalizeSeconds = FPlatformTime::Seconds() - StartTime;
+			UE_LOG(LogTemp, Log, TEXT("Recording finalized in %.3f s"), RecordingStats.FinalizeSeconds);
+
+			AsyncTask(ENamedThreads::GameThread, [WeakThis, FilePath, bSuccess, RecordingStats]()
+				{
+					if (WeakThis.IsValid())
+					{
+						WeakThis->OnAsyncFinalizeCompleted(FilePath, bSuccess, RecordingStats);
+					}
+				});
+		});
+}
+
+void AScreenRecordingManager::OnAsyncFinalizeCompleted(const FString& FilePath, bool bSuccess, const FScreenRecordingStats& Stats)
+{
+	bIsFinalizing = false;
+	OnRecordingFinalized.Broadcast(FilePath, bSuccess, Stats);
+}
+
+bool AScreenRecordingManager::SaveReplay(float Seconds, const FString& FileName)
+{
+	if (!ReplayBuffer || !bIsRecording)
 	{
-		Muxer->Finalize();
-		Muxer.Reset();
-		GME->Shutdown();
-		bIsInitialize = false;
+		return false;
+	}
+
+	const FString FilePath = FPaths::ProjectSavedDir() / FileName;
+	TWeakObjectPtr<AScreenRecordingManager> WeakThis(this);
+	return ReplayBuffer->SaveReplay(Seconds, FilePath, [WeakThis, FilePath](bool bSuccess)
+		{
+			AsyncTask(ENamedThreads::GameThread, [WeakThis, FilePath, bSuccess]()
+				{
+					if (WeakThis.IsValid())
+					{
+						WeakThis->OnReplaySaved.Broadcast(bSuccess, FilePath);
+					}
+				});
+		});
+}
+
+bool AScreenRecordingManager::SetResolution(int32 Width, int32 Height)
+{
+	if (!bIsInitialize || Width < 0 || Height < 0)
+	{
+		return false;
 	}
+	return GME->SetResolution(Width, Height);
 }
 
-void AScreenRecordingManager::OnMediaSample(const AVEncoder::FMediaPacket& Sample)
+void AScreenRecordingManager::RemoveSinks()
 {
-	UE_LOG(LogTemp, Log, TEXT("Get Packet"));
 	if (Muxer)
 	{
-		FScopeLock Lock(&MuxerCS);
-		Muxer->AddPacket(Sample);
+		GME->RemoveSink(Muxer.Get());
 	}
-}
\ No newline at end of file
+	if (ReplayBuffer)
+	{
+		GME->RemoveSink(ReplayBuffer.Get());
+	}
+}
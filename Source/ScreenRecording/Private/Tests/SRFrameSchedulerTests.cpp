@@ -0,0 +1,152 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#include "CoreMinimal.h"
+#include "Misc/AutomationTest.h"
+#include "Math/RandomStream.h"
+#include "SRFrameScheduler.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	const int32 TestMaxRepeats = 2;
+
+	struct FPacingResult
+	{
+		// Of the frames that were kept
+		TArray<FTimespan> CaptureTimes;
+		TArray<FTimespan> Timestamps;
+		FSRFrameSchedulerStats Stats;
+	};
+
+	// Frames rendered at CaptureFPS for Seconds, each up to JitterMs early or late, scheduled on a manual clock
+	FPacingResult SimulatePacing(ESRFrameRateMode Mode, uint32 Framerate, double CaptureFPS, double Seconds, double JitterMs)
+	{
+		TUniquePtr<FSRManualClock> ManualClock = MakeUnique<FSRManualClock>();
+		FSRManualClock* Clock = ManualClock.Get();
+		FSRFrameScheduler Scheduler(MoveTemp(ManualClock));
+		Scheduler.Configure(Mode, Framerate, TestMaxRepeats);
+		Scheduler.Reset();
+
+		FRandomStream Random(42);
+		FPacingResult Result;
+		FSRFrameScheduler::FTimestamps Timestamps;
+		for(int64 Frame = 0; Frame < int64(Seconds * CaptureFPS); ++Frame)
+		{
+			const double JitterSeconds = Random.FRandRange(-JitterMs, JitterMs) / 1000.0;
+			Clock->Set(FTimespan::FromSeconds(FMath::Max(Frame / CaptureFPS + JitterSeconds, 0.0)));
+			if(Scheduler.Schedule(Timestamps))
+			{
+				Result.CaptureTimes.Add(Clock->Now());
+				Result.Timestamps.Append(Timestamps.GetData(), Timestamps.Num());
+			}
+		}
+		Result.Stats = Scheduler.GetStats();
+		return Result;
+	}
+
+	// Every timestamp one grid step after the last, give or take the tick the grid rounds off
+	bool IsOnGrid(const TArray<FTimespan>& Timestamps, uint32 Framerate)
+	{
+		const int64 Step = ETimespan::TicksPerSecond / Framerate;
+		for(int32 Index = 1; Index < Timestamps.Num(); ++Index)
+		{
+			if(FMath::Abs((Timestamps[Index] - Timestamps[Index - 1]).GetTicks() - Step) > 1)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool IsIncreasing(const TArray<FTimespan>& Timestamps)
+	{
+		for(int32 Index = 1; Index < Timestamps.Num(); ++Index)
+		{
+			if(Timestamps[Index] <= Timestamps[Index - 1])
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSRFrameSchedulerConstantTest, "ScreenRecording.FrameScheduler.ConstantFrameRate", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSRFrameSchedulerConstantTest::RunTest(const FString& Parameters)
+{
+	// Rendering faster than the grid: one frame per grid point, the others dropped
+	const FPacingResult Fast = SimulatePacing(ESRFrameRateMode::Constant, 60, 144.0, 10.0, 1.0);
+	TestTrue(TEXT("144 to 60 fps: timestamps on the grid"), IsOnGrid(Fast.Timestamps, 60));
+	TestTrue(TEXT("144 to 60 fps: 60 timestamps a second"), FMath::Abs(Fast.Timestamps.Num() - 600) <= 1);
+	TestEqual(TEXT("144 to 60 fps: frames dropped"), int32(Fast.Stats.NumDropped), int32(Fast.Stats.NumFrames) - Fast.CaptureTimes.Num());
+	TestEqual(TEXT("144 to 60 fps: repeats"), int32(Fast.Stats.NumRepeats), 0);
+	TestEqual(TEXT("144 to 60 fps: grid points skipped"), int32(Fast.Stats.NumSkipped), 0);
+
+	// Rendering at half the rate: every frame after the first is repeated once
+	const FPacingResult Slow = SimulatePacing(ESRFrameRateMode::Constant, 60, 30.0, 10.0, 1.0);
+	TestTrue(TEXT("30 to 60 fps: timestamps on the grid"), IsOnGrid(Slow.Timestamps, 60));
+	TestEqual(TEXT("30 to 60 fps: frames dropped"), int32(Slow.Stats.NumDropped), 0);
+	TestEqual(TEXT("30 to 60 fps: repeats"), int32(Slow.Stats.NumRepeats), int32(Slow.Stats.NumFrames) - 1);
+	TestEqual(TEXT("30 to 60 fps: grid points skipped"), int32(Slow.Stats.NumSkipped), 0);
+
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSRFrameSchedulerStallTest, "ScreenRecording.FrameScheduler.Stall", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSRFrameSchedulerStallTest::RunTest(const FString& Parameters)
+{
+	TUniquePtr<FSRManualClock> ManualClock = MakeUnique<FSRManualClock>();
+	FSRManualClock* Clock = ManualClock.Get();
+	FSRFrameScheduler Scheduler(MoveTemp(ManualClock));
+	Scheduler.Configure(ESRFrameRateMode::Constant, 60, TestMaxRepeats);
+	Scheduler.Reset();
+
+	FSRFrameScheduler::FTimestamps Timestamps;
+	for(int32 Frame = 0; Frame < 60; ++Frame)
+	{
+		Clock->Set(FTimespan::FromSeconds(Frame / 60.0));
+		Scheduler.Schedule(Timestamps);
+	}
+
+	// A 100 ms hitch misses grid points 60 to 65. The frame after it fills the last two and the rest stay empty.
+	Clock->Set(FTimespan::FromSeconds(1.1));
+	TestTrue(TEXT("Frame after the hitch kept"), Scheduler.Schedule(Timestamps));
+	TestEqual(TEXT("Timestamps of the frame after the hitch"), Timestamps.Num(), 1 + TestMaxRepeats);
+	if(Timestamps.Num() == 1 + TestMaxRepeats)
+	{
+		TestEqual(TEXT("First repeat"), Timestamps[0].GetTicks(), 64 * ETimespan::TicksPerSecond / 60);
+		TestEqual(TEXT("Frame's own grid point"), Timestamps.Last().GetTicks(), 66 * ETimespan::TicksPerSecond / 60);
+	}
+
+	const FSRFrameSchedulerStats Stats = Scheduler.GetStats();
+	TestEqual(TEXT("Repeats"), int32(Stats.NumRepeats), TestMaxRepeats);
+	TestEqual(TEXT("Grid points skipped"), int32(Stats.NumSkipped), 4);
+	TestEqual(TEXT("Frames dropped"), int32(Stats.NumDropped), 0);
+
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSRFrameSchedulerVariableTest, "ScreenRecording.FrameScheduler.VariableFrameRate", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSRFrameSchedulerVariableTest::RunTest(const FString& Parameters)
+{
+	// Frames keep their capture times, and at most one is kept per grid point
+	const FPacingResult Limited = SimulatePacing(ESRFrameRateMode::Variable, 60, 144.0, 10.0, 1.0);
+	TestTrue(TEXT("VFR 60: frames keep their capture times"), Limited.Timestamps == Limited.CaptureTimes);
+	TestTrue(TEXT("VFR 60: timestamps increase"), IsIncreasing(Limited.Timestamps));
+	TestTrue(TEXT("VFR 60: one frame per grid point"), FMath::Abs(Limited.Timestamps.Num() - 600) <= 1);
+	TestEqual(TEXT("VFR 60: repeats"), int32(Limited.Stats.NumRepeats), 0);
+
+	// No limit: every frame is kept, jitter and all
+	const FPacingResult Unlimited = SimulatePacing(ESRFrameRateMode::Variable, 0, 144.0, 10.0, 1.0);
+	TestTrue(TEXT("VFR unlimited: frames keep their capture times"), Unlimited.Timestamps == Unlimited.CaptureTimes);
+	TestTrue(TEXT("VFR unlimited: timestamps increase"), IsIncreasing(Unlimited.Timestamps));
+	TestEqual(TEXT("VFR unlimited: frames dropped"), int32(Unlimited.Stats.NumDropped), 0);
+
+	return true;
+}
+
+#endif // WITH_DEV_AUTOMATION_TESTS
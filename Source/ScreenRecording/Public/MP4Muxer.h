@@ -2,6 +2,13 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Containers/LockFreeList.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "HAL/Event.h"
+#include "SRBoundedQueue.h"
+#include "SRMediaSink.h"
+#include "Async/Future.h"
 #include "AudioEncoder.h"
 #include "VideoEncoder.h"
 #include "MediaPacket.h"
@@ -13,31 +20,286 @@ struct AVStream;
 struct AVPacket;
 struct AVCodecParameters;
 
-class SCREENRECORDING_API FMP4Muxer
+class FSRAsyncFileOutput;
+
+namespace SRH264
+{
+    struct FParameterSets;
+}
+
+// What a producer does when the writer queue is full
+enum class EMP4MuxerOverflowPolicy : uint8
+{
+    // Wait for the writer thread to make room. Nothing is lost, but a slow disk stalls the encoder.
+    Block,
+    // Drop non-key video packets (and the rest of their GOP). Audio and keyframes still block.
+    DropNonKeyVideo,
+    // Discard the oldest queued GOP to make room for new packets.
+    DropOldestGop,
+};
+
+struct FMP4MuxerOptions
+{
+    // Maximum number of packets waiting for the writer thread. Rounded up to a power of two.
+    int32 QueueCapacity = 512;
+    EMP4MuxerOverflowPolicy OverflowPolicy = EMP4MuxerOverflowPolicy::Block;
+
+    // Write fragmented MP4 (moof/mdat fragments, CMAF compatible) instead of a single moov written at the end.
+    // Index memory stays constant, Finalize only has to flush the last fragment, and the file is playable
+    // up to the last complete fragment if the process dies.
+    bool bFragmented = false;
+    // Minimum fragment duration. Fragments start on the first keyframe after this much media time, so every fragment
+    // starts with one. A GOP longer than 4x this asks the encoder for a keyframe, if the muxer is its sink.
+    int32 FragmentDurationMs = 2000;
+
+    // Size of the buffers the file is written from. When > 0, the file is written through a custom AVIOContext that
+    // hands full buffers to a background I/O thread, so the writer thread never waits for the disk. 0 uses plain avio_open.
+    int32 IOBufferSizeMB = 8;
+    int32 IONumBuffers = 2;
+    // The end of the file is moved this far at a time ahead of the writes and trimmed back on Finalize. 0 grows it with
+    // each write. Not done for fragmented files: after a crash the zeros past the last fragment would stay in the file.
+    int32 IOGrowthMB = 256;
+
+    // Roll over to a new file (Name_000.mp4, Name_001.mp4, ...) once a segment is this long or this big. 0 disables either limit.
+    // Splits happen on video keyframes and every segment starts at timestamp 0, so each one plays on its own
+    // and concatenating them gives back the whole recording without gaps.
+    double SegmentDurationSeconds = 0;
+    int32 SegmentSizeMB = 0;
+};
+
+// Ingest counters, safe to read from any thread while the muxer is running.
+struct FMP4MuxerStats
+{
+    uint64 PacketsWritten = 0;
+    // Payload bytes handed to libavformat by reference, without a copy
+    uint64 BytesAdopted = 0;
+    // Payload bytes that had to be copied because the caller kept ownership
+    uint64 BytesCopied = 0;
+    // Copy rate over the last completed one second window. Should stay at 0 on the zero-copy path.
+    uint64 BytesCopiedPerSecond = 0;
+
+    // Writer queue
+    int32 QueueCapacity = 0;
+    int32 QueueDepth = 0;
+    int32 MaxQueueDepth = 0;
+    uint64 PacketsDropped = 0;
+    uint64 BytesDropped = 0;
+    // How many times, and for how long in total, producers waited for room in the queue
+    uint64 NumBlocked = 0;
+    double BlockedSeconds = 0;
+
+    // Number of files written, 1 unless segmenting
+    int32 NumSegments = 0;
+    // Splits postponed to a later keyframe because the next file was not open yet
+    uint64 SegmentSplitsDeferred = 0;
+
+    // File output, only filled in when the buffered I/O backend is used. Covers all segments.
+    uint64 IOBytesWritten = 0;
+    uint64 IONumFlushes = 0;
+    double IOThroughputBytesPerSecond = 0;
+    double IOAverageFlushSeconds = 0;
+    double IOMaxFlushSeconds = 0;
+    // How long the writer thread waited for a free I/O buffer
+    double IOStallSeconds = 0;
+};
+
+// Muxes encoded H.264/AAC packets into an MP4 file.
+// AddPacket only enqueues; a dedicated writer thread owns the AVFormatContext and does all the file I/O.
+// The picture size can change at any keyframe (FSRGameplayMediaEncoder::SetResolution). The file goes on: the new SPS/PPS
+// are in band with the keyframe, and files that haven't been started yet, like the next segment, get them in their header.
+class SCREENRECORDING_API FMP4Muxer : private FRunnable, public ISRMediaSink
 {
 public:
     FMP4Muxer();
     ~FMP4Muxer();
 
     // Initializes the muxer, creates streams, and writes the file header.
-    bool Initialize(const FString& FilePath, const AVEncoder::FVideoConfig& VideoConfig, const AVEncoder::FAudioConfig& AudioConfig);
+    bool Initialize(const FString& FilePath, const AVEncoder::FVideoConfig& InVideoConfig, const AVEncoder::FAudioConfig& InAudioConfig, const FMP4MuxerOptions& InOptions = FMP4MuxerOptions());
 
     // Add an encoded media packet (from your listener) to the file.
+    // The payload is copied into a recycled buffer, since the caller keeps ownership of it.
     bool AddPacket(const AVEncoder::FMediaPacket& Packet);
 
-    // Finalizes the file writing (writes trailer) and cleans up resources.
+    // Add an encoded media packet, adopting its payload storage.
+    // The data is handed to libavformat as a refcounted buffer, so nothing is allocated or copied.
+    bool AddPacket(AVEncoder::FMediaPacket&& Packet);
+
+    // Add a packet published by FSRGameplayMediaEncoder.
+    // The muxer keeps a reference to it and hands the shared payload to libavformat read-only, without a copy.
+    bool AddPacket(const FSRMediaPacketPtr& Packet);
+
+    // ISRMediaSink interface
+    void OnMediaPacket(const FSRMediaPacketPtr& Packet) override { AddPacket(Packet); }
+    const TCHAR* GetSinkName() const override { return TEXT("MP4Muxer"); }
+    // Segments ask for a keyframe when they are due, so they split on time instead of at the end of the GOP
+    void SetKeyframeRequester(TFunction<bool()> Requester) override { KeyframeRequester = MoveTemp(Requester); }
+
+    // Drains the queue, stops the writer thread, writes the trailer and cleans up resources.
     void Finalize();
 
+    FMP4MuxerStats GetStats() const;
+
 private:
-    bool AddVideoStream(const AVEncoder::FVideoConfig& Config);
-    bool AddAudioStream(const AVEncoder::FAudioConfig& Config);
+    // Owns the payload of one packet while libavformat holds a reference to it.
+    // Recycled through FreePayloads once the last AVBufferRef is released.
+    struct FPayload
+    {
+        TArray<uint8> Data;
+        // Set instead of Data for packets shared with other sinks
+        FSRMediaPacketPtr Shared;
+        FMP4Muxer* Owner = nullptr;
+
+        const uint8* GetData() const { return Shared ? Shared->GetData() : Data.GetData(); }
+        int32 Num() const { return Shared ? Shared->Num() : Data.Num(); }
+    };
+
+    // One output file with its own format context. Segmented recordings go through several of them.
+    struct FOutput
+    {
+        FString FilePath;
+        AVFormatContext* FormatContext = nullptr;
+        AVStream* VideoStream = nullptr;
+        AVStream* AudioStream = nullptr;
+        // Owns FormatContext->pb when the buffered I/O backend is used
+        TUniquePtr<FSRAsyncFileOutput> AsyncOutput;
+        bool bIsHeaderWritten = false;
+        // Timestamp of the keyframe the file starts with
+        FTimespan StartTimestamp;
+        // Subtracted from every timestamp written to this file. Segments start at 0, a single file keeps the encoder's clock.
+        FTimespan TimestampOffset;
+        int64 PayloadBytes = 0;
+        // What libavformat's sample tables for this file are estimated to hold, counted by FSRMemoryTracker
+        int64 IndexBytes = 0;
+    };
+
+    // One entry of the writer queue. Owns Payload until it is written or dropped.
+    struct FQueuedPacket
+    {
+        FPayload* Payload = nullptr;
+        AVEncoder::EPacketType Type = AVEncoder::EPacketType::Video;
+        FTimespan Timestamp;
+        FTimespan Duration;
+        bool bKeyFrame = false;
+        // H.264 payload that is already length prefixed
+        bool bIsAvcc = false;
+        // Video only, 0 if the producer didn't say
+        uint32 Width = 0;
+        uint32 Height = 0;
+        uint32 CopiedBytes = 0;
+        // FPlatformTime::Cycles64 when the frame was captured (0 if unknown) and when the packet was queued here
+        uint64 CaptureCycles = 0;
+        uint64 QueuedCycles = 0;
+    };
+
+    // FRunnable interface
+    uint32 Run() override;
+
+    // Creates the format context and streams and opens the file. Called on a background thread for upcoming segments,
+    // so the video config is passed in rather than read from VideoConfig.
+    FOutput* OpenOutput(const FString& FilePath, const AVEncoder::FVideoConfig& InVideoConfig);
+    // Writes the trailer and closes the file
+    void CloseOutput(FOutput& Out);
+    void CloseOutputAsync(TUniquePtr<FOutput> Out);
+    bool AddVideoStream(FOutput& Out, const AVEncoder::FVideoConfig& Config);
+    bool AddAudioStream(FOutput& Out, const AVEncoder::FAudioConfig& Config);
+
+    bool IsSegmented() const { return Options.SegmentDurationSeconds > 0 || Options.SegmentSizeMB > 0; }
+    FString GetSegmentPath(int32 Index) const;
+    void PrepareNextSegment();
+    // The current segment is long or big enough
+    bool IsSegmentDue(FTimespan Timestamp) const;
+    bool ShouldStartSegment(FTimespan KeyFrameTimestamp);
+    void StartNextSegment(FTimespan KeyFrameTimestamp);
+
+    FPayload* AcquirePayload();
+    static void ReleasePayload(void* Opaque, uint8* Data);
+    bool EnqueuePacket(const AVEncoder::FMediaPacket& Packet, FPayload* Payload, uint32 CopiedBytes);
+    bool EnqueuePacket(FQueuedPacket& Queued);
+    // Takes the packet at the head of the queue
+    bool DequeuePacket(FQueuedPacket& Queued);
+    void WaitForQueueSpace();
+    void DrainQueue();
+    void DropOldestGop();
+    void DropPacket(FQueuedPacket& Queued);
+    // A keyframe of another size: the encoder started over with new parameter sets. The file goes on, see AddVideoStream.
+    void ChangeVideoParameters(uint32 Width, uint32 Height, FTimespan Timestamp);
+    void ConvertVideoPayload(FPayload* Payload, bool bKeyFrame, bool bIsAvcc);
+    void SetVideoExtradata(const SRH264::FParameterSets& ParameterSets);
+    void ApplyVideoExtradata(FOutput& Out);
+    bool WriteHeader(FOutput& Out);
+    bool WritePacket(FQueuedPacket& Queued);
+    // Writer thread: adds to CopyRateWindowBytes and folds it into BytesCopiedPerSecond once a second
+    void UpdateCopyRate(uint32 NumCopiedBytes);
+
+    FMP4MuxerOptions Options;
+
+    TUniquePtr<TSRBoundedMpscQueue<FQueuedPacket>> Queue;
+    FRunnableThread* WriterThread = nullptr;
+    // Wakes the writer thread up when packets are queued
+    FEvent* WorkEvent = nullptr;
+    // Wakes blocked producers up when the writer thread made room
+    FEvent* SpaceEvent = nullptr;
+    TAtomic<bool> bStopWriter{ false };
+    TAtomic<bool> bAcceptingPackets{ false };
+    // Producers inside AddPacket. Finalize waits for them to leave before it stops the writer and frees the queue.
+    TAtomic<int32> NumProducers{ 0 };
+    TAtomic<int32> PendingGopDrops{ 0 };
+    // DropNonKeyVideo: once a P frame is dropped, every video packet up to the next keyframe must go too
+    TAtomic<bool> bDropVideoUntilKeyFrame{ false };
+
+    TAtomic<int32> MaxQueueDepth{ 0 };
+    TAtomic<uint64> PacketsDropped{ 0 };
+    TAtomic<uint64> BytesDropped{ 0 };
+    TAtomic<uint64> NumBlocked{ 0 };
+    TAtomic<uint64> BlockedCycles{ 0 };
+
+    FString BaseFilePath;
+    AVEncoder::FVideoConfig VideoConfig;
+    AVEncoder::FAudioConfig AudioConfig;
+
+    // The file packets are written to. Only the writer thread touches it once it is running.
+    TUniquePtr<FOutput> Output;
+    // The segment before Output, kept open for audio that was captured before the split but arrives after it
+    TUniquePtr<FOutput> PreviousOutput;
+    // The segment after Output, opened ahead of time on a background thread
+    TFuture<FOutput*> NextOutput;
+    // Segments whose trailer is being written on a background thread
+    TArray<TFuture<void>> ClosingOutputs;
+    int32 SegmentIndex = 0;
+    TAtomic<int32> NumSegments{ 0 };
+    TAtomic<uint64> SegmentSplitsDeferred{ 0 };
+    // Set before the first packet when the muxer is a sink. The writer thread asks for one keyframe per split.
+    TFunction<bool()> KeyframeRequester;
+    bool bSegmentKeyframeRequested = false;
+    // Fragmented output: the last video keyframe, and whether the fragment it started asked for the next one
+    FTimespan LastVideoKeyframe;
+    bool bFragmentKeyframeRequested = false;
+
+    // Guards swapping Output and folding the I/O stats of closed files into the Closed* totals
+    mutable FCriticalSection IOStatsCS;
+    uint64 ClosedIOBytes = 0;
+    uint64 ClosedIOFlushes = 0;
+    double ClosedIOWriteSeconds = 0;
+    double ClosedIOMaxFlushSeconds = 0;
+    double ClosedIOStallSeconds = 0;
+    double IOStartTime = 0;
+    double IOEndTime = 0;
+
+    // Reused for every packet, only touched by the writer thread. av_interleaved_write_frame takes the buffer reference and leaves it blank.
+    AVPacket* ScratchPacket = nullptr;
+
+    TLockFreePointerListUnordered<FPayload, PLATFORM_CACHE_LINE_SIZE> FreePayloads;
+    TAtomic<int32> NumPayloads{ 0 };
 
-    AVFormatContext* FormatContext = nullptr;
-    AVStream* VideoStream = nullptr;
-    AVStream* AudioStream = nullptr;
+    TAtomic<uint64> PacketsWritten{ 0 };
+    TAtomic<uint64> BytesAdopted{ 0 };
+    TAtomic<uint64> BytesCopied{ 0 };
+    TAtomic<uint64> BytesCopiedPerSecond{ 0 };
+    uint64 CopyRateWindowBytes = 0;
+    double CopyRateWindowStart = 0;
 
-    // We need to get the codec extradata (SPS/PPS for H.264)
-    // This is often in the first packet from the encoder.
+    // avcC record built from the SPS/PPS of the first keyframe, or of the first one after a parameter change
     TArray<uint8> VideoExtradata;
-    bool bIsHeaderWritten = false;
-};
\ No newline at end of file
+    // Target of the out of place Annex-B conversion, swapped with the payload storage so it is reused
+    TArray<uint8> AvccScratch;
+};
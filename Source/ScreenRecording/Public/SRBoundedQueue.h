@@ -0,0 +1,114 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Bounded lock-free queue for multiple producers and a single consumer.
+ *
+ * Every slot carries a sequence number that tells producers and the consumer whose turn it is, so
+ * no slot is ever touched by two threads at once and nothing is allocated after construction.
+ * The capacity is rounded up to a power of two.
+ */
+template<typename ElementType>
+class TSRBoundedMpscQueue
+{
+public:
+	explicit TSRBoundedMpscQueue(uint32 InCapacity)
+	{
+		const uint32 Capacity = FMath::RoundUpToPowerOfTwo(FMath::Max(InCapacity, 2u));
+		IndexMask = Capacity - 1;
+		Slots.SetNum(Capacity);
+		for (uint32 Index = 0; Index < Capacity; ++Index)
+		{
+			Slots[Index].Sequence.Store(Index, EMemoryOrder::Relaxed);
+		}
+	}
+
+	TSRBoundedMpscQueue(const TSRBoundedMpscQueue&) = delete;
+	TSRBoundedMpscQueue& operator=(const TSRBoundedMpscQueue&) = delete;
+
+	/** Can be called from any number of threads. Returns false if the queue is full. */
+	bool TryEnqueue(ElementType&& Item)
+	{
+		uint32 Pos = Tail.Load(EMemoryOrder::Relaxed);
+		for (;;)
+		{
+			FSlot& Slot = Slots[Pos & IndexMask];
+			const uint32 Sequence = Slot.Sequence.Load();
+			const int32 Diff = static_cast<int32>(Sequence - Pos);
+			if (Diff == 0)
+			{
+				if (Tail.CompareExchange(Pos, Pos + 1))
+				{
+					Slot.Item = MoveTemp(Item);
+					Slot.Sequence.Store(Pos + 1);
+					return true;
+				}
+				// CompareExchange updated Pos with the current tail, try again from there
+			}
+			else if (Diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				Pos = Tail.Load(EMemoryOrder::Relaxed);
+			}
+		}
+	}
+
+	/** Consumer thread only. Returns the oldest item without removing it, or nullptr if the queue is empty. */
+	ElementType* Peek()
+	{
+		FSlot& Slot = Slots[Head & IndexMask];
+		if (static_cast<int32>(Slot.Sequence.Load() - (Head + 1)) < 0)
+		{
+			return nullptr;
+		}
+		return &Slot.Item;
+	}
+
+	/** Consumer thread only. */
+	bool TryDequeue(ElementType& OutItem)
+	{
+		FSlot& Slot = Slots[Head & IndexMask];
+		if (static_cast<int32>(Slot.Sequence.Load() - (Head + 1)) < 0)
+		{
+			return false;
+		}
+
+		OutItem = MoveTemp(Slot.Item);
+		Slot.Sequence.Store(Head + IndexMask + 1);
+		++Head;
+		ConsumedHead.Store(Head, EMemoryOrder::Relaxed);
+		return true;
+	}
+
+	/** Approximate number of queued items. Safe to call from any thread. */
+	int32 Num() const
+	{
+		const uint32 Used = Tail.Load(EMemoryOrder::Relaxed) - ConsumedHead.Load(EMemoryOrder::Relaxed);
+		return static_cast<int32>(FMath::Min(Used, IndexMask + 1));
+	}
+
+	int32 Capacity() const
+	{
+		return static_cast<int32>(IndexMask + 1);
+	}
+
+private:
+	struct FSlot
+	{
+		TAtomic<uint32> Sequence{ 0 };
+		ElementType Item;
+	};
+
+	TArray<FSlot> Slots;
+	uint32 IndexMask = 0;
+
+	alignas(PLATFORM_CACHE_LINE_SIZE) TAtomic<uint32> Tail{ 0 };
+	alignas(PLATFORM_CACHE_LINE_SIZE) uint32 Head = 0;
+	TAtomic<uint32> ConsumedHead{ 0 };
+};
@@ -0,0 +1,137 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/PlatformTime.h"
+
+/** Where the frame scheduler gets the time from: the recording's timeline, zero at Reset. */
+class ISRClock
+{
+public:
+	virtual ~ISRClock() = default;
+
+	/** Any thread */
+	virtual FTimespan Now() const = 0;
+	/** Starts the timeline over at zero */
+	virtual void Reset() = 0;
+};
+
+/** FPlatformTime since the last Reset. */
+class FSRPlatformClock final : public ISRClock
+{
+public:
+	FSRPlatformClock()
+	{
+		Reset();
+	}
+
+	FTimespan Now() const override
+	{
+		return FTimespan::FromSeconds((FPlatformTime::Cycles64() - StartCycles.Load()) * FPlatformTime::GetSecondsPerCycle64());
+	}
+
+	void Reset() override
+	{
+		StartCycles = FPlatformTime::Cycles64();
+	}
+
+private:
+	TAtomic<uint64> StartCycles{ 0 };
+};
+
+/** Time that only moves when told to, to drive a scheduler from a simulation or a test instead of a renderer. */
+class FSRManualClock final : public ISRClock
+{
+public:
+	FTimespan Now() const override { return FTimespan(Ticks.Load()); }
+	void Reset() override { Ticks = 0; }
+
+	void Set(FTimespan Time) { Ticks = Time.GetTicks(); }
+	void Advance(FTimespan Delta) { Ticks += Delta.GetTicks(); }
+
+private:
+	TAtomic<int64> Ticks{ 0 };
+};
+
+enum class ESRFrameRateMode : uint8
+{
+	/**
+	 * Frames go on a fixed grid of Framerate frames per second: each one takes the grid point nearest to when it was
+	 * captured, a frame whose grid point is already taken is dropped, and grid points missed since the last frame are
+	 * filled by repeating the new one.
+	 */
+	Constant,
+	/** Frames keep the time they were captured at. Those coming faster than Framerate are dropped, none with Framerate 0. */
+	Variable,
+};
+
+/** Since the last Reset */
+struct FSRFrameSchedulerStats
+{
+	/** Frames passed to Schedule */
+	uint64 NumFrames = 0;
+	/** Frames that got no timestamp */
+	uint64 NumDropped = 0;
+	/** Extra timestamps given to frames to fill the grid */
+	uint64 NumRepeats = 0;
+	/** Grid points left empty because filling them would have taken more than MaxRepeats */
+	uint64 NumSkipped = 0;
+};
+
+/**
+ * Frame pacing for video capture: maps the times frames are captured at to the timestamps they are encoded with,
+ * dropping or repeating frames to hold the frame rate. Thread safe, frames can come from several threads.
+ * Timestamps always increase.
+ */
+class SCREENRECORDING_API FSRFrameScheduler
+{
+public:
+	/** Timestamps one frame is encoded at, oldest first */
+	using FTimestamps = TArray<FTimespan, TInlineAllocator<4>>;
+
+	explicit FSRFrameScheduler(TUniquePtr<ISRClock> InClock = MakeUnique<FSRPlatformClock>());
+
+	/**
+	 * @param Framerate Frames per second, 0 for no limit (variable frame rate only)
+	 * @param MaxRepeats How many times a frame can be repeated to fill the grid. A longer stall leaves a gap instead.
+	 */
+	void Configure(ESRFrameRateMode InMode, uint32 InFramerate, int32 InMaxRepeats);
+	/**
+	 * Changes the frame rate from the next frame on. The constant rate grid restarts at the first point not filled yet,
+	 * so the frames already scheduled keep their timestamps.
+	 */
+	void SetFramerate(uint32 InFramerate);
+	/** Starts a new recording: restarts the clock and forgets the frames so far. */
+	void Reset();
+
+	/** Schedules a frame captured now. False if it is dropped. */
+	bool Schedule(FTimestamps& OutTimestamps);
+	/** Schedules a frame captured at a given time of the timeline. False if it is dropped. */
+	bool Schedule(FTimespan CaptureTime, FTimestamps& OutTimestamps);
+
+	FTimespan Now() const { return Clock->Now(); }
+	ESRFrameRateMode GetMode() const { return Mode; }
+	FSRFrameSchedulerStats GetStats() const;
+
+private:
+	// Grid point nearest to Time, counted from GridOrigin. Negative before it.
+	int64 GetNearestSlot(FTimespan Time) const;
+	FTimespan GetSlotTime(int64 Slot) const;
+
+	TUniquePtr<ISRClock> Clock;
+
+	mutable FCriticalSection CS;
+	ESRFrameRateMode Mode = ESRFrameRateMode::Constant;
+	uint32 Framerate = 30;
+	int32 MaxRepeats = 0;
+
+	// Grid point Slot is at GridOrigin + Slot / Framerate, computed from the slot number so rounding never adds up
+	FTimespan GridOrigin = 0;
+	// First grid point no frame has taken yet
+	int64 NextSlot = 0;
+	bool bHasFrame = false;
+	FTimespan LastTimestamp = 0;
+
+	FSRFrameSchedulerStats Stats;
+};
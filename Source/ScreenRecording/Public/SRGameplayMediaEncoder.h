@@ -9,6 +9,7 @@
 
 #include "RHI.h"
 #include "RHIResources.h"
+#include "RHIGPUReadback.h"
 
 #include "HAL/Thread.h"
 
@@ -25,8 +26,41 @@ THIRD_PARTY_INCLUDES_END
 #include "VideoEncoder.h"
 #include "MediaPacket.h"
 #include "VideoEncoderInput.h"
+#include "SRMediaSink.h"
+#include "SRBoundedQueue.h"
+#include "SRSampleRing.h"
+#include "SRVideoFrame.h"
+#include "SRFrameScheduler.h"
 
 class SWindow;
+class FSRAudioResampler;
+namespace SRVideo { class FFrameConverter; }
+class FSRAsyncListener;
+
+/** How a listener or sink can force keyframes. Every forced keyframe costs bitrate, so they are rate limited per consumer. */
+struct FSRKeyframePolicy
+{
+	/** Forced keyframes for this consumer are at least this far apart. Requests in between are turned down. */
+	FTimespan MinInterval = FTimespan::FromSeconds(1);
+	/** Ask for one on registering, so the consumer can start right away instead of waiting for the rest of the GOP */
+	bool bOnRegister = true;
+};
+
+/** What one simulcast layer cost so far. Scale and encode times are only known per layer with the software encoder. */
+struct FSRVideoLayerStats
+{
+	uint32 Width = 0;
+	uint32 Height = 0;
+	uint32 TargetBitrate = 0;
+	uint64 Frames = 0;
+	uint64 Keyframes = 0;
+	uint64 Bytes = 0;
+	/** Bits per second of what was recorded */
+	double AverageBitrate = 0;
+	/** Scaling the captured frames to the layer's size */
+	double ScaleSeconds = 0;
+	double EncodeSeconds = 0;
+};
 
 class SCREENRECORDING_API FSRGameplayMediaEncoder final : private ISubmixBufferListener, public AVEncoder::IAudioEncoderListener
 {
@@ -39,11 +73,81 @@ public:
 
 	~FSRGameplayMediaEncoder();
 
-	bool RegisterListener(IGameplayMediaEncoderListener* Listener);
+	/**
+	 * @param bAsync Deliver on a thread of the listener's own, through a bounded queue, instead of on the encoder's threads.
+	 *               The encoder callbacks then never wait for the listener, and a listener that falls behind loses packets.
+	 * @param QueueCapacity How many packets an async listener can fall behind
+	 * @param LayerIndex The video layer the listener gets, see AddVideoLayer. Audio goes to everyone.
+	 * @param KeyframePolicy How often the listener can force keyframes with RequestKeyframe
+	 */
+	bool RegisterListener(IGameplayMediaEncoderListener* Listener, bool bAsync = false, int32 QueueCapacity = 256, uint32 LayerIndex = 0, const FSRKeyframePolicy& KeyframePolicy = FSRKeyframePolicy());
 	void UnregisterListener(IGameplayMediaEncoderListener* Listener);
 
+	/**
+	 * Sinks receive every encoded packet as a shared, immutable FSRMediaPacket on their own thread, so adding one costs
+	 * neither an encode nor a copy, and a slow one only loses its own packets. Like listeners, the first one starts encoding.
+	 * @param QueueCapacity How many packets the sink can fall behind before it starts losing them
+	 * @param LayerIndex The video layer the sink gets, see AddVideoLayer. Audio goes to everyone.
+	 * @param KeyframePolicy How often the sink can force keyframes, through ISRMediaSink::SetKeyframeRequester
+	 */
+	bool AddSink(ISRMediaSink* Sink, int32 QueueCapacity = 256, uint32 LayerIndex = 0, const FSRKeyframePolicy& KeyframePolicy = FSRKeyframePolicy());
+	/** Blocks until the packets already queued for the sink have been delivered. */
+	void RemoveSink(ISRMediaSink* Sink);
+	/**
+	 * Takes the sink out without waiting for it, and without stopping the encoder when it is the last one. Any thread.
+	 * Stopping the returned runner delivers what is still queued for the sink.
+	 */
+	TUniquePtr<FSRMediaSinkRunner> DetachSink(ISRMediaSink* Sink);
+
+	/**
+	 * Encodes a frame from system memory instead of the back buffer, for offline renderers, CPU compositors and tests.
+	 * Can be called from any thread while recording. Frames of any size are scaled to the encoder's, with black bars if
+	 * their aspect ratio is another. A hardware encoder
+	 * only takes BGRA8, which is uploaded to the GPU; the software encoder takes every ESRPixelFormat.
+	 * @return Whether the frame was accepted. Frame.OnRelease is called either way, once the frame is no longer read.
+	 */
+	bool SubmitVideoFrame(FSRVideoFrame Frame);
+	/** Whether back buffers are captured. Turn it off when all the frames come from SubmitVideoFrame. */
+	void SetBackBufferCapture(bool bEnabled) { bCaptureBackBuffer = bEnabled; }
+
 	void SetVideoBitrate(uint32 Bitrate);
 	void SetVideoFramerate(uint32 Framerate);
+	/**
+	 * Changes the encoded picture size without a Shutdown and Initialize, once initialized. Any even size up to 3840x2160,
+	 * like GameplayMediaEncoder.ResX= and ResY=: 0 for one side follows the other at 16:9, and bigger sizes are scaled down.
+	 * The frames captured before go out at the old size, then the encoder starts over with a keyframe and new SPS/PPS,
+	 * which sinks see as a keyframe of another Width and Height.
+	 */
+	bool SetResolution(uint32 Width, uint32 Height);
+
+	/**
+	 * Makes the next frame encoded a keyframe (IDR), for a consumer that needs a place to start decoding from.
+	 * Requests coming in before that frame make the same keyframe. Any thread.
+	 * @param Consumer The listener or sink asking, limited by its FSRKeyframePolicy. Unregistered ones are turned down,
+	 *                 nullptr is the application and is never limited.
+	 * @return Whether the keyframe is on its way
+	 */
+	bool RequestKeyframe(const void* Consumer = nullptr);
+
+	/** Layer 0 and up to three simulcast layers */
+	static constexpr int32 MaxVideoLayers = 4;
+
+	/**
+	 * Adds a simulcast layer: the captured frames encoded once more at another size and bitrate, say a 720p stream next
+	 * to a 1080p recording, without capturing twice. Layer 0 is the one GameplayMediaEncoder.ResX=, ResY= and Bitrate=
+	 * set up, GameplayMediaEncoder.Layers=1280x720:4000,854x480 adds more (kbps) on initializing.
+	 * The software encoder scales the frames for each layer, a hardware encoder takes layers if its AVEncoder backend
+	 * does. Keyframes are forced on all layers at once. Once initialized, game thread. Layers stay until Shutdown.
+	 * The size is any even one up to 3840x2160, like for SetResolution.
+	 * @param Bitrate 0 for as many bits per pixel as layer 0
+	 * @return The new layer's index, or INDEX_NONE
+	 */
+	int32 AddVideoLayer(uint32 Width, uint32 Height, uint32 Bitrate = 0);
+	int32 GetNumVideoLayers() const { return NumVideoLayers; }
+	/** One entry per layer, since Start */
+	TArray<FSRVideoLayerStats> GetVideoLayerStats() const;
+	/** Each layer and the total, GameplayMediaEncoder.LayerStats on the console. Also logged on Stop. */
+	void LogVideoLayerStats() const;
 
 	///**
 	// * Returns the audio codec name and configuration
@@ -55,6 +159,13 @@ public:
 	void Shutdown();
 	bool Start();
 	void Stop();
+	/**
+	 * Stop in two halves, for callers that must not hold up the game thread. BeginStop, on the game thread, stops
+	 * capturing and returns. FinishStop, on any thread, waits for the frames still in flight, encodes them and flushes
+	 * the encoders, to the sinks still attached. Start fails in between.
+	 */
+	void BeginStop();
+	void FinishStop();
 
 	static void InitializeCmd()
 	{
@@ -91,30 +202,182 @@ private:
 	// Returns how long it has been recording for.
 	FTimespan GetMediaTimestamp() const;
 
+	// AddVideoLayer without the game thread check, for Initialize, which the manager runs on a task thread
+	int32 AddVideoLayerImpl(uint32 Width, uint32 Height, uint32 Bitrate);
+
 	// Back buffer capture
 	void OnFrameBufferReady(SWindow& SlateWindow, const FTexture2DRHIRef& FrameBuffer);
 	// ISubmixBufferListener interface
 	void OnNewSubmixBuffer(const USoundSubmix* OwningSubmix, float* AudioData, int32 NumSamples, int32 NumChannels, const int32 SampleRate, double AudioClock) override;
 
-	void ProcessAudioFrame(const float* AudioData, int32 NumSamples, int32 NumChannels, int32 SampleRate);
+	// Audio render thread: copies the submix buffer into AudioRing, stamped with the master audio clock. Nothing else.
+	void CaptureAudioFrame(const float* AudioData, int32 NumSamples, int32 NumChannels, int32 SampleRate);
+	// Audio worker: downmixes a captured chunk to stereo, resamples it to AudioSampleRate if needed and encodes it
+	void ProcessAudioFrame(const float* AudioData, int32 NumFrames, int32 NumChannels, int32 SampleRate, FTimespan Timestamp);
+	// Audio worker: cuts the stereo stream into AAC frames and encodes the complete ones
+	void EncodeAudioFrames(const float* StereoData, int32 NumFrames, FTimespan Timestamp);
+	void EncodeAACFrame(const float* StereoData);
+	// Audio worker: encodes what is left of the last AAC frame, padded with silence
+	void FlushAudioFrames();
+	FTimespan AudioFramesToTimespan(int64 NumFrames) const;
+
+	// Describes the samples of one submix buffer in AudioRing
+	struct FAudioChunk
+	{
+		int32 NumFrames = 0;
+		int32 NumChannels = 0;
+		int32 SampleRate = 0;
+		int64 Timestamp = 0;
+	};
+
+	void StartAudioWorker();
+	// Encodes what is still queued, then joins the thread
+	void StopAudioWorker();
+	void RunAudioWorker();
+	// Render thread: copies the back buffer into an encoder input frame and queues it for the video worker
 	void ProcessVideoFrame(const FTexture2DRHIRef& FrameBuffer);
 
-	void UpdateVideoConfig();
+	// A back buffer copy the GPU may still be working on
+	struct FCapturedFrame
+	{
+		AVEncoder::FVideoEncoderInputFrame* InputFrame = nullptr;
+		FGPUFenceRHIRef CopyFence;
+		// Frames from SubmitVideoFrame for the software encoder. The video worker fills an input frame from it.
+		TOptional<FSRVideoFrame> SystemMemoryFrame;
+		int64 TimestampUs = 0;
+		// Software encoding: the frame pacing wants the same picture again at these times. The worker copies it.
+		FSRFrameScheduler::FTimestamps RepeatTimestamps;
+		// FPlatformTime::Cycles64 when the back buffer (or system memory frame) came in and when it was queued, for FSRStats
+		uint64 CaptureCycles = 0;
+		uint64 QueuedCycles = 0;
+	};
+
+	// Any thread. Drops the frame, releasing what it holds, if the queue is full.
+	bool EnqueueCapturedFrame(FCapturedFrame&& Frame);
+	// Render thread: copies a texture into an encoder input frame and queues it, for the hardware encoders
+	void CaptureTexture(const FTexture2DRHIRef& Texture, int64 TimestampUs, uint64 CaptureCycles);
+	// Render thread: uploads a BGRA8 system memory frame for the hardware encoders, captured once per timestamp
+	void UploadVideoFrame(FSRVideoFrame& Frame, const FSRFrameScheduler::FTimestamps& Timestamps, uint64 CaptureCycles);
+	// Video worker: converts a system memory frame into a new YUV input frame and releases it
+	bool FillInputFrame(FCapturedFrame& Frame);
+	// Makes TimestampUs the last video timestamp, if it is later
+	void AdvanceLastVideoTimestamp(int64 TimestampUs);
+
+	// Software encoding: a back buffer on its way to system memory, converted when the GPU is done with it
+	struct FReadbackSlot
+	{
+		FTexture2DRHIRef Texture;
+		TUniquePtr<FRHIGPUTextureReadback> Readback;
+		FSRFrameScheduler::FTimestamps Timestamps;
+		uint64 CaptureCycles = 0;
+		bool bInFlight = false;
+	};
+
+	// Render thread: scales the back buffer into the next readback slot. False if they are all still in flight.
+	bool StartReadback(const FTexture2DRHIRef& FrameBuffer, const FSRFrameScheduler::FTimestamps& Timestamps, uint64 CaptureCycles);
+	// Render thread: converts finished readbacks to YUV input frames, oldest first, and queues them for the video worker.
+	// With bWait, waits for the GPU to finish all of them.
+	void DeliverReadbacks(bool bWait);
+
+	void StartVideoWorker();
+	// Encodes what is still queued, then joins the thread
+	void StopVideoWorker();
+	void RunVideoWorker();
+	void EncodeVideoFrame(FCapturedFrame& Frame);
+	// Video worker: whether the frame should be forced to be a keyframe, asked for or because the GOP is over
+	bool TakeKeyframeRequest(int64 TimestampUs);
+	// Video worker: remembers when the frame encoded at TimestampUs was captured and handed to the encoder
+	void SetFrameTiming(int64 TimestampUs, uint64 CaptureCycles, uint64 SubmitCycles);
+	// Encoder threads: false if the frame is too old to be remembered
+	bool FindFrameTiming(int64 TimestampUs, uint64& OutCaptureCycles, uint64& OutSubmitCycles) const;
+	// Called with ListenersCS held. With bRunning and Policy.bOnRegister, asks for a keyframe for the new consumer.
+	void AddKeyframeLimiter(const void* Consumer, const FSRKeyframePolicy& Policy, bool bRunning);
+	void RemoveKeyframeLimiter(const void* Consumer);
+
+	// Video worker: applies bitrate and framerate changes, and resizes the encoder to the frame's size. True if it did.
+	bool UpdateVideoConfig(const AVEncoder::FVideoEncoderInputFrame& InputFrame);
 
 	void OnEncodedAudioFrame(const AVEncoder::FMediaPacket& Packet) override;
 	void OnEncodedVideoFrame(uint32 LayerIndex, const AVEncoder::FVideoEncoderInputFrame* Frame, const AVEncoder::FCodecPacket& Packet);
+	// What the encoder threads dispatch to. Never modified once published: adding or removing a consumer publishes
+	// a new snapshot (read-copy-update), so dispatch never locks.
+	struct FConsumerSnapshot
+	{
+		TArray<IGameplayMediaEncoderListener*> Listeners;
+		// Async listeners get the packets in the encoder's format, like the synchronous ones
+		TArray<FSRMediaSinkRunner*> ListenerRunners;
+		TArray<FSRMediaSinkRunner*> Sinks;
+
+		// The same consumers by the video layer they take
+		struct FVideoLayerConsumers
+		{
+			TArray<IGameplayMediaEncoderListener*> Listeners;
+			TArray<FSRMediaSinkRunner*> ListenerRunners;
+			TArray<FSRMediaSinkRunner*> Sinks;
+		};
+		TArray<FVideoLayerConsumers, TInlineAllocator<1>> VideoLayers;
+	};
+
+	// Encoder threads: pins the current snapshot, which may be null, for as long as it lives
+	class FConsumersScope
+	{
+	public:
+		explicit FConsumersScope(const FSRGameplayMediaEncoder& Encoder);
+		~FConsumersScope();
+
+		const FConsumerSnapshot* Snapshot = nullptr;
+
+	private:
+		TAtomic<int32>* Pins = nullptr;
+	};
+
+	// Called with ListenersCS held. Publishes the consumers, then waits for the encoder threads still dispatching to
+	// the snapshot it replaced and deletes it, so the consumers removed since can go.
+	void PublishConsumers();
+	bool HasConsumers() const { return Listeners.Num() > 0 || AsyncListeners.Num() > 0 || Sinks.Num() > 0; }
 
 	AVEncoder::FVideoEncoderInputFrame* ObtainInputFrame();
+	// The texture InputFrame is copied into from now on, in place of the one it had
+	void SetBackBuffer(AVEncoder::FVideoEncoderInputFrame* InputFrame, const FTexture2DRHIRef& Texture);
 	void CopyTexture(const FTexture2DRHIRef& SourceTexture, FTexture2DRHIRef& DestinationTexture) const;
 
-	void FloatToPCM16(float const* floatSamples, int32 numSamples, TArray<int16>& out) const;
-
+	// Serializes changes to the consumers below, which belong to the game thread. Dispatch reads Consumers instead.
 	FCriticalSection ListenersCS;
 	TArray<IGameplayMediaEncoderListener*> Listeners;
-
+	TArray<TUniquePtr<FSRAsyncListener>> AsyncListeners;
+	TArray<TUniquePtr<FSRMediaSinkRunner>> Sinks;
+	// The video layer each listener and sink takes
+	TMap<const void*, uint32> ConsumerLayers;
+
+	// Epoch based reclamation: dispatch pins the epoch it reads Consumers in, and publishing moves on to the next epoch
+	// and waits only for the pins of the one before, which no new dispatch takes.
+	TAtomic<const FConsumerSnapshot*> Consumers{ nullptr };
+	TAtomic<uint32> ConsumersEpoch{ 0 };
+	mutable TAtomic<int32> ConsumersPins[2] = { { 0 }, { 0 } };
+
+	// When each consumer last forced a keyframe, in FPlatformTime::Seconds. Entries come and go with the consumers.
+	struct FKeyframeLimiter
+	{
+		FSRKeyframePolicy Policy;
+		double LastForcedSeconds = 0;
+	};
+	FCriticalSection KeyframeCS;
+	TMap<const void*, FKeyframeLimiter> KeyframeLimiters;
+	TAtomic<bool> bKeyframeRequested{ false };
+	// Longest time between keyframes, GameplayMediaEncoder.GopSeconds= on the command line. x264 keeps to it itself,
+	// a hardware encoder gets keyframes forced when it goes longer without one.
+	FTimespan GopLength = FTimespan::FromSeconds(2);
+	// GameplayMediaEncoder.OpenGop: x264's periodic keyframes are I frames with a recovery point instead of IDRs
+	bool bOpenGop = false;
+	// Ticks of the last keyframe forced or out of the encoder
+	TAtomic<int64> LastKeyframeTimestamp{ 0 };
+	TAtomic<uint64> KeyframesForced{ 0 };
+	TAtomic<uint64> KeyframeRequestsLimited{ 0 };
+
+	// Audio and video never wait for each other, and neither the audio render thread nor the render thread takes a lock:
+	// AudioProcessingCS and VideoProcessingCS are only shared by the respective worker and Shutdown
 	FCriticalSection AudioProcessingCS;
-	FCriticalSection VideoProcessingCS;
-	FCriticalSection ProcessingCS;
+	mutable FCriticalSection VideoProcessingCS;
 
 	TUniquePtr<AVEncoder::FAudioEncoder> AudioEncoder;
 
@@ -122,19 +385,100 @@ private:
 
 	TUniquePtr<AVEncoder::FVideoEncoder> VideoEncoder;
 	TSharedPtr<AVEncoder::FVideoEncoderInput> VideoEncoderInput;
-
-	uint64 NumCapturedFrames = 0;
+	// x264 on YUV420P input frames, filled from GPU readbacks, instead of a hardware encoder reading D3D textures
+	bool bSoftwareVideoEncoding = false;
+	// Changed under VideoProcessingCS
+	int32 NumVideoLayers = 1;
+	// Packets out of the encoder per layer, counted by the encoder threads. Sizes of the layers after the first.
+	struct FLayerCounters
+	{
+		TAtomic<uint64> Frames{ 0 };
+		TAtomic<uint64> Keyframes{ 0 };
+		TAtomic<uint64> Bytes{ 0 };
+		TAtomic<uint32> Width{ 0 };
+		TAtomic<uint32> Height{ 0 };
+	};
+	FLayerCounters LayerCounters[MaxVideoLayers];
+	// Video worker, in VideoEncoder->Encode for all the layers
+	double VideoEncodeSeconds = 0;
+	// The last frames handed to the encoder, for FSRStats to time them to their packets. Written by the video worker,
+	// read by the encoder threads: a TimestampUs of -1 is being written, and a reader checks it is unchanged afterwards.
+	struct FFrameTiming
+	{
+		TAtomic<int64> TimestampUs{ -1 };
+		TAtomic<uint64> CaptureCycles{ 0 };
+		TAtomic<uint64> SubmitCycles{ 0 };
+	};
+	// More than x264's lookahead holds back
+	static constexpr int32 NumFrameTimings = 128;
+	FFrameTiming FrameTimings[NumFrameTimings];
+	int32 NextFrameTiming = 0;
+	// Render thread only. In flight from OldestReadbackSlot up to NextReadbackSlot.
+	TArray<FReadbackSlot> ReadbackSlots;
+	int32 NextReadbackSlot = 0;
+	int32 OldestReadbackSlot = 0;
+
+	// Captured frames waiting for the video worker. The render thread enqueues captures and SubmitVideoFrame enqueues
+	// from any thread, hence a multi-producer queue. No producer waits for room.
+	TSRBoundedMpscQueue<FCapturedFrame> CapturedFrames{ 4 };
+	FThread VideoThread;
+	FEvent* VideoWorkEvent = nullptr;
+	TAtomic<bool> bStopVideoWorker{ false };
+	TAtomic<uint64> VideoFramesDropped{ 0 };
+	TAtomic<bool> bCaptureBackBuffer{ true };
+	// Render thread only, for SubmitVideoFrame with a hardware encoder
+	FTexture2DRHIRef UploadTexture;
+	// Video worker only
+	TUniquePtr<SRVideo::FFrameConverter> FrameConverter;
+	// Maps capture times to the timestamps frames are encoded at, GameplayMediaEncoder.FPS= and FrameRateMode=
+	TUniquePtr<FSRFrameScheduler> FrameScheduler;
+
+	// Submix audio on its way to the audio worker, about a second of 7.1. The audio render thread is the only producer.
+	TSRSampleRing<float> AudioRing{ 512 * 1024 };
+	TSRBoundedMpscQueue<FAudioChunk> AudioChunks{ 256 };
+	FThread AudioThread;
+	FEvent* AudioWorkEvent = nullptr;
+	TAtomic<bool> bStopAudioWorker{ false };
+	uint64 AudioChunksDropped = 0;
+	// Audio worker scratch, only grown
+	Audio::AlignedFloatBuffer AudioScratch;
+	Audio::AlignedFloatBuffer StereoScratch;
+	// Audio worker only. Converts from whatever rate the audio device runs at.
+	TUniquePtr<FSRAudioResampler> AudioResampler;
+	// What the audio encoder runs at, GameplayMediaEncoder.AudioSampleRate= on the command line
+	int32 AudioSampleRate = 0;
+	// Audio worker only. The encoder gets whole AAC frames, stamped AudioTimelineStart + EncodedAudioFrames / AudioSampleRate,
+	// so timestamps are exact however long the recording. The frames short of a whole one wait in PendingAudio.
+	Audio::AlignedFloatBuffer PendingAudio;
+	int32 NumPendingAudioFrames = 0;
+	bool bAudioTimelineStarted = false;
+	FTimespan AudioTimelineStart;
+	int64 EncodedAudioFrames = 0;
+
+	// Audio render thread only. SRMasterAudioClock is ClockBase + Frames / SampleRate, counted in frames so rounding
+	// never adds up. Rebased when the sample rate changes.
+	int64 CapturedAudioClockBase = 0;
+	int64 CapturedAudioFrames = 0;
+	int32 CapturedAudioSampleRate = 0;
+	// Audio render thread only. How far the video frames' clock is ahead of SRMasterAudioClock, smoothed. Audio chunks
+	// are stamped with the sum, so audio follows the video timeline even as the audio device's clock drifts from it.
+	int64 AudioClockOffset = 0;
+	bool bHasAudioClockOffset = false;
+
+	TAtomic<uint64> NumCapturedFrames{ 0 };
 	FTimespan StartTime = 0;
+	// Between BeginStop and the end of FinishStop
+	TAtomic<bool> bStopping{ false };
+	// Triggered by the render thread once it is done with the capture BeginStop stopped
+	FEvent* CaptureStoppedEvent = nullptr;
 
 	// Instead of using the AudioClock parameter ISubmixBufferListener::OnNewSubmixBuffer gives us, we calculate our own, by
 	// advancing it as we receive more data.
 	// This is so that we can adjust the clock if things get out of sync, such as if we break into the debugger.
 	double AudioClock = 0;
 
-	FTimespan LastVideoInputTimestamp = 0;
-
-	bool bAudioFormatChecked = false;
-	bool bDoFrameSkipping = false;
+	// Ticks of the last captured frame, written by the render thread and read by the encoder's callback
+	TAtomic<int64> LastVideoInputTimestamp{ 0 };
 
 	friend class FScreenRecordingModule;
 	static FSRGameplayMediaEncoder* Singleton;
@@ -145,7 +489,6 @@ private:
 	TAtomic<uint32> NewVideoFramerate{ 0 };
 	FThreadSafeBool bChangeFramerate = false;
 
-	TArray<int16> PCM16;
 	TMap<AVEncoder::FVideoEncoderInputFrame*, FTexture2DRHIRef> BackBuffers;
 };
 
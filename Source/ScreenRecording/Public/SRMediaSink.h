@@ -0,0 +1,78 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "HAL/Event.h"
+#include "SRBoundedQueue.h"
+#include "SRPacketPool.h"
+
+/** Consumer of encoded packets. Registered with FSRGameplayMediaEncoder::AddSink. */
+class ISRMediaSink
+{
+public:
+	virtual ~ISRMediaSink() {}
+
+	/** Called on the sink's own thread, in publication order. Can block without holding up the encoder or the other sinks. */
+	virtual void OnMediaPacket(const FSRMediaPacketPtr& Packet) = 0;
+
+	virtual const TCHAR* GetSinkName() const = 0;
+
+	/**
+	 * Called by AddSink before the first packet. Requester asks the encoder for a keyframe, for sinks that need one to start
+	 * from, like a new file. It returns false when the sink's FSRKeyframePolicy turns the request down, can be called from
+	 * any thread, and is ignored once the sink is removed.
+	 */
+	virtual void SetKeyframeRequester(TFunction<bool()> Requester) {}
+};
+
+struct FSRMediaSinkStats
+{
+	uint64 PacketsDelivered = 0;
+	// Packets lost because the sink fell behind and its queue was full
+	uint64 PacketsDropped = 0;
+	int32 QueueCapacity = 0;
+	int32 MaxQueueDepth = 0;
+};
+
+/**
+ * Delivers packets to one sink through its own bounded queue and thread.
+ * Publishing never blocks: when a sink falls behind, its queue fills up and it loses packets (video up to the next
+ * keyframe, so what it does get stays decodable), while the encoder and the other sinks carry on.
+ */
+class FSRMediaSinkRunner final : private FRunnable
+{
+public:
+	FSRMediaSinkRunner(ISRMediaSink& InSink, int32 QueueCapacity);
+	~FSRMediaSinkRunner();
+
+	bool Start();
+
+	/** Delivers what is already queued, then stops the thread. */
+	void Stop();
+
+	/** Called by the publisher, from the encoder threads. */
+	void Enqueue(const FSRMediaPacketPtr& Packet);
+
+	ISRMediaSink& GetSink() const { return Sink; }
+	FSRMediaSinkStats GetStats() const;
+
+private:
+	// FRunnable interface
+	uint32 Run() override;
+
+	void Drain();
+
+	ISRMediaSink& Sink;
+	TSRBoundedMpscQueue<FSRMediaPacketPtr> Queue;
+	FRunnableThread* Thread = nullptr;
+	FEvent* WorkEvent = nullptr;
+	TAtomic<bool> bStopping{ false };
+	TAtomic<bool> bDropVideoUntilKeyFrame{ false };
+
+	TAtomic<uint64> PacketsDelivered{ 0 };
+	TAtomic<uint64> PacketsDropped{ 0 };
+	TAtomic<int32> MaxQueueDepth{ 0 };
+};
@@ -0,0 +1,86 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/** Where the recording pipeline keeps its memory. */
+enum class ESRMemory : uint8
+{
+	/** Back buffer copies the hardware encoders read, and the software path's readback textures */
+	EncoderInput,
+	/** Payloads of the published packets, in use or pooled */
+	PacketPool,
+	/** Payloads waiting for the muxer's writer thread. Shared packets are counted by the packet pool as well. */
+	MuxerQueue,
+	/** The sample tables libavformat keeps in memory until a file's trailer is written */
+	MuxerIndex,
+	/** Submix audio on its way to the audio worker */
+	AudioRing,
+	/** Slabs and packet tables of the replay buffers */
+	ReplayBuffer,
+	Num
+};
+
+const TCHAR* LexToString(ESRMemory Subsystem);
+
+struct FSRMemoryStats
+{
+	int64 Current = 0;
+	int64 HighWater = 0;
+	/** 0 if there is none */
+	int64 Budget = 0;
+};
+
+/**
+ * Bytes the recording pipeline holds, per subsystem, as counted by the code that allocates and frees them. Every Add is
+ * an atomic add and a compare against the high-water mark, so it stays on in shipping builds.
+ *
+ * A subsystem can have a budget, from SR.MemoryBudget <Subsystem> <MB> or -SR.MemoryBudget.<Subsystem>=<MB> on the
+ * command line. Going over it logs a warning and calls the over-budget callback, once until it is back under.
+ * SR.Memory logs everything.
+ */
+class SCREENRECORDING_API FSRMemoryTracker
+{
+public:
+	/** Subsystem, its stats just after it went over */
+	using FOverBudgetCallback = TFunction<void(ESRMemory, const FSRMemoryStats&)>;
+
+	static FSRMemoryTracker& Get();
+
+	/** Any thread. Negative for memory that is freed. */
+	void Add(ESRMemory Subsystem, int64 Bytes);
+
+	FSRMemoryStats GetStats(ESRMemory Subsystem) const;
+	/** Of all the subsystems */
+	int64 GetTotal() const;
+
+	/** 0 removes the budget. */
+	void SetBudget(ESRMemory Subsystem, int64 Bytes);
+	/**
+	 * Called on the thread whose Add went over the budget, which must not be held up long. Must not free or allocate
+	 * tracked memory either.
+	 */
+	void SetOverBudgetCallback(FOverBudgetCallback Callback);
+
+	/** Starts the high-water marks over from the current values. */
+	void ResetHighWater();
+	void Log() const;
+
+private:
+	FSRMemoryTracker();
+
+	void OnOverBudget(ESRMemory Subsystem, int64 Current, int64 Budget);
+
+	struct FSubsystem
+	{
+		TAtomic<int64> Current{ 0 };
+		TAtomic<int64> HighWater{ 0 };
+		TAtomic<int64> Budget{ 0 };
+		TAtomic<bool> bOverBudget{ false };
+	};
+	FSubsystem Subsystems[int32(ESRMemory::Num)];
+
+	FCriticalSection CallbackCS;
+	FOverBudgetCallback OverBudgetCallback;
+};
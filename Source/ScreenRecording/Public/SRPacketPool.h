@@ -0,0 +1,121 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Containers/LockFreeList.h"
+#include "Templates/RefCounting.h"
+#include "MediaPacket.h"
+
+/**
+ * An encoded packet as published by FSRGameplayMediaEncoder. Filled in once and never modified afterwards, so every
+ * sink can hold on to the same payload without copying it.
+ *
+ * Packets come from FSRPacketPool and go back to it, payload included, when the last reference is released.
+ */
+struct SCREENRECORDING_API FSRMediaPacket
+{
+	AVEncoder::EPacketType Type = AVEncoder::EPacketType::Video;
+	FTimespan Timestamp;
+	FTimespan Duration;
+	bool bKeyFrame = false;
+	// H.264 payloads are published with length prefixed NAL units (AVCC), which is what MP4 stores
+	bool bIsAvcc = false;
+	int32 Width = 0;
+	int32 Height = 0;
+	int32 FrameAvgQP = 0;
+	uint32 Framerate = 0;
+	// FPlatformTime::Cycles64 when the frame was captured and when the packet was published, 0 if unknown. For FSRStats.
+	uint64 CaptureCycles = 0;
+	uint64 PublishCycles = 0;
+
+	uint8* GetData() { return Data; }
+	const uint8* GetData() const { return Data; }
+	int32 Num() const { return Size; }
+	int32 Capacity() const { return BufferSize; }
+
+	/** Sets the payload size, which can't exceed the capacity the packet was acquired with. */
+	void SetNum(int32 NewSize)
+	{
+		check(NewSize >= 0 && NewSize <= BufferSize);
+		Size = NewSize;
+	}
+
+	// For TRefCountPtr
+	uint32 AddRef() const { return uint32(++NumRefs); }
+	uint32 Release() const;
+	uint32 GetRefCount() const { return uint32(NumRefs.Load()); }
+
+private:
+	friend class FSRPacketPool;
+
+	FSRMediaPacket() = default;
+	~FSRMediaPacket() = default;
+
+	uint8* Data = nullptr;
+	int32 Size = 0;
+	int32 BufferSize = 0;
+	// INDEX_NONE for payloads too big for any size class, which are not recycled
+	int32 SizeClass = INDEX_NONE;
+	mutable TAtomic<int32> NumRefs{ 0 };
+};
+
+using FSRMediaPacketPtr = TRefCountPtr<const FSRMediaPacket>;
+// What FSRPacketPool::Acquire returns, for filling in before publishing
+using FSRMutableMediaPacketPtr = TRefCountPtr<FSRMediaPacket>;
+
+struct FSRPacketPoolStats
+{
+	// Packets currently allocated, in use or waiting in the pool, and their payload memory
+	int32 NumPackets = 0;
+	int64 BytesAllocated = 0;
+	// Most packets in use at the same time since the last Trim
+	int32 HighWaterMark = 0;
+	int32 NumInUse = 0;
+	uint64 NumAcquired = 0;
+	// Acquires the pool could not serve, each of which went to the heap
+	uint64 NumAllocations = 0;
+};
+
+/**
+ * Recycles encoded packets and their payloads, so the encode path stops allocating once recording has warmed up.
+ * Payload buffers come in power of two size classes, from 1 KB (AAC frames) up to 16 MB (4K keyframes); each class
+ * has its own lock-free free list. Bigger payloads are allocated exactly and freed on release.
+ */
+class SCREENRECORDING_API FSRPacketPool
+{
+public:
+	/** The pool is never destroyed, packets can outlive every module that handles them. */
+	static FSRPacketPool& Get();
+
+	/** Returns a packet with Num() == PayloadSize and room for at least that much. Can be called from any thread. */
+	FSRMutableMediaPacketPtr Acquire(int32 PayloadSize);
+
+	/** Frees the packets waiting in the pool. Packets in use are still recycled when released. */
+	void Trim();
+
+	FSRPacketPoolStats GetStats() const;
+
+private:
+	FSRPacketPool() = default;
+
+	friend struct FSRMediaPacket;
+	void Recycle(FSRMediaPacket* Packet);
+	void Free(FSRMediaPacket* Packet);
+
+	static constexpr int32 MinSizeClassLog2 = 10;
+	static constexpr int32 NumSizeClasses = 15;
+
+	struct FSizeClass
+	{
+		TLockFreePointerListUnordered<FSRMediaPacket, PLATFORM_CACHE_LINE_SIZE> FreePackets;
+	};
+	FSizeClass SizeClasses[NumSizeClasses];
+
+	TAtomic<int32> NumPackets{ 0 };
+	TAtomic<int64> BytesAllocated{ 0 };
+	TAtomic<int32> NumInUse{ 0 };
+	TAtomic<int32> HighWaterMark{ 0 };
+	TAtomic<uint64> NumAcquired{ 0 };
+	TAtomic<uint64> NumAllocations{ 0 };
+};
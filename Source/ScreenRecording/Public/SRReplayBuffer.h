@@ -0,0 +1,135 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/Future.h"
+#include "AudioEncoder.h"
+#include "VideoEncoder.h"
+#include "MediaPacket.h"
+#include "MP4Muxer.h"
+#include "SRMediaSink.h"
+
+struct FSRReplayBufferOptions
+{
+	// How much media the buffer keeps. Whole GOPs are evicted, so up to one extra GOP is kept.
+	float MaxSeconds = 30.0f;
+	// Payload memory, allocated once. At 20 Mbps, 30 seconds need about 75 MB.
+	int32 SlabSizeMB = 96;
+	// Upper bound on the number of packets held (video and audio)
+	int32 MaxPackets = 16384;
+
+	// Stream configuration of the saved files
+	AVEncoder::FVideoConfig VideoConfig;
+	AVEncoder::FAudioConfig AudioConfig;
+	FMP4MuxerOptions MuxerOptions;
+};
+
+struct FSRReplayBufferStats
+{
+	int32 NumPackets = 0;
+	int32 NumGops = 0;
+	int64 BytesUsed = 0;
+	int64 SlabSize = 0;
+	double BufferedSeconds = 0;
+	uint64 GopsEvicted = 0;
+	// Packets that could not be stored, because a save was reading the memory they needed or they did not fit at all
+	uint64 PacketsDropped = 0;
+};
+
+/**
+ * Instant replay: keeps the last N seconds of encoded packets in memory, so they can be written to an MP4
+ * on demand without re-encoding and without continuously recording to disk.
+ *
+ * Payloads are stored back to back in a single preallocated slab used as a ring. The buffer always starts with a
+ * video keyframe and is trimmed a whole GOP at a time, together with the audio packets that arrived during that GOP.
+ */
+class SCREENRECORDING_API FSRReplayBuffer : public ISRMediaSink
+{
+public:
+	explicit FSRReplayBuffer(const FSRReplayBufferOptions& InOptions);
+	~FSRReplayBuffer();
+
+	FSRReplayBuffer(const FSRReplayBuffer&) = delete;
+	FSRReplayBuffer& operator=(const FSRReplayBuffer&) = delete;
+
+	/** Stores a copy of an encoded packet. */
+	void AddPacket(const FSRMediaPacket& Packet);
+
+	// ISRMediaSink interface
+	void OnMediaPacket(const FSRMediaPacketPtr& Packet) override { AddPacket(*Packet); }
+	const TCHAR* GetSinkName() const override { return TEXT("ReplayBuffer"); }
+
+	/**
+	 * Writes the last Seconds of media to an MP4 file, starting at the nearest keyframe before that point.
+	 * The file is written on a background thread, while recording into the buffer carries on.
+	 * Only one save can run at a time, a request while one runs is turned down rather than waited for.
+	 * @param OnCompleted Called on the background thread when the file is done. The next save can start once it returns.
+	 * @return false if a save is already running or there is nothing to save
+	 */
+	bool SaveReplay(float Seconds, const FString& FilePath, TFunction<void(bool)> OnCompleted);
+
+	bool IsSaving() const { return bSaving; }
+
+	/** Drops everything that is buffered. */
+	void Reset();
+
+	FSRReplayBufferStats GetStats() const;
+
+private:
+	struct FEntry
+	{
+		int64 Offset = 0;
+		int32 Size = 0;
+		AVEncoder::EPacketType Type = AVEncoder::EPacketType::Video;
+		bool bKeyFrame = false;
+		bool bIsAvcc = false;
+		FTimespan Timestamp;
+		FTimespan Duration;
+		// Of video packets. The encoder can change sizes while recording.
+		int32 Width = 0;
+		int32 Height = 0;
+	};
+
+	FEntry& GetEntry(uint64 Sequence) { return Entries[Sequence % Entries.Num()]; }
+	const FEntry& GetEntry(uint64 Sequence) const { return Entries[Sequence % Entries.Num()]; }
+
+	bool IsEmpty() const { return FirstSequence == NextSequence; }
+	// Where a payload of Size bytes can go without evicting anything, or INDEX_NONE
+	int64 FindSpace(int32 Size) const;
+	// Evicts the oldest GOP. Fails if that would touch packets a save is still reading.
+	bool EvictOldestGop();
+	void TrimToDuration();
+
+	void WriteReplay(uint64 Begin, uint64 End, FString FilePath, TFunction<void(bool)> OnCompleted);
+
+	FSRReplayBufferOptions Options;
+
+	mutable FCriticalSection CS;
+
+	uint8* Slab = nullptr;
+	int64 SlabSize = 0;
+	// Where the next payload goes
+	int64 WriteOffset = 0;
+
+	// Packets [FirstSequence, NextSequence) are buffered, in Entries[Sequence % Entries.Num()]
+	TArray<FEntry> Entries;
+	uint64 FirstSequence = 0;
+	uint64 NextSequence = 0;
+	// Sequence numbers of the keyframes, oldest first. GopStarts[0] == FirstSequence whenever the buffer is not empty.
+	TArray<uint64> GopStarts;
+	// After dropping a video packet, every video packet up to the next keyframe has to go too
+	bool bWaitForKeyFrame = true;
+
+	// While a save copies packets out, packets from this sequence number on must not be evicted
+	uint64 PinnedSequence = MAX_uint64;
+	// Of PacketsDropped, the ones since the pin was set. Logged by the save.
+	uint64 PacketsDroppedWhilePinned = 0;
+	TAtomic<bool> bSaving{ false };
+	TFuture<void> SaveFuture;
+
+	uint64 GopsEvicted = 0;
+	uint64 PacketsDropped = 0;
+	// Counted by FSRMemoryTracker, allocated up front
+	int64 TrackedBytes = 0;
+};
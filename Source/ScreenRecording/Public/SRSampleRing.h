@@ -0,0 +1,89 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Lock-free ring of samples for one producer and one consumer.
+ *
+ * The storage is allocated once, writes and reads are plain copies, so the producer can be a real-time thread.
+ * The capacity is rounded up to a power of two.
+ */
+template<typename ElementType>
+class TSRSampleRing
+{
+public:
+	explicit TSRSampleRing(uint32 InCapacity)
+	{
+		const uint32 Capacity = FMath::RoundUpToPowerOfTwo(FMath::Max(InCapacity, 2u));
+		IndexMask = Capacity - 1;
+		Buffer.SetNumUninitialized(Capacity);
+	}
+
+	TSRSampleRing(const TSRSampleRing&) = delete;
+	TSRSampleRing& operator=(const TSRSampleRing&) = delete;
+
+	/** Producer thread only. Writes all Num elements, or nothing if they don't fit. */
+	bool Write(const ElementType* Data, int32 Num)
+	{
+		const uint32 Pos = WritePos.Load(EMemoryOrder::Relaxed);
+		if (uint32(Num) > Capacity() - (Pos - ReadPos.Load()))
+		{
+			return false;
+		}
+
+		CopyToRing(Data, Num, Pos);
+		WritePos.Store(Pos + Num);
+		return true;
+	}
+
+	/** Consumer thread only. Reads Num elements, or nothing if fewer are available. */
+	bool Read(ElementType* Out, int32 Num)
+	{
+		const uint32 Pos = ReadPos.Load(EMemoryOrder::Relaxed);
+		if (uint32(Num) > WritePos.Load() - Pos)
+		{
+			return false;
+		}
+
+		CopyFromRing(Out, Num, Pos);
+		ReadPos.Store(Pos + Num);
+		return true;
+	}
+
+	/** Approximate number of elements that can be read. Safe to call from any thread. */
+	int32 Num() const
+	{
+		return static_cast<int32>(WritePos.Load(EMemoryOrder::Relaxed) - ReadPos.Load(EMemoryOrder::Relaxed));
+	}
+
+	uint32 Capacity() const
+	{
+		return IndexMask + 1;
+	}
+
+private:
+	// A ring copy is at most two pieces, split where it wraps around
+	void CopyToRing(const ElementType* Data, int32 Num, uint32 Pos)
+	{
+		const uint32 Start = Pos & IndexMask;
+		const int32 First = FMath::Min<int32>(Num, Capacity() - Start);
+		FMemory::Memcpy(Buffer.GetData() + Start, Data, First * sizeof(ElementType));
+		FMemory::Memcpy(Buffer.GetData(), Data + First, (Num - First) * sizeof(ElementType));
+	}
+
+	void CopyFromRing(ElementType* Out, int32 Num, uint32 Pos) const
+	{
+		const uint32 Start = Pos & IndexMask;
+		const int32 First = FMath::Min<int32>(Num, Capacity() - Start);
+		FMemory::Memcpy(Out, Buffer.GetData() + Start, First * sizeof(ElementType));
+		FMemory::Memcpy(Out + First, Buffer.GetData(), (Num - First) * sizeof(ElementType));
+	}
+
+	TArray<ElementType> Buffer;
+	uint32 IndexMask = 0;
+
+	alignas(PLATFORM_CACHE_LINE_SIZE) TAtomic<uint32> WritePos{ 0 };
+	alignas(PLATFORM_CACHE_LINE_SIZE) TAtomic<uint32> ReadPos{ 0 };
+};
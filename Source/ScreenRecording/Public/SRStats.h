@@ -0,0 +1,153 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Boundaries a video frame crosses on its way from the back buffer to the file. Each stage is timed from the end of
+ * the one before, EndToEnd covers all of them.
+ */
+enum class ESRStage : uint8
+{
+	/** Back buffer ready (or SubmitVideoFrame) to queued for the video worker, GPU copy or readback included */
+	Capture,
+	/** Queued to picked up by the video worker, waiting for the GPU copy included */
+	Queue,
+	/** Handed to the encoder to its packet coming out, layer 0 */
+	Encode,
+	/** Published to the sink's thread having it */
+	Sink,
+	/** Queued in the muxer to written to the file's buffers */
+	Mux,
+	/** A file buffer handed to the disk to written, per buffer rather than per frame */
+	Write,
+	/** Back buffer ready to written by the muxer */
+	EndToEnd,
+	Num
+};
+
+/** Things that are counted rather than timed. */
+enum class ESRCounter : uint8
+{
+	FramesCaptured,
+	/** The video worker or the GPU readbacks fell behind */
+	FramesDropped,
+	/** Repeated to hold a constant frame rate */
+	FramesRepeated,
+	VideoPackets,
+	AudioPackets,
+	/** Out of the encoders, every layer */
+	BytesEncoded,
+	/** Sinks and async listeners that fell behind */
+	SinkPacketsDropped,
+	BytesMuxed,
+	MuxPacketsDropped,
+	BytesWritten,
+	Num
+};
+
+/** Queues whose depth is sampled as packets go through. */
+enum class ESRQueue : uint8
+{
+	/** Captured frames waiting for the video worker */
+	Video,
+	/** Whichever sink queue took a packet last, so the max is the deepest of them */
+	Sink,
+	Mux,
+	Num
+};
+
+const TCHAR* LexToString(ESRStage Stage);
+const TCHAR* LexToString(ESRCounter Counter);
+const TCHAR* LexToString(ESRQueue Queue);
+
+/** Percentiles of one latency histogram, in microseconds. Within 1/16 of the true value. */
+struct FSRLatencyStats
+{
+	uint64 Count = 0;
+	double Mean = 0;
+	double P50 = 0;
+	double P99 = 0;
+	double P999 = 0;
+	double Max = 0;
+};
+
+/**
+ * Latency histogram that any number of threads can record into without a lock. Log-linear buckets: 16 per power of two
+ * of microseconds, exact below 16 us. Anything over a day goes into the last one.
+ */
+class SCREENRECORDING_API FSRLatencyHistogram
+{
+public:
+	void Record(uint64 Microseconds);
+	void Reset();
+	FSRLatencyStats GetStats() const;
+
+private:
+	static constexpr int32 SubBucketBits = 4;
+	static constexpr int32 NumSubBuckets = 1 << SubBucketBits;
+	static constexpr int32 NumBuckets = NumSubBuckets * 34;
+
+	static int32 GetBucket(uint64 Microseconds);
+	// The highest value that goes into Bucket
+	static uint64 GetBucketMax(int32 Bucket);
+
+	TAtomic<uint64> Buckets[NumBuckets];
+	TAtomic<uint64> Count{ 0 };
+	TAtomic<uint64> Sum{ 0 };
+	TAtomic<uint64> Max{ 0 };
+};
+
+struct FSRQueueStats
+{
+	int32 Depth = 0;
+	int32 MaxDepth = 0;
+};
+
+/** Everything FSRStats has, at one point in time. */
+struct FSRStatsSnapshot
+{
+	FSRLatencyStats Stages[int32(ESRStage::Num)];
+	uint64 Counters[int32(ESRCounter::Num)] = {};
+	FSRQueueStats Queues[int32(ESRQueue::Num)];
+	/** Since the last Reset */
+	double Seconds = 0;
+
+	const FSRLatencyStats& operator[](ESRStage Stage) const { return Stages[int32(Stage)]; }
+	uint64 operator[](ESRCounter Counter) const { return Counters[int32(Counter)]; }
+	const FSRQueueStats& operator[](ESRQueue Queue) const { return Queues[int32(Queue)]; }
+};
+
+/**
+ * Where the time goes between the back buffer and the bytes on disk. The pipeline stamps frames with
+ * FPlatformTime::Cycles64 at each stage boundary and records the differences here, along with counters and queue
+ * depths. Everything is lock-free, so it stays on in shipping builds.
+ *
+ * SR.Stats logs it (SR.Stats reset starts over), the SRStats CSV category has the worst latency of every stage and the
+ * counters per frame, and GetSnapshot is for code. FSRGameplayMediaEncoder::Start resets it.
+ */
+class SCREENRECORDING_API FSRStats
+{
+public:
+	static FSRStats& Get();
+
+	/** Any thread */
+	void RecordLatency(ESRStage Stage, uint64 StartCycles, uint64 EndCycles);
+	void RecordLatency(ESRStage Stage, uint64 StartCycles) { RecordLatency(Stage, StartCycles, FPlatformTime::Cycles64()); }
+	void Add(ESRCounter Counter, uint64 Value = 1);
+	void SetQueueDepth(ESRQueue Queue, int32 Depth);
+
+	FSRStatsSnapshot GetSnapshot() const;
+	void Reset();
+	void Log() const;
+
+private:
+	FSRStats();
+
+	FSRLatencyHistogram Stages[int32(ESRStage::Num)];
+	TAtomic<uint64> Counters[int32(ESRCounter::Num)];
+	TAtomic<int32> QueueDepths[int32(ESRQueue::Num)];
+	TAtomic<int32> MaxQueueDepths[int32(ESRQueue::Num)];
+	TAtomic<uint64> ResetCycles{ 0 };
+};
@@ -0,0 +1,84 @@
+// Copyright Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/** Layouts FSRGameplayMediaEncoder::SubmitVideoFrame takes. */
+enum class ESRPixelFormat : uint8
+{
+	/** One plane, 4 bytes per pixel, blue first */
+	BGRA8,
+	/** One plane, 4 bytes per pixel, red first */
+	RGBA8,
+	/** Y plane, then a half resolution plane of interleaved U and V */
+	NV12,
+	/** Y plane, then half resolution U and V planes */
+	I420,
+};
+
+/**
+ * A video frame in system memory, borrowed from whoever submits it: nothing is copied until the encoder input is filled
+ * from it. OnRelease says when that is done and the memory can be reused.
+ */
+struct FSRVideoFrame
+{
+	ESRPixelFormat Format = ESRPixelFormat::BGRA8;
+	int32 Width = 0;
+	int32 Height = 0;
+
+	/** GetNumPlanes(Format) of them are used */
+	const uint8* Planes[3] = { nullptr, nullptr, nullptr };
+	/** Bytes from the start of one row to the next, per plane */
+	int32 Strides[3] = { 0, 0, 0 };
+
+	/**
+	 * On the recording's timeline, the one the audio is stamped with. Unset stamps the frame on arrival, like a captured
+	 * back buffer. Either way the frame pacing has the last word: at a constant frame rate the frame moves to the nearest
+	 * point of the grid.
+	 */
+	TOptional<FTimespan> Timestamp;
+
+	/** Called exactly once, when Planes are no longer read, on whichever thread that happens. Also if the frame is rejected. */
+	TFunction<void()> OnRelease;
+
+	static int32 GetNumPlanes(ESRPixelFormat Format)
+	{
+		return Format == ESRPixelFormat::I420 ? 3 : Format == ESRPixelFormat::NV12 ? 2 : 1;
+	}
+
+	/** Sizes, planes and strides are consistent with the format. 4:2:0 formats need even sizes. */
+	bool IsValid() const
+	{
+		const bool bSubsampled = Format == ESRPixelFormat::NV12 || Format == ESRPixelFormat::I420;
+		if(Width <= 0 || Height <= 0 || (bSubsampled && (Width % 2 != 0 || Height % 2 != 0)))
+		{
+			return false;
+		}
+
+		const int32 MinStride[3] = {
+			bSubsampled ? Width : Width * 4,
+			Format == ESRPixelFormat::NV12 ? Width : Width / 2,
+			Width / 2
+		};
+		for(int32 Plane = 0; Plane < GetNumPlanes(Format); ++Plane)
+		{
+			if(!Planes[Plane] || Strides[Plane] < MinStride[Plane])
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** Hands the memory back, if that has not happened yet. */
+	void Release()
+	{
+		if(OnRelease)
+		{
+			TFunction<void()> Callback = MoveTemp(OnRelease);
+			OnRelease = nullptr;
+			Callback();
+		}
+	}
+};
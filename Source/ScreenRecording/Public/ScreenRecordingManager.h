@@ -11,19 +11,46 @@
 #include "MediaPacket.h"
 #include "VideoEncoderInput.h"
 #include "MP4Muxer.h" 
+#include "SRReplayBuffer.h"
 
 #include "ScreenRecordingManager.generated.h"
 
 // һͼɰ󶨵ίУ첽ʼɺ֪ͨͼ
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnInitCompletedSignature, bool, bSuccess);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnReplaySavedSignature, bool, bSuccess, const FString&, FilePath);
 
-class SRM_Listener : public IGameplayMediaEncoderListener
+// Summary of a finished recording, handed to OnRecordingFinalized
+USTRUCT(BlueprintType)
+struct SCREENRECORDING_API FScreenRecordingStats
 {
-public:
-	void OnMediaSample(const AVEncoder::FMediaPacket& Sample) override;
-	AActor* Owner;
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadOnly)
+	int64 PacketsWritten = 0;
+
+	UPROPERTY(BlueprintReadOnly)
+	int64 PacketsDropped = 0;
+
+	UPROPERTY(BlueprintReadOnly)
+	int64 BytesWritten = 0;
+
+	UPROPERTY(BlueprintReadOnly)
+	int32 NumSegments = 0;
+
+	UPROPERTY(BlueprintReadOnly)
+	int32 MaxQueueDepth = 0;
+
+	// Time encoder threads spent waiting for room in the muxer queue
+	UPROPERTY(BlueprintReadOnly)
+	float BlockedSeconds = 0.0f;
+
+	// Time spent draining, writing the trailer and shutting the encoders down after Stop
+	UPROPERTY(BlueprintReadOnly)
+	float FinalizeSeconds = 0.0f;
 };
 
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_ThreeParams(FOnRecordingFinalizedSignature, const FString&, FilePath, bool, bSuccess, const FScreenRecordingStats&, Stats);
+
 UCLASS()
 class SCREENRECORDING_API AScreenRecordingManager : public AActor
 {
@@ -41,7 +68,6 @@ protected:
 public:
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
-	void OnMediaSample(const AVEncoder::FMediaPacket& Sample);
 
 	// ʵִгʼ߼ĺں̨߳е
 	void PerformAsyncInitialization();
@@ -57,14 +83,52 @@ public:
 	void Initialize();
 	UFUNCTION(BlueprintCallable)
 	bool Start();
+	// Returns right away. The file is finished and the encoders are shut down on a worker thread, then OnRecordingFinalized fires.
 	UFUNCTION(BlueprintCallable)
 	void Stop();
 
+	UPROPERTY(BlueprintAssignable)
+	FOnRecordingFinalizedSignature OnRecordingFinalized;
+
+	void RemoveSinks();
+
+	// Back on the GameThread once the worker started by Stop is done
+	void OnAsyncFinalizeCompleted(const FString& FilePath, bool bSuccess, const FScreenRecordingStats& Stats);
+
+	UFUNCTION(BlueprintCallable)
+	bool IsFinalizing() const { return bIsFinalizing; }
+
+	// Writes the last Seconds of the replay buffer to Saved/<FileName> in the background. OnReplaySaved fires when done.
+	UFUNCTION(BlueprintCallable)
+	bool SaveReplay(float Seconds, const FString& FileName);
+
+	UPROPERTY(BlueprintAssignable)
+	FOnReplaySavedSignature OnReplaySaved;
+
+	// Changes the recorded picture size on the fly, the file goes on. Any even size up to 3840x2160, 0 for one side keeps 16:9.
+	UFUNCTION(BlueprintCallable)
+	bool SetResolution(int32 Width, int32 Height);
+
+	// Seconds of encoded media kept in memory for SaveReplay. 0 disables the replay buffer. Read by Initialize.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	float ReplayBufferSeconds = 0.0f;
+
+	// Record everything to Saved/CapturedVideo.mp4. Can be turned off when only the replay buffer is wanted. Read by Initialize.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bContinuousRecording = true;
+
 	FSRGameplayMediaEncoder* GME;
-	SRM_Listener Temp_Listener;
 
+	// Both are sinks of GME while recording, each fed from its own thread
 	TUniquePtr<FMP4Muxer> Muxer;
-	FCriticalSection MuxerCS;
+	// The muxer has its own bounded queue behind the sink queue
+	int32 MuxerSinkQueueCapacity = 64;
+
+	TUniquePtr<FSRReplayBuffer> ReplayBuffer;
+
+	FString RecordingFilePath;
+	TFuture<void> FinalizeFuture;
+	bool bIsFinalizing = false;
 
 	bool bIsRecording;
 	bool bIsInitialize;